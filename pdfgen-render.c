@@ -0,0 +1,1069 @@
+/**
+ * pdfgen-render: draw a PDF from a stream of drawing commands, so that
+ * programs can produce PDFs without linking to PDFGen.
+ *
+ * Usage: pdfgen-render [-d date] [-c] [-o output] [input]
+ *        pdfgen-render -b megabytes
+ *
+ * Commands are read from the input file (or stdin), and drawn in batches
+ * (see @ref pdf_execute) as they are read, so drawing overlaps with
+ * whatever is writing the commands, and the input is never held in memory
+ * all at once. The PDF is written to the output file (or stdout) at the
+ * end of the input.
+ *  -d date       Make the output reproducible, with this creation date
+ *                (see @ref pdf_set_deterministic)
+ *  -c            Convert the input to the binary format, rather than
+ *                drawing it
+ *  -o output     Write to this file rather than stdout
+ *  -b megabytes  Measure throughput with this many MB of generated
+ *                binary commands, and print a line of JSON with the
+ *                input & output rates
+ *
+ * The format of the input is picked by its first few bytes.
+ *
+ * Binary, version 1: the 8 bytes "PDFGENC" 0x01, then one record per
+ * command. Each record is a struct pdf_command with every field stored
+ * as 4 little endian bytes, and data_offset set to 0, followed by the
+ * data_len bytes of its data, which may be at most 256 MB.
+ *
+ * Text, version 1: the line "pdfgen-render 1", then one command per line.
+ * Blank lines & lines starting with '#' are ignored. Numbers are floats,
+ * colours are "#rrggbb", "#aarrggbb" or "none", and strings are either a
+ * single word or in double quotes, with C style escapes (\\, \", \n, \r,
+ * \t, \b, \f & \xHH). Alignments, barcode types & info fields can be
+ * given by name.
+ *   info field value               set document info (before drawing)
+ *   page [width height]            start a new page
+ *   font name
+ *   text size x y colour text
+ *   rotate size x y angle colour text
+ *   wrap size x y width align colour text
+ *   line x1 y1 x2 y2 width colour
+ *   rect x y width height border colour [fill]
+ *   ellipse x y xradius yradius width colour [fill]
+ *   circle x y radius width colour [fill]
+ *   path width colour [fill]       followed by path operations, one per
+ *                                  line ("m x y", "l x y", "c x1 y1 x2 y2
+ *                                  x3 y3", "v/y x1 y1 x2 y2" & "h"), up
+ *                                  to a line with just "end". There may
+ *                                  be at most 65536 operations
+ *   image x y width height file
+ *   barcode type x y width height colour text
+ *   bookmark parent title          parent is the number of an earlier
+ *                                  bookmark (from 0), or -1 for none
+ *   link x y width height page target_x target_y
+ *
+ * Commands which fail are reported on stderr (by command number for
+ * binary input, or line number for text), and drawing carries on. The
+ * exit status is 1 if anything failed.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pdfgen.h"
+
+#define BINARY_MAGIC "PDFGENC\x01"
+#define BINARY_MAGIC_LEN 8
+#define TEXT_MAGIC "pdfgen-render 1"
+#define RECORD_SIZE 48
+
+/* Commands are drawn once a batch has this many of them, or this much
+ * data */
+#define BATCH_COMMANDS 4096
+#define BATCH_DATA (1024 * 1024)
+/* Paths can't be split across batches, so longer ones are rejected rather
+ * than letting the batch grow without limit */
+#define MAX_PATH_OPS (BATCH_COMMANDS * 16)
+/* Largest data for a single binary command (eg: an image) */
+#define MAX_COMMAND_DATA (256 * 1024 * 1024)
+
+/* Commands which are handled by the renderer rather than pdf_execute */
+enum {
+    RENDER_PAGE = 0x100, /* v: width, height (0 for the default size) */
+    RENDER_INFO,         /* arg: INFO_*; data: value */
+    RENDER_BOOKMARK,     /* arg: parent bookmark number or -1; data: title */
+    RENDER_LINK,         /* v: x, y, width, height, target x, target y;
+                          * arg: target page number */
+    RENDER_IMAGE_FILE,   /* v: x, y, width, height; data: file name */
+};
+
+enum { INFO_CREATOR, INFO_PRODUCER, INFO_TITLE, INFO_AUTHOR, INFO_SUBJECT };
+
+struct renderer {
+    struct pdf_doc *pdf;
+    struct pdf_info info;
+    const char *date;
+    FILE *convert; /* Write commands here in binary, rather than drawing */
+
+    /* Commands waiting to be drawn */
+    struct pdf_command *batch;
+    unsigned long *where; /* Command/line number of each one */
+    int *results;
+    int batch_count, batch_size;
+    char *data;
+    size_t data_len, data_size;
+    int path_ops; /* Operations still to come for the last path */
+    int skip_ops; /* Operations still to come for a rejected path */
+    const char *unit; /* What 'where' counts: "Command" or "Line" */
+    const char *err;  /* Why the last special command failed, if not PDFGen */
+
+    int *bookmarks; /* Bookmark id for each bookmark number */
+    int bookmark_count, bookmark_size;
+    int failed;
+};
+
+static void *grow(void *array, int *size, int needed, size_t item)
+{
+    int new_size = *size ? *size : 64;
+    void *new_array;
+
+    while (new_size < needed)
+        new_size *= 2;
+    if (new_size == *size)
+        return array;
+    new_array = realloc(array, new_size * item);
+    if (new_array)
+        *size = new_size;
+    return new_array;
+}
+
+static int render_create(struct renderer *r)
+{
+    if (r->pdf)
+        return 0;
+    r->pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, &r->info);
+    if (!r->pdf) {
+        fprintf(stderr, "Unable to create PDF\n");
+        return -ENOMEM;
+    }
+    if (r->date && pdf_set_deterministic(r->pdf, r->date) < 0) {
+        fprintf(stderr, "Invalid date: %s\n", pdf_get_err(r->pdf, NULL));
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int render_err(struct renderer *r, int ret, const char *err)
+{
+    r->err = err;
+    return ret;
+}
+
+static void render_failed(struct renderer *r, unsigned long where, int ret)
+{
+    const char *err = r->err;
+
+    if (!err && r->pdf)
+        err = pdf_get_err(r->pdf, NULL);
+    fprintf(stderr, "%s %lu failed: %s\n", r->unit, where,
+            err ? err : strerror(-ret));
+    r->err = NULL;
+    if (r->pdf)
+        pdf_clear_err(r->pdf);
+    r->failed++;
+}
+
+/* Draw all of the commands waiting in the batch. pdf_execute only keeps
+ * the error message of the last command to fail, so each command (or path
+ * & its operations) is given to it separately, and any failure reported
+ * before the next one runs */
+static int render_flush(struct renderer *r)
+{
+    for (int i = 0; i < r->batch_count; i++) {
+        const struct pdf_command *cmd = &r->batch[i];
+        int count = 1;
+        int ret;
+
+        /* A path which is cut short fails on its own, as in a whole batch,
+         * and its operations then fail one by one */
+        if (cmd->op == PDF_CMD_PATH && cmd->arg > 0 &&
+            cmd->arg < r->batch_count - i)
+            count += cmd->arg;
+        ret = pdf_execute(r->pdf, NULL, cmd, count, r->data, r->data_len,
+                          NULL, 0, &r->results[i]);
+        if (ret < 0)
+            return ret;
+        if (ret > 0)
+            render_failed(r, r->where[i], r->results[i]);
+        i += count - 1;
+    }
+    r->batch_count = 0;
+    r->data_len = 0;
+    return 0;
+}
+
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    out[0] = value & 0xff;
+    out[1] = (value >> 8) & 0xff;
+    out[2] = (value >> 16) & 0xff;
+    out[3] = (value >> 24) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *in)
+{
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) |
+           ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static void encode_command(uint8_t *record, const struct pdf_command *cmd)
+{
+    put_u32(&record[0], cmd->op);
+    put_u32(&record[4], (uint32_t)cmd->arg);
+    put_u32(&record[8], cmd->colour);
+    put_u32(&record[12], cmd->fill);
+    for (int i = 0; i < 6; i++) {
+        uint32_t bits;
+
+        memcpy(&bits, &cmd->v[i], sizeof(bits));
+        put_u32(&record[16 + i * 4], bits);
+    }
+    put_u32(&record[40], 0);
+    put_u32(&record[44], cmd->data_len);
+}
+
+static void decode_command(struct pdf_command *cmd, const uint8_t *record)
+{
+    cmd->op = get_u32(&record[0]);
+    cmd->arg = (int32_t)get_u32(&record[4]);
+    cmd->colour = get_u32(&record[8]);
+    cmd->fill = get_u32(&record[12]);
+    for (int i = 0; i < 6; i++) {
+        uint32_t bits = get_u32(&record[16 + i * 4]);
+
+        memcpy(&cmd->v[i], &bits, sizeof(bits));
+    }
+    cmd->data_offset = 0;
+    cmd->data_len = get_u32(&record[44]);
+}
+
+/* Handle one of the commands which pdf_execute doesn't */
+static int render_special(struct renderer *r, const struct pdf_command *cmd,
+                          const char *data)
+{
+    static const size_t info_fields[] = {
+        offsetof(struct pdf_info, creator),
+        offsetof(struct pdf_info, producer),
+        offsetof(struct pdf_info, title),
+        offsetof(struct pdf_info, author),
+        offsetof(struct pdf_info, subject),
+    };
+    const float *v = cmd->v;
+    struct pdf_object *page;
+    char *field;
+    int *bookmarks;
+    int parent = -1;
+    int ret;
+
+    if (cmd->op == RENDER_INFO) {
+        if (r->pdf || cmd->arg < 0 || cmd->arg > INFO_SUBJECT ||
+            cmd->data_len >= sizeof(r->info.title))
+            return render_err(r, -EINVAL, "Invalid info field");
+        field = (char *)&r->info + info_fields[cmd->arg];
+        memset(field, 0, sizeof(r->info.title));
+        if (cmd->data_len)
+            memcpy(field, data, cmd->data_len);
+        return 0;
+    }
+
+    ret = render_create(r);
+    if (ret < 0)
+        return ret;
+
+    switch (cmd->op) {
+    case RENDER_PAGE:
+        page = pdf_append_page(r->pdf);
+        if (!page)
+            return pdf_get_err(r->pdf, &ret) ? ret : -ENOMEM;
+        if (v[0] > 0 && v[1] > 0)
+            return pdf_page_set_size(r->pdf, page, v[0], v[1]);
+        return 0;
+
+    case RENDER_BOOKMARK:
+        if (cmd->arg >= r->bookmark_count)
+            return render_err(r, -EINVAL, "No such parent bookmark");
+        if (cmd->arg >= 0)
+            parent = r->bookmarks[cmd->arg];
+        ret = pdf_add_bookmark_n(r->pdf, NULL, parent, data, cmd->data_len);
+        if (ret < 0)
+            return ret;
+        /* Keep the old array if it can't grow, so it's still freed */
+        bookmarks = (int *)grow(r->bookmarks, &r->bookmark_size,
+                                r->bookmark_count + 1, sizeof(int));
+        if (!bookmarks)
+            return -ENOMEM;
+        r->bookmarks = bookmarks;
+        r->bookmarks[r->bookmark_count++] = ret;
+        return 0;
+
+    case RENDER_LINK:
+        page = pdf_get_page(r->pdf, cmd->arg);
+        if (!page)
+            return -EINVAL;
+        return pdf_add_link(r->pdf, NULL, v[0], v[1], v[2], v[3], page, v[4],
+                            v[5]);
+
+    case RENDER_IMAGE_FILE: {
+        char filename[4096];
+
+        if (cmd->data_len >= sizeof(filename))
+            return render_err(r, -EINVAL, "Image file name too long");
+        memcpy(filename, data, cmd->data_len);
+        filename[cmd->data_len] = '\0';
+        return pdf_add_image_file(r->pdf, NULL, v[0], v[1], v[2], v[3],
+                                  filename);
+    }
+
+    default:
+        return render_err(r, -EINVAL, "Unknown command");
+    }
+}
+
+/* Queue up (or convert) one command. 'where' is its command or line
+ * number, for error messages */
+static int render_add(struct renderer *r, const struct pdf_command *cmd,
+                      const char *data, unsigned long where)
+{
+    int ret;
+
+    if (r->convert) {
+        uint8_t record[RECORD_SIZE];
+
+        encode_command(record, cmd);
+        if (fwrite(record, sizeof(record), 1, r->convert) != 1 ||
+            (cmd->data_len &&
+             fwrite(data, 1, cmd->data_len, r->convert) != cmd->data_len))
+            return -EIO;
+        return 0;
+    }
+
+    if (cmd->op >= RENDER_PAGE) {
+        /* pdf_execute reports any path which is cut short */
+        r->path_ops = 0;
+        ret = render_flush(r);
+        if (ret < 0)
+            return ret;
+        ret = render_special(r, cmd, data);
+        if (ret < 0)
+            render_failed(r, where, ret);
+        if (r->pdf)
+            pdf_clear_err(r->pdf);
+        return 0;
+    }
+
+    /* The operations of a rejected path go with it */
+    if (cmd->op == PDF_CMD_PATH_OP && r->skip_ops) {
+        r->skip_ops--;
+        return 0;
+    }
+    r->skip_ops = 0;
+    if (cmd->op == PDF_CMD_PATH && cmd->arg > MAX_PATH_OPS) {
+        r->path_ops = 0;
+        r->skip_ops = cmd->arg;
+        render_failed(r, where,
+                      render_err(r, -E2BIG, "Path has too many operations"));
+        return 0;
+    }
+
+    ret = render_create(r);
+    if (ret < 0)
+        return ret;
+    /* Paths can't be split from their operations */
+    if (!r->path_ops && (r->batch_count >= BATCH_COMMANDS ||
+                         r->data_len + cmd->data_len > BATCH_DATA)) {
+        ret = render_flush(r);
+        if (ret < 0)
+            return ret;
+    }
+    if (r->batch_count >= r->batch_size) {
+        int size = r->batch_size ? r->batch_size * 2 : BATCH_COMMANDS;
+        struct pdf_command *batch = (struct pdf_command *)realloc(
+            r->batch, size * sizeof(*batch));
+        unsigned long *where;
+        int *results;
+
+        if (batch)
+            r->batch = batch;
+        where = (unsigned long *)realloc(r->where, size * sizeof(*where));
+        if (where)
+            r->where = where;
+        results = (int *)realloc(r->results, size * sizeof(*results));
+        if (results)
+            r->results = results;
+        if (!batch || !where || !results)
+            return -ENOMEM;
+        r->batch_size = size;
+    }
+    if (r->data_len + cmd->data_len > r->data_size) {
+        size_t size = r->data_size ? r->data_size : BATCH_DATA;
+        char *new_data;
+
+        while (size < r->data_len + cmd->data_len)
+            size *= 2;
+        new_data = (char *)realloc(r->data, size);
+        if (!new_data)
+            return -ENOMEM;
+        r->data = new_data;
+        r->data_size = size;
+    }
+
+    r->batch[r->batch_count] = *cmd;
+    r->batch[r->batch_count].data_offset = (uint32_t)r->data_len;
+    r->where[r->batch_count++] = where;
+    if (cmd->data_len)
+        memcpy(&r->data[r->data_len], data, cmd->data_len);
+    r->data_len += cmd->data_len;
+
+    /* Anything other than an operation ends the path, so a path which
+     * claims more operations than it has can't hold up the batch */
+    if (cmd->op == PDF_CMD_PATH)
+        r->path_ops = cmd->arg > 0 ? cmd->arg : 0;
+    else if (cmd->op == PDF_CMD_PATH_OP && r->path_ops)
+        r->path_ops--;
+    else
+        r->path_ops = 0;
+    return 0;
+}
+
+static int read_binary(struct renderer *r, FILE *in)
+{
+    uint8_t record[RECORD_SIZE];
+    char *data = NULL;
+    size_t data_size = 0, len;
+    unsigned long number = 0;
+    int ret = 0;
+
+    r->unit = "Command";
+    while ((len = fread(record, 1, sizeof(record), in)) == sizeof(record)) {
+        struct pdf_command cmd;
+
+        decode_command(&cmd, record);
+        number++;
+        if (cmd.data_len > MAX_COMMAND_DATA) {
+            fprintf(stderr, "Command %lu: %u bytes of data is too large\n",
+                    number, cmd.data_len);
+            ret = -E2BIG;
+            break;
+        }
+        /* Read the data a batch at a time, so that the buffer only grows
+         * as far as the input really goes */
+        for (size_t pos = 0; ret == 0 && pos < cmd.data_len;) {
+            size_t chunk = cmd.data_len - pos;
+
+            if (chunk > BATCH_DATA)
+                chunk = BATCH_DATA;
+            if (pos + chunk > data_size) {
+                char *new_data = (char *)realloc(data, pos + chunk);
+
+                if (!new_data) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                data = new_data;
+                data_size = pos + chunk;
+            }
+            if (fread(&data[pos], 1, chunk, in) != chunk) {
+                fprintf(stderr, "Command %lu: data is truncated\n", number);
+                ret = -EINVAL;
+            }
+            pos += chunk;
+        }
+        if (ret < 0)
+            break;
+        ret = render_add(r, &cmd, data, number);
+        if (ret < 0)
+            break;
+    }
+    if (ret == 0 && len != 0) {
+        fprintf(stderr, "Command %lu is truncated\n", number + 1);
+        ret = -EINVAL;
+    }
+    free(data);
+    return ret;
+}
+
+/* Read a whole line, however long. Returns false at the end of the
+ * input */
+static int read_line(FILE *in, char **line, size_t *size)
+{
+    size_t len = 0;
+
+    if (!*line) {
+        *size = 256;
+        *line = (char *)malloc(*size);
+        if (!*line)
+            return 0;
+    }
+    while (fgets(&(*line)[len], (int)(*size - len), in)) {
+        len += strlen(&(*line)[len]);
+        if (len > 0 && (*line)[len - 1] == '\n')
+            return 1;
+        if (len + 1 >= *size) {
+            char *new_line = (char *)realloc(*line, *size * 2);
+
+            if (!new_line)
+                return 0;
+            *line = new_line;
+            *size *= 2;
+        }
+    }
+    return len > 0;
+}
+
+/* Split off the next word or quoted string, decoding escapes in place.
+ * Returns NULL if there are no more (or the string is invalid) */
+static char *next_token(char **pos, size_t *len, int *invalid)
+{
+    char *p = *pos, *start, *out;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    if (*p == '\0') {
+        *pos = p;
+        return NULL;
+    }
+
+    if (*p != '"') {
+        start = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+        *len = p - start;
+        if (*p)
+            *p++ = '\0';
+        *pos = p;
+        return start;
+    }
+
+    start = out = ++p;
+    while (*p != '"') {
+        char c = *p++;
+
+        if (c == '\0' || c == '\n') {
+            *invalid = 1;
+            return NULL;
+        }
+        if (c == '\\') {
+            c = *p++;
+            switch (c) {
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'x': {
+                char hex[3] = {p[0], p[0] ? p[1] : '\0', '\0'};
+                char *end;
+
+                c = (char)strtol(hex, &end, 16);
+                if (end != &hex[2]) {
+                    *invalid = 1;
+                    return NULL;
+                }
+                p += 2;
+                break;
+            }
+            case '\\':
+            case '"':
+                break;
+            default:
+                *invalid = 1;
+                return NULL;
+            }
+        }
+        *out++ = c;
+    }
+    *len = out - start;
+    *pos = p + 1;
+    return start;
+}
+
+static const struct {
+    const char *name;
+    int value;
+} names[] = {
+    {"left", PDF_ALIGN_LEFT},
+    {"right", PDF_ALIGN_RIGHT},
+    {"center", PDF_ALIGN_CENTER},
+    {"justify", PDF_ALIGN_JUSTIFY},
+    {"justify-all", PDF_ALIGN_JUSTIFY_ALL},
+    {"code128a", PDF_BARCODE_128A},
+    {"code39", PDF_BARCODE_39},
+    {"ean13", PDF_BARCODE_EAN13},
+    {"upca", PDF_BARCODE_UPCA},
+    {"ean8", PDF_BARCODE_EAN8},
+    {"upce", PDF_BARCODE_UPCE},
+    {"creator", INFO_CREATOR},
+    {"producer", INFO_PRODUCER},
+    {"title", INFO_TITLE},
+    {"author", INFO_AUTHOR},
+    {"subject", INFO_SUBJECT},
+};
+
+/*
+ * Operands of each text command, in order:
+ * 0-5 = v[n], i = arg, c = colour, f = fill, s = data,
+ * | = the rest are optional
+ */
+static const struct {
+    const char *name;
+    uint32_t op;
+    const char *operands;
+} verbs[] = {
+    {"nop", PDF_CMD_NOP, ""},
+    {"font", PDF_CMD_FONT, "s"},
+    {"text", PDF_CMD_TEXT, "012cs"},
+    {"rotate", PDF_CMD_TEXT, "0123cs"},
+    {"wrap", PDF_CMD_TEXT_WRAP, "0124ics"},
+    {"line", PDF_CMD_LINE, "01234c"},
+    {"rect", PDF_CMD_RECTANGLE, "01234c|f"},
+    {"ellipse", PDF_CMD_ELLIPSE, "01234c|f"},
+    {"circle", PDF_CMD_ELLIPSE, "0124c|f"},
+    {"path", PDF_CMD_PATH, "0c|f"},
+    {"m", PDF_CMD_PATH_OP, "01"},
+    {"l", PDF_CMD_PATH_OP, "01"},
+    {"c", PDF_CMD_PATH_OP, "012345"},
+    {"v", PDF_CMD_PATH_OP, "0123"},
+    {"y", PDF_CMD_PATH_OP, "0123"},
+    {"h", PDF_CMD_PATH_OP, ""},
+    {"barcode", PDF_CMD_BARCODE, "i0123cs"},
+    {"page", RENDER_PAGE, "|01"},
+    {"info", RENDER_INFO, "is"},
+    {"bookmark", RENDER_BOOKMARK, "is"},
+    {"link", RENDER_LINK, "0123i45"},
+    {"image", RENDER_IMAGE_FILE, "0123s"},
+};
+
+static int parse_colour(const char *token, uint32_t *colour)
+{
+    char *end;
+
+    if (strcmp(token, "none") == 0) {
+        *colour = PDF_TRANSPARENT;
+        return 0;
+    }
+    if (token[0] != '#' || (strlen(token) != 7 && strlen(token) != 9))
+        return -EINVAL;
+    *colour = (uint32_t)strtoul(&token[1], &end, 16);
+    return *end ? -EINVAL : 0;
+}
+
+static int parse_int(const char *token, int32_t *value)
+{
+    char *end;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(token, names[i].name) == 0) {
+            *value = names[i].value;
+            return 0;
+        }
+    }
+    *value = (int32_t)strtol(token, &end, 0);
+    return *end ? -EINVAL : 0;
+}
+
+/* Parse the operands of one line into a command, pointing 'data' at its
+ * string operand (if any) */
+static int parse_command(char *line, struct pdf_command *cmd, char **data,
+                         int *is_end)
+{
+    char *pos = line, *token;
+    const char *operands = NULL;
+    size_t len;
+    int invalid = 0, optional = 0, circle;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->fill = PDF_TRANSPARENT;
+    *data = NULL;
+    *is_end = 0;
+
+    token = next_token(&pos, &len, &invalid);
+    if (!token || token[0] == '#')
+        return invalid ? -EINVAL : 0;
+    if (strcmp(token, "end") == 0) {
+        *is_end = 1;
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++) {
+        if (strcmp(token, verbs[i].name) == 0) {
+            cmd->op = verbs[i].op;
+            operands = verbs[i].operands;
+            if (cmd->op == PDF_CMD_PATH_OP)
+                cmd->arg = token[0];
+            break;
+        }
+    }
+    if (!operands)
+        return -EINVAL;
+    circle = strcmp(token, "circle") == 0;
+
+    for (; *operands; operands++) {
+        if (*operands == '|') {
+            optional = 1;
+            continue;
+        }
+        token = next_token(&pos, &len, &invalid);
+        if (!token) {
+            if (optional && !invalid)
+                break;
+            return -EINVAL;
+        }
+        switch (*operands) {
+        case 'i':
+            if (parse_int(token, &cmd->arg) < 0)
+                return -EINVAL;
+            break;
+        case 'c':
+            if (parse_colour(token, &cmd->colour) < 0)
+                return -EINVAL;
+            break;
+        case 'f':
+            if (parse_colour(token, &cmd->fill) < 0)
+                return -EINVAL;
+            break;
+        case 's':
+            if (len > UINT32_MAX)
+                return -EINVAL;
+            *data = token;
+            cmd->data_len = (uint32_t)len;
+            break;
+        default: {
+            char *end;
+
+            cmd->v[*operands - '0'] = strtof(token, &end);
+            if (*end)
+                return -EINVAL;
+            break;
+        }
+        }
+    }
+    if (next_token(&pos, &len, &invalid) || invalid)
+        return -EINVAL;
+    /* Circles are ellipses with the same radius in both directions */
+    if (circle)
+        cmd->v[3] = cmd->v[2];
+    return 1;
+}
+
+static int read_text(struct renderer *r, FILE *in)
+{
+    char *line = NULL;
+    size_t size = 0;
+    unsigned long number = 1; /* The header has already been read */
+    /* Paths are held back until their "end", to count their operations */
+    struct pdf_command *path = NULL;
+    unsigned long *path_lines = NULL;
+    int path_count = 0, path_size = 0;
+    int ret = 0;
+
+    r->unit = "Line";
+    while (ret >= 0 && read_line(in, &line, &size)) {
+        struct pdf_command cmd;
+        char *data;
+        int is_end;
+
+        number++;
+        ret = parse_command(line, &cmd, &data, &is_end);
+        if (ret < 0) {
+            fprintf(stderr, "Line %lu: invalid command\n", number);
+            break;
+        }
+        if (ret == 0)
+            continue;
+
+        if (is_end || (path_count && cmd.op != PDF_CMD_PATH_OP)) {
+            if (!path_count || !is_end) {
+                fprintf(stderr, "Line %lu: %s without a path\n", number,
+                        is_end ? "end" : "path not ended");
+                ret = -EINVAL;
+                break;
+            }
+            path[0].arg = path_count - 1;
+            for (int i = 0; ret >= 0 && i < path_count; i++)
+                ret = render_add(r, &path[i], NULL, path_lines[i]);
+            path_count = 0;
+            continue;
+        }
+        if (cmd.op == PDF_CMD_PATH || path_count) {
+            if (path_count > MAX_PATH_OPS) {
+                fprintf(stderr, "Line %lu: path has too many operations\n",
+                        path_lines[0]);
+                ret = -E2BIG;
+                break;
+            }
+            if (path_count >= path_size) {
+                int size = path_size ? path_size * 2 : 64;
+                struct pdf_command *new_path = (struct pdf_command *)realloc(
+                    path, size * sizeof(*path));
+                unsigned long *new_lines;
+
+                if (new_path)
+                    path = new_path;
+                new_lines = (unsigned long *)realloc(
+                    path_lines, size * sizeof(*path_lines));
+                if (new_lines)
+                    path_lines = new_lines;
+                if (!new_path || !new_lines) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                path_size = size;
+            }
+            path_lines[path_count] = number;
+            path[path_count++] = cmd;
+            continue;
+        }
+        if (cmd.op == PDF_CMD_PATH_OP) {
+            fprintf(stderr, "Line %lu: path operation outside a path\n",
+                    number);
+            ret = -EINVAL;
+            break;
+        }
+        ret = render_add(r, &cmd, data, number);
+    }
+    if (ret >= 0 && path_count) {
+        fprintf(stderr, "Line %lu: path not ended\n", path_lines[0]);
+        ret = -EINVAL;
+    }
+    free(path);
+    free(path_lines);
+    free(line);
+    return ret < 0 ? ret : 0;
+}
+
+/* Work out the format of the input from its start, and read it all */
+static int render_input(struct renderer *r, FILE *in)
+{
+    char magic[sizeof(TEXT_MAGIC) + 1];
+    size_t len = fread(magic, 1, BINARY_MAGIC_LEN, in);
+
+    if (r->convert && fwrite(BINARY_MAGIC, BINARY_MAGIC_LEN, 1,
+                             r->convert) != 1)
+        return -EIO;
+    if (len == BINARY_MAGIC_LEN &&
+        memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_LEN) == 0)
+        return read_binary(r, in);
+
+    /* The rest of the header line */
+    if (len == BINARY_MAGIC_LEN)
+        len += fread(&magic[len], 1, sizeof(TEXT_MAGIC) - len, in);
+    if (len == sizeof(TEXT_MAGIC) &&
+        memcmp(magic, TEXT_MAGIC, sizeof(TEXT_MAGIC) - 1) == 0 &&
+        (magic[len - 1] == '\n' || magic[len - 1] == '\r')) {
+        if (magic[len - 1] == '\r' && fgetc(in) != '\n')
+            return -EINVAL;
+        return read_text(r, in);
+    }
+    fprintf(stderr, "Input is not a version 1 command stream\n");
+    return -EINVAL;
+}
+
+static void render_free(struct renderer *r)
+{
+    if (r->pdf)
+        pdf_destroy(r->pdf);
+    free(r->batch);
+    free(r->where);
+    free(r->results);
+    free(r->data);
+    free(r->bookmarks);
+}
+
+/* Render (or convert) a whole input stream, returning the exit status */
+static int render(struct renderer *r, FILE *in, FILE *out)
+{
+    int ret;
+
+    if (r->convert)
+        return render_input(r, in) < 0 || fflush(out) != 0;
+
+    ret = render_input(r, in);
+    if (ret >= 0)
+        ret = render_flush(r);
+    if (ret >= 0)
+        ret = render_create(r);
+    if (ret >= 0 && pdf_save_file(r->pdf, out) < 0) {
+        fprintf(stderr, "Unable to save PDF: %s\n",
+                pdf_get_err(r->pdf, NULL));
+        ret = -EIO;
+    }
+    if (ret >= 0 && fflush(out) != 0)
+        ret = -EIO;
+    return ret < 0 || r->failed;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write a page full of typical commands (text, lines, shapes, a path & a
+ * barcode) in binary, returning the number of bytes */
+static size_t generate_page(FILE *out, int page)
+{
+    static const char *const words[] = {"Invoice", "Quantity", "Total",
+                                        "Lorem ipsum dolor sit amet",
+                                        "1234.56"};
+    uint8_t record[RECORD_SIZE];
+    size_t bytes = 0;
+
+#define EMIT(cmd, data, len)                                                 \
+    do {                                                                     \
+        struct pdf_command c = cmd;                                          \
+        c.data_len = (uint32_t)(len);                                        \
+        encode_command(record, &c);                                          \
+        fwrite(record, sizeof(record), 1, out);                              \
+        fwrite(data, 1, len, out);                                           \
+        bytes += sizeof(record) + (len);                                     \
+    } while (0)
+
+    EMIT(((struct pdf_command){.op = RENDER_PAGE}), "", 0);
+    for (int row = 0; row < 40; row++) {
+        float y = 780 - row * 18.0f;
+
+        for (int col = 0; col < 5; col++) {
+            const char *word = words[(row + col + page) % 5];
+
+            EMIT(((struct pdf_command){.op = PDF_CMD_TEXT,
+                                       .v = {9, 40 + col * 105.0f, y}}),
+                 word, strlen(word));
+        }
+        EMIT(((struct pdf_command){.op = PDF_CMD_LINE,
+                                   .v = {40, y - 4, 560, y - 4, 0.5f},
+                                   .colour = PDF_RGB(0x80, 0x80, 0x80)}),
+             "", 0);
+        if (row % 4 == 0)
+            EMIT(((struct pdf_command){.op = PDF_CMD_RECTANGLE,
+                                       .v = {40, y - 4, 520, 16, 0},
+                                       .colour = PDF_TRANSPARENT,
+                                       .fill = PDF_RGB(0xee, 0xee, 0xff)}),
+                 "", 0);
+    }
+    EMIT(((struct pdf_command){.op = PDF_CMD_PATH, .v = {1}, .arg = 3}), "",
+         0);
+    EMIT(((struct pdf_command){.op = PDF_CMD_PATH_OP,
+                               .arg = 'm',
+                               .v = {40, 40}}),
+         "", 0);
+    EMIT(((struct pdf_command){.op = PDF_CMD_PATH_OP,
+                               .arg = 'c',
+                               .v = {100, 80, 200, 0, 300, 40}}),
+         "", 0);
+    EMIT(((struct pdf_command){.op = PDF_CMD_PATH_OP, .arg = 'h'}), "", 0);
+    EMIT(((struct pdf_command){.op = PDF_CMD_BARCODE,
+                               .arg = PDF_BARCODE_128A,
+                               .v = {400, 20, 150, 30}}),
+         "Code128", 7);
+#undef EMIT
+    return bytes;
+}
+
+/* Measure how quickly commands are read & drawn, and the PDF written */
+static int benchmark(long megabytes)
+{
+    struct renderer r = {0};
+    FILE *in = tmpfile(), *out = tmpfile();
+    size_t in_bytes = BINARY_MAGIC_LEN;
+    long out_bytes;
+    double start, drawn, saved;
+    int ret;
+
+    if (!in || !out)
+        return 1;
+    fwrite(BINARY_MAGIC, BINARY_MAGIC_LEN, 1, in);
+    for (int page = 0; in_bytes < (size_t)megabytes * 1024 * 1024; page++)
+        in_bytes += generate_page(in, page);
+    if (fflush(in) != 0)
+        return 1;
+    rewind(in);
+
+    start = now();
+    ret = render_input(&r, in);
+    if (ret >= 0)
+        ret = render_flush(&r);
+    drawn = now();
+    if (ret >= 0)
+        ret = pdf_save_file(r.pdf, out);
+    fflush(out);
+    saved = now();
+    out_bytes = ftell(out);
+    render_free(&r);
+    fclose(in);
+    fclose(out);
+    if (ret < 0 || r.failed)
+        return 1;
+
+    printf("{\"name\": \"render\", \"input_bytes\": %zu, "
+           "\"output_bytes\": %ld, \"input_mb_per_s\": %.1f, "
+           "\"output_mb_per_s\": %.1f, \"total_s\": %.3f}\n",
+           in_bytes, out_bytes, in_bytes / (drawn - start) / 1e6,
+           out_bytes / (saved - drawn) / 1e6, saved - start);
+    return 0;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "Usage: pdfgen-render [-d date] [-c] [-o output] "
+                    "[input]\n"
+                    "       pdfgen-render -b megabytes\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    struct renderer r = {0};
+    const char *input = NULL, *output = NULL;
+    FILE *in = stdin, *out = stdout;
+    int convert = 0;
+    int ret;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            r.date = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0)
+            convert = 1;
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            return benchmark(atol(argv[++i]));
+        else if (argv[i][0] == '-' || input)
+            return usage();
+        else
+            input = argv[i];
+    }
+
+    if (input && !(in = fopen(input, "rb"))) {
+        perror(input);
+        return 1;
+    }
+    if (output && !(out = fopen(output, "wb"))) {
+        perror(output);
+        return 1;
+    }
+    if (convert)
+        r.convert = out;
+
+    ret = render(&r, in, out);
+    render_free(&r);
+    if (in != stdin)
+        fclose(in);
+    if (out != stdout && fclose(out) != 0)
+        ret = 1;
+    return ret;
+}
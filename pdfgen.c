@@ -96,6 +96,7 @@
 #define _CRT_SECURE_NO_WARNINGS 1 // Drop the MSVC complaints about snprintf
 #define _USE_MATH_DEFINES
 #include <BaseTsd.h>
+#include <intrin.h> /* for _InterlockedExchangeAdd64 */
 typedef SSIZE_T ssize_t;
 #else
 
@@ -104,7 +105,15 @@ typedef SSIZE_T ssize_t;
 #endif
 
 #ifndef _XOPEN_SOURCE
-#define _XOPEN_SOURCE 600 /* for M_SQRT2 */
+#define _XOPEN_SOURCE 700 /* for M_SQRT2 & newlocale */
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L /* for flockfile, which _POSIX_SOURCE hides */
+#endif
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* for fseeko past 2GB on 32-bit systems */
 #endif
 
 #include <sys/types.h> /* for ssize_t */
@@ -112,6 +121,7 @@ typedef SSIZE_T ssize_t;
 
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <locale.h>
@@ -125,6 +135,10 @@ typedef SSIZE_T ssize_t;
 #include <sys/stat.h>
 #include <time.h>
 
+#ifdef PDFGEN_WRITER_THREAD
+#include <pthread.h>
+#endif
+
 #include "pdfgen.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
@@ -222,6 +236,9 @@ enum {
     OBJ_pages,
     OBJ_image,
     OBJ_link,
+    OBJ_raw,  /* Object copied verbatim from another PDF */
+    OBJ_form, /* Form XObject, ie: an imported page */
+    OBJ_pattern, /* Tiling pattern, see pdf_add_pattern */
 
     OBJ_count,
 };
@@ -243,33 +260,49 @@ struct dstr {
     size_t used_len;
 };
 
+/**
+ * Objects are allocated just large enough for the header plus the payload
+ * of their own type (see pdf_object_size), so only the union member that
+ * matches 'type' may be accessed. Anything large or variable length lives
+ * out of line, so that the common small objects (links, fonts, pages)
+ * stay compact.
+ */
 struct pdf_object {
     int type;                /* See OBJ_xxxx */
     int index;               /* PDF output index */
-    int offset;              /* Byte position within the output file */
+    uint64_t offset;         /* Byte position within the output file */
     struct pdf_object *prev; /* Previous of this type */
     struct pdf_object *next; /* Next of this type */
     union {
         struct {
             struct pdf_object *page;
-            char name[64];
+            char *name; /* Allocated, at most 63 characters */
             struct pdf_object *parent;
             struct flexarray children;
+            /* Filled in by pdf_link_bookmarks when saving */
+            struct pdf_object *prev_sibling, *next_sibling;
+            int descendants;
         } bookmark;
         struct {
             struct pdf_object *page;
             struct dstr stream;
+            int name;   /* Images: resource name number, ie: /Image<name> */
+            int format; /* Images: source format, IMAGE_xxx */
         } stream;
         struct {
             float width;
             float height;
-            struct flexarray children;
+            struct pdf_object *content; /* OBJ_stream of drawing operations */
             struct flexarray annotations;
+            struct flexarray forms; /* OBJ_form objects used on this page */
+            struct flexarray patterns; /* OBJ_pattern objects used */
+            float bbox[4]; /* Extent of drawing, see pdf_page_get_bbox */
         } page;
         struct pdf_info *info;
         struct {
             char name[64];
             int index;
+            const uint16_t *widths; /* NULL if not a standard font */
         } font;
         struct {
             struct pdf_object *page; /* Page containing link */
@@ -281,18 +314,66 @@ struct pdf_object {
             float target_x;                 /* Target location */
             float target_y;
         } link;
+        struct {
+            struct dstr data;      /* Object body, see PDF_RAW_REF */
+            size_t dict_len;       /* References only occur in this many
+                                      bytes at the start of data */
+            struct flexarray refs; /* Objects referred to, in order */
+            float bbox[4];         /* Forms: llx, lly, urx, ury */
+            int name;              /* Forms: resource name, /Form<name> */
+        } raw;
+        struct {
+            struct dstr content; /* Drawing operations for a single tile */
+            float width;         /* Size of each tile */
+            float height;
+            int name; /* Resource name, /P<name> */
+        } pattern;
     };
 };
 
+/* A string previously passed to pdf_text_encode, see pdf_set_text_cache */
+struct pdf_text_cache_entry {
+    const uint16_t *widths; /* Font widths the string was measured with */
+    uint64_t hash;          /* Hash of widths & text */
+    uint64_t seen;          /* Hash of the last string to miss, which is
+                               cached if it turns up again */
+    uint32_t width;         /* As returned by pdf_text_encode */
+    int chars;
+    size_t text_len;
+    size_t encoded_len;
+    char *data; /* text_len bytes of text followed by its encoding */
+};
+
 struct pdf_doc {
     char errstr[128];
     int errval;
+    int err_lock; /* Guards errstr & errval, see pdf_set_err */
     struct flexarray objects;
 
     float width;
     float height;
 
     struct pdf_object *current_font;
+    bool deterministic;  /* See pdf_set_deterministic */
+    bool measure_only;   /* See pdf_set_measure_only */
+    bool track_bbox;     /* See pdf_set_bbox_tracking */
+    size_t content_hint; /* See pdf_reserve */
+    int deleted_count;   /* Holes in objects, see pdf_del_object */
+    int last_name; /* Last image/form/pattern resource name handed out */
+    uint64_t object_counts[OBJ_count]; /* Objects of each type */
+    uint64_t heap_bytes;               /* Memory used, see pdf_charge */
+    uint64_t content_bytes;            /* Length of the page contents */
+    uint64_t image_bytes[IMAGE_UNKNOWN + 1]; /* Placed images, by format */
+    uint64_t imported_bytes;                 /* Raw & form objects */
+    struct pdf_limits limits;     /* See pdf_set_limits */
+    struct pdf_text_cache_entry *text_cache; /* See pdf_set_text_cache */
+    int text_cache_size;                     /* Slots, a power of two */
+    uint64_t text_cache_hits;
+    uint64_t text_cache_misses;
+#ifdef PDFGEN_TRACE
+    pdf_trace_fn trace; /* See pdf_set_trace */
+    void *trace_arg;
+#endif
 
     struct pdf_object *last_objects[OBJ_count];
     struct pdf_object *first_objects[OBJ_count];
@@ -389,29 +470,51 @@ static inline int flexarray_size(const struct flexarray *flex)
     return flex->item_count;
 }
 
+static int flexarray_add_bin(struct flexarray *flex)
+{
+    void ***bins = (void ***)realloc(flex->bins, (flex->bin_count + 1) *
+                                                     sizeof(*flex->bins));
+    if (!bins)
+        return -ENOMEM;
+    flex->bin_count++;
+    flex->bins = bins;
+    flex->bins[flex->bin_count - 1] =
+        (void **)calloc(flexarray_get_bin_size(flex, flex->bin_count - 1),
+                        sizeof(void *));
+    if (!flex->bins[flex->bin_count - 1]) {
+        flex->bin_count--;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 static int flexarray_set(struct flexarray *flex, int index, void *data)
 {
     int bin = flexarray_get_bin(flex, index);
     if (bin < 0)
         return -EINVAL;
-    if (bin >= flex->bin_count) {
-        void ***bins = (void ***)realloc(flex->bins, (flex->bin_count + 1) *
-                                                         sizeof(*flex->bins));
-        if (!bins)
-            return -ENOMEM;
-        flex->bin_count++;
-        flex->bins = bins;
-        flex->bins[flex->bin_count - 1] =
-            (void **)calloc(flexarray_get_bin_size(flex, flex->bin_count - 1),
-                            sizeof(void *));
-        if (!flex->bins[flex->bin_count - 1]) {
-            flex->bin_count--;
-            return -ENOMEM;
-        }
-    }
-    flex->item_count++;
+    if (bin >= flex->bin_count && flexarray_add_bin(flex) < 0)
+        return -ENOMEM;
+    if (index >= flex->item_count)
+        flex->item_count = index + 1;
     flex->bins[bin][flexarray_get_bin_offset(flex, bin, index)] = data;
-    return flex->item_count - 1;
+    return index;
+}
+
+/* Make room for 'count' items, so that appending them cannot fail */
+static int flexarray_reserve(struct flexarray *flex, int count)
+{
+    int bin;
+
+    if (count <= 0)
+        return 0;
+    bin = flexarray_get_bin(flex, count - 1);
+    if (bin < 0)
+        return -EINVAL;
+    while (bin >= flex->bin_count)
+        if (flexarray_add_bin(flex) < 0)
+            return -ENOMEM;
+    return 0;
 }
 
 static inline int flexarray_append(struct flexarray *flex, void *data)
@@ -482,25 +585,77 @@ static ssize_t dstr_ensure(struct dstr *str, size_t len)
 }
 
 // Locales can replace the decimal character with a ','.
-// This breaks the PDF output, so we force a 'safe' locale.
-static void force_locale(char *buf, int len)
+// This breaks the PDF output, so numbers are always formatted in the "C"
+// locale. Where possible this is only switched for the calling thread, as
+// setlocale changes the locale of every thread in the process.
+#ifdef _WIN32
+typedef struct {
+    int thread_mode; /* From _configthreadlocale */
+    char name[32];   /* Numeric locale to restore, if any */
+} pdf_locale_t;
+
+static void force_locale(pdf_locale_t *saved)
 {
-    char *saved_locale = setlocale(LC_ALL, NULL);
+    const struct lconv *lc = localeconv();
+    const char *current;
 
-    if (!saved_locale) {
-        *buf = '\0';
-    } else {
-        strncpy(buf, saved_locale, len - 1);
-        buf[len - 1] = '\0';
+    saved->name[0] = '\0';
+    if (lc && lc->decimal_point && strcmp(lc->decimal_point, ".") == 0)
+        return;
+    /* Only affect the calling thread */
+    saved->thread_mode = _configthreadlocale(_ENABLE_PER_THREAD_LOCALE);
+    current = setlocale(LC_NUMERIC, NULL);
+    if (current) {
+        strncpy(saved->name, current, sizeof(saved->name) - 1);
+        saved->name[sizeof(saved->name) - 1] = '\0';
+    }
+    setlocale(LC_NUMERIC, "C");
+}
+
+static void restore_locale(pdf_locale_t *saved)
+{
+    if (saved->name[0]) {
+        setlocale(LC_NUMERIC, saved->name);
+        _configthreadlocale(saved->thread_mode);
     }
+}
+#else
+typedef locale_t pdf_locale_t;
+
+/* The "C" locale, created on first use & shared by all documents */
+static locale_t pdf_c_locale(void)
+{
+    static locale_t c_locale;
+    locale_t loc = __atomic_load_n(&c_locale, __ATOMIC_ACQUIRE);
+    locale_t expected = (locale_t)0;
+
+    if (loc)
+        return loc;
+    loc = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+    if (!loc)
+        return (locale_t)0;
+    /* Another thread may have got there first */
+    if (!__atomic_compare_exchange_n(&c_locale, &expected, loc, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        freelocale(loc);
+        loc = expected;
+    }
+    return loc;
+}
 
-    setlocale(LC_NUMERIC, "POSIX");
+static void force_locale(pdf_locale_t *saved)
+{
+    locale_t loc = pdf_c_locale();
+
+    *saved = loc ? uselocale(loc) : (locale_t)0;
 }
 
-static void restore_locale(char *buf)
+static void restore_locale(pdf_locale_t *saved)
 {
-    setlocale(LC_ALL, buf);
+    if (*saved)
+        uselocale(*saved);
 }
+#endif
 
 #ifndef SKIP_ATTRIBUTE
 static int dstr_printf(struct dstr *str, const char *fmt, ...)
@@ -510,9 +665,9 @@ static int dstr_printf(struct dstr *str, const char *fmt, ...)
 {
     va_list ap, aq;
     int len;
-    char saved_locale[32];
+    pdf_locale_t saved_locale;
 
-    force_locale(saved_locale, sizeof(saved_locale));
+    force_locale(&saved_locale);
 
     va_start(ap, fmt);
     va_copy(aq, ap);
@@ -520,14 +675,14 @@ static int dstr_printf(struct dstr *str, const char *fmt, ...)
     if (dstr_ensure(str, str->used_len + len + 1) < 0) {
         va_end(ap);
         va_end(aq);
-        restore_locale(saved_locale);
+        restore_locale(&saved_locale);
         return -ENOMEM;
     }
     vsprintf(dstr_data(str) + str->used_len, fmt, aq);
     str->used_len += len;
     va_end(ap);
     va_end(aq);
-    restore_locale(saved_locale);
+    restore_locale(&saved_locale);
 
     return len;
 }
@@ -559,6 +714,37 @@ static void dstr_free(struct dstr *str)
  * PDF Implementation
  */
 
+/**
+ * The error state is shared by every thread drawing on the document, so
+ * it is guarded by a small spinlock; errors are rare & the critical
+ * sections are a copy of at most 128 bytes.
+ */
+static void pdf_err_lock(const struct pdf_doc *pdf)
+{
+    int *lock = (int *)&pdf->err_lock;
+#if defined(__GNUC__) || defined(__clang__)
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        ;
+#elif defined(_MSC_VER)
+    while (_InterlockedExchange((volatile long *)lock, 1))
+        ;
+#else
+    (void)lock;
+#endif
+}
+
+static void pdf_err_unlock(const struct pdf_doc *pdf)
+{
+    int *lock = (int *)&pdf->err_lock;
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#elif defined(_MSC_VER)
+    _InterlockedExchange((volatile long *)lock, 0);
+#else
+    (void)lock;
+#endif
+}
+
 #ifndef SKIP_ATTRIBUTE
 static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
                        ...) __attribute__((format(printf, 3, 4)));
@@ -568,64 +754,331 @@ static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
 {
     va_list ap;
     int len;
+    char errstr[sizeof(doc->errstr)];
 
     va_start(ap, buffer);
-    len = vsnprintf(doc->errstr, sizeof(doc->errstr) - 1, buffer, ap);
+    len = vsnprintf(errstr, sizeof(errstr) - 1, buffer, ap);
     va_end(ap);
 
-    if (len < 0) {
-        doc->errstr[0] = '\0';
-        return errval;
-    }
-
-    if (len >= (int)(sizeof(doc->errstr) - 1))
-        len = (int)(sizeof(doc->errstr) - 1);
+    if (len < 0)
+        len = 0;
+    if (len >= (int)(sizeof(errstr) - 1))
+        len = (int)(sizeof(errstr) - 1);
+    errstr[len] = '\0';
 
-    doc->errstr[len] = '\0';
+    pdf_err_lock(doc);
+    memcpy(doc->errstr, errstr, len + 1);
     doc->errval = errval;
+    pdf_err_unlock(doc);
 
     return errval;
 }
 
 const char *pdf_get_err(const struct pdf_doc *pdf, int *errval)
 {
+    bool set;
+
     if (!pdf)
         return NULL;
-    if (pdf->errstr[0] == '\0')
-        return NULL;
-    if (errval)
+    pdf_err_lock(pdf);
+    set = pdf->errstr[0] != '\0';
+    if (set && errval)
         *errval = pdf->errval;
-    return pdf->errstr;
+    pdf_err_unlock(pdf);
+    return set ? pdf->errstr : NULL;
 }
 
 void pdf_clear_err(struct pdf_doc *pdf)
 {
     if (!pdf)
         return;
+    pdf_err_lock(pdf);
     pdf->errstr[0] = '\0';
     pdf->errval = 0;
+    pdf_err_unlock(pdf);
 }
 
 static int pdf_get_errval(struct pdf_doc *pdf)
 {
+    int errval;
+
     if (!pdf)
         return 0;
-    return pdf->errval;
+    pdf_err_lock(pdf);
+    errval = pdf->errval;
+    pdf_err_unlock(pdf);
+    return errval;
+}
+
+/**
+ * Tracing
+ * With PDFGEN_TRACE defined, the hot paths report how long they took to
+ * the callback from pdf_set_trace. Otherwise these compile to nothing.
+ */
+#ifdef PDFGEN_TRACE
+static uint64_t pdf_trace_now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pdf_trace_span(const struct pdf_doc *pdf, const char *category,
+                           const char *name, uint64_t start, uint64_t bytes)
+{
+    pdf->trace(pdf->trace_arg, category, name, start,
+               pdf_trace_now() - start, bytes);
+}
+
+#define PDF_TRACE_START(pdf, start)                                          \
+    uint64_t start = (pdf)->trace ? pdf_trace_now() : 0
+#define PDF_TRACE_END(pdf, start, category, name, bytes)                     \
+    do {                                                                     \
+        if ((pdf)->trace)                                                    \
+            pdf_trace_span(pdf, category, name, start, bytes);               \
+    } while (0)
+#else
+#define PDF_TRACE_START(pdf, start)
+#define PDF_TRACE_END(pdf, start, category, name, bytes) (void)(bytes)
+#endif
+
+int pdf_set_trace(struct pdf_doc *pdf, pdf_trace_fn callback, void *arg)
+{
+    if (!pdf)
+        return -EINVAL;
+#ifdef PDFGEN_TRACE
+    pdf->trace = callback;
+    pdf->trace_arg = arg;
+    return 0;
+#else
+    (void)callback;
+    (void)arg;
+    return pdf_set_err(pdf, -ENOTSUP,
+                       "Tracing requires building with PDFGEN_TRACE");
+#endif
+}
+
+/* Events may come from several threads at once, so each one is written
+ * with the FILE locked */
+static void pdf_lock_file(FILE *fp)
+{
+#ifdef _WIN32
+    _lock_file(fp);
+#else
+    flockfile(fp);
+#endif
+}
+
+static void pdf_unlock_file(FILE *fp)
+{
+#ifdef _WIN32
+    _unlock_file(fp);
+#else
+    funlockfile(fp);
+#endif
+}
+
+#if defined(_MSC_VER)
+#define PDF_THREAD_LOCAL __declspec(thread)
+#else
+#define PDF_THREAD_LOCAL __thread
+#endif
+
+static uint64_t pdf_counter_add(uint64_t *counter, int64_t delta);
+
+/* Each thread gets its own track in the trace, numbered from 1 in the
+ * order they first report an event */
+static int pdf_trace_thread_id(void)
+{
+    static uint64_t next_id;
+    static PDF_THREAD_LOCAL int id;
+
+    if (!id)
+        id = (int)pdf_counter_add(&next_id, 1);
+    return id;
+}
+
+int pdf_trace_chrome_start(FILE *fp)
+{
+    if (!fp)
+        return -EINVAL;
+    return fprintf(fp, "[\n") < 0 ? -EIO : 0;
+}
+
+void pdf_trace_chrome(void *arg, const char *category, const char *name,
+                      uint64_t start_ns, uint64_t duration_ns, uint64_t bytes)
+{
+    FILE *fp = (FILE *)arg;
+    int tid = pdf_trace_thread_id();
+
+    pdf_lock_file(fp);
+    fprintf(fp,
+            "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"bytes\": %" PRIu64 "}},\n",
+            name, category, start_ns / 1000.0, duration_ns / 1000.0, tid,
+            bytes);
+    pdf_unlock_file(fp);
+}
+
+int pdf_trace_chrome_finish(FILE *fp)
+{
+    int ret;
+
+    if (!fp)
+        return -EINVAL;
+    /* Every event ends with a comma, so the array is closed off with a
+     * metadata event naming the process */
+    pdf_lock_file(fp);
+    ret = fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", "
+                      "\"pid\": 1, \"args\": {\"name\": \"pdfgen\"}}\n]\n");
+    pdf_unlock_file(fp);
+    if (ret < 0 || fflush(fp) != 0)
+        return -EIO;
+    return 0;
 }
 
+/* Marks where a reference to an object is written in a raw object */
+#define PDF_RAW_REF '\x01'
+#define PDF_RAW_REF_STR "\x01"
+
 static struct pdf_object *pdf_get_object(const struct pdf_doc *pdf, int index)
 {
     return (struct pdf_object *)flexarray_get(&pdf->objects, index);
 }
 
+/**
+ * The running totals behind pdf_get_stats & pdf_set_limits. Content
+ * streams of different pages may grow on different threads, so these are
+ * updated atomically where possible.
+ */
+static uint64_t pdf_counter_add(uint64_t *counter, int64_t delta)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_add_fetch(counter, (uint64_t)delta, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)counter,
+                                               delta) +
+           (uint64_t)delta;
+#else
+    return *counter += (uint64_t)delta;
+#endif
+}
+
+static uint64_t pdf_counter_get(const uint64_t *counter)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return (uint64_t)_InterlockedCompareExchange64(
+        (volatile __int64 *)counter, 0, 0);
+#else
+    return *counter;
+#endif
+}
+
+/* Memory accounting, for pdf_set_limits */
+static void pdf_charge(struct pdf_doc *pdf, int64_t bytes)
+{
+    pdf_counter_add(&pdf->heap_bytes, bytes);
+}
+
+/**
+ * Charge for memory which is about to be allocated, unless that would go
+ * past the document's limit. The check & the charge are a single atomic
+ * add (undone if it went too far), so threads growing different pages
+ * can't both slip under the limit. Returns false, with nothing charged,
+ * if there's no room.
+ */
+static bool pdf_try_reserve(struct pdf_doc *pdf, uint64_t bytes)
+{
+    uint64_t total = pdf_counter_add(&pdf->heap_bytes, (int64_t)bytes);
+
+    if (pdf->limits.heap_bytes && total > pdf->limits.heap_bytes) {
+        pdf_charge(pdf, -(int64_t)bytes);
+        return false;
+    }
+    return true;
+}
+
+static int pdf_heap_error(struct pdf_doc *pdf)
+{
+    return pdf_set_err(pdf, -ENOSPC,
+                       "Document memory limit of %" PRIu64 " bytes reached",
+                       pdf->limits.heap_bytes);
+}
+
+/* As pdf_try_reserve, but fails with -ENOSPC. Undo with pdf_charge */
+static int pdf_reserve_heap(struct pdf_doc *pdf, uint64_t bytes)
+{
+    return pdf_try_reserve(pdf, bytes) ? 0 : pdf_heap_error(pdf);
+}
+
+/* Fail early if the document can't have this much more memory, before
+ * doing the work which needs it (which is then reserved) */
+static int pdf_check_heap(struct pdf_doc *pdf, uint64_t extra)
+{
+    if (pdf->limits.heap_bytes &&
+        pdf_counter_get(&pdf->heap_bytes) + extra > pdf->limits.heap_bytes)
+        return pdf_heap_error(pdf);
+    return 0;
+}
+
+/* Memory used by the bins of a flexarray */
+static uint64_t flexarray_heap(const struct flexarray *flex)
+{
+    uint64_t size = 0;
+
+    for (int bin = 0; bin < flex->bin_count; bin++)
+        size += flexarray_get_bin_size(flex, bin) * sizeof(void *);
+    return size;
+}
+
+/* Append to a flexarray, reserving memory for any new bin it needs */
+static int pdf_flexarray_append(struct pdf_doc *pdf, struct flexarray *flex,
+                                void *data)
+{
+    int bin = flexarray_get_bin(flex, flexarray_size(flex));
+    uint64_t size = 0;
+    int ret;
+
+    if (bin >= flex->bin_count) {
+        size = flexarray_get_bin_size(flex, bin) * sizeof(void *);
+        if (pdf_reserve_heap(pdf, size) < 0)
+            return pdf_get_errval(pdf);
+    }
+    ret = flexarray_append(flex, data);
+    if (ret < 0) {
+        pdf_charge(pdf, -(int64_t)size);
+        return pdf_set_err(pdf, ret, "Unable to grow list of %d entries",
+                           flexarray_size(flex));
+    }
+    return ret;
+}
+
+/* Fail if an image of this size would exceed the limit */
+static int pdf_check_image_size(struct pdf_doc *pdf, uint32_t width,
+                                uint32_t height, int bytes_per_pixel)
+{
+    uint64_t size = (uint64_t)width * height * bytes_per_pixel;
+
+    if (pdf->limits.image_bytes && size > pdf->limits.image_bytes)
+        return pdf_set_err(pdf, -ENOSPC,
+                           "Image of %" PRIu64 " bytes exceeds the limit of "
+                           "%" PRIu64 " bytes",
+                           size, pdf->limits.image_bytes);
+    return pdf_check_heap(pdf, size);
+}
+
 static int pdf_append_object(struct pdf_doc *pdf, struct pdf_object *obj)
 {
-    int index = flexarray_append(&pdf->objects, obj);
+    int index = pdf_flexarray_append(pdf, &pdf->objects, obj);
 
     if (index < 0)
         return index;
     obj->index = index;
 
+    pdf_counter_add(&pdf->object_counts[obj->type], 1);
     if (pdf->last_objects[obj->type]) {
         obj->prev = pdf->last_objects[obj->type];
         pdf->last_objects[obj->type]->next = obj;
@@ -646,28 +1099,157 @@ static void pdf_object_destroy(struct pdf_object *object)
         dstr_free(&object->stream.stream);
         break;
     case OBJ_page:
-        flexarray_clear(&object->page.children);
         flexarray_clear(&object->page.annotations);
+        flexarray_clear(&object->page.forms);
+        flexarray_clear(&object->page.patterns);
         break;
     case OBJ_info:
         free(object->info);
         break;
     case OBJ_bookmark:
+        free(object->bookmark.name);
         flexarray_clear(&object->bookmark.children);
         break;
+    case OBJ_raw:
+    case OBJ_form:
+        dstr_free(&object->raw.data);
+        flexarray_clear(&object->raw.refs);
+        break;
+    case OBJ_pattern:
+        dstr_free(&object->pattern.content);
+        break;
     }
     free(object);
 }
 
+/* Bytes needed for the header & the given member of the payload union */
+#define PDF_OBJECT_SIZE(member)                                              \
+    (offsetof(struct pdf_object, member) +                                   \
+     sizeof(((struct pdf_object *)0)->member))
+
+/* How much memory an object of the given type needs */
+static size_t pdf_object_size(int type)
+{
+    switch (type) {
+    case OBJ_bookmark:
+        return PDF_OBJECT_SIZE(bookmark);
+    case OBJ_stream:
+    case OBJ_image:
+        return PDF_OBJECT_SIZE(stream);
+    case OBJ_page:
+        return PDF_OBJECT_SIZE(page);
+    case OBJ_info:
+        return PDF_OBJECT_SIZE(info);
+    case OBJ_font:
+        return PDF_OBJECT_SIZE(font);
+    case OBJ_link:
+        return PDF_OBJECT_SIZE(link);
+    case OBJ_raw:
+    case OBJ_form:
+        return PDF_OBJECT_SIZE(raw);
+    case OBJ_pattern:
+        return PDF_OBJECT_SIZE(pattern);
+    }
+    /* No payload */
+    return offsetof(struct pdf_object, info);
+}
+
+#ifdef PDFGEN_TRACE
+static const char *pdf_object_type_name(int type)
+{
+    static const char *names[OBJ_count] = {
+        "none",    "info",  "stream", "font", "page", "bookmark", "outline",
+        "catalog", "pages", "image",  "link", "raw",  "form",     "pattern",
+    };
+    return names[type];
+}
+#endif
+
+/* How much memory an object is using, including its data */
+static uint64_t pdf_object_heap(const struct pdf_object *obj)
+{
+    uint64_t size = pdf_object_size(obj->type);
+
+    switch (obj->type) {
+    case OBJ_image:
+        /* Images are charged for as they're placed (see pdf_add_image) */
+        if (!obj->stream.page)
+            break;
+        /* fall through */
+    case OBJ_stream:
+        if (obj->stream.stream.data)
+            size += obj->stream.stream.alloc_len;
+        break;
+    case OBJ_page:
+        size += flexarray_heap(&obj->page.annotations) +
+                flexarray_heap(&obj->page.forms) +
+                flexarray_heap(&obj->page.patterns);
+        break;
+    case OBJ_bookmark:
+        if (obj->bookmark.name)
+            size += strlen(obj->bookmark.name) + 1;
+        size += flexarray_heap(&obj->bookmark.children);
+        break;
+    case OBJ_raw:
+    case OBJ_form:
+        if (obj->raw.data.data)
+            size += obj->raw.data.alloc_len;
+        size += flexarray_heap(&obj->raw.refs);
+        break;
+    case OBJ_pattern:
+        if (obj->pattern.content.data)
+            size += obj->pattern.content.alloc_len;
+        break;
+    }
+    return size;
+}
+
+/**
+ * Add (sign = 1) or remove (sign = -1) an object's data from the totals
+ * for pdf_get_stats. This is done wherever the object's memory is charged
+ * for, so that the totals never need recalculating.
+ */
+static void pdf_count_object(struct pdf_doc *pdf,
+                             const struct pdf_object *obj, int sign)
+{
+    switch (obj->type) {
+    case OBJ_stream:
+        pdf_counter_add(&pdf->content_bytes,
+                        sign * (int64_t)dstr_len(&obj->stream.stream));
+        break;
+    case OBJ_image:
+        if (obj->stream.page)
+            pdf_counter_add(&pdf->image_bytes[obj->stream.format],
+                            sign * (int64_t)dstr_len(&obj->stream.stream));
+        break;
+    case OBJ_raw:
+    case OBJ_form:
+        pdf_counter_add(&pdf->imported_bytes,
+                        sign * (int64_t)dstr_len(&obj->raw.data));
+        break;
+    }
+}
+
 static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
 {
     struct pdf_object *obj;
 
     if (!pdf)
         return NULL;
+    PDF_TRACE_START(pdf, start);
+
+    if (pdf->limits.objects &&
+        flexarray_size(&pdf->objects) >= pdf->limits.objects) {
+        pdf_set_err(pdf, -ENOSPC, "Document object limit of %d reached",
+                    pdf->limits.objects);
+        return NULL;
+    }
+    if (pdf_reserve_heap(pdf, pdf_object_size(type)) < 0)
+        return NULL;
 
-    obj = (struct pdf_object *)calloc(1, sizeof(*obj));
+    obj = (struct pdf_object *)calloc(1, pdf_object_size(type));
     if (!obj) {
+        pdf_charge(pdf, -(int64_t)pdf_object_size(type));
         pdf_set_err(pdf, -errno,
                     "Unable to allocate object %d of type %d: %s",
                     flexarray_size(&pdf->objects) + 1, type, strerror(errno));
@@ -675,40 +1257,87 @@ static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
     }
 
     obj->type = type;
+    if (type == OBJ_image)
+        obj->stream.format = IMAGE_UNKNOWN;
 
     if (pdf_append_object(pdf, obj) < 0) {
+        pdf_charge(pdf, -(int64_t)pdf_object_size(type));
         free(obj);
         return NULL;
     }
 
+    PDF_TRACE_END(pdf, start, "object", pdf_object_type_name(type),
+                  pdf_object_size(type));
     return obj;
 }
 
+/* Remove an object from the chain of objects of its type */
+static void pdf_unlink_object(struct pdf_doc *pdf, struct pdf_object *obj)
+{
+    pdf_counter_add(&pdf->object_counts[obj->type], -1);
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        pdf->first_objects[obj->type] = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    else
+        pdf->last_objects[obj->type] = obj->prev;
+    obj->prev = obj->next = NULL;
+}
+
+/**
+ * Delete an object, leaving a hole in the object numbering which is closed
+ * up when saving (see pdf_out_number_objects). Objects are never
+ * renumbered in memory, as callers hold on to their numbers (eg: bookmark
+ * parents). Deleting the newest object (the usual case when backing out of
+ * a failed operation) doesn't leave a hole.
+ */
 static void pdf_del_object(struct pdf_doc *pdf, struct pdf_object *obj)
 {
-    int type = obj->type;
+    pdf_charge(pdf, -(int64_t)pdf_object_heap(obj));
+    pdf_count_object(pdf, obj, -1);
+    pdf_unlink_object(pdf, obj);
     flexarray_set(&pdf->objects, obj->index, NULL);
-    if (pdf->last_objects[type] == obj) {
-        pdf->last_objects[type] = NULL;
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-            struct pdf_object *o = pdf_get_object(pdf, i);
-            if (o && o->type == type)
-                pdf->last_objects[type] = o;
-        }
+    pdf->deleted_count++;
+    while (flexarray_size(&pdf->objects) > 0 &&
+           !pdf_get_object(pdf, flexarray_size(&pdf->objects) - 1)) {
+        pdf->objects.item_count--;
+        pdf->deleted_count--;
     }
+    pdf_object_destroy(obj);
+}
 
-    if (pdf->first_objects[type] == obj) {
-        pdf->first_objects[type] = NULL;
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-            struct pdf_object *o = pdf_get_object(pdf, i);
-            if (o && o->type == type) {
-                pdf->first_objects[type] = o;
-                break;
-            }
+/* Remove the most recently added objects, so that only count remain */
+static void pdf_truncate_objects(struct pdf_doc *pdf, int count)
+{
+    for (int i = flexarray_size(&pdf->objects) - 1; i >= count; i--) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (!obj) {
+            pdf->deleted_count--;
+            continue;
         }
+        pdf_charge(pdf, -(int64_t)pdf_object_heap(obj));
+        pdf_count_object(pdf, obj, -1);
+        pdf_unlink_object(pdf, obj);
+        pdf_object_destroy(obj);
     }
+    pdf->objects.item_count = count;
+}
 
-    pdf_object_destroy(obj);
+/* Fill in a PDF date string for the current local time */
+static void pdf_default_date(char *date, size_t len)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+#ifdef _WIN32
+    struct tm *tmp;
+    tmp = localtime(&now);
+    tm = *tmp;
+#else
+    localtime_r(&now, &tm);
+#endif
+    strftime(date, len, "%Y%m%d%H%M%SZ", &tm);
 }
 
 struct pdf_doc *pdf_create(float width, float height,
@@ -747,19 +1376,8 @@ struct pdf_doc *pdf_create(float width, float height,
         obj->info->date[sizeof(obj->info->date) - 1] = '\0';
     }
     /* FIXME: Should be quoting PDF strings? */
-    if (!obj->info->date[0]) {
-        time_t now = time(NULL);
-        struct tm tm;
-#ifdef _WIN32
-        struct tm *tmp;
-        tmp = localtime(&now);
-        tm = *tmp;
-#else
-        localtime_r(&now, &tm);
-#endif
-        strftime(obj->info->date, sizeof(obj->info->date), "%Y%m%d%H%M%SZ",
-                 &tm);
-    }
+    if (!obj->info->date[0])
+        pdf_default_date(obj->info->date, sizeof(obj->info->date));
 
     if (!pdf_add_object(pdf, OBJ_pages)) {
         pdf_destroy(pdf);
@@ -790,20 +1408,28 @@ float pdf_height(const struct pdf_doc *pdf)
 
 float pdf_page_width(const struct pdf_object *page)
 {
+    if (!page || page->type != OBJ_page)
+        return 0;
     return page->page.width;
 }
 
 float pdf_page_height(const struct pdf_object *page)
 {
+    if (!page || page->type != OBJ_page)
+        return 0;
     return page->page.height;
 }
 
 void pdf_destroy(struct pdf_doc *pdf)
 {
     if (pdf) {
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-            pdf_object_destroy(pdf_get_object(pdf, i));
+        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+            struct pdf_object *obj = pdf_get_object(pdf, i);
+            if (obj)
+                pdf_object_destroy(obj);
+        }
         flexarray_clear(&pdf->objects);
+        pdf_set_text_cache(pdf, 0);
         free(pdf);
     }
 }
@@ -816,6 +1442,263 @@ static struct pdf_object *pdf_find_first_object(const struct pdf_doc *pdf,
     return pdf->first_objects[type];
 }
 
+/* Find a font in 'pdf' matching either the name or resource name of 'font' */
+static struct pdf_object *pdf_find_font_clash(const struct pdf_doc *pdf,
+                                              const struct pdf_object *font)
+{
+    struct pdf_object *obj;
+
+    for (obj = pdf_find_first_object(pdf, OBJ_font); obj; obj = obj->next)
+        if (strcmp(obj->font.name, font->font.name) == 0 ||
+            obj->font.index == font->font.index)
+            return obj;
+    return NULL;
+}
+
+/* Should this object from another document be moved into 'pdf'? */
+static bool pdf_append_wanted(const struct pdf_doc *pdf,
+                              const struct pdf_object *obj)
+{
+    switch (obj->type) {
+    case OBJ_page:
+    case OBJ_stream:
+    case OBJ_image:
+    case OBJ_bookmark:
+    case OBJ_link:
+    case OBJ_raw:
+    case OBJ_form:
+    case OBJ_pattern:
+        return true;
+    case OBJ_font:
+        return pdf_find_font_clash(pdf, obj) == NULL;
+    }
+    /* The document level objects are replaced by those of 'pdf' */
+    return false;
+}
+
+/* The resource name prefixes given new numbers by pdf_rename_content */
+static const char *const pdf_renamed_prefixes[] = {"Image", "Form", "P"};
+
+/**
+ * Copy a content stream, replacing the numbers of the image, form &
+ * pattern names it uses with names[number], where that is non-zero.
+ * Strings are skipped, so text which happens to look like a name is left
+ * alone.
+ * Returns 1 if anything was renamed (and out is filled in), 0 if not.
+ */
+static int pdf_rename_content(struct dstr *content, const int *names,
+                              int name_count, struct dstr *out)
+{
+    const char *data = dstr_data(content);
+    size_t len = dstr_len(content), copied = 0, i = 0;
+
+    while (i < len) {
+        size_t start = i++;
+
+        if (data[start] == '(') {
+            /* Strings may contain balanced or escaped parentheses */
+            for (int depth = 1; i < len && depth > 0; i++) {
+                if (data[i] == '\\')
+                    i++;
+                else if (data[i] == '(')
+                    depth++;
+                else if (data[i] == ')')
+                    depth--;
+            }
+            continue;
+        }
+        if (data[start] != '/')
+            continue;
+        for (size_t p = 0; p < ARRAY_SIZE(pdf_renamed_prefixes); p++) {
+            const char *prefix = pdf_renamed_prefixes[p];
+            size_t prefix_len = strlen(prefix);
+            size_t end = start + 1 + prefix_len;
+            long number = 0;
+
+            if (end >= len || memcmp(&data[start + 1], prefix, prefix_len) ||
+                !isdigit((unsigned char)data[end]))
+                continue;
+            i = end;
+            while (i < len && isdigit((unsigned char)data[i]) &&
+                   number <= name_count)
+                number = number * 10 + (data[i++] - '0');
+            if (number >= name_count || !names[number] ||
+                (i < len && isdigit((unsigned char)data[i])))
+                break;
+            if (dstr_append_data(out, &data[copied], end - copied) < 0 ||
+                dstr_printf(out, "%d", names[number]) < 0)
+                return -ENOMEM;
+            copied = i;
+            break;
+        }
+    }
+    if (copied == 0)
+        return 0;
+    if (dstr_append_data(out, &data[copied], len - copied) < 0)
+        return -ENOMEM;
+    return 1;
+}
+
+/**
+ * Give the images, forms & patterns of 'src' new names from the counter of
+ * 'dst',
+ * so they can't clash with those 'dst' hands out later. The page contents
+ * referring to them are rewritten first, so that nothing changes if that
+ * runs out of memory.
+ */
+static int pdf_rename_resources(struct pdf_doc *dst, struct pdf_doc *src)
+{
+    struct pdf_object *page;
+    struct dstr *contents;
+    int *names, count = 0, ret = 0, last_name = dst->last_name;
+
+    if (src->last_name == 0)
+        return 0;
+    names = (int *)calloc(src->last_name + 1, sizeof(*names));
+    contents = (struct dstr *)calloc(src->object_counts[OBJ_page] + 1,
+                                     sizeof(*contents));
+    if (!names || !contents) {
+        free(names);
+        free(contents);
+        return pdf_set_err(dst, -ENOMEM, "Unable to allocate %d names",
+                           src->last_name);
+    }
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_image); obj;
+         obj = obj->next)
+        if (obj->stream.name)
+            names[obj->stream.name] = ++last_name;
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_form); obj;
+         obj = obj->next)
+        names[obj->raw.name] = ++last_name;
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_pattern);
+         obj; obj = obj->next)
+        names[obj->pattern.name] = ++last_name;
+
+    for (page = pdf_find_first_object(src, OBJ_page); page && ret >= 0;
+         page = page->next) {
+        contents[count] = INIT_DSTR;
+        ret = pdf_rename_content(&page->page.content->stream.stream, names,
+                                 src->last_name + 1, &contents[count++]);
+    }
+    if (ret < 0) {
+        for (int i = 0; i < count; i++)
+            dstr_free(&contents[i]);
+        free(names);
+        free(contents);
+        return pdf_set_err(dst, -ENOMEM, "Unable to rename page resources");
+    }
+
+    /* Nothing can fail from here on */
+    count = 0;
+    for (page = pdf_find_first_object(src, OBJ_page); page;
+         page = page->next) {
+        struct dstr *stream = &page->page.content->stream.stream;
+
+        /* Renamed contents are never empty */
+        if (dstr_len(&contents[count])) {
+            dstr_free(stream);
+            *stream = contents[count];
+        }
+        count++;
+    }
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_image); obj;
+         obj = obj->next)
+        if (obj->stream.name)
+            obj->stream.name = names[obj->stream.name];
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_form); obj;
+         obj = obj->next)
+        obj->raw.name = names[obj->raw.name];
+    for (struct pdf_object *obj = pdf_find_first_object(src, OBJ_pattern);
+         obj; obj = obj->next)
+        obj->pattern.name = names[obj->pattern.name];
+    dst->last_name = last_name;
+
+    free(names);
+    free(contents);
+    return 0;
+}
+
+int pdf_append_document(struct pdf_doc *dst, struct pdf_doc *src)
+{
+    int count = 0;
+    uint64_t heap = 0, bins;
+
+    if (!dst)
+        return -EINVAL;
+    if (!src || dst == src)
+        return pdf_set_err(dst, -EINVAL, "Invalid document to append");
+
+    /* Content streams refer to fonts by resource name, which we can't
+     * change, so a font can only be shared if both name & resource name
+     * match */
+    for (struct pdf_object *font = pdf_find_first_object(src, OBJ_font);
+         font; font = font->next) {
+        struct pdf_object *other = pdf_find_font_clash(dst, font);
+        if (other && (other->font.index != font->font.index ||
+                      strcmp(other->font.name, font->font.name) != 0))
+            return pdf_set_err(dst, -EINVAL,
+                               "Font '%s' (/F%d) clashes with '%s' (/F%d)",
+                               font->font.name, font->font.index,
+                               other->font.name, other->font.index);
+    }
+
+    /* Make sure the move can't fail half way through */
+    for (int i = 0; i < flexarray_size(&src->objects); i++) {
+        struct pdf_object *obj = pdf_get_object(src, i);
+        if (obj && pdf_append_wanted(dst, obj)) {
+            count++;
+            heap += pdf_object_heap(obj);
+        }
+    }
+    if (dst->limits.objects &&
+        flexarray_size(&dst->objects) + count + 1 > dst->limits.objects)
+        return pdf_set_err(dst, -ENOSPC,
+                           "Document object limit of %d reached",
+                           dst->limits.objects);
+    /* The objects' numbers are reserved too, so appending them can't
+     * fail either */
+    bins = flexarray_heap(&dst->objects);
+    if (pdf_reserve_heap(dst, heap) < 0)
+        return pdf_get_errval(dst);
+    if (flexarray_reserve(&dst->objects,
+                          flexarray_size(&dst->objects) + count + 1) < 0) {
+        pdf_charge(dst, -(int64_t)heap);
+        return pdf_set_err(dst, -ENOMEM, "Unable to allocate %d objects",
+                           count);
+    }
+    pdf_charge(dst, flexarray_heap(&dst->objects) - bins);
+    if ((pdf_find_first_object(src, OBJ_bookmark) &&
+         !pdf_find_first_object(dst, OBJ_outline) &&
+         !pdf_add_object(dst, OBJ_outline)) ||
+        pdf_rename_resources(dst, src) < 0) {
+        pdf_charge(dst, -(int64_t)heap);
+        return pdf_get_errval(dst);
+    }
+
+    /* Everything refers to each other via pointers, so only the object
+     * numbers change as the objects are moved across */
+    for (int i = 0; i < flexarray_size(&src->objects); i++) {
+        struct pdf_object *obj = pdf_get_object(src, i);
+
+        if (!obj)
+            continue;
+        if (pdf_append_wanted(dst, obj)) {
+            obj->prev = obj->next = NULL;
+            pdf_append_object(dst, obj);
+            pdf_count_object(dst, obj, 1);
+            /* Renaming may have changed the size of the contents */
+            heap -= pdf_object_heap(obj);
+        } else {
+            pdf_object_destroy(obj);
+        }
+    }
+    pdf_charge(dst, -(int64_t)heap);
+    flexarray_clear(&src->objects);
+    free(src);
+
+    return 0;
+}
+
 static struct pdf_object *pdf_find_last_object(const struct pdf_doc *pdf,
                                                int type)
 {
@@ -824,26 +1707,52 @@ static struct pdf_object *pdf_find_last_object(const struct pdf_doc *pdf,
     return pdf->last_objects[type];
 }
 
+/* The standard fonts always get the same resource name (/F1 - /F14), so
+ * that content streams from different documents agree on them */
+static const char *const standard_fonts[] = {
+    "Times-Roman",
+    "Times-Bold",
+    "Times-Italic",
+    "Times-BoldItalic",
+    "Helvetica",
+    "Helvetica-Bold",
+    "Helvetica-Oblique",
+    "Helvetica-BoldOblique",
+    "Courier",
+    "Courier-Bold",
+    "Courier-Oblique",
+    "Courier-BoldOblique",
+    "Symbol",
+    "ZapfDingbats",
+};
+
+static const uint16_t *find_font_widths(const char *font_name);
+
 int pdf_set_font(struct pdf_doc *pdf, const char *font)
 {
     struct pdf_object *obj;
-    int last_index = 0;
+    int last_index = ARRAY_SIZE(standard_fonts);
 
     /* See if we've used this font before */
     for (obj = pdf_find_first_object(pdf, OBJ_font); obj; obj = obj->next) {
         if (strcmp(obj->font.name, font) == 0)
             break;
-        last_index = obj->font.index;
+        if (obj->font.index > last_index)
+            last_index = obj->font.index;
     }
 
     /* Create a new font object if we need it */
     if (!obj) {
         obj = pdf_add_object(pdf, OBJ_font);
         if (!obj)
-            return pdf->errval;
+            return pdf_get_errval(pdf);
         strncpy(obj->font.name, font, sizeof(obj->font.name) - 1);
         obj->font.name[sizeof(obj->font.name) - 1] = '\0';
         obj->font.index = last_index + 1;
+        obj->font.widths = find_font_widths(obj->font.name);
+        for (size_t i = 0; i < ARRAY_SIZE(standard_fonts); i++)
+            if (strcmp(standard_fonts[i], font) == 0)
+                obj->font.index = i + 1;
     }
 
     pdf->current_font = obj;
@@ -853,15 +1762,48 @@ int pdf_set_font(struct pdf_doc *pdf, const char *font)
 
 struct pdf_object *pdf_append_page(struct pdf_doc *pdf)
 {
-    struct pdf_object *page;
+    struct pdf_object *page, *content;
 
     page = pdf_add_object(pdf, OBJ_page);
 
     if (!page)
         return NULL;
 
+    /* Every page gets its own content stream up front, so that drawing
+     * onto an existing page never needs to create new objects */
+    content = pdf_add_object(pdf, OBJ_stream);
+    if (!content) {
+        pdf_del_object(pdf, page);
+        return NULL;
+    }
+    content->stream.page = page;
+    if (pdf->content_hint) {
+        /* Only a reservation which succeeded needs giving back */
+        bool reserved = pdf_reserve_heap(pdf, pdf->content_hint) == 0;
+
+        if (!reserved ||
+            dstr_ensure(&content->stream.stream, pdf->content_hint) < 0) {
+            if (reserved) {
+                pdf_charge(pdf, -(int64_t)pdf->content_hint);
+                pdf_set_err(pdf, -ENOMEM,
+                            "Unable to allocate %zu bytes of content",
+                            pdf->content_hint);
+            }
+            pdf_del_object(pdf, content);
+            pdf_del_object(pdf, page);
+            return NULL;
+        }
+        /* Replace the reservation with what was actually allocated */
+        pdf_charge(pdf, -(int64_t)pdf->content_hint);
+        if (content->stream.stream.data)
+            pdf_charge(pdf, content->stream.stream.alloc_len);
+    }
+
     page->page.width = pdf->width;
     page->page.height = pdf->height;
+    page->page.content = content;
+    page->page.bbox[0] = page->page.bbox[1] = FLT_MAX;
+    page->page.bbox[2] = page->page.bbox[3] = -FLT_MAX;
 
     return page;
 }
@@ -897,760 +1839,2818 @@ int pdf_page_set_size(struct pdf_doc *pdf, struct pdf_object *page,
     return 0;
 }
 
-// Recursively scan for the number of children
-static int pdf_get_bookmark_count(const struct pdf_object *obj)
+int pdf_page_get_bbox(struct pdf_doc *pdf, struct pdf_object *page,
+                      float bbox[4])
 {
-    int count = 0;
-    if (obj->type == OBJ_bookmark) {
-        int nchildren = flexarray_size(&obj->bookmark.children);
-        count += nchildren;
-        for (int i = 0; i < nchildren; i++) {
-            count += pdf_get_bookmark_count(
-                (const struct pdf_object *)flexarray_get(
-                    &obj->bookmark.children, i));
-        }
-    }
-    return count;
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+
+    if (!page || page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid PDF page");
+    if (!pdf->measure_only && !pdf->track_bbox)
+        return pdf_set_err(pdf, -EINVAL, "Bounding boxes aren't tracked");
+    if (page->page.bbox[0] > page->page.bbox[2])
+        return pdf_set_err(pdf, -ENOENT, "Nothing drawn on page");
+    memcpy(bbox, page->page.bbox, sizeof(page->page.bbox));
+    return 0;
 }
 
-static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
+int pdf_reserve(struct pdf_doc *pdf, int pages, int objects,
+                size_t content_bytes_per_page)
 {
-    struct pdf_object *object = pdf_get_object(pdf, index);
-    if (!object)
-        return -ENOENT;
+    uint64_t bins;
 
-    if (object->type == OBJ_none)
-        return -ENOENT;
+    if (!pdf)
+        return -EINVAL;
+    if (pages < 0 || objects < 0 || pages > INT_MAX / 2)
+        return pdf_set_err(pdf, -EINVAL, "Invalid reservation %d/%d", pages,
+                           objects);
+    /* Every page has at least its own content stream */
+    if (objects < pages * 2)
+        objects = pages * 2;
+    bins = flexarray_heap(&pdf->objects);
+    if (objects > INT_MAX - flexarray_size(&pdf->objects) ||
+        flexarray_reserve(&pdf->objects,
+                          flexarray_size(&pdf->objects) + objects) < 0)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to reserve %d objects",
+                           objects);
+    pdf_charge(pdf, flexarray_heap(&pdf->objects) - bins);
+    pdf->content_hint = content_bytes_per_page;
+    return 0;
+}
 
-    object->offset = ftell(fp);
+/* Rough size of an object of each type once saved, excluding stream data */
+static int pdf_object_overhead(int type)
+{
+    switch (type) {
+    case OBJ_info:
+        return 250;
+    case OBJ_stream:
+        return 60;
+    case OBJ_font:
+        return 120;
+    case OBJ_page:
+        return 630;
+    case OBJ_bookmark:
+        return 210;
+    case OBJ_link:
+        return 175;
+    case OBJ_pattern:
+        return 250;
+    case OBJ_outline:
+    case OBJ_catalog:
+        return 100;
+    case OBJ_pages:
+        return 60;
+    }
+    return 20;
+}
 
-    fprintf(fp, "%d 0 obj\r\n", index);
+int pdf_get_stats(const struct pdf_doc *pdf, struct pdf_stats *stats)
+{
+    uint64_t output = 200; /* Header & trailer */
+    uint64_t counts[OBJ_count];
 
-    switch (object->type) {
-    case OBJ_stream:
-    case OBJ_image: {
-        fwrite(dstr_data(&object->stream.stream),
-               dstr_len(&object->stream.stream), 1, fp);
-        break;
-    }
-    case OBJ_info: {
-        struct pdf_info *info = object->info;
-
-        fprintf(fp, "<<\r\n");
-        if (info->creator[0])
-            fprintf(fp, "  /Creator (%s)\r\n", info->creator);
-        if (info->producer[0])
-            fprintf(fp, "  /Producer (%s)\r\n", info->producer);
-        if (info->title[0])
-            fprintf(fp, "  /Title (%s)\r\n", info->title);
-        if (info->author[0])
-            fprintf(fp, "  /Author (%s)\r\n", info->author);
-        if (info->subject[0])
-            fprintf(fp, "  /Subject (%s)\r\n", info->subject);
-        if (info->date[0])
-            fprintf(fp, "  /CreationDate (D:%s)\r\n", info->date);
-        fprintf(fp, ">>\r\n");
-        break;
-    }
+    if (!pdf || !stats)
+        return -EINVAL;
+    memset(stats, 0, sizeof(*stats));
+
+    /* Everything is counted as it's added (see pdf_count_object), as the
+     * content streams may be growing on other threads */
+    for (int type = 0; type < OBJ_count; type++) {
+        counts[type] = pdf_counter_get(&pdf->object_counts[type]);
+        if (type != OBJ_none)
+            stats->objects += (int)counts[type];
+        output += counts[type] * (pdf_object_overhead(type) + 20 /* xref */);
+    }
+    stats->pages = (int)counts[OBJ_page];
+    stats->fonts = (int)counts[OBJ_font];
+    stats->images = (int)counts[OBJ_image];
+    stats->bookmarks = (int)counts[OBJ_bookmark];
+    stats->links = (int)counts[OBJ_link];
+    stats->forms = (int)counts[OBJ_form];
+    stats->imported_objects = (int)counts[OBJ_raw];
+
+    stats->content_bytes = pdf_counter_get(&pdf->content_bytes);
+    for (int format = 0; format <= IMAGE_UNKNOWN; format++) {
+        stats->image_format_bytes[format] =
+            pdf_counter_get(&pdf->image_bytes[format]);
+        stats->image_bytes += stats->image_format_bytes[format];
+    }
+    stats->imported_bytes = pdf_counter_get(&pdf->imported_bytes);
+
+    /* Every page lists every font in its resources */
+    output += (uint64_t)stats->pages * stats->fonts * 16;
+    stats->text_cache_hits = pdf_counter_get(&pdf->text_cache_hits);
+    stats->text_cache_misses = pdf_counter_get(&pdf->text_cache_misses);
+    stats->heap_bytes = sizeof(*pdf) + pdf_counter_get(&pdf->heap_bytes);
+    stats->output_bytes = output + stats->content_bytes +
+                          stats->image_bytes + stats->imported_bytes;
+    return 0;
+}
 
-    case OBJ_page: {
-        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
-        bool printed_xobjects = false;
+int pdf_set_limits(struct pdf_doc *pdf, const struct pdf_limits *limits)
+{
+    if (!pdf)
+        return -EINVAL;
+    if (limits && limits->objects < 0)
+        return pdf_set_err(pdf, -EINVAL, "Invalid object limit %d",
+                           limits->objects);
+    if (limits)
+        pdf->limits = *limits;
+    else
+        memset(&pdf->limits, 0, sizeof(pdf->limits));
+    return 0;
+}
 
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Page\r\n"
-                "  /Parent %d 0 R\r\n",
-                pages->index);
-        fprintf(fp, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
-                object->page.height);
-        fprintf(fp, "  /Resources <<\r\n");
-        fprintf(fp, "    /Font <<\r\n");
-        for (struct pdf_object *font = pdf_find_first_object(pdf, OBJ_font);
-             font; font = font->next)
-            fprintf(fp, "      /F%d %d 0 R\r\n", font->font.index,
-                    font->index);
-        fprintf(fp, "    >>\r\n");
-        // We trim transparency to just 4-bits
-        fprintf(fp, "    /ExtGState <<\r\n");
-        for (int i = 0; i < 16; i++) {
-            fprintf(fp, "      /GS%d <</ca %f>>\r\n", i,
-                    (float)(15 - i) / 15);
-        }
-        fprintf(fp, "    >>\r\n");
+int pdf_set_deterministic(struct pdf_doc *pdf, const char *date)
+{
+    struct pdf_object *info;
 
-        for (struct pdf_object *image = pdf_find_first_object(pdf, OBJ_image);
-             image; image = image->next) {
-            if (image->stream.page == object) {
-                if (!printed_xobjects) {
-                    fprintf(fp, "    /XObject <<");
-                    printed_xobjects = true;
-                }
-                fprintf(fp, "      /Image%d %d 0 R ", image->index,
-                        image->index);
-            }
-        }
-        if (printed_xobjects)
-            fprintf(fp, "    >>\r\n");
-        fprintf(fp, "  >>\r\n");
+    if (!pdf)
+        return -EINVAL;
+    info = pdf_find_first_object(pdf, OBJ_info);
+    if (date && strlen(date) >= sizeof(info->info->date))
+        return pdf_set_err(pdf, -EINVAL, "Date '%s' is too long", date);
+    snprintf(info->info->date, sizeof(info->info->date), "%s",
+             date ? date : "");
+    pdf->deterministic = true;
+    return 0;
+}
 
-        fprintf(fp, "  /Contents [\r\n");
-        for (int i = 0; i < flexarray_size(&object->page.children); i++) {
-            struct pdf_object *child =
-                (struct pdf_object *)flexarray_get(&object->page.children, i);
-            fprintf(fp, "%d 0 R\r\n", child->index);
+int pdf_set_text_cache(struct pdf_doc *pdf, int entries)
+{
+    struct pdf_text_cache_entry *cache = NULL;
+    int size = 0;
+
+    if (!pdf || entries < 0 || entries > PDF_TEXT_CACHE_MAX_ENTRIES)
+        return pdf ? pdf_set_err(pdf, -EINVAL,
+                                 "Invalid text cache size %d", entries)
+                   : -EINVAL;
+
+    if (entries > 0) {
+        size = 1;
+        while (size < entries)
+            size *= 2;
+        if (pdf_reserve_heap(pdf, size * sizeof(*cache)) < 0)
+            return pdf_get_errval(pdf);
+        cache = (struct pdf_text_cache_entry *)calloc(size, sizeof(*cache));
+        if (!cache) {
+            pdf_charge(pdf, -(int64_t)(size * sizeof(*cache)));
+            return pdf_set_err(pdf, -ENOMEM,
+                               "Unable to allocate text cache");
         }
-        fprintf(fp, "]\r\n");
+    }
 
-        if (flexarray_size(&object->page.annotations)) {
-            fprintf(fp, "  /Annots [\r\n");
-            for (int i = 0; i < flexarray_size(&object->page.annotations);
-                 i++) {
-                struct pdf_object *child = (struct pdf_object *)flexarray_get(
-                    &object->page.annotations, i);
-                fprintf(fp, "%d 0 R\r\n", child->index);
-            }
-            fprintf(fp, "]\r\n");
+    for (int i = 0; i < pdf->text_cache_size; i++) {
+        struct pdf_text_cache_entry *entry = &pdf->text_cache[i];
+        if (entry->data) {
+            pdf_charge(pdf, -(int64_t)(entry->text_len + entry->encoded_len));
+            free(entry->data);
         }
-
-        fprintf(fp, ">>\r\n");
-        break;
     }
+    if (pdf->text_cache) {
+        pdf_charge(pdf, -(int64_t)(pdf->text_cache_size *
+                                   sizeof(*pdf->text_cache)));
+        free(pdf->text_cache);
+    }
+    pdf->text_cache = cache;
+    pdf->text_cache_size = size;
+    return 0;
+}
 
-    case OBJ_bookmark: {
-        struct pdf_object *parent, *other;
+int pdf_set_measure_only(struct pdf_doc *pdf, int measure_only)
+{
+    if (!pdf)
+        return -EINVAL;
+    pdf->measure_only = measure_only != 0;
+    return 0;
+}
 
-        parent = object->bookmark.parent;
-        if (!parent)
-            parent = pdf_find_first_object(pdf, OBJ_outline);
-        if (!object->bookmark.page)
-            break;
-        fprintf(fp,
-                "<<\r\n"
-                "  /Dest [%d 0 R /XYZ 0 %f null]\r\n"
-                "  /Parent %d 0 R\r\n"
-                "  /Title (%s)\r\n",
-                object->bookmark.page->index, pdf->height, parent->index,
-                object->bookmark.name);
-        int nchildren = flexarray_size(&object->bookmark.children);
-        if (nchildren > 0) {
-            struct pdf_object *f, *l;
-            f = (struct pdf_object *)flexarray_get(&object->bookmark.children,
-                                                   0);
-            l = (struct pdf_object *)flexarray_get(&object->bookmark.children,
-                                                   nchildren - 1);
-            fprintf(fp, "  /First %d 0 R\r\n", f->index);
-            fprintf(fp, "  /Last %d 0 R\r\n", l->index);
-            fprintf(fp, "  /Count %d\r\n", pdf_get_bookmark_count(object));
-        }
-        // Find the previous bookmark with the same parent
-        for (other = object->prev;
-             other && other->bookmark.parent != object->bookmark.parent;
-             other = other->prev)
-            ;
-        if (other)
-            fprintf(fp, "  /Prev %d 0 R\r\n", other->index);
-        // Find the next bookmark with the same parent
-        for (other = object->next;
-             other && other->bookmark.parent != object->bookmark.parent;
-             other = other->next)
-            ;
-        if (other)
-            fprintf(fp, "  /Next %d 0 R\r\n", other->index);
-        fprintf(fp, ">>\r\n");
-        break;
-    }
+int pdf_set_bbox_tracking(struct pdf_doc *pdf, int track)
+{
+    if (!pdf)
+        return -EINVAL;
+    pdf->track_bbox = track != 0;
+    return 0;
+}
 
-    case OBJ_outline: {
-        struct pdf_object *first, *last, *cur;
-        first = pdf_find_first_object(pdf, OBJ_bookmark);
-        last = pdf_find_last_object(pdf, OBJ_bookmark);
+/**
+ * Work out the siblings & number of descendants of every bookmark, which
+ * the outline needs. This is done in a couple of passes over the list of
+ * bookmarks, rather than walking the tree for each one, so that it takes
+ * linear time however deep or wide the tree is. Parents are always
+ * created before their children, so going backwards through the list
+ * visits every child before its parent.
+ */
+static void pdf_link_bookmarks(struct pdf_doc *pdf)
+{
+    struct pdf_object *obj, *last_top = NULL;
 
-        if (first && last) {
-            int count = 0;
-            cur = first;
-            while (cur) {
-                if (!cur->bookmark.parent)
-                    count += pdf_get_bookmark_count(cur) + 1;
-                cur = cur->next;
-            }
+    for (obj = pdf_find_first_object(pdf, OBJ_bookmark); obj;
+         obj = obj->next) {
+        int nchildren = flexarray_size(&obj->bookmark.children);
 
-            /* Bookmark outline */
-            fprintf(fp,
-                    "<<\r\n"
-                    "  /Count %d\r\n"
-                    "  /Type /Outlines\r\n"
-                    "  /First %d 0 R\r\n"
-                    "  /Last %d 0 R\r\n"
-                    ">>\r\n",
-                    count, first->index, last->index);
+        obj->bookmark.descendants = 0;
+        if (!obj->bookmark.parent) {
+            obj->bookmark.prev_sibling = last_top;
+            obj->bookmark.next_sibling = NULL;
+            if (last_top)
+                last_top->bookmark.next_sibling = obj;
+            last_top = obj;
+        }
+        for (int i = 0; i < nchildren; i++) {
+            struct pdf_object *child = (struct pdf_object *)flexarray_get(
+                &obj->bookmark.children, i);
+            child->bookmark.prev_sibling =
+                i > 0 ? (struct pdf_object *)flexarray_get(
+                            &obj->bookmark.children, i - 1)
+                      : NULL;
+            child->bookmark.next_sibling =
+                i < nchildren - 1
+                    ? (struct pdf_object *)flexarray_get(
+                          &obj->bookmark.children, i + 1)
+                    : NULL;
         }
-        break;
     }
+    for (obj = pdf_find_last_object(pdf, OBJ_bookmark); obj; obj = obj->prev)
+        if (obj->bookmark.parent)
+            obj->bookmark.parent->bookmark.descendants +=
+                obj->bookmark.descendants + 1;
+}
 
-    case OBJ_font:
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Font\r\n"
-                "  /Subtype /Type1\r\n"
-                "  /BaseFont /%s\r\n"
-                "  /Encoding /WinAnsiEncoding\r\n"
-                ">>\r\n",
-                object->font.name);
-        break;
+/**
+ * SHA-256, used to give documents an ID derived from their content when
+ * saving in deterministic mode (see pdf_set_deterministic)
+ */
+struct pdf_sha256 {
+    uint32_t state[8];
+    uint64_t length; /* Total bytes hashed */
+    uint8_t block[64];
+    size_t used; /* Bytes in block */
+};
 
-    case OBJ_pages: {
-        int npages = 0;
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void pdf_sha256_init(struct pdf_sha256 *sha)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Pages\r\n"
-                    "  /Kids [ ");
-        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
-             page; page = page->next) {
-            npages++;
-            fprintf(fp, "%d 0 R ", page->index);
-        }
-        fprintf(fp, "]\r\n");
-        fprintf(fp, "  /Count %d\r\n", npages);
-        fprintf(fp, ">>\r\n");
-        break;
-    }
+static void pdf_sha256_block(struct pdf_sha256 *sha, const uint8_t *data)
+{
+    uint32_t w[64], v[8];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)data[i * 4] << 24 |
+               (uint32_t)data[i * 4 + 1] << 16 |
+               (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(v, sha->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 =
+            SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 =
+            SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+        memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; i++)
+        sha->state[i] += v[i];
+}
 
-    case OBJ_catalog: {
-        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
-        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+static void pdf_sha256_update(struct pdf_sha256 *sha, const void *data,
+                              size_t len)
+{
+    const uint8_t *d8 = (const uint8_t *)data;
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Catalog\r\n");
-        if (outline)
-            fprintf(fp,
-                    "  /Outlines %d 0 R\r\n"
-                    "  /PageMode /UseOutlines\r\n",
-                    outline->index);
-        fprintf(fp,
-                "  /Pages %d 0 R\r\n"
-                ">>\r\n",
-                pages->index);
-        break;
-    }
+    sha->length += len;
+    if (sha->used) {
+        size_t chunk = 64 - sha->used < len ? 64 - sha->used : len;
+        memcpy(&sha->block[sha->used], d8, chunk);
+        sha->used += chunk;
+        d8 += chunk;
+        len -= chunk;
+        if (sha->used < 64)
+            return;
+        pdf_sha256_block(sha, sha->block);
+        sha->used = 0;
+    }
+    for (; len >= 64; len -= 64, d8 += 64)
+        pdf_sha256_block(sha, d8);
+    memcpy(sha->block, d8, len);
+    sha->used = len;
+}
 
-    case OBJ_link: {
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Annot\r\n"
-                "  /Subtype /Link\r\n"
-                "  /Rect [%f %f %f %f]\r\n"
-                "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
-                "  /Border [0 0 0]\r\n"
-                ">>\r\n",
-                object->link.llx, object->link.lly, object->link.urx,
-                object->link.ury, object->link.target_page->index,
-                object->link.target_x, object->link.target_y);
-        break;
-    }
+static void pdf_sha256_final(struct pdf_sha256 *sha, uint8_t digest[32])
+{
+    uint64_t bits = sha->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = (sha->used < 56 ? 56 : 120) - sha->used;
+
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    pdf_sha256_update(sha, pad, pad_len + 8);
+    for (int i = 0; i < 32; i++)
+        digest[i] = (uint8_t)(sha->state[i / 4] >> (24 - (i % 4) * 8));
+}
 
-    default:
-        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
-                           object->type);
-    }
+/* Size of each output buffer */
+#define PDF_OUT_BUFFER_SIZE (1024 * 1024)
+/* Number of buffers that may be queued up for the writer thread */
+#define PDF_OUT_QUEUE 4
+/* Documents expected to be smaller than this are written straight to the
+ * FILE, whose own buffering is plenty for them */
+#define PDF_OUT_DIRECT_SIZE (4 * PDF_OUT_BUFFER_SIZE)
 
-    fprintf(fp, "endobj\r\n");
+/**
+ * Destination for a document being saved. Offsets are worked out by
+ * counting the bytes as they're written, rather than with ftell, which
+ * is limited to a 'long' on some platforms and doesn't work on pipes.
+ *
+ * Output of large documents is collected in large buffers, which are only
+ * allocated as they're needed. When built with PDFGEN_WRITER_THREAD (POSIX
+ * only), full buffers are handed to a writer thread, so formatting the
+ * next objects overlaps with the disk I/O.
+ */
+struct pdf_output_block {
+    const char *data; /* Either buffer, or data owned by the document */
+    size_t len;
+    char *buffer;
+};
 
-    return 0;
-}
+struct pdf_output {
+    FILE *fp;
+    uint64_t offset; /* Number of bytes written so far */
+    int error;       /* First write error, as a negative errno */
+    struct pdf_output_block blocks[PDF_OUT_QUEUE];
+    int head;    /* Oldest block queued for writing */
+    int count;   /* Number of blocks queued */
+    int tail;    /* Block being filled */
+    size_t used; /* Bytes in the block being filled */
+    bool buffered;
+    bool hashing; /* Whether sha covers everything written */
+    struct pdf_sha256 sha;
+    /* The number each object is saved as, by index, when deleted objects
+     * have left holes to close up (otherwise NULL) */
+    int *numbers;
+#ifdef PDFGEN_WRITER_THREAD
+    bool threaded;
+    bool finished;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
 
-// Slightly modified djb2 hash algorithm to get pseudo-random ID
-static uint64_t hash(uint64_t hash, const void *data, size_t len)
+static void pdf_out_write_block(struct pdf_output *out, const char *data,
+                                size_t len)
 {
-    const uint8_t *d8 = (const uint8_t *)data;
-    for (; len; len--) {
-        hash = (((hash & 0x03ffffffffffffff) << 5) +
-                (hash & 0x7fffffffffffffff)) +
-               *d8++;
-    }
-    return hash;
+    if (len && fwrite(data, len, 1, out->fp) != 1 && !out->error)
+        out->error = errno ? -errno : -EIO;
 }
 
-int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+#ifdef PDFGEN_WRITER_THREAD
+static void *pdf_out_thread(void *arg)
 {
-    struct pdf_object *obj;
-    int xref_offset;
-    int xref_count = 0;
-    uint64_t id1, id2;
-    time_t now = time(NULL);
-    char saved_locale[32];
+    struct pdf_output *out = (struct pdf_output *)arg;
 
-    force_locale(saved_locale, sizeof(saved_locale));
+    pthread_mutex_lock(&out->lock);
+    for (;;) {
+        struct pdf_output_block *block;
 
-    fprintf(fp, "%%PDF-1.3\r\n");
-    /* Hibit bytes */
-    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+        while (!out->count && !out->finished)
+            pthread_cond_wait(&out->cond, &out->lock);
+        if (!out->count)
+            break;
+        /* Queued blocks aren't touched by anything else, so they can be
+         * written out without holding the lock */
+        block = &out->blocks[out->head];
+        pthread_mutex_unlock(&out->lock);
+        pdf_out_write_block(out, block->data, block->len);
+        pthread_mutex_lock(&out->lock);
+        out->head = (out->head + 1) % PDF_OUT_QUEUE;
+        out->count--;
+        pthread_cond_broadcast(&out->cond);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return NULL;
+}
+#endif
 
-    /* Dump all the objects & get their file offsets */
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-        if (pdf_save_object(pdf, fp, i) >= 0)
-            xref_count++;
-
-    /* xref */
-    xref_offset = ftell(fp);
-    fprintf(fp, "xref\r\n");
-    fprintf(fp, "0 %d\r\n", xref_count + 1);
-    fprintf(fp, "0000000000 65535 f\r\n");
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-        obj = pdf_get_object(pdf, i);
-        if (obj->type != OBJ_none)
-            fprintf(fp, "%10.10d 00000 n\r\n", obj->offset);
-    }
-
-    fprintf(fp,
-            "trailer\r\n"
-            "<<\r\n"
-            "/Size %d\r\n",
-            xref_count + 1);
-    obj = pdf_find_first_object(pdf, OBJ_catalog);
-    fprintf(fp, "/Root %d 0 R\r\n", obj->index);
-    obj = pdf_find_first_object(pdf, OBJ_info);
-    fprintf(fp, "/Info %d 0 R\r\n", obj->index);
-    /* Generate document unique IDs */
-    id1 = hash(5381, obj->info, sizeof(struct pdf_info));
-    id1 = hash(id1, &xref_count, sizeof(xref_count));
-    id2 = hash(5381, &now, sizeof(now));
-    fprintf(fp, "/ID [<%16.16" PRIx64 "> <%16.16" PRIx64 ">]\r\n", id1, id2);
-    fprintf(fp, ">>\r\n"
-                "startxref\r\n");
-    fprintf(fp, "%d\r\n", xref_offset);
-    fprintf(fp, "%%%%EOF\r\n");
+/* 'size' is roughly how much will be written, to decide on buffering */
+static void pdf_out_open(struct pdf_output *out, FILE *fp, uint64_t size)
+{
+    memset(out, 0, sizeof(*out));
+    out->fp = fp;
 
-    restore_locale(saved_locale);
+    /* Without buffers, everything is just written straight out */
+    if (size < PDF_OUT_DIRECT_SIZE)
+        return;
+    out->blocks[0].buffer = (char *)malloc(PDF_OUT_BUFFER_SIZE);
+    out->blocks[0].data = out->blocks[0].buffer;
+    if (!out->blocks[0].buffer)
+        return;
+    out->buffered = true;
 
-    return 0;
+#ifdef PDFGEN_WRITER_THREAD
+    if (pthread_mutex_init(&out->lock, NULL) != 0)
+        return;
+    if (pthread_cond_init(&out->cond, NULL) != 0) {
+        pthread_mutex_destroy(&out->lock);
+        return;
+    }
+    out->threaded =
+        pthread_create(&out->thread, NULL, pdf_out_thread, out) == 0;
+    if (!out->threaded) {
+        pthread_cond_destroy(&out->cond);
+        pthread_mutex_destroy(&out->lock);
+    }
+#endif
 }
 
-int pdf_save(struct pdf_doc *pdf, const char *filename)
+/* The block currently being filled */
+static struct pdf_output_block *pdf_out_tail(struct pdf_output *out)
 {
-    FILE *fp;
-    int e;
-
-    if (filename == NULL)
-        fp = stdout;
-    else if ((fp = fopen(filename, "wb")) == NULL)
-        return pdf_set_err(pdf, -errno, "Unable to open '%s': %s", filename,
-                           strerror(errno));
+    return &out->blocks[out->tail];
+}
 
-    e = pdf_save_file(pdf, fp);
+/* Wait until the writer thread has written all the queued blocks */
+static void pdf_out_wait(struct pdf_output *out)
+{
+#ifdef PDFGEN_WRITER_THREAD
+    if (out->threaded) {
+        pthread_mutex_lock(&out->lock);
+        while (out->count)
+            pthread_cond_wait(&out->cond, &out->lock);
+        pthread_mutex_unlock(&out->lock);
+    }
+#else
+    (void)out;
+#endif
+}
 
-    if (fp != stdout)
-        if (fclose(fp) != 0 && e >= 0)
-            return pdf_set_err(pdf, -errno, "Unable to close '%s': %s",
-                               filename, strerror(errno));
+/* Send off the block being filled, & wait for another to be free */
+static void pdf_out_push(struct pdf_output *out)
+{
+    struct pdf_output_block *block = pdf_out_tail(out);
+
+    block->len = out->used;
+    out->used = 0;
+#ifdef PDFGEN_WRITER_THREAD
+    if (out->threaded) {
+        out->tail = (out->tail + 1) % PDF_OUT_QUEUE;
+        pthread_mutex_lock(&out->lock);
+        out->count++;
+        pthread_cond_broadcast(&out->cond);
+        while (out->count == PDF_OUT_QUEUE)
+            pthread_cond_wait(&out->cond, &out->lock);
+        pthread_mutex_unlock(&out->lock);
+    } else
+#endif
+    {
+        pdf_out_write_block(out, block->data, block->len);
+    }
+    block = pdf_out_tail(out);
+    if (!block->buffer) {
+        block->buffer = (char *)malloc(PDF_OUT_BUFFER_SIZE);
+        /* Without another buffer, carry on writing straight out once
+         * everything queued so far has gone */
+        if (!block->buffer) {
+            pdf_out_wait(out);
+            out->buffered = false;
+        }
+    }
+    block->data = block->buffer;
+}
 
-    return e;
+/* Wait until everything so far has actually been written */
+static void pdf_out_drain(struct pdf_output *out)
+{
+    if (out->used)
+        pdf_out_push(out);
+    pdf_out_wait(out);
 }
 
-static int pdf_add_stream(struct pdf_doc *pdf, struct pdf_object *page,
-                          const char *buffer)
+/* Finish writing, returning the first error that happened (if any) */
+static int pdf_out_close(struct pdf_output *out)
 {
-    struct pdf_object *obj;
-    size_t len;
+    pdf_out_drain(out);
+#ifdef PDFGEN_WRITER_THREAD
+    if (out->threaded) {
+        pthread_mutex_lock(&out->lock);
+        out->finished = true;
+        pthread_cond_broadcast(&out->cond);
+        pthread_mutex_unlock(&out->lock);
+        pthread_join(out->thread, NULL);
+        pthread_cond_destroy(&out->cond);
+        pthread_mutex_destroy(&out->lock);
+        out->threaded = false;
+    }
+#endif
+    for (int i = 0; i < PDF_OUT_QUEUE; i++) {
+        free(out->blocks[i].buffer);
+        out->blocks[i].buffer = NULL;
+    }
+    free(out->numbers);
+    out->numbers = NULL;
+    if (fflush(out->fp) != 0 && !out->error)
+        out->error = -errno;
+    return out->error;
+}
 
-    if (!page)
-        page = pdf_find_last_object(pdf, OBJ_page);
+/**
+ * Number the objects in the order they're saved, skipping the holes left
+ * by pdf_del_object, so that the xref has no free entries. The objects
+ * keep their indexes, as callers hold on to them (eg: bookmark parents).
+ */
+static int pdf_out_number_objects(struct pdf_output *out,
+                                  const struct pdf_doc *pdf)
+{
+    int count = flexarray_size(&pdf->objects), number = 0;
 
-    if (!page)
-        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+    if (pdf->deleted_count == 0)
+        return 0;
+    out->numbers = (int *)malloc(count * sizeof(*out->numbers));
+    if (!out->numbers)
+        return -ENOMEM;
+    for (int i = 0; i < count; i++)
+        out->numbers[i] = pdf_get_object(pdf, i) ? number++ : 0;
+    return 0;
+}
 
-    len = strlen(buffer);
-    /* We don't want any trailing whitespace in the stream */
-    while (len >= 1 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n'))
-        len--;
+/* The number an object is saved as */
+static int pdf_out_number(const struct pdf_output *out,
+                          const struct pdf_object *obj)
+{
+    return out->numbers ? out->numbers[obj->index] : obj->index;
+}
 
-    obj = pdf_add_object(pdf, OBJ_stream);
-    if (!obj)
-        return pdf->errval;
+static void pdf_out_write(struct pdf_output *out, const void *data,
+                          size_t len)
+{
+    const char *d8 = (const char *)data;
 
-    dstr_printf(&obj->stream.stream, "<< /Length %zu >>stream\r\n", len);
-    dstr_append_data(&obj->stream.stream, buffer, len);
-    dstr_append(&obj->stream.stream, "\r\nendstream\r\n");
+    out->offset += len;
+    if (out->hashing)
+        pdf_sha256_update(&out->sha, data, len);
+    if (!out->buffered) {
+        pdf_out_write_block(out, d8, len);
+        return;
+    }
+    while (len > 0) {
+        size_t space = PDF_OUT_BUFFER_SIZE - out->used;
+        size_t chunk = len < space ? len : space;
 
-    return flexarray_append(&page->page.children, obj);
+        memcpy(&pdf_out_tail(out)->buffer[out->used], d8, chunk);
+        out->used += chunk;
+        d8 += chunk;
+        len -= chunk;
+        if (out->used == PDF_OUT_BUFFER_SIZE)
+            pdf_out_push(out);
+    }
 }
 
-int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
-                     const char *name)
+/**
+ * As for pdf_out_write, but for data belonging to the document, which
+ * doesn't change until saving is finished. Big blocks of it (eg: images)
+ * are queued up as they are, rather than being copied
+ */
+static void pdf_out_write_ref(struct pdf_output *out, const void *data,
+                              size_t len)
 {
-    struct pdf_object *obj, *outline = NULL;
+    if (!out->buffered || len < PDF_OUT_BUFFER_SIZE / 4) {
+        pdf_out_write(out, data, len);
+        return;
+    }
+    if (out->used)
+        pdf_out_push(out);
+    if (out->hashing)
+        pdf_sha256_update(&out->sha, data, len);
+    pdf_out_tail(out)->data = (const char *)data;
+    out->used = len;
+    out->offset += len;
+    pdf_out_push(out);
+}
 
-    if (!page)
-        page = pdf_find_last_object(pdf, OBJ_page);
+/* Format output that can't go straight in to an output buffer */
+#ifndef SKIP_ATTRIBUTE
+static void pdf_out_vprintf(struct pdf_output *out, int len, const char *fmt,
+                            va_list ap) __attribute__((format(printf, 3, 0)));
+#endif
+static void pdf_out_vprintf(struct pdf_output *out, int len, const char *fmt,
+                            va_list ap)
+{
+    char small[256];
+    char *str = small;
+
+    if ((size_t)len >= sizeof(small)) {
+        str = (char *)malloc(len + 1);
+        if (!str) {
+            if (!out->error)
+                out->error = -ENOMEM;
+            return;
+        }
+    }
+    vsnprintf(str, len + 1, fmt, ap);
+    pdf_out_write(out, str, len);
+    if (str != small)
+        free(str);
+}
 
-    if (!page)
-        return pdf_set_err(pdf, -EINVAL,
-                           "Unable to add bookmark, no pages available");
+#ifndef SKIP_ATTRIBUTE
+static void pdf_out_printf(struct pdf_output *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+#endif
+static void pdf_out_printf(struct pdf_output *out, const char *fmt, ...)
+{
+    va_list ap;
+    char *dest;
+    int len;
 
-    if (!pdf_find_first_object(pdf, OBJ_outline)) {
-        outline = pdf_add_object(pdf, OBJ_outline);
-        if (!outline)
-            return pdf->errval;
+    if (!out->buffered) {
+        va_start(ap, fmt);
+        len = vsnprintf(NULL, 0, fmt, ap);
+        va_end(ap);
+        if (len > 0) {
+            va_start(ap, fmt);
+            pdf_out_vprintf(out, len, fmt, ap);
+            va_end(ap);
+        }
+        return;
     }
 
-    obj = pdf_add_object(pdf, OBJ_bookmark);
-    if (!obj) {
-        if (outline)
-            pdf_del_object(pdf, outline);
-        return pdf->errval;
+    /* Format directly in to the buffer, starting a fresh one if it
+     * doesn't fit in what's left */
+    va_start(ap, fmt);
+    len = vsnprintf(&pdf_out_tail(out)->buffer[out->used],
+                    PDF_OUT_BUFFER_SIZE - out->used, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if ((size_t)len >= PDF_OUT_BUFFER_SIZE - out->used) {
+        if (out->used)
+            pdf_out_push(out);
+        if ((size_t)len >= PDF_OUT_BUFFER_SIZE) {
+            /* Too big for a buffer, so it gets split across several */
+            va_start(ap, fmt);
+            pdf_out_vprintf(out, len, fmt, ap);
+            va_end(ap);
+            return;
+        }
+        va_start(ap, fmt);
+        vsnprintf(pdf_out_tail(out)->buffer, PDF_OUT_BUFFER_SIZE, fmt, ap);
+        va_end(ap);
     }
+    dest = &pdf_out_tail(out)->buffer[out->used];
+    if (out->hashing)
+        pdf_sha256_update(&out->sha, dest, len);
+    out->used += len;
+    out->offset += len;
+}
 
-    strncpy(obj->bookmark.name, name, sizeof(obj->bookmark.name) - 1);
-    obj->bookmark.name[sizeof(obj->bookmark.name) - 1] = '\0';
-    obj->bookmark.page = page;
-    if (parent >= 0) {
-        struct pdf_object *parent_obj = pdf_get_object(pdf, parent);
-        if (!parent_obj)
-            return pdf_set_err(pdf, -EINVAL, "Invalid parent ID %d supplied",
-                               parent);
-        obj->bookmark.parent = parent_obj;
-        flexarray_append(&parent_obj->bookmark.children, obj);
-    }
+/* Offsets in the xref table are limited to 10 digits */
+#define PDF_MAX_XREF_OFFSET 9999999999ULL
+/* Bytes in each xref entry, including the two byte end of line */
+#define PDF_XREF_ENTRY_SIZE 20
 
-    return obj->index;
+/**
+ * Builds up the xref table. Every entry is the same size, so rather than
+ * going through printf one line at a time they're formatted directly in
+ * to a buffer, which is written out whenever it fills up.
+ */
+struct pdf_xref {
+    struct pdf_output *out;
+    size_t used;
+    char buffer[PDF_XREF_ENTRY_SIZE * 512];
+};
+
+static void pdf_xref_start(struct pdf_xref *xref, struct pdf_output *out,
+                           int count)
+{
+    xref->out = out;
+    xref->used = 0;
+    pdf_out_printf(out, "xref\r\n");
+    pdf_out_printf(out, "0 %d\r\n", count + 1);
+    pdf_out_printf(out, "0000000000 65535 f\r\n");
 }
 
-int pdf_add_link(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                 float y, float width, float height,
-                 struct pdf_object *target_page, float target_x,
-                 float target_y)
+static void pdf_xref_flush(struct pdf_xref *xref)
 {
-    struct pdf_object *obj;
+    pdf_out_write(xref->out, xref->buffer, xref->used);
+    xref->used = 0;
+}
 
-    if (!page)
-        page = pdf_find_last_object(pdf, OBJ_page);
+static int pdf_xref_add(struct pdf_xref *xref, uint64_t offset)
+{
+    char *entry;
+
+    if (offset > PDF_MAX_XREF_OFFSET)
+        return -EFBIG;
+    if (xref->used == sizeof(xref->buffer))
+        pdf_xref_flush(xref);
+    entry = &xref->buffer[xref->used];
+    for (int i = 9; i >= 0; i--) {
+        entry[i] = '0' + offset % 10;
+        offset /= 10;
+    }
+    memcpy(&entry[10], " 00000 n\r\n", PDF_XREF_ENTRY_SIZE - 10);
+    xref->used += PDF_XREF_ENTRY_SIZE;
+    return 0;
+}
 
-    if (!page)
-        return pdf_set_err(pdf, -EINVAL,
-                           "Unable to add link, no pages available");
+static void pdf_save_info(struct pdf_output *out,
+                          const struct pdf_info *info)
+{
+    pdf_out_printf(out, "<<\r\n");
+    if (info->creator[0])
+        pdf_out_printf(out, "  /Creator (%s)\r\n", info->creator);
+    if (info->producer[0])
+        pdf_out_printf(out, "  /Producer (%s)\r\n", info->producer);
+    if (info->title[0])
+        pdf_out_printf(out, "  /Title (%s)\r\n", info->title);
+    if (info->author[0])
+        pdf_out_printf(out, "  /Author (%s)\r\n", info->author);
+    if (info->subject[0])
+        pdf_out_printf(out, "  /Subject (%s)\r\n", info->subject);
+    if (info->date[0])
+        pdf_out_printf(out, "  /CreationDate (D:%s)\r\n", info->date);
+    pdf_out_printf(out, ">>\r\n");
+}
 
-    if (!target_page)
-        return pdf_set_err(pdf, -EINVAL, "Unable to link, no target page");
+/* The fonts & transparency levels available to content streams */
+static void pdf_save_font_resources(const struct pdf_doc *pdf,
+                                    struct pdf_output *out)
+{
+    pdf_out_printf(out, "    /Font <<\r\n");
+    for (struct pdf_object *font = pdf_find_first_object(pdf, OBJ_font); font;
+         font = font->next)
+        pdf_out_printf(out, "      /F%d %d 0 R\r\n", font->font.index,
+                       pdf_out_number(out, font));
+    pdf_out_printf(out, "    >>\r\n");
+    // We trim transparency to just 4-bits
+    pdf_out_printf(out, "    /ExtGState <<\r\n");
+    for (int i = 0; i < 16; i++) {
+        pdf_out_printf(out, "      /GS%d <</ca %f>>\r\n", i,
+                       (float)(15 - i) / 15);
+    }
+    pdf_out_printf(out, "    >>\r\n");
+}
 
-    obj = pdf_add_object(pdf, OBJ_link);
-    if (!obj) {
-        return pdf->errval;
-    }
+static int pdf_save_object(struct pdf_doc *pdf, struct pdf_output *out,
+                           int index)
+{
+    struct pdf_object *object = pdf_get_object(pdf, index);
+    if (!object)
+        return -ENOENT;
 
-    obj->link.target_page = target_page;
-    obj->link.target_x = target_x;
-    obj->link.target_y = target_y;
-    obj->link.llx = x;
-    obj->link.lly = y;
-    obj->link.urx = x + width;
-    obj->link.ury = y + height;
-    flexarray_append(&page->page.annotations, obj);
+    if (object->type == OBJ_none)
+        return -ENOENT;
 
-    return obj->index;
-}
+    if (pdf->limits.output_bytes && out->offset > pdf->limits.output_bytes)
+        return pdf_set_err(pdf, -ENOSPC,
+                           "Output limit of %" PRIu64 " bytes reached",
+                           pdf->limits.output_bytes);
 
-static int utf8_to_utf32(const char *utf8, int len, uint32_t *utf32)
-{
-    uint32_t ch;
-    uint8_t mask;
+    object->offset = out->offset;
 
-    if (len <= 0 || !utf8 || !utf32)
-        return -EINVAL;
+    pdf_out_printf(out, "%d 0 obj\r\n", pdf_out_number(out, object));
 
-    ch = *(uint8_t *)utf8;
-    if ((ch & 0x80) == 0) {
-        len = 1;
-        mask = 0x7f;
-    } else if ((ch & 0xe0) == 0xc0 && len >= 2) {
-        len = 2;
-        mask = 0x1f;
-    } else if ((ch & 0xf0) == 0xe0 && len >= 3) {
-        len = 3;
-        mask = 0xf;
-    } else if ((ch & 0xf8) == 0xf0 && len >= 4) {
-        len = 4;
-        mask = 0x7;
-    } else
-        return -EINVAL;
+    switch (object->type) {
+    case OBJ_stream:
+        pdf_out_printf(out, "<< /Length %zu >>stream\r\n",
+                       dstr_len(&object->stream.stream));
+        pdf_out_write_ref(out, dstr_data(&object->stream.stream),
+                          dstr_len(&object->stream.stream));
+        pdf_out_printf(out, "\r\nendstream\r\n");
+        break;
 
-    ch = 0;
-    for (int i = 0; i < len; i++) {
-        int shift = (len - i - 1) * 6;
-        if (!*utf8)
-            return -EINVAL;
-        if (i == 0)
-            ch |= ((uint32_t)(*utf8++) & mask) << shift;
-        else
-            ch |= ((uint32_t)(*utf8++) & 0x3f) << shift;
+    case OBJ_image: {
+        pdf_out_write_ref(out, dstr_data(&object->stream.stream),
+                          dstr_len(&object->stream.stream));
+        break;
     }
 
-    *utf32 = ch;
+    case OBJ_pattern:
+        pdf_out_printf(out,
+                       "<<\r\n"
+                       "  /Type /Pattern\r\n"
+                       "  /PatternType 1\r\n"
+                       "  /PaintType 1\r\n"
+                       "  /TilingType 1\r\n"
+                       "  /BBox [0 0 %f %f]\r\n"
+                       "  /XStep %f\r\n"
+                       "  /YStep %f\r\n",
+                       object->pattern.width, object->pattern.height,
+                       object->pattern.width, object->pattern.height);
+        pdf_out_printf(out, "  /Resources <<\r\n");
+        pdf_save_font_resources(pdf, out);
+        pdf_out_printf(out, "  >>\r\n");
+        pdf_out_printf(out, "  /Length %zu\r\n>>stream\r\n",
+                       dstr_len(&object->pattern.content));
+        pdf_out_write_ref(out, dstr_data(&object->pattern.content),
+                          dstr_len(&object->pattern.content));
+        pdf_out_printf(out, "\r\nendstream\r\n");
+        break;
 
-    return len;
-}
+    case OBJ_info:
+        pdf_save_info(out, object->info);
+        break;
 
-static int utf8_to_pdfencoding(struct pdf_doc *pdf, const char *utf8, int len,
-                               uint8_t *res)
-{
-    uint32_t code;
-    int code_len;
+    case OBJ_page: {
+        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+        bool printed_xobjects = false;
 
-    *res = 0;
+        pdf_out_printf(out,
+                       "<<\r\n"
+                       "  /Type /Page\r\n"
+                       "  /Parent %d 0 R\r\n",
+                       pdf_out_number(out, pages));
+        pdf_out_printf(out, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
+                       object->page.height);
+        pdf_out_printf(out, "  /Resources <<\r\n");
+        pdf_save_font_resources(pdf, out);
 
-    code_len = utf8_to_utf32(utf8, len, &code);
-    if (code_len < 0) {
-        return pdf_set_err(pdf, -EINVAL, "Invalid UTF-8 encoding");
+        for (struct pdf_object *image = pdf_find_first_object(pdf, OBJ_image);
+             image; image = image->next) {
+            if (image->stream.page == object) {
+                if (!printed_xobjects) {
+                    pdf_out_printf(out, "    /XObject <<");
+                    printed_xobjects = true;
+                }
+                pdf_out_printf(out, "      /Image%d %d 0 R ",
+                               image->stream.name,
+                               pdf_out_number(out, image));
+            }
+        }
+        for (int i = 0; i < flexarray_size(&object->page.forms); i++) {
+            struct pdf_object *form =
+                (struct pdf_object *)flexarray_get(&object->page.forms, i);
+            if (!printed_xobjects) {
+                pdf_out_printf(out, "    /XObject <<");
+                printed_xobjects = true;
+            }
+            pdf_out_printf(out, "      /Form%d %d 0 R ", form->raw.name,
+                           pdf_out_number(out, form));
+        }
+        if (printed_xobjects)
+            pdf_out_printf(out, "    >>\r\n");
+        if (flexarray_size(&object->page.patterns)) {
+            pdf_out_printf(out, "    /Pattern <<");
+            for (int i = 0; i < flexarray_size(&object->page.patterns);
+                 i++) {
+                struct pdf_object *pattern =
+                    (struct pdf_object *)flexarray_get(
+                        &object->page.patterns, i);
+                pdf_out_printf(out, " /P%d %d 0 R", pattern->pattern.name,
+                               pdf_out_number(out, pattern));
+            }
+            pdf_out_printf(out, " >>\r\n");
+        }
+        pdf_out_printf(out, "  >>\r\n");
+
+        pdf_out_printf(out, "  /Contents %d 0 R\r\n",
+                       pdf_out_number(out, object->page.content));
+
+        if (flexarray_size(&object->page.annotations)) {
+            pdf_out_printf(out, "  /Annots [\r\n");
+            for (int i = 0; i < flexarray_size(&object->page.annotations);
+                 i++) {
+                struct pdf_object *child = (struct pdf_object *)flexarray_get(
+                    &object->page.annotations, i);
+                pdf_out_printf(out, "%d 0 R\r\n", pdf_out_number(out, child));
+            }
+            pdf_out_printf(out, "]\r\n");
+        }
+
+        pdf_out_printf(out, ">>\r\n");
+        break;
     }
 
-    if (code > 255) {
-        /* We support *some* minimal UTF-8 characters */
-        // See Appendix D of
-        // https://opensource.adobe.com/dc-acrobat-sdk-docs/pdfstandards/pdfreference1.7old.pdf
-        // These are all in WinAnsiEncoding
-        switch (code) {
-        case 0x152: // Latin Capital Ligature OE
-            *res = 0214;
+    case OBJ_bookmark: {
+        struct pdf_object *parent, *other;
+
+        parent = object->bookmark.parent;
+        if (!parent)
+            parent = pdf_find_first_object(pdf, OBJ_outline);
+        if (!object->bookmark.page)
             break;
-        case 0x153: // Latin Small Ligature oe
-            *res = 0234;
-            break;
-        case 0x160: // Latin Capital Letter S with caron
-            *res = 0212;
-            break;
-        case 0x161: // Latin Small Letter S with caron
-            *res = 0232;
-            break;
-        case 0x178: // Latin Capital Letter y with diaeresis
-            *res = 0237;
-            break;
-        case 0x17d: // Latin Capital Letter Z with caron
-            *res = 0216;
-            break;
-        case 0x17e: // Latin Small Letter Z with caron
-            *res = 0236;
-            break;
-        case 0x192: // Latin Small Letter F with hook
-            *res = 0203;
-            break;
-        case 0x2c6: // Modifier Letter Circumflex Accent
-            *res = 0210;
-            break;
-        case 0x2dc: // Small Tilde
-            *res = 0230;
-            break;
-        case 0x2013: // Endash
-            *res = 0226;
-            break;
-        case 0x2014: // Emdash
-            *res = 0227;
-            break;
-        case 0x2018: // Left Single Quote
-            *res = 0221;
-            break;
-        case 0x2019: // Right Single Quote
-            *res = 0222;
-            break;
-        case 0x201a: // Single low-9 Quotation Mark
-            *res = 0202;
-            break;
-        case 0x201c: // Left Double Quote
-            *res = 0223;
-            break;
-        case 0x201d: // Right Double Quote
-            *res = 0224;
-            break;
-        case 0x201e: // Double low-9 Quotation Mark
-            *res = 0204;
-            break;
-        case 0x2020: // Dagger
-            *res = 0206;
-            break;
-        case 0x2021: // Double Dagger
-            *res = 0207;
-            break;
-        case 0x2022: // Bullet
-            *res = 0225;
-            break;
-        case 0x2026: // Horizontal Ellipsis
-            *res = 0205;
-            break;
-        case 0x2030: // Per Mille Sign
-            *res = 0211;
-            break;
-        case 0x2039: // Single Left-pointing Angle Quotation Mark
-            *res = 0213;
-            break;
-        case 0x203a: // Single Right-pointing Angle Quotation Mark
-            *res = 0233;
-            break;
-        case 0x20ac: // Euro
-            *res = 0200;
-            break;
-        case 0x2122: // Trade Mark Sign
-            *res = 0231;
-            break;
-        default:
-            return pdf_set_err(pdf, -EINVAL,
-                               "Unsupported UTF-8 character: 0x%x 0o%o %s",
-                               code, code, utf8);
+        pdf_out_printf(out,
+                       "<<\r\n"
+                       "  /Dest [%d 0 R /XYZ 0 %f null]\r\n"
+                       "  /Parent %d 0 R\r\n"
+                       "  /Title (%s)\r\n",
+                       pdf_out_number(out, object->bookmark.page),
+                       pdf->height, pdf_out_number(out, parent),
+                       object->bookmark.name);
+        int nchildren = flexarray_size(&object->bookmark.children);
+        if (nchildren > 0) {
+            struct pdf_object *f, *l;
+            f = (struct pdf_object *)flexarray_get(&object->bookmark.children,
+                                                   0);
+            l = (struct pdf_object *)flexarray_get(&object->bookmark.children,
+                                                   nchildren - 1);
+            pdf_out_printf(out, "  /First %d 0 R\r\n",
+                           pdf_out_number(out, f));
+            pdf_out_printf(out, "  /Last %d 0 R\r\n",
+                           pdf_out_number(out, l));
+            pdf_out_printf(out, "  /Count %d\r\n",
+                           object->bookmark.descendants);
         }
-    } else {
-        *res = code;
+        other = object->bookmark.prev_sibling;
+        if (other)
+            pdf_out_printf(out, "  /Prev %d 0 R\r\n",
+                           pdf_out_number(out, other));
+        other = object->bookmark.next_sibling;
+        if (other)
+            pdf_out_printf(out, "  /Next %d 0 R\r\n",
+                           pdf_out_number(out, other));
+        pdf_out_printf(out, ">>\r\n");
+        break;
     }
-    return code_len;
-}
 
-static int pdf_add_text_spacing(struct pdf_doc *pdf, struct pdf_object *page,
-                                const char *text, float size, float xoff,
-                                float yoff, uint32_t colour, float spacing,
-                                float angle)
-{
-    int ret;
-    size_t len = text ? strlen(text) : 0;
-    struct dstr str = INIT_DSTR;
-    int alpha = (colour >> 24) >> 4;
+    case OBJ_outline: {
+        struct pdf_object *first, *last;
+        first = pdf_find_first_object(pdf, OBJ_bookmark);
+        last = pdf_find_last_object(pdf, OBJ_bookmark);
 
-    /* Don't bother adding empty/null strings */
-    if (!len)
-        return 0;
+        if (first && last) {
+            /* Every bookmark is below the outline */
+            int count = pdf->object_counts[OBJ_bookmark];
 
-    dstr_append(&str, "BT ");
-    dstr_printf(&str, "/GS%d gs ", alpha);
-    if (angle != 0) {
-        dstr_printf(&str, "%f %f %f %f %f %f Tm ", cosf(angle), sinf(angle),
-                    -sinf(angle), cosf(angle), xoff, yoff);
-    } else {
-        dstr_printf(&str, "%f %f TD ", xoff, yoff);
+            /* Bookmark outline */
+            pdf_out_printf(out,
+                           "<<\r\n"
+                           "  /Count %d\r\n"
+                           "  /Type /Outlines\r\n"
+                           "  /First %d 0 R\r\n"
+                           "  /Last %d 0 R\r\n"
+                           ">>\r\n",
+                           count, pdf_out_number(out, first),
+                           pdf_out_number(out, last));
+        }
+        break;
     }
-    dstr_printf(&str, "/F%d %f Tf ", pdf->current_font->font.index, size);
-    dstr_printf(&str, "%f %f %f rg ", PDF_RGB_R(colour), PDF_RGB_G(colour),
-                PDF_RGB_B(colour));
-    dstr_printf(&str, "%f Tc ", spacing);
-    dstr_append(&str, "(");
 
-    /* Escape magic characters properly */
-    for (size_t i = 0; i < len;) {
-        int code_len;
-        uint8_t pdf_char;
-        code_len = utf8_to_pdfencoding(pdf, &text[i], len - i, &pdf_char);
-        if (code_len < 0) {
-            dstr_free(&str);
-            return code_len;
-        }
+    case OBJ_font:
+        pdf_out_printf(out,
+                       "<<\r\n"
+                       "  /Type /Font\r\n"
+                       "  /Subtype /Type1\r\n"
+                       "  /BaseFont /%s\r\n"
+                       "  /Encoding /WinAnsiEncoding\r\n"
+                       ">>\r\n",
+                       object->font.name);
+        break;
 
-        if (strchr("()\\", pdf_char)) {
-            char buf[3];
-            /* Escape some characters */
-            buf[0] = '\\';
-            buf[1] = pdf_char;
-            buf[2] = '\0';
-            dstr_append(&str, buf);
-        } else if (strrchr("\n\r\t\b\f", pdf_char)) {
-            /* Skip over these characters */
-            ;
-        } else {
-            dstr_append_data(&str, &pdf_char, 1);
+    case OBJ_pages: {
+        int npages = 0;
+
+        pdf_out_printf(out, "<<\r\n"
+                            "  /Type /Pages\r\n"
+                            "  /Kids [ ");
+        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
+             page; page = page->next) {
+            npages++;
+            pdf_out_printf(out, "%d 0 R ", pdf_out_number(out, page));
         }
+        pdf_out_printf(out, "]\r\n");
+        pdf_out_printf(out, "  /Count %d\r\n", npages);
+        pdf_out_printf(out, ">>\r\n");
+        break;
+    }
 
-        i += code_len;
+    case OBJ_catalog: {
+        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
+        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+
+        pdf_out_printf(out, "<<\r\n"
+                            "  /Type /Catalog\r\n");
+        if (outline)
+            pdf_out_printf(out,
+                           "  /Outlines %d 0 R\r\n"
+                           "  /PageMode /UseOutlines\r\n",
+                           pdf_out_number(out, outline));
+        pdf_out_printf(out,
+                       "  /Pages %d 0 R\r\n"
+                       ">>\r\n",
+                       pdf_out_number(out, pages));
+        break;
     }
-    dstr_append(&str, ") Tj ");
-    dstr_append(&str, "ET");
 
-    ret = pdf_add_stream(pdf, page, dstr_data(&str));
-    dstr_free(&str);
-    return ret;
+    case OBJ_raw:
+    case OBJ_form: {
+        const char *data = dstr_data(&object->raw.data);
+        size_t last = 0;
+        int ref = 0;
+
+        for (size_t i = 0; i < object->raw.dict_len; i++)
+            if (data[i] == PDF_RAW_REF) {
+                struct pdf_object *target =
+                    (struct pdf_object *)flexarray_get(&object->raw.refs,
+                                                       ref++);
+                pdf_out_write(out, &data[last], i - last);
+                pdf_out_printf(out, "%d 0 R", pdf_out_number(out, target));
+                last = i + 1;
+            }
+        pdf_out_write_ref(out, &data[last],
+                          dstr_len(&object->raw.data) - last);
+        break;
+    }
+
+    case OBJ_link: {
+        pdf_out_printf(out,
+                       "<<\r\n"
+                       "  /Type /Annot\r\n"
+                       "  /Subtype /Link\r\n"
+                       "  /Rect [%f %f %f %f]\r\n"
+                       "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
+                       "  /Border [0 0 0]\r\n"
+                       ">>\r\n",
+                       object->link.llx, object->link.lly, object->link.urx,
+                       object->link.ury,
+                       pdf_out_number(out, object->link.target_page),
+                       object->link.target_x, object->link.target_y);
+        break;
+    }
+
+    default:
+        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
+                           object->type);
+    }
+
+    pdf_out_printf(out, "endobj\r\n");
+
+    return 0;
 }
 
-int pdf_add_text(struct pdf_doc *pdf, struct pdf_object *page,
-                 const char *text, float size, float xoff, float yoff,
-                 uint32_t colour)
+// Slightly modified djb2 hash algorithm to get pseudo-random ID
+static uint64_t hash(uint64_t hash, const void *data, size_t len)
 {
-    return pdf_add_text_spacing(pdf, page, text, size, xoff, yoff, colour, 0,
-                                0);
+    const uint8_t *d8 = (const uint8_t *)data;
+    for (; len; len--) {
+        hash = (((hash & 0x03ffffffffffffff) << 5) +
+                (hash & 0x7fffffffffffffff)) +
+               *d8++;
+    }
+    return hash;
 }
 
-int pdf_add_text_rotate(struct pdf_doc *pdf, struct pdf_object *page,
-                        const char *text, float size, float xoff, float yoff,
-                        float angle, uint32_t colour)
+static void pdf_save_header(struct pdf_output *out)
 {
-    return pdf_add_text_spacing(pdf, page, text, size, xoff, yoff, colour, 0,
-                                angle);
+    pdf_out_printf(out, "%%PDF-1.3\r\n");
+    /* Hibit bytes */
+    pdf_out_printf(out, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
 }
 
-/* How wide is each character, in points, at size 14 */
-static const uint16_t helvetica_widths[256] = {
-    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
-    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
-    280, 280, 280, 280,  280, 280, 280, 280,  357,  560, 560,  896, 672,
-    192, 335, 335, 392,  588, 280, 335, 280,  280,  560, 560,  560, 560,
-    560, 560, 560, 560,  560, 560, 280, 280,  588,  588, 588,  560, 1023,
-    672, 672, 727, 727,  672, 615, 784, 727,  280,  504, 672,  560, 839,
-    727, 784, 672, 784,  727, 672, 615, 727,  672,  951, 672,  672, 615,
-    280, 280, 280, 472,  560, 335, 560, 560,  504,  560, 560,  280, 560,
-    560, 223, 223, 504,  223, 839, 560, 560,  560,  560, 335,  504, 280,
-    560, 504, 727, 504,  504, 504, 336, 262,  336,  588, 352,  560, 352,
-    223, 560, 335, 1008, 560, 560, 335, 1008, 672,  335, 1008, 352, 615,
-    352, 352, 223, 223,  335, 335, 352, 560,  1008, 335, 1008, 504, 335,
-    951, 352, 504, 672,  280, 335, 560, 560,  560,  560, 262,  560, 335,
-    742, 372, 560, 588,  335, 742, 335, 403,  588,  335, 335,  335, 560,
-    541, 280, 335, 335,  367, 560, 840, 840,  840,  615, 672,  672, 672,
-    672, 672, 672, 1008, 727, 672, 672, 672,  672,  280, 280,  280, 280,
-    727, 727, 784, 784,  784, 784, 784, 588,  784,  727, 727,  727, 727,
-    672, 672, 615, 560,  560, 560, 560, 560,  560,  896, 504,  560, 560,
-    560, 560, 280, 280,  280, 280, 560, 560,  560,  560, 560,  560, 560,
-    588, 615, 560, 560,  560, 560, 504, 560,  504,
-};
+/* Everything after the xref entries: the trailer dictionary & startxref */
+static void pdf_save_trailer(struct pdf_output *out, int xref_count,
+                             int root_index, int info_index,
+                             const struct pdf_info *info,
+                             uint64_t xref_offset)
+{
+    uint64_t id1, id2;
+    uint8_t digest[32];
+    char id[33];
+    time_t now = time(NULL);
 
-static const uint16_t helvetica_bold_widths[256] = {
-    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
-    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
-    280,  280, 280,  280, 280, 335, 477, 560,  560, 896, 727, 239,  335, 335,
-    392,  588, 280,  335, 280, 280, 560, 560,  560, 560, 560, 560,  560, 560,
-    560,  560, 335,  335, 588, 588, 588, 615,  982, 727, 727, 727,  727, 672,
-    615,  784, 727,  280, 560, 727, 615, 839,  727, 784, 672, 784,  727, 672,
-    615,  727, 672,  951, 672, 672, 615, 335,  280, 335, 588, 560,  335, 560,
-    615,  560, 615,  560, 335, 615, 615, 280,  280, 560, 280, 896,  615, 615,
-    615,  615, 392,  560, 335, 615, 560, 784,  560, 560, 504, 392,  282, 392,
-    588,  352, 560,  352, 280, 560, 504, 1008, 560, 560, 335, 1008, 672, 335,
-    1008, 352, 615,  352, 352, 280, 280, 504,  504, 352, 560, 1008, 335, 1008,
-    560,  335, 951,  352, 504, 672, 280, 335,  560, 560, 560, 560,  282, 560,
-    335,  742, 372,  560, 588, 335, 742, 335,  403, 588, 335, 335,  335, 615,
-    560,  280, 335,  335, 367, 560, 840, 840,  840, 615, 727, 727,  727, 727,
-    727,  727, 1008, 727, 672, 672, 672, 672,  280, 280, 280, 280,  727, 727,
-    784,  784, 784,  784, 784, 588, 784, 727,  727, 727, 727, 672,  672, 615,
-    560,  560, 560,  560, 560, 560, 896, 560,  560, 560, 560, 560,  280, 280,
-    280,  280, 615,  615, 615, 615, 615, 615,  615, 588, 615, 615,  615, 615,
-    615,  560, 615,  560,
-};
+    pdf_out_printf(out,
+                   "trailer\r\n"
+                   "<<\r\n"
+                   "/Size %d\r\n",
+                   xref_count + 1);
+    pdf_out_printf(out, "/Root %d 0 R\r\n", root_index);
+    pdf_out_printf(out, "/Info %d 0 R\r\n", info_index);
+    /* Generate document unique IDs */
+    if (out->hashing) {
+        /* Everything written so far (which doesn't include the ID) is
+         * hashed, so identical documents get identical IDs */
+        out->hashing = false;
+        pdf_sha256_final(&out->sha, digest);
+        for (int i = 0; i < 16; i++)
+            sprintf(&id[i * 2], "%2.2x", digest[i]);
+        pdf_out_printf(out, "/ID [<%s> <%s>]\r\n", id, id);
+    } else {
+        id1 = hash(5381, info, sizeof(struct pdf_info));
+        id1 = hash(id1, &xref_count, sizeof(xref_count));
+        id2 = hash(5381, &now, sizeof(now));
+        pdf_out_printf(out,
+                       "/ID [<%16.16" PRIx64 "> <%16.16" PRIx64 ">]\r\n",
+                       id1, id2);
+    }
+    pdf_out_printf(out, ">>\r\n"
+                        "startxref\r\n");
+    pdf_out_printf(out, "%" PRIu64 "\r\n", xref_offset);
+    pdf_out_printf(out, "%%%%EOF\r\n");
+}
 
-static const uint16_t helvetica_bold_oblique_widths[256] = {
-    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
-    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
-    280,  280, 280,  280, 280, 335, 477, 560,  560, 896, 727, 239,  335, 335,
-    392,  588, 280,  335, 280, 280, 560, 560,  560, 560, 560, 560,  560, 560,
-    560,  560, 335,  335, 588, 588, 588, 615,  982, 727, 727, 727,  727, 672,
-    615,  784, 727,  280, 560, 727, 615, 839,  727, 784, 672, 784,  727, 672,
-    615,  727, 672,  951, 672, 672, 615, 335,  280, 335, 588, 560,  335, 560,
-    615,  560, 615,  560, 335, 615, 615, 280,  280, 560, 280, 896,  615, 615,
-    615,  615, 392,  560, 335, 615, 560, 784,  560, 560, 504, 392,  282, 392,
-    588,  352, 560,  352, 280, 560, 504, 1008, 560, 560, 335, 1008, 672, 335,
-    1008, 352, 615,  352, 352, 280, 280, 504,  504, 352, 560, 1008, 335, 1008,
-    560,  335, 951,  352, 504, 672, 280, 335,  560, 560, 560, 560,  282, 560,
-    335,  742, 372,  560, 588, 335, 742, 335,  403, 588, 335, 335,  335, 615,
-    560,  280, 335,  335, 367, 560, 840, 840,  840, 615, 727, 727,  727, 727,
-    727,  727, 1008, 727, 672, 672, 672, 672,  280, 280, 280, 280,  727, 727,
-    784,  784, 784,  784, 784, 588, 784, 727,  727, 727, 727, 672,  672, 615,
-    560,  560, 560,  560, 560, 560, 896, 560,  560, 560, 560, 560,  280, 280,
-    280,  280, 615,  615, 615, 615, 615, 615,  615, 588, 615, 615,  615, 615,
-    615,  560, 615,  560,
-};
+#ifdef PDFGEN_TRACE
+/* Save the objects, reporting the total time & size for each type. The
+ * objects of different types are interleaved, so the spans for each type
+ * are laid end to end within the overall span rather than being exact */
+static int pdf_save_objects_traced(struct pdf_doc *pdf,
+                                   struct pdf_output *out)
+{
+    uint64_t durations[OBJ_count] = {0}, bytes[OBJ_count] = {0};
+    uint64_t start = pdf_trace_now(), offset = start;
+    int count = 0;
 
-static const uint16_t helvetica_oblique_widths[256] = {
-    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
-    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
-    280, 280, 280, 280,  280, 280, 280, 280,  357,  560, 560,  896, 672,
-    192, 335, 335, 392,  588, 280, 335, 280,  280,  560, 560,  560, 560,
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        uint64_t object_start = pdf_trace_now();
+        uint64_t object_offset = out->offset;
+        int e = pdf_save_object(pdf, out, i);
+
+        if (e == -ENOSPC)
+            return e;
+        if (e >= 0) {
+            int type = pdf_get_object(pdf, i)->type;
+            durations[type] += pdf_trace_now() - object_start;
+            bytes[type] += out->offset - object_offset;
+            count++;
+        }
+    }
+    pdf_trace_span(pdf, "save", "objects", start, out->offset);
+    for (int type = 0; type < OBJ_count; type++) {
+        if (!durations[type] && !bytes[type])
+            continue;
+        pdf->trace(pdf->trace_arg, "save", pdf_object_type_name(type),
+                   offset, durations[type], bytes[type]);
+        offset += durations[type];
+    }
+    return count;
+}
+#endif
+
+/* Write all the objects & record their offsets, returning how many */
+static int pdf_save_objects(struct pdf_doc *pdf, struct pdf_output *out)
+{
+    int count = 0;
+
+#ifdef PDFGEN_TRACE
+    if (pdf->trace)
+        return pdf_save_objects_traced(pdf, out);
+#endif
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        int e = pdf_save_object(pdf, out, i);
+        if (e == -ENOSPC)
+            return e;
+        if (e >= 0)
+            count++;
+    }
+    return count;
+}
+
+int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+{
+    struct pdf_output out;
+    struct pdf_object *obj, *info;
+    struct pdf_xref xref;
+    uint64_t xref_offset, trailer_offset;
+    int xref_count = flexarray_size(&pdf->objects) - 1 - pdf->deleted_count;
+    pdf_locale_t saved_locale;
+    int e;
+
+    PDF_TRACE_START(pdf, save_start);
+    pdf_link_bookmarks(pdf);
+    force_locale(&saved_locale);
+
+    pdf_out_open(&out, fp, pdf->heap_bytes);
+    if (pdf_out_number_objects(&out, pdf) < 0) {
+        pdf_out_close(&out);
+        restore_locale(&saved_locale);
+        return pdf_set_err(pdf, -ENOMEM, "Unable to number objects");
+    }
+    if (pdf->deterministic) {
+        out.hashing = true;
+        pdf_sha256_init(&out.sha);
+    }
+    pdf_save_header(&out);
+
+    /* Dump all the objects & get their file offsets */
+    e = pdf_save_objects(pdf, &out);
+    if (e < 0) {
+        pdf_out_close(&out);
+        restore_locale(&saved_locale);
+        return e;
+    }
+
+    /* xref, with an entry for every object saved (object 0 is always
+     * OBJ_none) */
+    PDF_TRACE_START(pdf, xref_start);
+    xref_offset = out.offset;
+    pdf_xref_start(&xref, &out, xref_count);
+    for (int i = 1; i < flexarray_size(&pdf->objects); i++) {
+        obj = pdf_get_object(pdf, i);
+        if (!obj)
+            continue;
+        if (pdf_xref_add(&xref, obj->offset) < 0) {
+            pdf_out_close(&out);
+            restore_locale(&saved_locale);
+            return pdf_set_err(pdf, -EFBIG,
+                               "PDF is too large for an xref table: object "
+                               "%d is at offset %" PRIu64,
+                               i, obj->offset);
+        }
+    }
+    pdf_xref_flush(&xref);
+    PDF_TRACE_END(pdf, xref_start, "save", "xref", out.offset - xref_offset);
+
+    PDF_TRACE_START(pdf, trailer_start);
+    trailer_offset = out.offset;
+    obj = pdf_find_first_object(pdf, OBJ_catalog);
+    info = pdf_find_first_object(pdf, OBJ_info);
+    pdf_save_trailer(&out, xref_count, pdf_out_number(&out, obj),
+                     pdf_out_number(&out, info), info->info, xref_offset);
+    PDF_TRACE_END(pdf, trailer_start, "save", "trailer",
+                  out.offset - trailer_offset);
+
+    e = pdf_out_close(&out);
+    restore_locale(&saved_locale);
+    PDF_TRACE_END(pdf, save_start, "save", "save", out.offset);
+
+    if (e < 0 || ferror(fp))
+        return pdf_set_err(pdf, e < 0 ? e : -EIO, "Unable to write PDF: %s",
+                           strerror(e < 0 ? -e : EIO));
+    if (pdf->limits.output_bytes && out.offset > pdf->limits.output_bytes)
+        return pdf_set_err(pdf, -ENOSPC,
+                           "Output limit of %" PRIu64 " bytes reached",
+                           pdf->limits.output_bytes);
+
+    return 0;
+}
+
+int pdf_save(struct pdf_doc *pdf, const char *filename)
+{
+    FILE *fp;
+    int e;
+
+    if (filename == NULL)
+        fp = stdout;
+    else if ((fp = fopen(filename, "wb")) == NULL)
+        return pdf_set_err(pdf, -errno, "Unable to open '%s': %s", filename,
+                           strerror(errno));
+
+    e = pdf_save_file(pdf, fp);
+
+    if (fp != stdout)
+        if (fclose(fp) != 0 && e >= 0)
+            return pdf_set_err(pdf, -errno, "Unable to close '%s': %s",
+                               filename, strerror(errno));
+
+    return e;
+}
+
+/**
+ * Page fragments
+ * A fragment is the body of a PDF document (pages, content, images, fonts,
+ * links & bookmarks) serialised exactly as pdf_save_file would write it,
+ * still using the document's own object numbers. It is followed by a small
+ * text index describing each object:
+ *   fragment
+ *   <object count>
+ *   <index> <type> <offset> [<font name>|<outline count>|<dict size>]
+ *   ...
+ *   startfragment
+ *   <offset of "fragment">
+ *   %%EOF
+ * Type is one of 'p'age, 's'tream, 'i'mage, 'f'ont, 'l'ink, 'B'ookmark
+ * (top level), 'b'ookmark (nested), imported objects with ('X') or
+ * without ('x') stream data, or the placeholders 'P' (page tree)
+ * and 'O' (outline) which are not written and only exist to be referred to.
+ * Offsets are relative to the start of the fragment.
+ */
+static char pdf_fragment_type(const struct pdf_object *obj)
+{
+    switch (obj->type) {
+    case OBJ_font:
+        return 'f';
+    case OBJ_page:
+        return 'p';
+    case OBJ_stream:
+    case OBJ_pattern:
+        return 's';
+    case OBJ_image:
+        return 'i';
+    case OBJ_link:
+        return 'l';
+    case OBJ_bookmark:
+        return obj->bookmark.parent ? 'b' : 'B';
+    case OBJ_pages:
+        return 'P';
+    case OBJ_outline:
+        return 'O';
+    case OBJ_raw:
+    case OBJ_form:
+        return obj->raw.dict_len < dstr_len(&obj->raw.data) ? 'X' : 'x';
+    }
+    return '\0';
+}
+
+int pdf_save_fragment(struct pdf_doc *pdf, FILE *fp)
+{
+    struct pdf_output out_file;
+    struct pdf_output *out = &out_file;
+    uint64_t index_offset;
+    int count = 0;
+    pdf_locale_t saved_locale;
+    int e;
+
+    pdf_link_bookmarks(pdf);
+    force_locale(&saved_locale);
+    pdf_out_open(out, fp, pdf->heap_bytes);
+    if (pdf_out_number_objects(out, pdf) < 0) {
+        pdf_out_close(out);
+        restore_locale(&saved_locale);
+        return pdf_set_err(pdf, -ENOMEM, "Unable to number objects");
+    }
+
+    pdf_out_printf(out, "%%PDFGEN-FRAGMENT-1\r\n");
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        char type = obj ? pdf_fragment_type(obj) : '\0';
+
+        if (!type)
+            continue;
+        count++;
+        if (type == 'P' || type == 'O')
+            continue;
+        if (pdf_save_object(pdf, out, i) < 0) {
+            pdf_out_close(out);
+            restore_locale(&saved_locale);
+            return pdf_get_errval(pdf);
+        }
+    }
+
+    index_offset = out->offset;
+    pdf_out_printf(out, "fragment\r\n%d\r\n", count);
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        char type = obj ? pdf_fragment_type(obj) : '\0';
+
+        switch (type) {
+        case '\0':
+            break;
+        case 'P':
+            pdf_out_printf(out, "%d P 0\r\n", pdf_out_number(out, obj));
+            break;
+        case 'O':
+            pdf_out_printf(out, "%d O 0 %d\r\n", pdf_out_number(out, obj),
+                           (int)pdf->object_counts[OBJ_bookmark]);
+            break;
+        case 'f':
+            pdf_out_printf(out, "%d f %" PRIu64 " %s\r\n",
+                           pdf_out_number(out, obj), obj->offset,
+                           obj->font.name);
+            break;
+        case 'X':
+            /* Upper bound on the size of the object header plus the
+             * dictionary once its references have been written out */
+            pdf_out_printf(out, "%d X %" PRIu64 " %zu\r\n",
+                           pdf_out_number(out, obj), obj->offset,
+                           32 + obj->raw.dict_len +
+                               16 * (size_t)flexarray_size(&obj->raw.refs));
+            break;
+        default:
+            pdf_out_printf(out, "%d %c %" PRIu64 "\r\n",
+                           pdf_out_number(out, obj), type, obj->offset);
+            break;
+        }
+    }
+    pdf_out_printf(out, "startfragment\r\n%" PRIu64 "\r\n%%%%EOF\r\n",
+                   index_offset);
+
+    e = pdf_out_close(out);
+    restore_locale(&saved_locale);
+
+    if (e < 0 || ferror(fp))
+        return pdf_set_err(pdf, e < 0 ? e : -EIO,
+                           "Unable to write fragment: %s",
+                           strerror(e < 0 ? -e : EIO));
+
+    return 0;
+}
+
+struct pdf_fragment_entry {
+    int local;       /* Object number within the fragment */
+    char type;       /* See pdf_fragment_type */
+    uint64_t offset; /* Byte position within the fragment */
+    uint64_t length; /* Number of bytes in the fragment */
+    int global;      /* Object number in the stitched output */
+    int emit;        /* Whether this entry is copied to the output */
+    int extra;       /* Font table index, outline count or dictionary size */
+};
+
+struct pdf_fragment {
+    struct pdf_fragment_entry *entries;
+    int entry_count;
+    int *map; /* Local object number => stitched object number */
+    int map_len;
+    int outline_count;
+};
+
+struct pdf_stitch {
+    char *err_msg;
+    size_t err_msg_length;
+    char (*fonts)[64];
+    int *font_globals;
+    int font_count;
+    int next_global;
+};
+
+#ifndef SKIP_ATTRIBUTE
+static int pdf_stitch_err(struct pdf_stitch *st, int errval,
+                          const char *buffer, ...)
+    __attribute__((format(printf, 3, 4)));
+#endif
+static int pdf_stitch_err(struct pdf_stitch *st, int errval,
+                          const char *buffer, ...)
+{
+    va_list ap;
+
+    if (st->err_msg && st->err_msg_length) {
+        va_start(ap, buffer);
+        vsnprintf(st->err_msg, st->err_msg_length, buffer, ap);
+        va_end(ap);
+    }
+    return errval;
+}
+
+/* Look up a font by name, allocating it an output object if it is new */
+static int pdf_stitch_font(struct pdf_stitch *st, const char *name,
+                           int *is_new)
+{
+    char(*fonts)[64];
+    int *globals;
+
+    for (int i = 0; i < st->font_count; i++)
+        if (strcmp(st->fonts[i], name) == 0) {
+            *is_new = 0;
+            return i;
+        }
+
+    fonts = (char(*)[64])realloc(st->fonts,
+                                 (st->font_count + 1) * sizeof(*fonts));
+    if (!fonts)
+        return -ENOMEM;
+    st->fonts = fonts;
+    globals = (int *)realloc(st->font_globals,
+                             (st->font_count + 1) * sizeof(*globals));
+    if (!globals)
+        return -ENOMEM;
+    st->font_globals = globals;
+
+    snprintf(st->fonts[st->font_count], sizeof(st->fonts[0]), "%s", name);
+    st->font_globals[st->font_count] = st->next_global++;
+    *is_new = 1;
+    return st->font_count++;
+}
+
+/* fseek & ftell with 64-bit offsets, as fragments may exceed 2GB */
+static int pdf_fseek64(FILE *fp, uint64_t offset, int whence)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)offset, whence);
+#else
+    return fseeko(fp, (off_t)offset, whence);
+#endif
+}
+
+static int64_t pdf_ftell64(FILE *fp)
+{
+#ifdef _WIN32
+    return _ftelli64(fp);
+#else
+    return ftello(fp);
+#endif
+}
+
+static int pdf_stitch_load_index(struct pdf_stitch *st, FILE *fp,
+                                 const char *filename,
+                                 struct pdf_fragment *frag)
+{
+    char line[128];
+    int64_t end;
+    uint64_t index_offset = 0;
+    int count = 0;
+    int prev = -1;
+
+    if (pdf_fseek64(fp, 0, SEEK_END) < 0 || (end = pdf_ftell64(fp)) < 0)
+        return pdf_stitch_err(st, -errno, "Unable to seek in '%s': %s",
+                              filename, strerror(errno));
+
+    /* The trailer is short, so just search the last few lines for it */
+    pdf_fseek64(fp, end > 64 ? end - 64 : 0, SEEK_SET);
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "startfragment", 13) == 0) {
+            if (!fgets(line, sizeof(line), fp))
+                break;
+            index_offset = strtoull(line, NULL, 10);
+            break;
+        }
+    if (index_offset == 0 || index_offset >= (uint64_t)end)
+        return pdf_stitch_err(st, -EINVAL, "'%s' is not a pdfgen fragment",
+                              filename);
+
+    if (pdf_fseek64(fp, index_offset, SEEK_SET) < 0 ||
+        !fgets(line, sizeof(line), fp) ||
+        strncmp(line, "fragment", 8) != 0 ||
+        !fgets(line, sizeof(line), fp) || (count = atoi(line)) <= 0)
+        return pdf_stitch_err(st, -EINVAL, "Invalid fragment index in '%s'",
+                              filename);
+
+    frag->entries = (struct pdf_fragment_entry *)calloc(
+        count, sizeof(*frag->entries));
+    if (!frag->entries)
+        return pdf_stitch_err(st, -ENOMEM,
+                              "Unable to allocate %d fragment entries",
+                              count);
+
+    for (int i = 0; i < count; i++) {
+        struct pdf_fragment_entry *e = &frag->entries[i];
+        char name[64] = {0};
+
+        if (!fgets(line, sizeof(line), fp) ||
+            sscanf(line, "%d %c %" SCNu64 " %63s", &e->local, &e->type,
+                   &e->offset, name) < 3 ||
+            e->local <= 0 || e->offset >= index_offset)
+            return pdf_stitch_err(st, -EINVAL,
+                                  "Invalid fragment entry %d in '%s'", i,
+                                  filename);
+        frag->entry_count++;
+        if (e->local >= frag->map_len)
+            frag->map_len = e->local + 1;
+
+        switch (e->type) {
+        case 'P':
+            break;
+        case 'O':
+            e->extra = atoi(name);
+            frag->outline_count = e->extra;
+            break;
+        case 'f': {
+            int is_new = 0;
+            int font = pdf_stitch_font(st, name, &is_new);
+            if (font < 0)
+                return pdf_stitch_err(st, font, "Unable to record font");
+            e->extra = font;
+            e->global = st->font_globals[font];
+            e->emit = is_new;
+            break;
+        }
+        case 'X':
+            e->extra = atoi(name);
+            if (e->extra <= 0)
+                return pdf_stitch_err(st, -EINVAL,
+                                      "Invalid fragment entry %d in '%s'", i,
+                                      filename);
+            /* fall through */
+        case 'p':
+        case 's':
+        case 'i':
+        case 'l':
+        case 'b':
+        case 'B':
+        case 'x':
+            e->global = st->next_global++;
+            e->emit = 1;
+            break;
+        default:
+            return pdf_stitch_err(st, -EINVAL,
+                                  "Invalid fragment object type '%c' in '%s'",
+                                  e->type, filename);
+        }
+
+        /* Objects are stored back to back, so each one ends where the next
+         * one starts */
+        if (e->type != 'P' && e->type != 'O') {
+            if (prev >= 0)
+                frag->entries[prev].length =
+                    e->offset - frag->entries[prev].offset;
+            prev = i;
+        }
+    }
+    if (prev >= 0)
+        frag->entries[prev].length =
+            index_offset - frag->entries[prev].offset;
+
+    frag->map = (int *)calloc(frag->map_len, sizeof(*frag->map));
+    if (!frag->map)
+        return pdf_stitch_err(st, -ENOMEM, "Unable to allocate object map");
+    for (int i = 0; i < frag->entry_count; i++)
+        frag->map[frag->entries[i].local] = frag->entries[i].global;
+
+    return 0;
+}
+
+/**
+ * Copy a piece of an object dictionary to the output, renumbering every
+ * "<n> 0 R" reference it contains. PDF strings are copied verbatim.
+ */
+static int pdf_stitch_rewrite(struct pdf_output *out, const char *dict,
+                              size_t len, const struct pdf_fragment *frag)
+{
+    size_t i = 0, last = 0;
+
+    while (i < len) {
+        char ch = dict[i];
+
+        if (ch == '(') {
+            int depth = 0;
+            for (; i < len; i++) {
+                if (dict[i] == '\\')
+                    i++;
+                else if (dict[i] == '(')
+                    depth++;
+                else if (dict[i] == ')' && --depth == 0)
+                    break;
+            }
+            i++;
+            continue;
+        }
+
+        if (isdigit((unsigned char)ch) &&
+            (i == 0 || (!isalnum((unsigned char)dict[i - 1]) &&
+                        dict[i - 1] != '.' && dict[i - 1] != '-'))) {
+            size_t j = i;
+            long value = 0;
+
+            while (j < len && isdigit((unsigned char)dict[j]) &&
+                   value < INT_MAX / 10)
+                value = value * 10 + dict[j++] - '0';
+            if (j + 4 <= len && memcmp(&dict[j], " 0 R", 4) == 0) {
+                if (value >= frag->map_len || !frag->map[value])
+                    return -EINVAL;
+                pdf_out_write(out, &dict[last], i - last);
+                pdf_out_printf(out, "%d 0 R", frag->map[value]);
+                i = last = j + 4;
+                continue;
+            }
+            i = j;
+            continue;
+        }
+        i++;
+    }
+    pdf_out_write(out, &dict[last], len - last);
+    return 0;
+}
+
+/* Copy one object from a fragment to the output */
+/* Where the data of a stream object starts, if its 'stream' keyword is
+ * within the first len bytes */
+static const char *pdf_stitch_stream_data(const char *data, size_t len)
+{
+    for (size_t i = 0; i + 8 <= len; i++)
+        if (memcmp(&data[i], "stream\r\n", 8) == 0)
+            return &data[i + 8];
+    return NULL;
+}
+
+static int pdf_stitch_object(struct pdf_stitch *st, struct pdf_output *out,
+                             FILE *in, const char *filename,
+                             const struct pdf_fragment *frag,
+                             const struct pdf_fragment_entry *e,
+                             const char *extra)
+{
+    char chunk[4096];
+    char *head;
+    size_t head_len, dict_len;
+    size_t remaining = e->length;
+    const char *body;
+    bool is_stream = e->type == 's' || e->type == 'i' || e->type == 'X';
+    int ret;
+
+    /* Stream objects only need their dictionary rewritten, which is at the
+     * start; everything else is read in whole */
+    if (e->type == 's' || e->type == 'i') {
+        head = chunk;
+        head_len = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+    } else {
+        if (e->type == 'X' && (size_t)e->extra < remaining)
+            remaining = e->extra;
+        head = (char *)malloc(remaining);
+        if (!head)
+            return pdf_stitch_err(st, -ENOMEM,
+                                  "Unable to allocate %zu bytes", remaining);
+        head_len = remaining;
+        remaining = e->length;
+    }
+
+    ret = 0;
+    if (pdf_fseek64(in, e->offset, SEEK_SET) < 0 ||
+        fread(head, head_len, 1, in) != 1)
+        ret = pdf_stitch_err(st, -EIO, "Unable to read object %d of '%s'",
+                             e->local, filename);
+
+    /* A stream's dictionary can be longer than the first chunk (eg: a
+     * pattern's resources list every font), so keep reading until the
+     * 'stream' keyword turns up */
+    while (ret >= 0 && (e->type == 's' || e->type == 'i') &&
+           head_len < e->length &&
+           !pdf_stitch_stream_data(head, head_len)) {
+        size_t more = e->length - head_len;
+        char *new_head;
+
+        if (more > head_len)
+            more = head_len;
+        new_head = (char *)realloc(head == chunk ? NULL : head,
+                                   head_len + more);
+        if (!new_head) {
+            ret = pdf_stitch_err(st, -ENOMEM, "Unable to allocate %zu bytes",
+                                 head_len + more);
+            break;
+        }
+        if (head == chunk)
+            memcpy(new_head, chunk, head_len);
+        head = new_head;
+        if (fread(&head[head_len], more, 1, in) != 1)
+            ret = pdf_stitch_err(st, -EIO,
+                                 "Unable to read object %d of '%s'",
+                                 e->local, filename);
+        head_len += more;
+    }
+
+    /* Skip over the original "<n> 0 obj" line */
+    body = ret < 0 ? NULL : (const char *)memchr(head, '\n', head_len);
+    if (ret >= 0 && !body)
+        ret = pdf_stitch_err(st, -EINVAL, "Corrupt object %d in '%s'",
+                             e->local, filename);
+    if (ret < 0)
+        goto out;
+    body++;
+    dict_len = head_len - (body - head);
+
+    if (is_stream) {
+        /* The stream data (which follows the 'stream' keyword) is passed
+         * straight through */
+        const char *stream = pdf_stitch_stream_data(body, dict_len);
+
+        if (!stream) {
+            ret = pdf_stitch_err(st, -EINVAL,
+                                 "Missing stream in object %d of '%s'",
+                                 e->local, filename);
+            goto out;
+        }
+        dict_len = stream - body;
+    }
+
+    pdf_out_printf(out, "%d 0 obj\r\n", e->global);
+    if (extra) {
+        /* Splice the extra keys in before the final '>>' */
+        size_t close = dict_len;
+        while (close >= 2 && memcmp(&body[close - 2], ">>", 2) != 0)
+            close--;
+        if (close < 2) {
+            ret = pdf_stitch_err(st, -EINVAL,
+                                 "Missing dictionary in object %d of '%s'",
+                                 e->local, filename);
+            goto out;
+        }
+        ret = pdf_stitch_rewrite(out, body, close - 2, frag);
+        if (ret >= 0) {
+            pdf_out_write(out, extra, strlen(extra));
+            ret = pdf_stitch_rewrite(out, &body[close - 2],
+                                     dict_len - (close - 2), frag);
+        }
+    } else {
+        ret = pdf_stitch_rewrite(out, body, dict_len, frag);
+    }
+    if (ret < 0) {
+        ret = pdf_stitch_err(st, ret,
+                             "Dangling reference in object %d of '%s'",
+                             e->local, filename);
+        goto out;
+    }
+
+    /* Pass the remainder of the object through untouched */
+    pdf_out_write(out, &body[dict_len], head_len - (body - head) - dict_len);
+    remaining -= head_len;
+    while (remaining > 0) {
+        size_t len = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        if (fread(chunk, len, 1, in) != 1) {
+            ret = pdf_stitch_err(st, -EIO,
+                                 "Unable to read object %d of '%s'",
+                                 e->local, filename);
+            break;
+        }
+        pdf_out_write(out, chunk, len);
+        remaining -= len;
+    }
+
+out:
+    if (head != chunk)
+        free(head);
+    return ret;
+}
+
+/* Find the first/last top level bookmark of a fragment */
+static const struct pdf_fragment_entry *
+pdf_fragment_top_bookmark(const struct pdf_fragment *frag, bool first)
+{
+    const struct pdf_fragment_entry *found = NULL;
+
+    for (int i = 0; i < frag->entry_count; i++)
+        if (frag->entries[i].type == 'B') {
+            found = &frag->entries[i];
+            if (first)
+                break;
+        }
+    return found;
+}
+
+int pdf_stitch_fragments(FILE *fp, const char *const *fragment_files,
+                         int fragment_count, const struct pdf_info *info,
+                         int deterministic, char *err_msg,
+                         size_t err_msg_length)
+{
+    struct pdf_stitch st = {err_msg, err_msg_length, NULL, NULL, 0, 0};
+    struct pdf_output out_file;
+    struct pdf_output *out = &out_file;
+    struct pdf_fragment *frags;
+    struct pdf_info doc_info;
+    struct pdf_xref xref;
+    uint64_t *offsets = NULL;
+    uint64_t xref_offset;
+    int info_index = 1, pages_index = 2, catalog_index = 3;
+    int outline_index = 0, outline_count = 0;
+    int npages = 0;
+    int ret = 0, e;
+    pdf_locale_t saved_locale;
+
+    if (fragment_count <= 0 || !fragment_files)
+        return pdf_stitch_err(&st, -EINVAL, "No fragments to stitch");
+
+    frags = (struct pdf_fragment *)calloc(fragment_count, sizeof(*frags));
+    if (!frags)
+        return pdf_stitch_err(&st, -ENOMEM, "Unable to allocate fragments");
+
+    if (info)
+        doc_info = *info;
+    else
+        memset(&doc_info, 0, sizeof(doc_info));
+    if (!doc_info.date[0] && !deterministic)
+        pdf_default_date(doc_info.date, sizeof(doc_info.date));
+
+    /* First pass: read every index & allocate the output object numbers */
+    st.next_global = catalog_index + 1;
+    for (int i = 0; i < fragment_count && ret >= 0; i++) {
+        FILE *in = fopen(fragment_files[i], "rb");
+        if (!in) {
+            ret = pdf_stitch_err(&st, -errno, "Unable to open '%s': %s",
+                                 fragment_files[i], strerror(errno));
+            break;
+        }
+        ret = pdf_stitch_load_index(&st, in, fragment_files[i], &frags[i]);
+        fclose(in);
+        outline_count += frags[i].outline_count;
+    }
+    if (ret >= 0 && outline_count > 0)
+        outline_index = st.next_global++;
+    /* The page tree & outline placeholders map onto the merged ones */
+    for (int i = 0; i < fragment_count && ret >= 0; i++)
+        for (int j = 0; j < frags[i].entry_count; j++) {
+            struct pdf_fragment_entry *e = &frags[i].entries[j];
+            if (e->type == 'P')
+                frags[i].map[e->local] = pages_index;
+            else if (e->type == 'O')
+                frags[i].map[e->local] = outline_index;
+        }
+
+    if (ret >= 0) {
+        offsets = (uint64_t *)calloc(st.next_global, sizeof(*offsets));
+        if (!offsets)
+            ret = pdf_stitch_err(&st, -ENOMEM,
+                                 "Unable to allocate %d xref entries",
+                                 st.next_global);
+    }
+    if (ret < 0)
+        goto out;
+
+    force_locale(&saved_locale);
+
+    /* Stitching is meant for large documents */
+    pdf_out_open(out, fp, UINT64_MAX);
+    if (deterministic) {
+        out->hashing = true;
+        pdf_sha256_init(&out->sha);
+    }
+    pdf_save_header(out);
+    offsets[info_index] = out->offset;
+    pdf_out_printf(out, "%d 0 obj\r\n", info_index);
+    pdf_save_info(out, &doc_info);
+    pdf_out_printf(out, "endobj\r\n");
+
+    /* Second pass: copy the objects across */
+    for (int i = 0; i < fragment_count && ret >= 0; i++) {
+        const struct pdf_fragment_entry *first, *last, *prev_last = NULL,
+                                                       *next_first = NULL;
+        FILE *in;
+
+        /* Top level bookmarks need to be chained across fragments */
+        first = pdf_fragment_top_bookmark(&frags[i], true);
+        last = pdf_fragment_top_bookmark(&frags[i], false);
+        for (int j = i - 1; j >= 0 && !prev_last; j--)
+            prev_last = pdf_fragment_top_bookmark(&frags[j], false);
+        for (int j = i + 1; j < fragment_count && !next_first; j++)
+            next_first = pdf_fragment_top_bookmark(&frags[j], true);
+
+        in = fopen(fragment_files[i], "rb");
+        if (!in) {
+            ret = pdf_stitch_err(&st, -errno, "Unable to open '%s': %s",
+                                 fragment_files[i], strerror(errno));
+            break;
+        }
+        for (int j = 0; j < frags[i].entry_count && ret >= 0; j++) {
+            const struct pdf_fragment_entry *e = &frags[i].entries[j];
+            char extra[64] = {0};
+
+            if (!e->emit)
+                continue;
+            if (e == first && prev_last)
+                snprintf(extra, sizeof(extra), "  /Prev %d 0 R\r\n",
+                         prev_last->global);
+            if (e == last && next_first)
+                snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra),
+                         "  /Next %d 0 R\r\n", next_first->global);
+            offsets[e->global] = out->offset;
+            ret = pdf_stitch_object(&st, out, in, fragment_files[i],
+                                    &frags[i], e, extra[0] ? extra : NULL);
+        }
+        fclose(in);
+    }
+
+    if (ret >= 0) {
+        offsets[pages_index] = out->offset;
+        pdf_out_printf(out,
+                       "%d 0 obj\r\n"
+                       "<<\r\n"
+                       "  /Type /Pages\r\n"
+                       "  /Kids [ ",
+                       pages_index);
+        for (int i = 0; i < fragment_count; i++)
+            for (int j = 0; j < frags[i].entry_count; j++)
+                if (frags[i].entries[j].type == 'p') {
+                    pdf_out_printf(out, "%d 0 R ",
+                                   frags[i].entries[j].global);
+                    npages++;
+                }
+        pdf_out_printf(out, "]\r\n");
+        pdf_out_printf(out, "  /Count %d\r\n", npages);
+        pdf_out_printf(out, ">>\r\nendobj\r\n");
+
+        offsets[catalog_index] = out->offset;
+        pdf_out_printf(out, "%d 0 obj\r\n<<\r\n  /Type /Catalog\r\n",
+                       catalog_index);
+        if (outline_index)
+            pdf_out_printf(out,
+                           "  /Outlines %d 0 R\r\n"
+                           "  /PageMode /UseOutlines\r\n",
+                           outline_index);
+        pdf_out_printf(out, "  /Pages %d 0 R\r\n>>\r\nendobj\r\n",
+                       pages_index);
+
+        if (outline_index) {
+            const struct pdf_fragment_entry *first = NULL, *last = NULL;
+            for (int i = 0; i < fragment_count; i++) {
+                if (!first)
+                    first = pdf_fragment_top_bookmark(&frags[i], true);
+                if (pdf_fragment_top_bookmark(&frags[i], false))
+                    last = pdf_fragment_top_bookmark(&frags[i], false);
+            }
+            offsets[outline_index] = out->offset;
+            pdf_out_printf(out,
+                           "%d 0 obj\r\n"
+                           "<<\r\n"
+                           "  /Count %d\r\n"
+                           "  /Type /Outlines\r\n"
+                           "  /First %d 0 R\r\n"
+                           "  /Last %d 0 R\r\n"
+                           ">>\r\n"
+                           "endobj\r\n",
+                           outline_index, outline_count,
+                           first ? first->global : 0,
+                           last ? last->global : 0);
+        }
+
+        xref_offset = out->offset;
+        pdf_xref_start(&xref, out, st.next_global - 1);
+        for (int i = 1; i < st.next_global && ret >= 0; i++)
+            if (pdf_xref_add(&xref, offsets[i]) < 0)
+                ret = pdf_stitch_err(&st, -EFBIG,
+                                     "Output is too large for an xref "
+                                     "table: object %d is at offset "
+                                     "%" PRIu64,
+                                     i, offsets[i]);
+        pdf_xref_flush(&xref);
+        pdf_save_trailer(out, st.next_global - 1, catalog_index, info_index,
+                         &doc_info, xref_offset);
+    }
+    e = pdf_out_close(out);
+    if (ret >= 0 && (e < 0 || ferror(fp)))
+        ret = pdf_stitch_err(&st, e < 0 ? e : -EIO,
+                             "Unable to write output: %s",
+                             strerror(e < 0 ? -e : EIO));
+
+    restore_locale(&saved_locale);
+
+out:
+    for (int i = 0; i < fragment_count; i++) {
+        free(frags[i].entries);
+        free(frags[i].map);
+    }
+    free(frags);
+    free(offsets);
+    free(st.fonts);
+    free(st.font_globals);
+    return ret;
+}
+
+/* Grow a bounding box (llx, lly, urx, ury) to include a point */
+static void pdf_bbox_extend(float bbox[4], float x, float y)
+{
+    bbox[0] = fminf(bbox[0], x);
+    bbox[1] = fminf(bbox[1], y);
+    bbox[2] = fmaxf(bbox[2], x);
+    bbox[3] = fmaxf(bbox[3], y);
+}
+
+/* Are page bounding boxes being kept up to date? */
+static inline bool pdf_measuring(const struct pdf_doc *pdf)
+{
+    return pdf->measure_only || pdf->track_bbox;
+}
+
+/**
+ * Grow the bounding box of a page to cover another bounding box, plus a
+ * margin (eg: half the line width) on all sides, resolving a NULL page to
+ * the last one. An empty box (llx > urx), or a document which isn't
+ * measuring, leaves the page as it is.
+ * Every drawing call goes through here before formatting its operations.
+ * Returns 1 in measure-only mode, when the caller should stop there and
+ * report success.
+ */
+static int pdf_measure_bbox(struct pdf_doc *pdf, struct pdf_object **page,
+                            const float bbox[4], float margin)
+{
+    struct pdf_object *p = *page;
+
+    if (!p)
+        p = *page = pdf_find_last_object(pdf, OBJ_page);
+
+    if (!p || (p->type != OBJ_page && p->type != OBJ_pattern))
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+
+    /* Tiles of a pattern are not part of any page */
+    if (bbox[0] <= bbox[2] && p->type == OBJ_page && pdf_measuring(pdf)) {
+        margin = fabsf(margin);
+        pdf_bbox_extend(p->page.bbox, bbox[0] - margin, bbox[1] - margin);
+        pdf_bbox_extend(p->page.bbox, bbox[2] + margin, bbox[3] + margin);
+    }
+    return pdf->measure_only ? 1 : 0;
+}
+
+/* As for pdf_measure_bbox, for a rectangle with corners in either order */
+static int pdf_measure(struct pdf_doc *pdf, struct pdf_object **page,
+                       float x1, float y1, float x2, float y2, float margin)
+{
+    float bbox[4] = {FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    pdf_bbox_extend(bbox, x1, y1);
+    pdf_bbox_extend(bbox, x2, y2);
+    return pdf_measure_bbox(pdf, page, bbox, margin);
+}
+
+/* As for pdf_measure_bbox, for the area covered by a set of points */
+static int pdf_measure_points(struct pdf_doc *pdf, struct pdf_object **page,
+                              const float x[], const float y[], int count,
+                              float margin)
+{
+    float bbox[4] = {FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    for (int i = 0; i < count; i++)
+        pdf_bbox_extend(bbox, x[i], y[i]);
+    return pdf_measure_bbox(pdf, page, bbox, margin);
+}
+
+/**
+ * Append a sequence of drawing operations to the content stream of a page.
+ * This only touches the page's own buffer, so different pages may be
+ * drawn on concurrently as long as explicit page handles are used.
+ */
+static int pdf_add_stream(struct pdf_doc *pdf, struct pdf_object *page,
+                          const char *buffer)
+{
+    struct dstr *content;
+    size_t len, alloc_len, old_len, reserved = 0;
+
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+
+    if (!page || (page->type != OBJ_page && page->type != OBJ_pattern))
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+
+    len = strlen(buffer);
+    /* We don't want any trailing whitespace in the stream */
+    while (len >= 1 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n'))
+        len--;
+
+    if (page->type == OBJ_pattern)
+        content = &page->pattern.content;
+    else
+        content = &page->page.content->stream.stream;
+    alloc_len = content->data ? content->alloc_len : 0;
+    old_len = dstr_len(content);
+    /* Reserve roughly what dstr_ensure will allocate, then settle up once
+     * the real amount is known */
+    if (old_len + len + 3 > alloc_len) {
+        reserved = old_len + len + 3 + 4096 - alloc_len;
+        if (pdf_reserve_heap(pdf, reserved) < 0)
+            return pdf_get_errval(pdf);
+    }
+    if ((old_len > 0 && dstr_append(content, "\r\n") < 0) ||
+        dstr_append_data(content, buffer, len) < 0) {
+        pdf_charge(pdf, -(int64_t)reserved);
+        return pdf_set_err(pdf, -ENOMEM, "Unable to grow page contents");
+    }
+    if (content->data)
+        pdf_charge(pdf, (int64_t)(content->alloc_len - alloc_len));
+    pdf_charge(pdf, -(int64_t)reserved);
+    if (page->type == OBJ_page)
+        pdf_counter_add(&pdf->content_bytes,
+                        (int64_t)(dstr_len(content) - old_len));
+
+    return 0;
+}
+
+/**
+ * Write the operators selecting @pattern, or @colour if that is NULL, as
+ * the fill colour. Patterns are recorded in the resources of @page.
+ */
+static int pdf_set_fill(struct pdf_doc *pdf, struct pdf_object *page,
+                        struct dstr *str, uint32_t colour,
+                        struct pdf_object *pattern)
+{
+    bool found = false;
+
+    if (!pattern) {
+        dstr_printf(str, "%f %f %f rg ", PDF_RGB_R(colour),
+                    PDF_RGB_G(colour), PDF_RGB_B(colour));
+        return 0;
+    }
+
+    if (pattern->type != OBJ_pattern)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pattern");
+    if (page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL,
+                           "Patterns can only be used on pages");
+
+    for (int i = 0; i < flexarray_size(&page->page.patterns); i++)
+        if (flexarray_get(&page->page.patterns, i) == pattern)
+            found = true;
+    if (!found &&
+        pdf_flexarray_append(pdf, &page->page.patterns, pattern) < 0)
+        return pdf_get_errval(pdf);
+
+    dstr_printf(str, "/Pattern cs /P%d scn ", pattern->pattern.name);
+    return 0;
+}
+
+int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
+                     const char *name)
+{
+    return pdf_add_bookmark_n(pdf, page, parent, name, strlen(name));
+}
+
+int pdf_add_bookmark_n(struct pdf_doc *pdf, struct pdf_object *page,
+                       int parent, const char *name, size_t name_len)
+{
+    struct pdf_object *obj, *outline = NULL, *parent_obj = NULL;
+
+    if (!name && name_len)
+        return pdf_set_err(pdf, -EINVAL, "NULL bookmark name of length %zu",
+                           name_len);
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+
+    if (!page)
+        return pdf_set_err(pdf, -EINVAL,
+                           "Unable to add bookmark, no pages available");
+    if (page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+    if (parent >= 0) {
+        parent_obj = pdf_get_object(pdf, parent);
+        if (!parent_obj || parent_obj->type != OBJ_bookmark)
+            return pdf_set_err(pdf, -EINVAL, "Invalid parent ID %d supplied",
+                               parent);
+    }
+
+    if (!pdf_find_first_object(pdf, OBJ_outline)) {
+        outline = pdf_add_object(pdf, OBJ_outline);
+        if (!outline)
+            return pdf_get_errval(pdf);
+    }
+
+    obj = pdf_add_object(pdf, OBJ_bookmark);
+    if (!obj) {
+        if (outline)
+            pdf_del_object(pdf, outline);
+        return pdf_get_errval(pdf);
+    }
+
+    if (name_len > 63)
+        name_len = 63;
+    if (pdf_reserve_heap(pdf, name_len + 1) == 0) {
+        obj->bookmark.name = (char *)malloc(name_len + 1);
+        if (!obj->bookmark.name) {
+            pdf_charge(pdf, -(int64_t)(name_len + 1));
+            pdf_set_err(pdf, -ENOMEM, "Unable to allocate bookmark name");
+        }
+    }
+    if (!obj->bookmark.name ||
+        (parent_obj && pdf_flexarray_append(
+                           pdf, &parent_obj->bookmark.children, obj) < 0)) {
+        pdf_del_object(pdf, obj);
+        if (outline)
+            pdf_del_object(pdf, outline);
+        return pdf_get_errval(pdf);
+    }
+    memcpy(obj->bookmark.name, name, name_len);
+    obj->bookmark.name[name_len] = '\0';
+    obj->bookmark.page = page;
+    obj->bookmark.parent = parent_obj;
+
+    return obj->index;
+}
+
+int pdf_add_link(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                 float y, float width, float height,
+                 struct pdf_object *target_page, float target_x,
+                 float target_y)
+{
+    struct pdf_object *obj;
+
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+
+    if (!page)
+        return pdf_set_err(pdf, -EINVAL,
+                           "Unable to add link, no pages available");
+    if (page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+
+    if (!target_page || target_page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Unable to link, no target page");
+
+    obj = pdf_add_object(pdf, OBJ_link);
+    if (!obj) {
+        return pdf_get_errval(pdf);
+    }
+
+    obj->link.target_page = target_page;
+    obj->link.target_x = target_x;
+    obj->link.target_y = target_y;
+    obj->link.llx = x;
+    obj->link.lly = y;
+    obj->link.urx = x + width;
+    obj->link.ury = y + height;
+    if (pdf_flexarray_append(pdf, &page->page.annotations, obj) < 0) {
+        pdf_del_object(pdf, obj);
+        return pdf_get_errval(pdf);
+    }
+
+    return obj->index;
+}
+
+static int utf8_to_utf32(const char *utf8, int len, uint32_t *utf32)
+{
+    uint32_t ch;
+    uint8_t mask;
+
+    if (len <= 0 || !utf8 || !utf32)
+        return -EINVAL;
+
+    ch = *(uint8_t *)utf8;
+    if ((ch & 0x80) == 0) {
+        len = 1;
+        mask = 0x7f;
+    } else if ((ch & 0xe0) == 0xc0 && len >= 2) {
+        len = 2;
+        mask = 0x1f;
+    } else if ((ch & 0xf0) == 0xe0 && len >= 3) {
+        len = 3;
+        mask = 0xf;
+    } else if ((ch & 0xf8) == 0xf0 && len >= 4) {
+        len = 4;
+        mask = 0x7;
+    } else
+        return -EINVAL;
+
+    ch = 0;
+    for (int i = 0; i < len; i++) {
+        int shift = (len - i - 1) * 6;
+        if (!*utf8)
+            return -EINVAL;
+        if (i == 0)
+            ch |= ((uint32_t)(*utf8++) & mask) << shift;
+        else
+            ch |= ((uint32_t)(*utf8++) & 0x3f) << shift;
+    }
+
+    *utf32 = ch;
+
+    return len;
+}
+
+static int utf8_to_pdfencoding(struct pdf_doc *pdf, const char *utf8, int len,
+                               uint8_t *res)
+{
+    uint32_t code;
+    int code_len;
+
+    *res = 0;
+
+    code_len = utf8_to_utf32(utf8, len, &code);
+    if (code_len < 0) {
+        return pdf_set_err(pdf, -EINVAL, "Invalid UTF-8 encoding");
+    }
+
+    if (code > 255) {
+        /* We support *some* minimal UTF-8 characters */
+        // See Appendix D of
+        // https://opensource.adobe.com/dc-acrobat-sdk-docs/pdfstandards/pdfreference1.7old.pdf
+        // These are all in WinAnsiEncoding
+        switch (code) {
+        case 0x152: // Latin Capital Ligature OE
+            *res = 0214;
+            break;
+        case 0x153: // Latin Small Ligature oe
+            *res = 0234;
+            break;
+        case 0x160: // Latin Capital Letter S with caron
+            *res = 0212;
+            break;
+        case 0x161: // Latin Small Letter S with caron
+            *res = 0232;
+            break;
+        case 0x178: // Latin Capital Letter y with diaeresis
+            *res = 0237;
+            break;
+        case 0x17d: // Latin Capital Letter Z with caron
+            *res = 0216;
+            break;
+        case 0x17e: // Latin Small Letter Z with caron
+            *res = 0236;
+            break;
+        case 0x192: // Latin Small Letter F with hook
+            *res = 0203;
+            break;
+        case 0x2c6: // Modifier Letter Circumflex Accent
+            *res = 0210;
+            break;
+        case 0x2dc: // Small Tilde
+            *res = 0230;
+            break;
+        case 0x2013: // Endash
+            *res = 0226;
+            break;
+        case 0x2014: // Emdash
+            *res = 0227;
+            break;
+        case 0x2018: // Left Single Quote
+            *res = 0221;
+            break;
+        case 0x2019: // Right Single Quote
+            *res = 0222;
+            break;
+        case 0x201a: // Single low-9 Quotation Mark
+            *res = 0202;
+            break;
+        case 0x201c: // Left Double Quote
+            *res = 0223;
+            break;
+        case 0x201d: // Right Double Quote
+            *res = 0224;
+            break;
+        case 0x201e: // Double low-9 Quotation Mark
+            *res = 0204;
+            break;
+        case 0x2020: // Dagger
+            *res = 0206;
+            break;
+        case 0x2021: // Double Dagger
+            *res = 0207;
+            break;
+        case 0x2022: // Bullet
+            *res = 0225;
+            break;
+        case 0x2026: // Horizontal Ellipsis
+            *res = 0205;
+            break;
+        case 0x2030: // Per Mille Sign
+            *res = 0211;
+            break;
+        case 0x2039: // Single Left-pointing Angle Quotation Mark
+            *res = 0213;
+            break;
+        case 0x203a: // Single Right-pointing Angle Quotation Mark
+            *res = 0233;
+            break;
+        case 0x20ac: // Euro
+            *res = 0200;
+            break;
+        case 0x2122: // Trade Mark Sign
+            *res = 0231;
+            break;
+        default:
+            return pdf_set_err(pdf, -EINVAL,
+                               "Unsupported UTF-8 character: 0x%x 0o%o %.*s",
+                               code, code, code_len, utf8);
+        }
+    } else {
+        *res = code;
+    }
+    return code_len;
+}
+
+/* Width used for each character of fonts we have no widths for, in the
+ * same units as the widths tables (ie: half an em) */
+#define PDF_UNKNOWN_CHAR_WIDTH 504
+
+/**
+ * Measure a line of text, given its total width from the widths tables.
+ * The box runs from the baseline to an em above it, plus a quarter of an
+ * em below for descenders, and is rotated along with the text.
+ */
+static int pdf_measure_text(struct pdf_doc *pdf, struct pdf_object **page,
+                            float size, float xoff, float yoff, float angle,
+                            uint32_t widths, int chars, float spacing)
+{
+    float width = widths * size / (14.0f * 72.0f) + spacing * chars;
+    float x[4] = {0, width, width, 0};
+    float y[4] = {-size / 4, -size / 4, size, size};
+
+    for (int i = 0; i < 4; i++) {
+        float cx = x[i], cy = y[i];
+        x[i] = xoff + cx * cosf(angle) - cy * sinf(angle);
+        y[i] = yoff + cx * sinf(angle) + cy * cosf(angle);
+    }
+    return pdf_measure_points(pdf, page, x, y, 4, 0);
+}
+
+/* Longest string kept in the text cache; longer ones rarely repeat */
+#define PDF_TEXT_CACHE_MAX_LEN 256
+
+/**
+ * Encode text without the cache. @width & @chars may be NULL, to skip
+ * adding up the width of the text when nothing is going to measure it.
+ */
+static int pdf_text_encode_chars(struct pdf_doc *pdf, struct dstr *str,
+                                 const char *text, size_t len,
+                                 const uint16_t *widths, uint32_t *width,
+                                 int *chars)
+{
+    uint32_t total = 0;
+    int count = 0;
+
+    for (size_t i = 0; i < len;) {
+        int code_len;
+        uint8_t pdf_char;
+        code_len = utf8_to_pdfencoding(pdf, &text[i], len - i, &pdf_char);
+        if (code_len < 0)
+            return code_len;
+        i += code_len;
+
+        if (strrchr("\n\r\t\b\f", pdf_char))
+            /* Skip over these characters */
+            continue;
+        count++;
+        if (width)
+            total += widths ? widths[pdf_char] : PDF_UNKNOWN_CHAR_WIDTH;
+        if (!str)
+            continue;
+
+        if (strchr("()\\", pdf_char)) {
+            char buf[3];
+            /* Escape some characters */
+            buf[0] = '\\';
+            buf[1] = pdf_char;
+            buf[2] = '\0';
+            dstr_append(str, buf);
+        } else {
+            dstr_append_data(str, &pdf_char, 1);
+        }
+    }
+    if (width)
+        *width = total;
+    if (chars)
+        *chars = count;
+    return 0;
+}
+
+/**
+ * Append len bytes of UTF-8 text to str as the body of a PDF string,
+ * measuring it as we go (str may be NULL to only measure it, and width &
+ * chars may be NULL to only encode it). Control characters are dropped.
+ * Short strings are looked up in the text cache first, if there is one.
+ * Each string hashes to a single slot, which holds the most recent string
+ * to land there twice in a row, so that strings which are only ever drawn
+ * once don't pay for being copied into the cache.
+ */
+static int pdf_text_encode(struct pdf_doc *pdf, struct dstr *str,
+                           const char *text, size_t len,
+                           const uint16_t *widths, uint32_t *width,
+                           int *chars)
+{
+    struct pdf_text_cache_entry *entry;
+    struct dstr encoded = INIT_DSTR;
+    uint64_t key;
+    size_t size, old_size;
+    uint32_t scratch_width;
+    int scratch_chars;
+    bool reserved;
+    char *data;
+    int ret;
+
+    if (!pdf->text_cache || len > PDF_TEXT_CACHE_MAX_LEN)
+        return pdf_text_encode_chars(pdf, str, text, len, widths, width,
+                                     chars);
+    /* Cached strings always carry their measurements */
+    if (!width)
+        width = &scratch_width;
+    if (!chars)
+        chars = &scratch_chars;
+
+    /* The encoding doesn't depend on the font, only the width does */
+    key = hash(hash(5381, &widths, sizeof(widths)), text, len);
+    entry = &pdf->text_cache[key & (uint64_t)(pdf->text_cache_size - 1)];
+    if (entry->data && entry->hash == key && entry->widths == widths &&
+        entry->text_len == len && memcmp(entry->data, text, len) == 0) {
+        pdf_counter_add(&pdf->text_cache_hits, 1);
+        *width = entry->width;
+        *chars = entry->chars;
+        if (str)
+            dstr_append_data(str, &entry->data[len], entry->encoded_len);
+        return 0;
+    }
+
+    pdf_counter_add(&pdf->text_cache_misses, 1);
+    if (entry->seen != key) {
+        entry->seen = key;
+        return pdf_text_encode_chars(pdf, str, text, len, widths, width,
+                                     chars);
+    }
+    ret = pdf_text_encode_chars(pdf, &encoded, text, len, widths, width,
+                                chars);
+    if (ret < 0) {
+        dstr_free(&encoded);
+        return ret;
+    }
+    if (str)
+        dstr_append_data(str, dstr_data(&encoded), dstr_len(&encoded));
+
+    /* Replace whatever was in the slot, unless that would go past the
+     * memory limit, in which case the string just isn't cached */
+    size = len + dstr_len(&encoded);
+    old_size = entry->text_len + entry->encoded_len;
+    pdf_charge(pdf, -(int64_t)old_size);
+    reserved = pdf_try_reserve(pdf, size);
+    data = reserved ? (char *)malloc(size) : NULL;
+    if (data) {
+        memcpy(data, text, len);
+        memcpy(&data[len], dstr_data(&encoded), dstr_len(&encoded));
+        free(entry->data);
+        entry->widths = widths;
+        entry->hash = key;
+        entry->width = *width;
+        entry->chars = *chars;
+        entry->text_len = len;
+        entry->encoded_len = dstr_len(&encoded);
+        entry->data = data;
+    } else {
+        /* The slot keeps its old string */
+        if (reserved)
+            pdf_charge(pdf, -(int64_t)size);
+        pdf_charge(pdf, (int64_t)old_size);
+    }
+    dstr_free(&encoded);
+    return 0;
+}
+
+/**
+ * Draw a line of text. Callers which have already laid the text out pass
+ * its width (in font width table units) & number of characters, so that
+ * it doesn't have to be measured again for the bounding box; otherwise
+ * width is NULL.
+ */
+static int pdf_add_text_measured(struct pdf_doc *pdf,
+                                 struct pdf_object *page, const char *text,
+                                 size_t len, float size, float xoff,
+                                 float yoff, uint32_t colour, float spacing,
+                                 float angle, const uint32_t *width,
+                                 int chars)
+{
+    int ret = 0;
+    struct dstr str = INIT_DSTR;
+    int alpha = (colour >> 24) >> 4;
+    const uint16_t *widths = pdf->current_font->font.widths;
+    bool measuring = pdf_measuring(pdf) && !width;
+    uint32_t text_width = width ? *width : 0;
+
+    /* Don't bother adding empty/null strings */
+    if (!len)
+        return 0;
+    if (!text)
+        return pdf_set_err(pdf, -EINVAL, "NULL text of length %zu", len);
+    PDF_TRACE_START(pdf, start);
+
+    if (!pdf->measure_only) {
+        dstr_append(&str, "BT ");
+        dstr_printf(&str, "/GS%d gs ", alpha);
+        if (angle != 0) {
+            dstr_printf(&str, "%f %f %f %f %f %f Tm ", cosf(angle),
+                        sinf(angle), -sinf(angle), cosf(angle), xoff, yoff);
+        } else {
+            dstr_printf(&str, "%f %f TD ", xoff, yoff);
+        }
+        dstr_printf(&str, "/F%d %f Tf ", pdf->current_font->font.index,
+                    size);
+        dstr_printf(&str, "%f %f %f rg ", PDF_RGB_R(colour),
+                    PDF_RGB_G(colour), PDF_RGB_B(colour));
+        dstr_printf(&str, "%f Tc ", spacing);
+        dstr_append(&str, "(");
+    }
+
+    /* The width is only needed for the bounding box, and text which has
+     * been laid out already has nothing left to encode it for when only
+     * measuring */
+    if (measuring || !pdf->measure_only)
+        ret = pdf_text_encode(pdf, pdf->measure_only ? NULL : &str, text,
+                              len, widths, measuring ? &text_width : NULL,
+                              measuring ? &chars : NULL);
+    if (ret < 0) {
+        dstr_free(&str);
+        return ret;
+    }
+
+    if (measuring || (width && pdf_measuring(pdf)))
+        ret = pdf_measure_text(pdf, &page, size, xoff, yoff, angle,
+                               text_width, chars, spacing);
+    if (ret == 0) {
+        dstr_append(&str, ") Tj ");
+        dstr_append(&str, "ET");
+        ret = pdf_add_stream(pdf, page, dstr_data(&str));
+    } else if (ret > 0) {
+        ret = 0;
+    }
+    PDF_TRACE_END(pdf, start, "text", "encode", dstr_len(&str));
+    dstr_free(&str);
+    return ret;
+}
+
+static int pdf_add_text_spacing(struct pdf_doc *pdf, struct pdf_object *page,
+                                const char *text, size_t len, float size,
+                                float xoff, float yoff, uint32_t colour,
+                                float spacing, float angle)
+{
+    return pdf_add_text_measured(pdf, page, text, len, size, xoff, yoff,
+                                 colour, spacing, angle, NULL, 0);
+}
+
+int pdf_add_text(struct pdf_doc *pdf, struct pdf_object *page,
+                 const char *text, float size, float xoff, float yoff,
+                 uint32_t colour)
+{
+    return pdf_add_text_spacing(pdf, page, text, text ? strlen(text) : 0,
+                                size, xoff, yoff, colour, 0, 0);
+}
+
+int pdf_add_text_n(struct pdf_doc *pdf, struct pdf_object *page,
+                   const char *text, size_t len, float size, float xoff,
+                   float yoff, uint32_t colour)
+{
+    return pdf_add_text_spacing(pdf, page, text, len, size, xoff, yoff,
+                                colour, 0, 0);
+}
+
+int pdf_add_text_rotate(struct pdf_doc *pdf, struct pdf_object *page,
+                        const char *text, float size, float xoff, float yoff,
+                        float angle, uint32_t colour)
+{
+    return pdf_add_text_spacing(pdf, page, text, text ? strlen(text) : 0,
+                                size, xoff, yoff, colour, 0, angle);
+}
+
+int pdf_add_text_rotate_n(struct pdf_doc *pdf, struct pdf_object *page,
+                          const char *text, size_t len, float size,
+                          float xoff, float yoff, float angle,
+                          uint32_t colour)
+{
+    return pdf_add_text_spacing(pdf, page, text, len, size, xoff, yoff,
+                                colour, 0, angle);
+}
+
+/* How wide is each character, in points, at size 14 */
+static const uint16_t helvetica_widths[256] = {
+    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
+    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
+    280, 280, 280, 280,  280, 280, 280, 280,  357,  560, 560,  896, 672,
+    192, 335, 335, 392,  588, 280, 335, 280,  280,  560, 560,  560, 560,
+    560, 560, 560, 560,  560, 560, 280, 280,  588,  588, 588,  560, 1023,
+    672, 672, 727, 727,  672, 615, 784, 727,  280,  504, 672,  560, 839,
+    727, 784, 672, 784,  727, 672, 615, 727,  672,  951, 672,  672, 615,
+    280, 280, 280, 472,  560, 335, 560, 560,  504,  560, 560,  280, 560,
+    560, 223, 223, 504,  223, 839, 560, 560,  560,  560, 335,  504, 280,
+    560, 504, 727, 504,  504, 504, 336, 262,  336,  588, 352,  560, 352,
+    223, 560, 335, 1008, 560, 560, 335, 1008, 672,  335, 1008, 352, 615,
+    352, 352, 223, 223,  335, 335, 352, 560,  1008, 335, 1008, 504, 335,
+    951, 352, 504, 672,  280, 335, 560, 560,  560,  560, 262,  560, 335,
+    742, 372, 560, 588,  335, 742, 335, 403,  588,  335, 335,  335, 560,
+    541, 280, 335, 335,  367, 560, 840, 840,  840,  615, 672,  672, 672,
+    672, 672, 672, 1008, 727, 672, 672, 672,  672,  280, 280,  280, 280,
+    727, 727, 784, 784,  784, 784, 784, 588,  784,  727, 727,  727, 727,
+    672, 672, 615, 560,  560, 560, 560, 560,  560,  896, 504,  560, 560,
+    560, 560, 280, 280,  280, 280, 560, 560,  560,  560, 560,  560, 560,
+    588, 615, 560, 560,  560, 560, 504, 560,  504,
+};
+
+static const uint16_t helvetica_bold_widths[256] = {
+    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
+    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
+    280,  280, 280,  280, 280, 335, 477, 560,  560, 896, 727, 239,  335, 335,
+    392,  588, 280,  335, 280, 280, 560, 560,  560, 560, 560, 560,  560, 560,
+    560,  560, 335,  335, 588, 588, 588, 615,  982, 727, 727, 727,  727, 672,
+    615,  784, 727,  280, 560, 727, 615, 839,  727, 784, 672, 784,  727, 672,
+    615,  727, 672,  951, 672, 672, 615, 335,  280, 335, 588, 560,  335, 560,
+    615,  560, 615,  560, 335, 615, 615, 280,  280, 560, 280, 896,  615, 615,
+    615,  615, 392,  560, 335, 615, 560, 784,  560, 560, 504, 392,  282, 392,
+    588,  352, 560,  352, 280, 560, 504, 1008, 560, 560, 335, 1008, 672, 335,
+    1008, 352, 615,  352, 352, 280, 280, 504,  504, 352, 560, 1008, 335, 1008,
+    560,  335, 951,  352, 504, 672, 280, 335,  560, 560, 560, 560,  282, 560,
+    335,  742, 372,  560, 588, 335, 742, 335,  403, 588, 335, 335,  335, 615,
+    560,  280, 335,  335, 367, 560, 840, 840,  840, 615, 727, 727,  727, 727,
+    727,  727, 1008, 727, 672, 672, 672, 672,  280, 280, 280, 280,  727, 727,
+    784,  784, 784,  784, 784, 588, 784, 727,  727, 727, 727, 672,  672, 615,
+    560,  560, 560,  560, 560, 560, 896, 560,  560, 560, 560, 560,  280, 280,
+    280,  280, 615,  615, 615, 615, 615, 615,  615, 588, 615, 615,  615, 615,
+    615,  560, 615,  560,
+};
+
+static const uint16_t helvetica_bold_oblique_widths[256] = {
+    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
+    280,  280, 280,  280, 280, 280, 280, 280,  280, 280, 280, 280,  280, 280,
+    280,  280, 280,  280, 280, 335, 477, 560,  560, 896, 727, 239,  335, 335,
+    392,  588, 280,  335, 280, 280, 560, 560,  560, 560, 560, 560,  560, 560,
+    560,  560, 335,  335, 588, 588, 588, 615,  982, 727, 727, 727,  727, 672,
+    615,  784, 727,  280, 560, 727, 615, 839,  727, 784, 672, 784,  727, 672,
+    615,  727, 672,  951, 672, 672, 615, 335,  280, 335, 588, 560,  335, 560,
+    615,  560, 615,  560, 335, 615, 615, 280,  280, 560, 280, 896,  615, 615,
+    615,  615, 392,  560, 335, 615, 560, 784,  560, 560, 504, 392,  282, 392,
+    588,  352, 560,  352, 280, 560, 504, 1008, 560, 560, 335, 1008, 672, 335,
+    1008, 352, 615,  352, 352, 280, 280, 504,  504, 352, 560, 1008, 335, 1008,
+    560,  335, 951,  352, 504, 672, 280, 335,  560, 560, 560, 560,  282, 560,
+    335,  742, 372,  560, 588, 335, 742, 335,  403, 588, 335, 335,  335, 615,
+    560,  280, 335,  335, 367, 560, 840, 840,  840, 615, 727, 727,  727, 727,
+    727,  727, 1008, 727, 672, 672, 672, 672,  280, 280, 280, 280,  727, 727,
+    784,  784, 784,  784, 784, 588, 784, 727,  727, 727, 727, 672,  672, 615,
+    560,  560, 560,  560, 560, 560, 896, 560,  560, 560, 560, 560,  280, 280,
+    280,  280, 615,  615, 615, 615, 615, 615,  615, 588, 615, 615,  615, 615,
+    615,  560, 615,  560,
+};
+
+static const uint16_t helvetica_oblique_widths[256] = {
+    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
+    280, 280, 280, 280,  280, 280, 280, 280,  280,  280, 280,  280, 280,
+    280, 280, 280, 280,  280, 280, 280, 280,  357,  560, 560,  896, 672,
+    192, 335, 335, 392,  588, 280, 335, 280,  280,  560, 560,  560, 560,
     560, 560, 560, 560,  560, 560, 280, 280,  588,  588, 588,  560, 1023,
     672, 672, 727, 727,  672, 615, 784, 727,  280,  504, 672,  560, 839,
     727, 784, 672, 784,  727, 672, 615, 727,  672,  951, 672,  672, 615,
@@ -1823,15 +4823,19 @@ static const uint16_t courier_widths[256] = {
     604,
 };
 
-static int pdf_text_point_width(struct pdf_doc *pdf, const char *text,
-                                ptrdiff_t text_len, float size,
-                                const uint16_t *widths, float *point_width)
-{
-    uint32_t len = 0;
-    if (text_len < 0)
-        text_len = strlen(text);
-    *point_width = 0.0f;
+/* Our widths arrays are for 14pt fonts */
+#define PDF_UNITS_TO_POINTS(units, size) ((units) * (size) / (14.0f * 72.0f))
 
+/**
+ * Add the widths of text_len bytes of text to units, stopping early once
+ * the total is at least max_width points wide (so that measuring a
+ * very long string against a line only looks at one line's worth of it).
+ */
+static int pdf_text_units(struct pdf_doc *pdf, const char *text,
+                          ptrdiff_t text_len, float size,
+                          const uint16_t *widths, float max_width,
+                          uint32_t *units)
+{
     for (int i = 0; i < (int)text_len;) {
         uint8_t pdf_char = 0;
         int code_len;
@@ -1839,16 +4843,35 @@ static int pdf_text_point_width(struct pdf_doc *pdf, const char *text,
             utf8_to_pdfencoding(pdf, &text[i], text_len - i, &pdf_char);
         if (code_len < 0)
             return pdf_set_err(pdf, code_len,
-                               "Invalid unicode string at position %d in %s",
-                               i, text);
+                               "Invalid unicode string at position %d in "
+                               "%.*s",
+                               i, (int)text_len, text);
         i += code_len;
 
-        if (pdf_char != '\n' && pdf_char != '\r')
-            len += widths[pdf_char];
+        if (pdf_char != '\n' && pdf_char != '\r') {
+            *units += widths[pdf_char];
+            if (PDF_UNITS_TO_POINTS(*units, size) >= max_width)
+                break;
+        }
     }
+    return 0;
+}
+
+static int pdf_text_point_width(struct pdf_doc *pdf, const char *text,
+                                ptrdiff_t text_len, float size,
+                                const uint16_t *widths, float *point_width)
+{
+    uint32_t units = 0;
+    int e;
+
+    if (text_len < 0)
+        text_len = strlen(text);
+    *point_width = 0.0f;
 
-    /* Our widths arrays are for 14pt fonts */
-    *point_width = len * size / (14.0f * 72.0f);
+    e = pdf_text_units(pdf, text, text_len, size, widths, FLT_MAX, &units);
+    if (e < 0)
+        return e;
+    *point_width = PDF_UNITS_TO_POINTS(units, size);
 
     return 0;
 }
@@ -1887,6 +4910,16 @@ static const uint16_t *find_font_widths(const char *font_name)
 int pdf_get_font_text_width(struct pdf_doc *pdf, const char *font_name,
                             const char *text, float size, float *text_width)
 {
+    return pdf_get_font_text_width_n(pdf, font_name, text, strlen(text),
+                                     size, text_width);
+}
+
+int pdf_get_font_text_width_n(struct pdf_doc *pdf, const char *font_name,
+                              const char *text, size_t len, float size,
+                              float *text_width)
+{
+    if (!text && len)
+        return pdf_set_err(pdf, -EINVAL, "NULL text of length %zu", len);
     if (!font_name)
         font_name = pdf->current_font->font.name;
     const uint16_t *widths = find_font_widths(font_name);
@@ -1895,24 +4928,24 @@ int pdf_get_font_text_width(struct pdf_doc *pdf, const char *font_name,
         return pdf_set_err(pdf, -EINVAL,
                            "Unable to determine width for font '%s'",
                            pdf->current_font->font.name);
-    return pdf_text_point_width(pdf, text, -1, size, widths, text_width);
+    return pdf_text_point_width(pdf, text, len, size, widths, text_width);
 }
 
-static const char *find_word_break(const char *string)
+static const char *find_word_break(const char *string, const char *end)
 {
     if (!string)
         return NULL;
     /* Skip over the actual word */
-    while (*string && !isspace(*string))
+    while (string < end && !isspace(*string))
         string++;
 
     return string;
 }
 
-int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
-                      const char *text, float size, float xoff, float yoff,
-                      float angle, uint32_t colour, float wrap_width,
-                      int align, float *height)
+static int pdf_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
+                         const char *text, size_t text_len, float size,
+                         float xoff, float yoff, float angle, uint32_t colour,
+                         float wrap_width, int align, float *height)
 {
     /* Move through the text string, stopping at word boundaries,
      * trying to find the longest text string we can fit in the given width
@@ -1920,7 +4953,9 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
     const char *start = text;
     const char *last_best = text;
     const char *end = text;
-    char line[512];
+    const char *word_end = text;
+    const char *text_end = text + text_len;
+    uint32_t units = 0; /* Width of the text from start to end */
     const uint16_t *widths;
     float orig_yoff = yoff;
 
@@ -1930,39 +4965,50 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
                            "Unable to determine width for font '%s'",
                            pdf->current_font->font.name);
 
-    while (start && *start) {
-        const char *new_end = find_word_break(end + 1);
+    while (start < text_end) {
+        const char *new_end;
         float line_width;
         int output = 0;
         float xoff_align = xoff;
         int e;
 
-        end = new_end;
+        /* The rest of a word which was chopped in two is still one word,
+         * so there is no need to look for its end again */
+        if (end + 1 >= word_end)
+            word_end = find_word_break(end + 1, text_end);
+        new_end = word_end;
 
-        e = pdf_text_point_width(pdf, start, end - start, size, widths,
-                                 &line_width);
+        /* Only the new word needs measuring, and only until the line is
+         * full */
+        e = pdf_text_units(pdf, end, new_end - end, size, widths,
+                           wrap_width, &units);
         if (e < 0)
             return e;
+        end = new_end;
+        line_width = PDF_UNITS_TO_POINTS(units, size);
 
         if (line_width >= wrap_width) {
             if (last_best == start) {
-                /* There is a single word that is too long for the line */
-                ptrdiff_t i;
-                /* Find the best character to chop it at */
-                for (i = end - start - 1; i > 0; i--) {
-                    float this_width;
-                    // Don't look at places that are in the middle of a utf-8
-                    // sequence
-                    if ((start[i - 1] & 0xc0) == 0xc0 ||
-                        ((start[i - 1] & 0xc0) == 0x80 &&
-                         (start[i] & 0xc0) == 0x80))
-                        continue;
-                    e = pdf_text_point_width(pdf, start, i, size, widths,
-                                             &this_width);
-                    if (e < 0)
-                        return e;
-                    if (this_width < wrap_width)
+                /* There is a single word that is too long for the line.
+                 * Chop it at the last character which still fits, not
+                 * looking at places that are in the middle of a utf-8
+                 * sequence */
+                ptrdiff_t i = 0;
+                uint32_t chop_units = 0;
+
+                while (i < end - start - 1) {
+                    uint8_t pdf_char;
+                    int code_len = utf8_to_pdfencoding(
+                        pdf, &start[i], end - start - i, &pdf_char);
+                    if (code_len < 0)
+                        return code_len;
+                    if (i + code_len > end - start - 1)
+                        break;
+                    if (pdf_char != '\n' && pdf_char != '\r')
+                        chop_units += widths[pdf_char];
+                    if (PDF_UNITS_TO_POINTS(chop_units, size) >= wrap_width)
                         break;
+                    i += code_len;
                 }
                 if (i == 0)
                     return pdf_set_err(pdf, -EINVAL,
@@ -1973,19 +5019,14 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
                 end = last_best;
             output = 1;
         }
-        if (*end == '\0')
+        if (end == text_end)
             output = 1;
-
-        if (*end == '\n' || *end == '\r')
+        else if (*end == '\n' || *end == '\r')
             output = 1;
 
         if (output) {
             int len = end - start;
             float char_spacing = 0;
-            if (len >= (int)sizeof(line))
-                len = (int)sizeof(line) - 1;
-            strncpy(line, start, len);
-            line[len] = '\0';
 
             e = pdf_text_point_width(pdf, start, len, size, widths,
                                      &line_width);
@@ -2000,8 +5041,8 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
                 xoff_align += (wrap_width - line_width) / 2;
                 break;
             case PDF_ALIGN_JUSTIFY:
-                if ((len - 1) > 0 && *end != '\r' && *end != '\n' &&
-                    *end != '\0')
+                if ((len - 1) > 0 && end != text_end && *end != '\r' &&
+                    *end != '\n')
                     char_spacing = (wrap_width - line_width) / (len - 2);
                 break;
             case PDF_ALIGN_JUSTIFY_ALL:
@@ -2011,14 +5052,15 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
             }
 
             if (align != PDF_ALIGN_NO_WRITE) {
-                pdf_add_text_spacing(pdf, page, line, size, xoff_align, yoff,
-                                     colour, char_spacing, angle);
+                pdf_add_text_spacing(pdf, page, start, len, size, xoff_align,
+                                     yoff, colour, char_spacing, angle);
             }
 
-            if (*end == ' ')
+            if (end != text_end && *end == ' ')
                 end++;
 
             start = last_best = end;
+            units = 0;
             yoff -= size;
         } else
             last_best = end;
@@ -2029,11 +5071,884 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
     return 0;
 }
 
+int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
+                      const char *text, float size, float xoff, float yoff,
+                      float angle, uint32_t colour, float wrap_width,
+                      int align, float *height)
+{
+    return pdf_add_text_wrap_n(pdf, page, text, text ? strlen(text) : 0,
+                               size, xoff, yoff, angle, colour, wrap_width,
+                               align, height);
+}
+
+int pdf_add_text_wrap_n(struct pdf_doc *pdf, struct pdf_object *page,
+                        const char *text, size_t len, float size, float xoff,
+                        float yoff, float angle, uint32_t colour,
+                        float wrap_width, int align, float *height)
+{
+    int ret;
+
+    if (!text && len)
+        return pdf_set_err(pdf, -EINVAL, "NULL text of length %zu", len);
+    PDF_TRACE_START(pdf, start);
+    ret = pdf_text_wrap(pdf, page, text, len, size, xoff, yoff, angle,
+                        colour, wrap_width, align, height);
+    PDF_TRACE_END(pdf, start, "text", "wrap", len);
+    return ret;
+}
+
+/**
+ * Flowing text
+ *
+ * Text is laid out a character at a time as it arrives: each line is built
+ * up in a buffer along with its width, remembering the last place it could
+ * be broken, so nothing is ever measured twice. Once a character no longer
+ * fits, the line is written out up to that break and the rest of it carries
+ * over to the next line.
+ */
+struct pdf_flow {
+    struct pdf_doc *pdf;
+    struct pdf_object *page; /* Page being filled, or the starting page */
+    struct pdf_flow_frame frame;
+    pdf_flow_page_fn on_page;
+    void *arg;
+    int page_count;    /* Pages laid out on so far */
+    float top;         /* Top of the next line on the current page */
+    bool full;         /* Ran out of pages, ignore any more text */
+    bool has_style;    /* A paragraph has been started */
+    bool first_line;   /* The next line starts a paragraph */
+    bool space;        /* The line so far ends in a space */
+    char font_name[64];
+    struct pdf_flow_style style; /* Of the current paragraph */
+    struct pdf_object *font;
+    struct dstr line;    /* UTF-8 text of the line being built */
+    size_t line_start;   /* Position of the line within all the text */
+    size_t offset;       /* Amount of text written so far */
+    uint32_t width;      /* Width of the line, in font width table units */
+    int chars;           /* Characters in the line */
+    size_t brk;          /* Length of the line before its last space */
+    uint32_t brk_width;  /* Width & characters before that space */
+    int brk_chars;       /* (ignored if brk is 0) */
+    size_t brk_offset;   /* Position of the text following that space */
+    char partial[4];     /* Incomplete UTF-8 character from the last write */
+    int partial_len;
+};
+
+struct pdf_flow *pdf_flow_create(struct pdf_doc *pdf, struct pdf_object *page,
+                                 const struct pdf_flow_frame *frame,
+                                 pdf_flow_page_fn on_page, void *arg)
+{
+    struct pdf_flow *flow;
+
+    if (!frame || frame->width <= 0 || frame->height <= 0 ||
+        frame->max_pages < 0) {
+        pdf_set_err(pdf, -EINVAL, "Invalid text flow frame");
+        return NULL;
+    }
+    if (page && page->type != OBJ_page) {
+        pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+        return NULL;
+    }
+    flow = (struct pdf_flow *)calloc(1, sizeof(*flow));
+    if (!flow) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate text flow");
+        return NULL;
+    }
+    flow->pdf = pdf;
+    flow->page = page;
+    flow->frame = *frame;
+    flow->on_page = on_page;
+    flow->arg = arg;
+    flow->line = INIT_DSTR;
+    flow->first_line = true;
+    return flow;
+}
+
+/* Move to the next page, returning 1 if there are no more */
+static int pdf_flow_next_page(struct pdf_flow *flow)
+{
+    struct pdf_doc *pdf = flow->pdf;
+    int e;
+
+    if (flow->frame.max_pages && flow->page_count >= flow->frame.max_pages) {
+        flow->full = true;
+        return 1;
+    }
+    if (flow->page_count > 0 || !flow->page) {
+        flow->page = pdf_append_page(pdf);
+        if (!flow->page)
+            return pdf_get_errval(pdf);
+    }
+    flow->page_count++;
+    flow->top = flow->frame.y + flow->frame.height;
+    if (flow->on_page) {
+        e = flow->on_page(flow->arg, pdf, flow->page, flow->page_count);
+        if (e < 0)
+            return e;
+    }
+    return 0;
+}
+
+/* Width available for the next line, in font width table units */
+static float pdf_flow_avail(const struct pdf_flow *flow)
+{
+    float width = flow->frame.width;
+
+    if (flow->first_line)
+        width -= flow->style.indent;
+    return width * (14.0f * 72.0f) / flow->style.size;
+}
+
+/**
+ * Write out the first len bytes of the line, which are width units wide.
+ * The last line of a paragraph is never justified.
+ * Returns 1 if there was no room for it.
+ */
+static int pdf_flow_emit(struct pdf_flow *flow, size_t len, uint32_t width,
+                         int chars, bool last)
+{
+    struct pdf_doc *pdf = flow->pdf;
+    const struct pdf_flow_style *style = &flow->style;
+    float leading = style->leading > 0 ? style->leading : style->size * 1.2f;
+    float avail = flow->frame.width;
+    float x = flow->frame.x;
+    float line_width = width * style->size / (14.0f * 72.0f);
+    float spacing = 0;
+    struct pdf_object *save_font;
+    int e;
+
+    /* Every page gets at least one line, however tall it is */
+    if (flow->page_count == 0 ||
+        (flow->top - leading < flow->frame.y &&
+         flow->top < flow->frame.y + flow->frame.height)) {
+        e = pdf_flow_next_page(flow);
+        if (e != 0)
+            return e;
+    }
+    if (flow->first_line) {
+        x += style->indent;
+        avail -= style->indent;
+    }
+    switch (style->align) {
+    case PDF_ALIGN_RIGHT:
+        x += avail - line_width;
+        break;
+    case PDF_ALIGN_CENTER:
+        x += (avail - line_width) / 2;
+        break;
+    case PDF_ALIGN_JUSTIFY:
+        if (!last && chars > 1)
+            spacing = (avail - line_width) / (chars - 1);
+        break;
+    }
+
+    save_font = pdf->current_font;
+    pdf->current_font = flow->font;
+    e = pdf_add_text_measured(pdf, flow->page, dstr_data(&flow->line), len,
+                              style->size, x, flow->top - style->size,
+                              style->colour, spacing, 0, &width, chars);
+    pdf->current_font = save_font;
+    if (e < 0)
+        return e;
+
+    flow->top -= leading;
+    flow->first_line = last;
+    if (last)
+        flow->top -= style->space_after;
+    return 0;
+}
+
+/* Remove the first len bytes of the line */
+static void pdf_flow_consume(struct pdf_flow *flow, size_t len)
+{
+    char *text = dstr_data(&flow->line);
+
+    memmove(text, text + len, flow->line.used_len - len + 1);
+    flow->line.used_len -= len;
+}
+
+/* Finish the current paragraph, if there is one */
+static int pdf_flow_paragraph(struct pdf_flow *flow)
+{
+    size_t len = dstr_len(&flow->line);
+    int e;
+
+    if (!flow->has_style)
+        return 0;
+    if (len == 0) {
+        /* Nothing left over, eg: the last line was exactly full */
+        if (!flow->first_line) {
+            flow->first_line = true;
+            flow->top -= flow->style.space_after;
+        }
+        return 0;
+    }
+    /* A trailing space doesn't count */
+    if (flow->space) {
+        len--;
+        flow->width = flow->brk_width;
+        flow->chars = flow->brk_chars;
+    }
+    e = pdf_flow_emit(flow, len, flow->width, flow->chars, true);
+    if (e != 0)
+        return e;
+    pdf_flow_consume(flow, dstr_len(&flow->line));
+    flow->width = flow->chars = 0;
+    flow->brk = 0;
+    flow->space = false;
+    flow->line_start = flow->offset;
+    return 0;
+}
+
+static bool pdf_flow_same_style(const struct pdf_flow *flow,
+                                const struct pdf_flow_style *style)
+{
+    const struct pdf_flow_style *cur = &flow->style;
+
+    return strcmp(flow->font_name, style->font ? style->font
+                                               : flow->pdf->current_font
+                                                     ->font.name) == 0 &&
+           cur->size == style->size && cur->leading == style->leading &&
+           cur->space_after == style->space_after &&
+           cur->indent == style->indent && cur->align == style->align &&
+           cur->colour == style->colour;
+}
+
+static int pdf_flow_set_style(struct pdf_flow *flow,
+                              const struct pdf_flow_style *style)
+{
+    struct pdf_doc *pdf = flow->pdf;
+    struct pdf_object *save_font = pdf->current_font;
+    int e;
+
+    if (style->size <= 0)
+        return pdf_set_err(pdf, -EINVAL, "Invalid font size %f", style->size);
+    if (style->font) {
+        e = pdf_set_font(pdf, style->font);
+        if (e < 0)
+            return e;
+    }
+    flow->font = pdf->current_font;
+    pdf->current_font = save_font;
+    snprintf(flow->font_name, sizeof(flow->font_name), "%s",
+             flow->font->font.name);
+    flow->style = *style;
+    flow->style.font = flow->font_name;
+    flow->has_style = true;
+    return 0;
+}
+
+/* Add a single character (of len bytes, encoded as ch) to the line */
+static int pdf_flow_char(struct pdf_flow *flow, const char *utf8, int len,
+                         uint8_t ch)
+{
+    const uint16_t *widths = flow->font->font.widths;
+    uint32_t width;
+    int e;
+
+    if (ch == '\r')
+        return 0;
+    if (ch == '\n') {
+        /* An empty paragraph still takes up a line */
+        if (dstr_len(&flow->line) == 0 && flow->first_line)
+            e = pdf_flow_emit(flow, 0, 0, 0, true);
+        else
+            e = pdf_flow_paragraph(flow);
+        if (e == 0)
+            flow->line_start = flow->offset + len;
+        return e;
+    }
+    if (ch == '\t')
+        ch = ' ';
+    width = widths ? widths[ch] : PDF_UNKNOWN_CHAR_WIDTH;
+
+    if (ch == ' ') {
+        if (dstr_len(&flow->line) == 0 || flow->space) {
+            if (dstr_len(&flow->line) == 0)
+                flow->line_start = flow->offset + len;
+            return 0;
+        }
+        flow->brk = dstr_len(&flow->line);
+        flow->brk_width = flow->width;
+        flow->brk_chars = flow->chars;
+        flow->brk_offset = flow->offset + len;
+        flow->space = true;
+        utf8 = " ";
+        len = 1;
+    } else if (dstr_len(&flow->line) > 0 &&
+               flow->width + width > pdf_flow_avail(flow)) {
+        if (flow->brk > 0) {
+            /* Break at the last space, carrying the rest over */
+            e = pdf_flow_emit(flow, flow->brk, flow->brk_width,
+                              flow->brk_chars, false);
+            if (e != 0)
+                return e;
+            pdf_flow_consume(flow, flow->brk + 1);
+            flow->width -= flow->brk_width +
+                           (widths ? widths[' '] : PDF_UNKNOWN_CHAR_WIDTH);
+            flow->chars -= flow->brk_chars + 1;
+            flow->line_start = flow->brk_offset;
+        } else {
+            /* A single word wider than the frame gets chopped up */
+            e = pdf_flow_emit(flow, dstr_len(&flow->line), flow->width,
+                              flow->chars, false);
+            if (e != 0)
+                return e;
+            pdf_flow_consume(flow, dstr_len(&flow->line));
+            flow->width = flow->chars = 0;
+            flow->line_start = flow->offset;
+        }
+        flow->brk = 0;
+        flow->space = false;
+    } else {
+        flow->space = false;
+    }
+
+    if (dstr_append_data(&flow->line, utf8, len) < 0)
+        return pdf_set_err(flow->pdf, -ENOMEM, "Unable to grow text flow");
+    flow->width += width;
+    flow->chars++;
+    return 0;
+}
+
+/* Number of bytes in the UTF-8 sequence starting with lead */
+static int utf8_sequence_len(uint8_t lead)
+{
+    if ((lead & 0xe0) == 0xc0)
+        return 2;
+    if ((lead & 0xf0) == 0xe0)
+        return 3;
+    if ((lead & 0xf8) == 0xf0)
+        return 4;
+    return 1;
+}
+
+int pdf_flow_write(struct pdf_flow *flow, const struct pdf_flow_style *style,
+                   const char *text, size_t len)
+{
+    struct pdf_doc *pdf;
+    size_t i = 0;
+    int e;
+
+    if (!flow || !style || (!text && len))
+        return -EINVAL;
+    if (flow->full)
+        return 1;
+    pdf = flow->pdf;
+    PDF_TRACE_START(pdf, start);
+
+    if (!flow->has_style || !pdf_flow_same_style(flow, style)) {
+        e = pdf_flow_paragraph(flow);
+        if (e == 0)
+            e = pdf_flow_set_style(flow, style);
+        if (e != 0)
+            goto out;
+    }
+
+    /* Finish off a character split across writes */
+    if (flow->partial_len) {
+        int need = utf8_sequence_len((uint8_t)flow->partial[0]);
+        uint8_t ch;
+
+        while (flow->partial_len < need && i < len)
+            flow->partial[flow->partial_len++] = text[i++];
+        if (flow->partial_len < need) {
+            e = 0;
+            goto out;
+        }
+        flow->partial_len = 0;
+        e = utf8_to_pdfencoding(pdf, flow->partial, need, &ch);
+        if (e >= 0)
+            e = pdf_flow_char(flow, flow->partial, need, ch);
+        if (e != 0)
+            goto out;
+        flow->offset += need;
+    }
+
+    for (e = 0; i < len && e == 0;) {
+        int need = utf8_sequence_len((uint8_t)text[i]);
+        uint8_t ch;
+
+        if (need > (int)(len - i)) {
+            /* Not counted in the offset until it is complete */
+            flow->partial_len = (int)(len - i);
+            memcpy(flow->partial, &text[i], len - i);
+            break;
+        }
+        e = utf8_to_pdfencoding(pdf, &text[i], need, &ch);
+        if (e >= 0)
+            e = pdf_flow_char(flow, &text[i], need, ch);
+        i += need;
+        flow->offset += need;
+    }
+
+out:
+    PDF_TRACE_END(pdf, start, "text", "flow", len);
+    if (e > 0)
+        flow->full = true;
+    return e;
+}
+
+int pdf_flow_end(struct pdf_flow *flow, size_t *overflow)
+{
+    int e = 0;
+
+    if (!flow)
+        return -EINVAL;
+    if (!flow->full && flow->partial_len)
+        e = pdf_set_err(flow->pdf, -EINVAL, "Incomplete UTF-8 character");
+    else if (!flow->full && dstr_len(&flow->line) > 0)
+        e = pdf_flow_paragraph(flow);
+    if (e > 0 || flow->full)
+        e = 1;
+    if (overflow)
+        *overflow = flow->full ? flow->line_start : flow->offset;
+    dstr_free(&flow->line);
+    free(flow);
+    return e;
+}
+
+/**
+ * Tables
+ *
+ * Tables are laid out in passes over their cells: the natural (unwrapped)
+ * width of every cell decides the column widths, wrapping the cells that
+ * don't fit then gives the row heights, and only then is anything drawn.
+ * All the text on a page goes into a single text object, followed by the
+ * grid as a single path, with each border shared between cells drawn
+ * just once.
+ */
+struct pdf_table {
+    struct pdf_doc *pdf;
+    const struct pdf_table_style *style;
+    const struct pdf_table_column *columns;
+    const char *const *cells;
+    int column_count;
+    struct pdf_object *fonts[2]; /* Body & header */
+    float *col_x;                /* Left edge of each column, then the right
+                                    edge of the table */
+    float *natural;              /* Unwrapped width of each cell */
+    int *lines;                  /* Unwrapped lines in each cell */
+    float *heights;              /* Of each row */
+    float leading;
+    struct pdf_object *page;
+    float band_top;      /* Top of the rows on this page */
+    float y;             /* Top of the next row */
+    struct pdf_object *current_font; /* In use in the text object */
+    struct dstr content; /* Operations for this page */
+    struct dstr grid;    /* Grid lines for this page */
+};
+
+/**
+ * Find the longest line at the start of text that fits within avail (in
+ * font width table units), breaking at the last space if possible, or
+ * else between characters. Lines also end at '\n'.
+ * Returns the length of the line, with its width (without any trailing
+ * space) in *width and the start of the next line in *next.
+ */
+static int pdf_text_line(struct pdf_doc *pdf, const uint16_t *widths,
+                         const char *text, float avail, uint32_t *width,
+                         const char **next)
+{
+    uint32_t line_width = 0, brk_width = 0;
+    int brk = 0, i = 0;
+
+    while (text[i] && text[i] != '\n') {
+        uint8_t ch;
+        uint32_t char_width;
+        int code_len = utf8_to_pdfencoding(pdf, &text[i], 4, &ch);
+
+        if (code_len < 0)
+            return code_len;
+        char_width = widths ? widths[ch] : PDF_UNKNOWN_CHAR_WIDTH;
+        if (ch == ' ') {
+            brk = i;
+            brk_width = line_width;
+        } else if (i > 0 && line_width + char_width > avail) {
+            if (brk > 0) {
+                *width = brk_width;
+                *next = &text[brk + 1];
+                return brk;
+            }
+            break;
+        }
+        if (ch != '\r')
+            line_width += char_width;
+        i += code_len;
+    }
+    *width = line_width;
+    *next = text[i] == '\n' ? &text[i + 1] : &text[i];
+    return i;
+}
+
+static struct pdf_object *pdf_table_font(const struct pdf_table *table,
+                                         int row)
+{
+    return table->fonts[row < table->style->header_rows ? 1 : 0];
+}
+
+/* Work out the column widths & row heights */
+static int pdf_table_measure(struct pdf_table *table,
+                             const struct pdf_flow_frame *frame,
+                             int row_count)
+{
+    struct pdf_doc *pdf = table->pdf;
+    const struct pdf_table_style *style = table->style;
+    int columns = table->column_count;
+    float scale = style->size / (14.0f * 72.0f);
+    float padding = 2 * style->padding;
+    float remaining = frame->width, auto_natural = 0;
+    float *col_width = &table->col_x[1];
+    int auto_count = 0;
+
+    for (int c = 0; c < columns; c++)
+        col_width[c] = 0;
+    for (int row = 0; row < row_count; row++) {
+        const uint16_t *widths = pdf_table_font(table, row)->font.widths;
+        for (int c = 0; c < columns; c++) {
+            int cell = row * columns + c;
+            const char *text = table->cells[cell];
+            uint32_t width, widest = 0;
+            int lines = 0;
+
+            while (text && *text) {
+                int e = pdf_text_line(pdf, widths, text, FLT_MAX, &width,
+                                      &text);
+                if (e < 0)
+                    return e;
+                if (width > widest)
+                    widest = width;
+                lines++;
+            }
+            table->natural[cell] = widest * scale + padding;
+            table->lines[cell] = lines;
+            col_width[c] = fmaxf(col_width[c], table->natural[cell]);
+        }
+    }
+
+    /* Columns without a width share out what is left, in proportion to
+     * the widest cell in each. If those don't all fit, the narrower
+     * columns get what they need first, so that only the widest wrap. */
+    for (int c = 0; c < columns; c++) {
+        if (table->columns[c].width > 0) {
+            remaining -= table->columns[c].width;
+            col_width[c] = table->columns[c].width;
+        } else {
+            auto_natural += col_width[c];
+            auto_count++;
+        }
+    }
+    if (auto_count && remaining <= 0)
+        return pdf_set_err(pdf, -EINVAL, "No room left for table columns");
+    if (auto_count && auto_natural > remaining) {
+        /* Columns narrower than an even share keep their width, which
+         * leaves more to share out between the others */
+        float share = remaining / auto_count, narrow, wide;
+
+        for (;;) {
+            int wide_count = 0;
+            float next;
+
+            narrow = wide = 0;
+            for (int c = 0; c < columns; c++) {
+                if (table->columns[c].width > 0)
+                    continue;
+                if (col_width[c] <= share) {
+                    narrow += col_width[c];
+                } else {
+                    wide += col_width[c];
+                    wide_count++;
+                }
+            }
+            if (wide_count == 0)
+                break;
+            next = (remaining - narrow) / wide_count;
+            if (next <= share)
+                break;
+            share = next;
+        }
+        for (int c = 0; c < columns; c++)
+            if (table->columns[c].width <= 0 && col_width[c] > share)
+                col_width[c] = (remaining - narrow) * col_width[c] / wide;
+    } else {
+        for (int c = 0; c < columns; c++) {
+            if (table->columns[c].width > 0)
+                continue;
+            if (auto_natural > 0)
+                col_width[c] = remaining * col_width[c] / auto_natural;
+            else
+                col_width[c] = remaining / auto_count;
+        }
+    }
+    table->col_x[0] = frame->x;
+    /* Turn the widths into positions */
+    for (int c = 0; c < columns; c++)
+        table->col_x[c + 1] += table->col_x[c];
+
+    for (int row = 0; row < row_count; row++) {
+        const uint16_t *widths = pdf_table_font(table, row)->font.widths;
+        int lines = 1;
+
+        for (int c = 0; c < columns; c++) {
+            int cell = row * columns + c;
+            float width = table->col_x[c + 1] - table->col_x[c];
+            const char *text = table->cells[cell];
+            int cell_lines = 0;
+
+            if (table->natural[cell] <= width) {
+                cell_lines = table->lines[cell];
+            } else {
+                float avail = (width - padding) / scale;
+                uint32_t line_width;
+                while (text && *text) {
+                    int e = pdf_text_line(pdf, widths, text, avail,
+                                          &line_width, &text);
+                    if (e < 0)
+                        return e;
+                    cell_lines++;
+                }
+            }
+            if (cell_lines > lines)
+                lines = cell_lines;
+        }
+        table->heights[row] = lines * table->leading + padding;
+    }
+    return 0;
+}
+
+/* Add a row to the current page, at the top of the space left */
+static int pdf_table_row(struct pdf_table *table, int row)
+{
+    struct pdf_doc *pdf = table->pdf;
+    const struct pdf_table_style *style = table->style;
+    struct pdf_object *font = pdf_table_font(table, row);
+    float scale = style->size / (14.0f * 72.0f);
+    float top = table->y;
+
+    table->y -= table->heights[row];
+    if (pdf->measure_only)
+        return 0;
+
+    if (style->border_width > 0)
+        dstr_printf(&table->grid, "%f %f m %f %f l ", table->col_x[0], top,
+                    table->col_x[table->column_count], top);
+    if (font != table->current_font) {
+        dstr_printf(&table->content, "/F%d %f Tf ", font->font.index,
+                    style->size);
+        table->current_font = font;
+    }
+    for (int c = 0; c < table->column_count; c++) {
+        const char *text = table->cells[row * table->column_count + c];
+        float left = table->col_x[c] + style->padding;
+        float avail = table->col_x[c + 1] - style->padding - left;
+        float baseline = top - style->padding - style->size;
+
+        while (text && *text) {
+            const char *line = text;
+            uint32_t width;
+            float x = left;
+            int len = pdf_text_line(pdf, font->font.widths, text,
+                                    avail / scale, &width, &text);
+            if (len < 0)
+                return len;
+            if (table->columns[c].align == PDF_ALIGN_RIGHT)
+                x += avail - width * scale;
+            else if (table->columns[c].align == PDF_ALIGN_CENTER)
+                x += (avail - width * scale) / 2;
+            if (len > 0) {
+                dstr_printf(&table->content, "1 0 0 1 %f %f Tm (", x,
+                            baseline);
+                len = pdf_text_encode(pdf, &table->content, line, len,
+                                      font->font.widths, NULL, NULL);
+                if (len < 0)
+                    return len;
+                dstr_append(&table->content, ") Tj ");
+            }
+            baseline -= table->leading;
+        }
+    }
+    return 0;
+}
+
+/* Start the operations for a new page of the table */
+static void pdf_table_start_page(struct pdf_table *table,
+                                 struct pdf_object *page, float top)
+{
+    const struct pdf_table_style *style = table->style;
+
+    table->page = page;
+    table->band_top = table->y = top;
+    table->current_font = NULL;
+    if (table->pdf->measure_only)
+        return;
+    dstr_printf(&table->content, "BT /GS%d gs %f %f %f rg ",
+                (style->colour >> 24) >> 4, PDF_RGB_R(style->colour),
+                PDF_RGB_G(style->colour), PDF_RGB_B(style->colour));
+    if (style->border_width > 0)
+        dstr_printf(&table->grid, "%f w %f %f %f RG ", style->border_width,
+                    PDF_RGB_R(style->border_colour),
+                    PDF_RGB_G(style->border_colour),
+                    PDF_RGB_B(style->border_colour));
+}
+
+/* Write out the rows on the current page */
+static int pdf_table_end_page(struct pdf_table *table)
+{
+    const struct pdf_table_style *style = table->style;
+    struct dstr *content = &table->content;
+    int e;
+
+    if (table->y == table->band_top) {
+        dstr_free(content);
+        dstr_free(&table->grid);
+        return 0;
+    }
+    e = pdf_measure(table->pdf, &table->page, table->col_x[0], table->y,
+                    table->col_x[table->column_count], table->band_top,
+                    style->border_width > 0 ? style->border_width / 2 : 0);
+    if (e != 0)
+        return e < 0 ? e : 0;
+
+    dstr_append(content, "ET");
+    if (style->border_width > 0) {
+        /* The bottom of the last row, and the columns all the way down */
+        dstr_printf(&table->grid, "%f %f m %f %f l ", table->col_x[0],
+                    table->y, table->col_x[table->column_count], table->y);
+        for (int c = 0; c <= table->column_count; c++)
+            dstr_printf(&table->grid, "%f %f m %f %f l ", table->col_x[c],
+                        table->band_top, table->col_x[c], table->y);
+        dstr_append(&table->grid, "S");
+        dstr_append(content, "\r\n");
+        dstr_append_data(content, dstr_data(&table->grid),
+                         dstr_len(&table->grid));
+    }
+    e = pdf_add_stream(table->pdf, table->page, dstr_data(content));
+    dstr_free(content);
+    dstr_free(&table->grid);
+    return e;
+}
+
+int pdf_add_table(struct pdf_doc *pdf, struct pdf_object *page,
+                  const struct pdf_flow_frame *frame, float top,
+                  const struct pdf_table_column *columns, int column_count,
+                  const char *const *cells, int row_count,
+                  const struct pdf_table_style *style, float *bottom)
+{
+    struct pdf_object *save_font;
+    struct pdf_table table;
+    float frame_top, header_height = 0;
+    int page_count = 1, placed = 0, row = 0, e = 0;
+    size_t cell_count;
+
+    if (!pdf)
+        return -EINVAL;
+    save_font = pdf->current_font;
+    if (!frame || frame->width <= 0 || frame->height <= 0 ||
+        frame->max_pages < 0 || !columns || column_count <= 0 ||
+        row_count < 0 || (!cells && row_count) || !style ||
+        style->size <= 0 || style->padding < 0 || style->header_rows < 0 ||
+        style->header_rows > row_count)
+        return pdf_set_err(pdf, -EINVAL, "Invalid table");
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+    if (!page || page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+
+    memset(&table, 0, sizeof(table));
+    table.pdf = pdf;
+    table.style = style;
+    table.columns = columns;
+    table.cells = cells;
+    table.column_count = column_count;
+    table.leading = style->size * 1.2f;
+    table.content = INIT_DSTR;
+    table.grid = INIT_DSTR;
+    if (style->font)
+        e = pdf_set_font(pdf, style->font);
+    table.fonts[0] = pdf->current_font;
+    if (e == 0 && style->header_font)
+        e = pdf_set_font(pdf, style->header_font);
+    table.fonts[1] = pdf->current_font;
+    pdf->current_font = save_font;
+    if (e < 0)
+        return e;
+
+    PDF_TRACE_START(pdf, start);
+    cell_count = (size_t)row_count * column_count;
+    table.col_x = (float *)calloc(column_count + 1, sizeof(float));
+    table.natural = (float *)malloc((cell_count + 1) * sizeof(float));
+    table.lines = (int *)malloc((cell_count + 1) * sizeof(int));
+    table.heights = (float *)malloc((row_count + 1) * sizeof(float));
+    if (!table.col_x || !table.natural || !table.lines || !table.heights) {
+        e = pdf_set_err(pdf, -ENOMEM, "Unable to allocate table layout");
+        goto out;
+    }
+    e = pdf_table_measure(&table, frame, row_count);
+    if (e < 0)
+        goto out;
+
+    frame_top = frame->y + frame->height;
+    for (int h = 0; h < style->header_rows; h++)
+        header_height += table.heights[h];
+    pdf_table_start_page(&table, page, top);
+    for (row = 0; row < row_count; row++) {
+        /* A row is never split, but if it is too tall for any page it
+         * gets one to itself, without the header rows if they wouldn't
+         * fit above it */
+        if (table.y - table.heights[row] < frame->y &&
+            (placed > 0 || top < frame_top)) {
+            e = pdf_table_end_page(&table);
+            if (e < 0)
+                goto out;
+            if (frame->max_pages && page_count >= frame->max_pages)
+                break;
+            page = pdf_append_page(pdf);
+            if (!page) {
+                e = pdf_get_errval(pdf);
+                goto out;
+            }
+            page_count++;
+            placed = 0;
+            top = frame_top;
+            pdf_table_start_page(&table, page, top);
+            if (row >= style->header_rows &&
+                top - header_height - table.heights[row] >= frame->y)
+                for (int h = 0; h < style->header_rows && e == 0; h++)
+                    e = pdf_table_row(&table, h);
+            if (e < 0)
+                goto out;
+        }
+        e = pdf_table_row(&table, row);
+        if (e < 0)
+            goto out;
+        placed++;
+    }
+    if (row == row_count)
+        e = pdf_table_end_page(&table);
+    if (bottom)
+        *bottom = table.y;
+
+out:
+    PDF_TRACE_END(pdf, start, "table", "layout", cell_count);
+    dstr_free(&table.content);
+    dstr_free(&table.grid);
+    free(table.col_x);
+    free(table.natural);
+    free(table.lines);
+    free(table.heights);
+    return e < 0 ? e : row;
+}
+
 int pdf_add_line(struct pdf_doc *pdf, struct pdf_object *page, float x1,
                  float y1, float x2, float y2, float width, uint32_t colour)
 {
     int ret;
     struct dstr str = INIT_DSTR;
+    float xs[2] = {x1, x2}, ys[2] = {y1, y2};
+
+    ret = pdf_measure_points(pdf, &page, xs, ys, 2, width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
 
     dstr_printf(&str, "%f w\r\n", width);
     dstr_printf(&str, "%f %f m\r\n", x1, y1);
@@ -2055,6 +5970,12 @@ int pdf_add_cubic_bezier(struct pdf_doc *pdf, struct pdf_object *page,
 {
     int ret;
     struct dstr str = INIT_DSTR;
+    /* The curve always lies within its control points */
+    float xs[4] = {x1, x2, xq1, xq2}, ys[4] = {y1, y2, yq1, yq2};
+
+    ret = pdf_measure_points(pdf, &page, xs, ys, 4, width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
 
     dstr_printf(&str, "%f w\r\n", width);
     dstr_printf(&str, "%f %f m\r\n", x1, y1);
@@ -2083,18 +6004,50 @@ int pdf_add_quadratic_bezier(struct pdf_doc *pdf, struct pdf_object *page,
                                 width, colour);
 }
 
-int pdf_add_custom_path(struct pdf_doc *pdf, struct pdf_object *page,
+/* Add a path, filled with fill_pattern if given, or else fill_colour */
+static int pdf_add_path(struct pdf_doc *pdf, struct pdf_object *page,
                         const struct pdf_path_operation *operations,
                         int operation_count, float stroke_width,
-                        uint32_t stroke_colour, uint32_t fill_colour)
+                        uint32_t stroke_colour, uint32_t fill_colour,
+                        struct pdf_object *fill_pattern)
 {
+    bool fill = fill_pattern || !PDF_IS_TRANSPARENT(fill_colour);
     int ret;
     struct dstr str = INIT_DSTR;
+    float bbox[4] = {FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    /* Curves always lie within their control points */
+    for (int i = 0; i < operation_count; i++) {
+        const struct pdf_path_operation *operation = &operations[i];
+        switch (operation->op) {
+        case 'c':
+            pdf_bbox_extend(bbox, operation->x3, operation->y3);
+            /* fall through */
+        case 'v':
+        case 'y':
+            pdf_bbox_extend(bbox, operation->x2, operation->y2);
+            /* fall through */
+        case 'm':
+        case 'l':
+            pdf_bbox_extend(bbox, operation->x1, operation->y1);
+            break;
+        case 'h':
+            break;
+        default:
+            return pdf_set_err(pdf, -EINVAL, "Invalid operation");
+        }
+    }
+    ret = pdf_measure_bbox(pdf, &page, bbox, stroke_width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
 
-    if (!PDF_IS_TRANSPARENT(fill_colour)) {
+    if (fill) {
         dstr_printf(&str, "/DeviceRGB CS\r\n");
-        dstr_printf(&str, "%f %f %f rg\r\n", PDF_RGB_R(fill_colour),
-                    PDF_RGB_G(fill_colour), PDF_RGB_B(fill_colour));
+        ret = pdf_set_fill(pdf, page, &str, fill_colour, fill_pattern);
+        if (ret < 0) {
+            dstr_free(&str);
+            return ret;
+        }
     }
     dstr_printf(&str, "%f w\r\n", stroke_width);
     dstr_printf(&str, "/DeviceRGB CS\r\n");
@@ -2132,31 +6085,64 @@ int pdf_add_custom_path(struct pdf_doc *pdf, struct pdf_object *page,
         }
     }
 
-    if (PDF_IS_TRANSPARENT(fill_colour))
-        dstr_printf(&str, "%s", "S ");
-    else
+    if (fill)
         dstr_printf(&str, "%s", "B ");
+    else
+        dstr_printf(&str, "%s", "S ");
     ret = pdf_add_stream(pdf, page, dstr_data(&str));
     dstr_free(&str);
 
     return ret;
 }
 
-int pdf_add_ellipse(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                    float y, float xradius, float yradius, float width,
-                    uint32_t colour, uint32_t fill_colour)
+int pdf_add_custom_path(struct pdf_doc *pdf, struct pdf_object *page,
+                        const struct pdf_path_operation *operations,
+                        int operation_count, float stroke_width,
+                        uint32_t stroke_colour, uint32_t fill_colour)
+{
+    return pdf_add_path(pdf, page, operations, operation_count, stroke_width,
+                        stroke_colour, fill_colour, NULL);
+}
+
+int pdf_add_custom_path_pattern(struct pdf_doc *pdf, struct pdf_object *page,
+                                const struct pdf_path_operation *operations,
+                                int operation_count, float stroke_width,
+                                uint32_t stroke_colour,
+                                struct pdf_object *fill_pattern)
+{
+    if (!fill_pattern)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pattern");
+    return pdf_add_path(pdf, page, operations, operation_count, stroke_width,
+                        stroke_colour, PDF_TRANSPARENT, fill_pattern);
+}
+
+/* Add an ellipse, filled with fill_pattern if given, or else fill_colour */
+static int pdf_add_ellipse_fill(struct pdf_doc *pdf, struct pdf_object *page,
+                                float x, float y, float xradius,
+                                float yradius, float width, uint32_t colour,
+                                uint32_t fill_colour,
+                                struct pdf_object *fill_pattern)
 {
+    bool fill = fill_pattern || !PDF_IS_TRANSPARENT(fill_colour);
     int ret;
     struct dstr str = INIT_DSTR;
     float lx, ly;
 
+    ret = pdf_measure(pdf, &page, x - xradius, y - yradius, x + xradius,
+                      y + yradius, width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+
     lx = (4.0f / 3.0f) * (float)(M_SQRT2 - 1) * xradius;
     ly = (4.0f / 3.0f) * (float)(M_SQRT2 - 1) * yradius;
 
-    if (!PDF_IS_TRANSPARENT(fill_colour)) {
+    if (fill) {
         dstr_printf(&str, "/DeviceRGB CS\r\n");
-        dstr_printf(&str, "%f %f %f rg\r\n", PDF_RGB_R(fill_colour),
-                    PDF_RGB_G(fill_colour), PDF_RGB_B(fill_colour));
+        ret = pdf_set_fill(pdf, page, &str, fill_colour, fill_pattern);
+        if (ret < 0) {
+            dstr_free(&str);
+            return ret;
+        }
     }
 
     /* stroke color */
@@ -2180,10 +6166,10 @@ int pdf_add_ellipse(struct pdf_doc *pdf, struct pdf_object *page, float x,
     dstr_printf(&str, "%.2f %.2f %.2f %.2f %.2f %.2f c ", (x + lx),
                 (y + yradius), (x + xradius), (y + ly), (x + xradius), y);
 
-    if (PDF_IS_TRANSPARENT(fill_colour))
-        dstr_printf(&str, "%s", "S ");
-    else
+    if (fill)
         dstr_printf(&str, "%s", "B ");
+    else
+        dstr_printf(&str, "%s", "S ");
 
     ret = pdf_add_stream(pdf, page, dstr_data(&str));
     dstr_free(&str);
@@ -2191,6 +6177,25 @@ int pdf_add_ellipse(struct pdf_doc *pdf, struct pdf_object *page, float x,
     return ret;
 }
 
+int pdf_add_ellipse(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                    float y, float xradius, float yradius, float width,
+                    uint32_t colour, uint32_t fill_colour)
+{
+    return pdf_add_ellipse_fill(pdf, page, x, y, xradius, yradius, width,
+                                colour, fill_colour, NULL);
+}
+
+int pdf_add_ellipse_pattern(struct pdf_doc *pdf, struct pdf_object *page,
+                            float x, float y, float xradius, float yradius,
+                            float width, uint32_t colour,
+                            struct pdf_object *fill_pattern)
+{
+    if (!fill_pattern)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pattern");
+    return pdf_add_ellipse_fill(pdf, page, x, y, xradius, yradius, width,
+                                colour, PDF_TRANSPARENT, fill_pattern);
+}
+
 int pdf_add_circle(struct pdf_doc *pdf, struct pdf_object *page, float xr,
                    float yr, float radius, float width, uint32_t colour,
                    uint32_t fill_colour)
@@ -2206,6 +6211,11 @@ int pdf_add_rectangle(struct pdf_doc *pdf, struct pdf_object *page, float x,
     int ret;
     struct dstr str = INIT_DSTR;
 
+    ret = pdf_measure(pdf, &page, x, y, x + width, y + height,
+                      border_width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+
     dstr_printf(&str, "%f %f %f RG ", PDF_RGB_R(colour), PDF_RGB_G(colour),
                 PDF_RGB_B(colour));
     dstr_printf(&str, "%f w ", border_width);
@@ -2217,16 +6227,27 @@ int pdf_add_rectangle(struct pdf_doc *pdf, struct pdf_object *page, float x,
     return ret;
 }
 
-int pdf_add_filled_rectangle(struct pdf_doc *pdf, struct pdf_object *page,
-                             float x, float y, float width, float height,
-                             float border_width, uint32_t colour_fill,
-                             uint32_t colour_border)
+/* Add a rectangle, filled with pattern if given, or else colour_fill */
+static int pdf_add_rectangle_fill(struct pdf_doc *pdf,
+                                  struct pdf_object *page, float x, float y,
+                                  float width, float height,
+                                  float border_width, uint32_t colour_fill,
+                                  struct pdf_object *pattern,
+                                  uint32_t colour_border)
 {
     int ret;
     struct dstr str = INIT_DSTR;
 
-    dstr_printf(&str, "%f %f %f rg ", PDF_RGB_R(colour_fill),
-                PDF_RGB_G(colour_fill), PDF_RGB_B(colour_fill));
+    ret = pdf_measure(pdf, &page, x, y, x + width, y + height,
+                      border_width > 0 ? border_width / 2 : 0);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+
+    ret = pdf_set_fill(pdf, page, &str, colour_fill, pattern);
+    if (ret < 0) {
+        dstr_free(&str);
+        return ret;
+    }
     if (border_width > 0) {
         dstr_printf(&str, "%f %f %f RG ", PDF_RGB_R(colour_border),
                     PDF_RGB_G(colour_border), PDF_RGB_B(colour_border));
@@ -2242,12 +6263,39 @@ int pdf_add_filled_rectangle(struct pdf_doc *pdf, struct pdf_object *page,
     return ret;
 }
 
+int pdf_add_filled_rectangle(struct pdf_doc *pdf, struct pdf_object *page,
+                             float x, float y, float width, float height,
+                             float border_width, uint32_t colour_fill,
+                             uint32_t colour_border)
+{
+    return pdf_add_rectangle_fill(pdf, page, x, y, width, height,
+                                  border_width, colour_fill, NULL,
+                                  colour_border);
+}
+
+int pdf_add_filled_rectangle_pattern(struct pdf_doc *pdf,
+                                     struct pdf_object *page, float x,
+                                     float y, float width, float height,
+                                     float border_width,
+                                     struct pdf_object *pattern,
+                                     uint32_t colour_border)
+{
+    if (!pattern)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pattern");
+    return pdf_add_rectangle_fill(pdf, page, x, y, width, height,
+                                  border_width, 0, pattern, colour_border);
+}
+
 int pdf_add_polygon(struct pdf_doc *pdf, struct pdf_object *page, float x[],
                     float y[], int count, float border_width, uint32_t colour)
 {
     int ret;
     struct dstr str = INIT_DSTR;
 
+    ret = pdf_measure_points(pdf, &page, x, y, count, border_width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+
     dstr_printf(&str, "%f %f %f RG ", PDF_RGB_R(colour), PDF_RGB_G(colour),
                 PDF_RGB_B(colour));
     dstr_printf(&str, "%f w ", border_width);
@@ -2270,6 +6318,10 @@ int pdf_add_filled_polygon(struct pdf_doc *pdf, struct pdf_object *page,
     int ret;
     struct dstr str = INIT_DSTR;
 
+    ret = pdf_measure_points(pdf, &page, x, y, count, border_width / 2);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+
     dstr_printf(&str, "%f %f %f RG ", PDF_RGB_R(colour), PDF_RGB_G(colour),
                 PDF_RGB_B(colour));
     dstr_printf(&str, "%f %f %f rg ", PDF_RGB_R(colour), PDF_RGB_G(colour),
@@ -2350,18 +6402,19 @@ static float pdf_barcode_128a_ch(struct pdf_doc *pdf, struct pdf_object *page,
 
 static int pdf_add_barcode_128a(struct pdf_doc *pdf, struct pdf_object *page,
                                 float x, float y, float width, float height,
-                                const char *string, uint32_t colour)
+                                const char *string, size_t len,
+                                uint32_t colour)
 {
     const char *s;
-    size_t len = strlen(string) + 3;
-    float char_width = width / len;
+    const char *end = string + len;
+    float char_width = width / (len + 3);
     int checksum, i;
 
     if (char_width / 11.0f <= 0)
         return pdf_set_err(pdf, -EINVAL,
                            "Insufficient width to draw barcode");
 
-    for (s = string; *s; s++)
+    for (s = string; s < end; s++)
         if (find_128_encoding(*s) < 0)
             return pdf_set_err(pdf, -EINVAL, "Invalid barcode character 0x%x",
                                *s);
@@ -2370,7 +6423,7 @@ static int pdf_add_barcode_128a(struct pdf_doc *pdf, struct pdf_object *page,
                             6);
     checksum = 104;
 
-    for (i = 1, s = string; *s; s++, i++) {
+    for (i = 1, s = string; s < end; s++, i++) {
         int index = find_128_encoding(*s);
         // This should be impossible, due to the checks above, but confirm
         // here anyway to stop coverity complaining
@@ -2440,13 +6493,13 @@ static int pdf_barcode_39_ch(struct pdf_doc *pdf, struct pdf_object *page,
         if (pattern == 0) { // wide
             if (pdf_add_filled_rectangle(pdf, page, x, y, ww - 1, height, 0,
                                          colour, PDF_TRANSPARENT) < 0)
-                return pdf->errval;
+                return pdf_get_errval(pdf);
             x += ww;
         }
         if (pattern == 1) { // narrow
             if (pdf_add_filled_rectangle(pdf, page, x, y, nw - 1, height, 0,
                                          colour, PDF_TRANSPARENT) < 0)
-                return pdf->errval;
+                return pdf_get_errval(pdf);
             x += nw;
         }
         if (pattern == 2) { // space
@@ -2458,246 +6511,598 @@ static int pdf_barcode_39_ch(struct pdf_doc *pdf, struct pdf_object *page,
     return 0;
 }
 
-static int pdf_add_barcode_39(struct pdf_doc *pdf, struct pdf_object *page,
-                              float x, float y, float width, float height,
-                              const char *string, uint32_t colour)
+static int pdf_add_barcode_39(struct pdf_doc *pdf, struct pdf_object *page,
+                              float x, float y, float width, float height,
+                              const char *string, size_t len, uint32_t colour)
+{
+    float char_width = width / (len + 2);
+    int e;
+
+    e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour, '*',
+                          &x);
+    if (e < 0)
+        return e;
+
+    for (size_t i = 0; i < len; i++) {
+        e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour,
+                              string[i], &x);
+        if (e < 0)
+            return e;
+    }
+
+    e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour, '*',
+                          NULL);
+    if (e < 0)
+        return e;
+
+    return 0;
+}
+
+/* EAN/UPC character encoding. Each 4-bit value indicates width in x units.
+ * Elements are SBSB (Space, Bar, Space, Bar) for LHS digits
+ * Elements are inverted for RHS digits
+ */
+static const int code_eanupc_encoding[] = {
+    0x3211, // 0
+    0x2221, // 1
+    0x2122, // 2
+    0x1411, // 3
+    0x1132, // 4
+    0x1231, // 5
+    0x1114, // 6
+    0x1312, // 7
+    0x1213, // 8
+    0x3112, // 9
+};
+
+/**
+ * List of different barcode guard patterns that are supported
+ */
+enum {
+    GUARD_NORMAL,  //!< Produce normal guard pattern
+    GUARD_CENTRE,  //!< Produce centre guard pattern
+    GUARD_SPECIAL, //!< Produce special guard pattern
+    GUARD_ADDON,
+    GUARD_ADDON_DELIN,
+};
+
+static const int code_eanupc_aux_encoding[] = {
+    0x150, // Normal guard
+    0x554, // Centre guard
+    0x555, // Special guard
+    0x160, // Add-on guard
+    0x500, // Add-on delineator
+};
+
+static const int set_ean13_encoding[] = {
+    0x00, // 0
+    0x34, // 1
+    0x2c, // 2
+    0x1c, // 3
+    0x32, // 4
+    0x26, // 5
+    0x0e, // 6
+    0x2a, // 7
+    0x1a, // 8
+    0x16, // 9
+};
+
+static const int set_upce_encoding[] = {
+    0x07, // 0
+    0x0b, // 1
+    0x13, // 2
+    0x23, // 3
+    0x0d, // 4
+    0x19, // 5
+    0x31, // 6
+    0x15, // 7
+    0x25, // 8
+    0x29, // 9
+};
+
+#define EANUPC_X PDF_MM_TO_POINT(0.330f)
+
+static const struct {
+    unsigned modules;
+    float height_bar;
+    float height_outer;
+    unsigned quiet_left;
+    unsigned quiet_right;
+} eanupc_dimensions[] = {
+    {113, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 11, 7}, // EAN-13
+    {113, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 9, 9},  // UPC-A
+    {81, PDF_MM_TO_POINT(18.23), PDF_MM_TO_POINT(21.31), 7, 7},   // EAN-8
+    {67, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 9, 7},   // UPC-E
+};
+
+static void pdf_barcode_eanupc_calc_dims(int type, float width, float height,
+                                         float *x_off, float *y_off,
+                                         float *new_width, float *new_height,
+                                         float *x, float *bar_height,
+                                         float *bar_ext, float *font_size)
+{
+    float aspectBarcode, aspectRect, scale;
+
+    aspectRect = width / height;
+    aspectBarcode = eanupc_dimensions[type - PDF_BARCODE_EAN13].modules *
+                    EANUPC_X /
+                    eanupc_dimensions[type - PDF_BARCODE_EAN13].height_outer;
+    if (aspectRect > aspectBarcode) {
+        *new_height = height;
+        *new_width = height * aspectBarcode;
+    } else if (aspectRect < aspectBarcode) {
+        *new_width = width;
+        *new_height = width / aspectBarcode;
+    } else {
+        *new_width = width;
+        *new_height = height;
+    }
+    scale = *new_height /
+            eanupc_dimensions[type - PDF_BARCODE_EAN13].height_outer;
+
+    *x = *new_width / eanupc_dimensions[type - PDF_BARCODE_EAN13].modules;
+    *bar_ext = *x * 5;
+    *bar_height =
+        eanupc_dimensions[type - PDF_BARCODE_EAN13].height_bar * scale;
+    *font_size = 8.0f * scale;
+    *x_off = (width - *new_width) / 2.0f;
+    *y_off = (height - *new_height) / 2.0f;
+}
+
+static int pdf_barcode_eanupc_ch(struct pdf_doc *pdf, struct pdf_object *page,
+                                 float x, float y, float x_width,
+                                 float height, uint32_t colour, char ch,
+                                 int set, float *new_x)
+{
+    if ('0' > ch || ch > '9')
+        return pdf_set_err(pdf, -EINVAL, "Invalid EAN/UPC character %c 0x%x",
+                           ch, ch);
+
+    int code;
+    code = code_eanupc_encoding[ch - '0'];
+
+    for (int i = 3; i >= 0; i--) {
+        int shift = (set == 1 ? 3 - i : i) * 4;
+        int bar = (set == 2 && i & 0x1) || (set != 2 && (i & 0x1) == 0);
+        float width = (float)((code >> shift) & 0xf);
+
+        switch (ch) {
+        case '1':
+        case '2':
+            if ((set == 0 && bar) || (set != 0 && !bar)) {
+                width -= 1.0f / 13.0f;
+            } else {
+                width += 1.0f / 13.0f;
+            }
+            break;
+
+        case '7':
+        case '8':
+            if ((set == 0 && bar) || (set != 0 && !bar)) {
+                width += 1.0f / 13.0f;
+            } else {
+                width -= 1.0f / 13.0f;
+            }
+            break;
+        }
+
+        width *= x_width;
+        if (bar) {
+            if (pdf_add_filled_rectangle(pdf, page, x, y, width, height, 0,
+                                         colour, PDF_TRANSPARENT) < 0)
+                return pdf_get_errval(pdf);
+        }
+        x += width;
+    }
+    if (new_x)
+        *new_x = x;
+    return 0;
+}
+
+static int pdf_barcode_eanupc_aux(struct pdf_doc *pdf,
+                                  struct pdf_object *page, float x, float y,
+                                  float x_width, float height,
+                                  uint32_t colour, int guard_type,
+                                  float *new_x)
+{
+    int code = code_eanupc_aux_encoding[guard_type];
+
+    for (int i = 5; i >= 0; i--) {
+        int value = code >> i * 2 & 0x3;
+        if (value) {
+            if ((i & 0x1) == 0) {
+                if (pdf_add_filled_rectangle(pdf, page, x, y, x_width * value,
+                                             height, 0, colour,
+                                             PDF_TRANSPARENT) < 0)
+                    return pdf_get_errval(pdf);
+            }
+            x += x_width * value;
+        }
+    }
+    if (new_x)
+        *new_x = x;
+    return 0;
+}
+
+static int pdf_add_barcode_ean13(struct pdf_doc *pdf, struct pdf_object *page,
+                                 float x, float y, float width, float height,
+                                 const char *string, size_t len,
+                                 uint32_t colour)
 {
-    size_t len = strlen(string);
-    float char_width = width / (len + 2);
-    int e;
+    if (!string)
+        return 0;
 
-    e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour, '*',
-                          &x);
+    int lead = 0;
+    if (len == 13) {
+        char ch = string[0];
+        if (!isdigit(*string))
+            return pdf_set_err(pdf, -EINVAL,
+                               "Invalid EAN13 character %c 0x%x", ch, ch);
+        lead = ch - '0';
+        ++string;
+    } else if (len != 12)
+        return pdf_set_err(pdf, -EINVAL, "Invalid EAN13 string length %lu",
+                           len);
+
+    /* Scale and calculate dimensions */
+    float x_off, y_off, new_width, new_height, x_width, bar_height, bar_ext,
+        font;
+
+    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_EAN13, width, height, &x_off,
+                                 &y_off, &new_width, &new_height, &x_width,
+                                 &bar_height, &bar_ext, &font);
+
+    x += x_off;
+    y += y_off;
+    float bar_y = y + new_height - bar_height;
+
+    int e;
+    const char *save_font = pdf->current_font->font.name;
+    e = pdf_set_font(pdf, "Courier"); /* Built-in monospace font */
     if (e < 0)
         return e;
 
-    while (string && *string) {
-        e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour,
-                              *string, &x);
-        if (e < 0)
+    char text[2];
+    text[1] = 0;
+    text[0] = lead + '0';
+    e = pdf_add_text(pdf, page, text, font, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    x += eanupc_dimensions[0].quiet_left * x_width;
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    for (int i = 0; i != 6; i++) {
+        text[0] = *string;
+        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                              7 * x_width, PDF_ALIGN_CENTER, NULL);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+
+        int set = (set_ean13_encoding[lead] & 1 << i) ? 1 : 0;
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
+                                  colour, *string, set, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
             return e;
+        }
         string++;
     }
 
-    e = pdf_barcode_39_ch(pdf, page, x, y, char_width, height, colour, '*',
-                          NULL);
-    if (e < 0)
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_CENTRE,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
         return e;
+    }
+
+    for (int i = 0; i != 6; i++) {
+        text[0] = *string;
+        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                              7 * x_width, PDF_ALIGN_CENTER, NULL);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
+                                  colour, *string, 2, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+        string++;
+    }
+
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
 
+    text[0] = '>';
+    x += eanupc_dimensions[0].quiet_right * x_width -
+         604.0f * font / (14.0f * 72.0f);
+    e = pdf_add_text(pdf, page, text, font, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+    pdf_set_font(pdf, save_font);
     return 0;
 }
 
-/* EAN/UPC character encoding. Each 4-bit value indicates width in x units.
- * Elements are SBSB (Space, Bar, Space, Bar) for LHS digits
- * Elements are inverted for RHS digits
- */
-static const int code_eanupc_encoding[] = {
-    0x3211, // 0
-    0x2221, // 1
-    0x2122, // 2
-    0x1411, // 3
-    0x1132, // 4
-    0x1231, // 5
-    0x1114, // 6
-    0x1312, // 7
-    0x1213, // 8
-    0x3112, // 9
-};
+static int pdf_add_barcode_upca(struct pdf_doc *pdf, struct pdf_object *page,
+                                float x, float y, float width, float height,
+                                const char *string, size_t len,
+                                uint32_t colour)
+{
+    if (!string)
+        return 0;
 
-/**
- * List of different barcode guard patterns that are supported
- */
-enum {
-    GUARD_NORMAL,  //!< Produce normal guard pattern
-    GUARD_CENTRE,  //!< Produce centre guard pattern
-    GUARD_SPECIAL, //!< Produce special guard pattern
-    GUARD_ADDON,
-    GUARD_ADDON_DELIN,
-};
+    if (len != 12)
+        return pdf_set_err(pdf, -EINVAL, "Invalid UPCA string length %lu",
+                           len);
 
-static const int code_eanupc_aux_encoding[] = {
-    0x150, // Normal guard
-    0x554, // Centre guard
-    0x555, // Special guard
-    0x160, // Add-on guard
-    0x500, // Add-on delineator
-};
+    /* Scale and calculate dimensions */
+    float x_off, y_off, new_width, new_height;
+    float x_width, bar_height, bar_ext, font;
 
-static const int set_ean13_encoding[] = {
-    0x00, // 0
-    0x34, // 1
-    0x2c, // 2
-    0x1c, // 3
-    0x32, // 4
-    0x26, // 5
-    0x0e, // 6
-    0x2a, // 7
-    0x1a, // 8
-    0x16, // 9
-};
+    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_UPCA, width, height, &x_off,
+                                 &y_off, &new_width, &new_height, &x_width,
+                                 &bar_height, &bar_ext, &font);
 
-static const int set_upce_encoding[] = {
-    0x07, // 0
-    0x0b, // 1
-    0x13, // 2
-    0x23, // 3
-    0x0d, // 4
-    0x19, // 5
-    0x31, // 6
-    0x15, // 7
-    0x25, // 8
-    0x29, // 9
-};
+    x += x_off;
+    y += y_off;
+    float bar_y = y + new_height - bar_height;
 
-#define EANUPC_X PDF_MM_TO_POINT(0.330f)
+    int e;
+    const char *save_font = pdf->current_font->font.name;
+    e = pdf_set_font(pdf, "Courier");
+    if (e < 0)
+        return e;
+
+    char text[2];
+    text[1] = 0;
+    text[0] = *string;
+    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    x += eanupc_dimensions[1].quiet_left * x_width;
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    for (int i = 0; i != 6; i++) {
+        text[0] = *string;
+        if (i) {
+            e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                                  7 * x_width, PDF_ALIGN_CENTER, NULL);
+            if (e < 0) {
+                pdf_set_font(pdf, save_font);
+                return e;
+            }
+        }
+
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y - (i ? 0 : bar_ext),
+                                  x_width, bar_height + (i ? 0 : bar_ext),
+                                  colour, *string, 0, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+        string++;
+    }
+
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_CENTRE,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
 
-static const struct {
-    unsigned modules;
-    float height_bar;
-    float height_outer;
-    unsigned quiet_left;
-    unsigned quiet_right;
-} eanupc_dimensions[] = {
-    {113, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 11, 7}, // EAN-13
-    {113, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 9, 9},  // UPC-A
-    {81, PDF_MM_TO_POINT(18.23), PDF_MM_TO_POINT(21.31), 7, 7},   // EAN-8
-    {67, PDF_MM_TO_POINT(22.85), PDF_MM_TO_POINT(25.93), 9, 7},   // UPC-E
-};
+    for (int i = 0; i != 6; i++) {
+        text[0] = *string;
+        if (i != 5) {
+            e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                                  7 * x_width, PDF_ALIGN_CENTER, NULL);
+            if (e < 0) {
+                pdf_set_font(pdf, save_font);
+                return e;
+            }
+        }
 
-static void pdf_barcode_eanupc_calc_dims(int type, float width, float height,
-                                         float *x_off, float *y_off,
-                                         float *new_width, float *new_height,
-                                         float *x, float *bar_height,
-                                         float *bar_ext, float *font_size)
-{
-    float aspectBarcode, aspectRect, scale;
+        e = pdf_barcode_eanupc_ch(
+            pdf, page, x, bar_y - (i != 5 ? 0 : bar_ext), x_width,
+            bar_height + (i != 5 ? 0 : bar_ext), colour, *string, 2, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+        string++;
+    }
 
-    aspectRect = width / height;
-    aspectBarcode = eanupc_dimensions[type - PDF_BARCODE_EAN13].modules *
-                    EANUPC_X /
-                    eanupc_dimensions[type - PDF_BARCODE_EAN13].height_outer;
-    if (aspectRect > aspectBarcode) {
-        *new_height = height;
-        *new_width = height * aspectBarcode;
-    } else if (aspectRect < aspectBarcode) {
-        *new_width = width;
-        *new_height = width / aspectBarcode;
-    } else {
-        *new_width = width;
-        *new_height = height;
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
     }
-    scale = *new_height /
-            eanupc_dimensions[type - PDF_BARCODE_EAN13].height_outer;
 
-    *x = *new_width / eanupc_dimensions[type - PDF_BARCODE_EAN13].modules;
-    *bar_ext = *x * 5;
-    *bar_height =
-        eanupc_dimensions[type - PDF_BARCODE_EAN13].height_bar * scale;
-    *font_size = 8.0f * scale;
-    *x_off = (width - *new_width) / 2.0f;
-    *y_off = (height - *new_height) / 2.0f;
+    text[0] = *--string;
+
+    x += eanupc_dimensions[1].quiet_right * x_width -
+         604.0f * font * 4.0f / 7.0f / (14.0f * 72.0f);
+    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+    pdf_set_font(pdf, save_font);
+    return 0;
 }
 
-static int pdf_barcode_eanupc_ch(struct pdf_doc *pdf, struct pdf_object *page,
-                                 float x, float y, float x_width,
-                                 float height, uint32_t colour, char ch,
-                                 int set, float *new_x)
+static int pdf_add_barcode_ean8(struct pdf_doc *pdf, struct pdf_object *page,
+                                float x, float y, float width, float height,
+                                const char *string, size_t len,
+                                uint32_t colour)
 {
-    if ('0' > ch || ch > '9')
-        return pdf_set_err(pdf, -EINVAL, "Invalid EAN/UPC character %c 0x%x",
-                           ch, ch);
+    if (!string)
+        return 0;
 
-    int code;
-    code = code_eanupc_encoding[ch - '0'];
+    if (len != 8)
+        return pdf_set_err(pdf, -EINVAL, "Invalid EAN8 string length %lu",
+                           len);
 
-    for (int i = 3; i >= 0; i--) {
-        int shift = (set == 1 ? 3 - i : i) * 4;
-        int bar = (set == 2 && i & 0x1) || (set != 2 && (i & 0x1) == 0);
-        float width = (float)((code >> shift) & 0xf);
+    /* Scale and calculate dimensions */
+    float x_off, y_off, new_width, new_height, x_width, bar_height, bar_ext,
+        font;
 
-        switch (ch) {
-        case '1':
-        case '2':
-            if ((set == 0 && bar) || (set != 0 && !bar)) {
-                width -= 1.0f / 13.0f;
-            } else {
-                width += 1.0f / 13.0f;
-            }
-            break;
+    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_EAN8, width, height, &x_off,
+                                 &y_off, &new_width, &new_height, &x_width,
+                                 &bar_height, &bar_ext, &font);
 
-        case '7':
-        case '8':
-            if ((set == 0 && bar) || (set != 0 && !bar)) {
-                width += 1.0f / 13.0f;
-            } else {
-                width -= 1.0f / 13.0f;
-            }
-            break;
+    x += x_off;
+    y += y_off;
+    float bar_y = y + new_height - bar_height;
+
+    int e;
+    const char *save_font = pdf->current_font->font.name;
+    e = pdf_set_font(pdf, "Courier"); /* Built-in monospace font */
+    if (e < 0)
+        return e;
+
+    char text[2];
+    text[1] = 0;
+    text[0] = '<';
+    e = pdf_add_text(pdf, page, text, font, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    x += eanupc_dimensions[2].quiet_left * x_width;
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    for (int i = 0; i != 4; i++) {
+        text[0] = *string;
+        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                              7 * x_width, PDF_ALIGN_CENTER, NULL);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
         }
 
-        width *= x_width;
-        if (bar) {
-            if (pdf_add_filled_rectangle(pdf, page, x, y, width, height, 0,
-                                         colour, PDF_TRANSPARENT) < 0)
-                return pdf->errval;
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
+                                  colour, *string, 0, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
         }
-        x += width;
+        string++;
     }
-    if (new_x)
-        *new_x = x;
-    return 0;
-}
 
-static int pdf_barcode_eanupc_aux(struct pdf_doc *pdf,
-                                  struct pdf_object *page, float x, float y,
-                                  float x_width, float height,
-                                  uint32_t colour, int guard_type,
-                                  float *new_x)
-{
-    int code = code_eanupc_aux_encoding[guard_type];
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_CENTRE,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
 
-    for (int i = 5; i >= 0; i--) {
-        int value = code >> i * 2 & 0x3;
-        if (value) {
-            if ((i & 0x1) == 0) {
-                if (pdf_add_filled_rectangle(pdf, page, x, y, x_width * value,
-                                             height, 0, colour,
-                                             PDF_TRANSPARENT) < 0)
-                    return pdf->errval;
-            }
-            x += x_width * value;
+    for (int i = 0; i != 4; i++) {
+        text[0] = *string;
+        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                              7 * x_width, PDF_ALIGN_CENTER, NULL);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
+                                  colour, *string, 2, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
         }
+        string++;
     }
-    if (new_x)
-        *new_x = x;
+
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
+                               bar_height + bar_ext, colour, GUARD_NORMAL,
+                               &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    text[0] = '>';
+    x += eanupc_dimensions[0].quiet_right * x_width -
+         604.0f * font / (14.0f * 72.0f);
+    e = pdf_add_text(pdf, page, text, font, x, y, colour);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+    pdf_set_font(pdf, save_font);
     return 0;
 }
 
-static int pdf_add_barcode_ean13(struct pdf_doc *pdf, struct pdf_object *page,
-                                 float x, float y, float width, float height,
-                                 const char *string, uint32_t colour)
+static int pdf_add_barcode_upce(struct pdf_doc *pdf, struct pdf_object *page,
+                                float x, float y, float width, float height,
+                                const char *string, size_t len,
+                                uint32_t colour)
 {
     if (!string)
         return 0;
 
-    size_t len = strlen(string);
-    int lead = 0;
-    if (len == 13) {
-        char ch = string[0];
-        if (!isdigit(*string))
-            return pdf_set_err(pdf, -EINVAL,
-                               "Invalid EAN13 character %c 0x%x", ch, ch);
-        lead = ch - '0';
-        ++string;
-    } else if (len != 12)
-        return pdf_set_err(pdf, -EINVAL, "Invalid EAN13 string length %lu",
+    if (len != 12)
+        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE string length %lu",
                            len);
 
+    if (*string != '0')
+        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE char %c at start",
+                           *string);
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit(string[i]))
+            return pdf_set_err(pdf, -EINVAL, "Invalid UPCE char 0x%x at %zd",
+                               string[i], i);
+    }
+
     /* Scale and calculate dimensions */
-    float x_off, y_off, new_width, new_height, x_width, bar_height, bar_ext,
-        font;
+    float x_off, y_off, new_width, new_height;
+    float x_width, bar_height, bar_ext, font;
 
-    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_EAN13, width, height, &x_off,
+    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_UPCE, width, height, &x_off,
                                  &y_off, &new_width, &new_height, &x_width,
                                  &bar_height, &bar_ext, &font);
 
@@ -2707,1461 +7112,2603 @@ static int pdf_add_barcode_ean13(struct pdf_doc *pdf, struct pdf_object *page,
 
     int e;
     const char *save_font = pdf->current_font->font.name;
-    e = pdf_set_font(pdf, "Courier"); /* Built-in monospace font */
+    e = pdf_set_font(pdf, "Courier");
     if (e < 0)
         return e;
 
     char text[2];
     text[1] = 0;
-    text[0] = lead + '0';
-    e = pdf_add_text(pdf, page, text, font, x, y, colour);
+    text[0] = string[0];
+    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
     if (e < 0) {
         pdf_set_font(pdf, save_font);
         return e;
     }
 
-    x += eanupc_dimensions[0].quiet_left * x_width;
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
+    x += eanupc_dimensions[2].quiet_left * x_width;
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y, x_width, bar_height,
+                               colour, GUARD_NORMAL, &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    char X[6];
+    if (string[5] && memcmp(string + 6, "0000", 4) == 0 &&
+        '5' <= string[10] && string[10] <= '9') {
+        memcpy(X, string + 1, 5);
+        X[5] = string[10];
+    } else if (string[4] && memcmp(string + 5, "00000", 5) == 0) {
+        memcpy(X, string + 1, 4);
+        X[4] = string[11];
+        X[5] = 4;
+    } else if ('0' <= string[3] && string[3] <= '2' &&
+               memcmp(string + 4, "0000", 4) == 0) {
+        X[0] = string[1];
+        X[1] = string[2];
+        X[2] = string[8];
+        X[3] = string[9];
+        X[4] = string[10];
+        X[5] = string[3];
+    } else if ('3' <= string[3] && string[3] <= '9' &&
+               memcmp(string + 4, "00000", 5) == 0) {
+        memcpy(X, string + 1, 3);
+        X[3] = string[9];
+        X[4] = string[10];
+        X[5] = 3;
+    } else {
+        pdf_set_font(pdf, save_font);
+        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE string format");
+    }
+
+    for (int i = 0; i != 6; i++) {
+        text[0] = X[i];
+        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
+                              7 * x_width, PDF_ALIGN_CENTER, NULL);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+
+        int set = (set_upce_encoding[string[11] - '0'] & 1 << i) ? 1 : 0;
+        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
+                                  colour, X[i], set, &x);
+        if (e < 0) {
+            pdf_set_font(pdf, save_font);
+            return e;
+        }
+    }
+
+    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y, x_width, bar_height,
+                               colour, GUARD_SPECIAL, &x);
+    if (e < 0) {
+        pdf_set_font(pdf, save_font);
+        return e;
+    }
+
+    text[0] = string[11];
+    x += eanupc_dimensions[0].quiet_right * x_width -
+         604.0f * font * 4.0f / 7.0f / (14.0f * 72.0f);
+    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
     if (e < 0) {
         pdf_set_font(pdf, save_font);
         return e;
     }
 
-    for (int i = 0; i != 6; i++) {
-        text[0] = *string;
-        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                              7 * x_width, PDF_ALIGN_CENTER, NULL);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
+    pdf_set_font(pdf, save_font);
+    return 0;
+}
+
+int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
+                    float x, float y, float width, float height,
+                    const char *string, uint32_t colour)
+{
+    return pdf_add_barcode_n(pdf, page, code, x, y, width, height, string,
+                             string ? strlen(string) : 0, colour);
+}
+
+int pdf_add_barcode_n(struct pdf_doc *pdf, struct pdf_object *page, int code,
+                      float x, float y, float width, float height,
+                      const char *string, size_t len, uint32_t colour)
+{
+    if (!string && len)
+        return pdf_set_err(pdf, -EINVAL, "NULL barcode string of length %zu",
+                           len);
+    if (!len)
+        return 0;
+    switch (code) {
+    case PDF_BARCODE_128A:
+        return pdf_add_barcode_128a(pdf, page, x, y, width, height, string,
+                                    len, colour);
+    case PDF_BARCODE_39:
+        return pdf_add_barcode_39(pdf, page, x, y, width, height, string,
+                                  len, colour);
+    case PDF_BARCODE_EAN13:
+        return pdf_add_barcode_ean13(pdf, page, x, y, width, height, string,
+                                     len, colour);
+    case PDF_BARCODE_UPCA:
+        return pdf_add_barcode_upca(pdf, page, x, y, width, height, string,
+                                    len, colour);
+    case PDF_BARCODE_EAN8:
+        return pdf_add_barcode_ean8(pdf, page, x, y, width, height, string,
+                                    len, colour);
+    case PDF_BARCODE_UPCE:
+        return pdf_add_barcode_upce(pdf, page, x, y, width, height, string,
+                                    len, colour);
+    default:
+        return pdf_set_err(pdf, -EINVAL, "Invalid barcode code %d", code);
+    }
+}
+
+static pdf_object *pdf_add_raw_grayscale8(struct pdf_doc *pdf,
+                                          const uint8_t *data, uint32_t width,
+                                          uint32_t height)
+{
+    struct pdf_object *obj;
+    size_t len;
+    const char *endstream = ">\r\nendstream\r\n";
+    struct dstr str = INIT_DSTR;
+    size_t data_len = (size_t)width * (size_t)height;
+
+    dstr_printf(&str,
+                "<<\r\n"
+                "  /Type /XObject\r\n"
+                "  /Subtype /Image\r\n"
+                "  /ColorSpace /DeviceGray\r\n"
+                "  /Height %d\r\n"
+                "  /Width %d\r\n"
+                "  /BitsPerComponent 8\r\n"
+                "  /Length %zu\r\n"
+                ">>stream\r\n",
+                height, width, data_len + 1);
+
+    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
+    if (dstr_ensure(&str, len) < 0) {
+        dstr_free(&str);
+        pdf_set_err(pdf, -ENOMEM,
+                    "Unable to allocate %zu bytes memory for image", len);
+        return NULL;
+    }
+    dstr_append_data(&str, data, data_len);
+    dstr_append(&str, endstream);
+
+    obj = pdf_add_object(pdf, OBJ_image);
+    if (!obj) {
+        dstr_free(&str);
+        return NULL;
+    }
+    obj->stream.stream = str;
+    obj->stream.format = IMAGE_UNKNOWN;
+
+    return obj;
+}
+
+static struct pdf_object *pdf_add_raw_rgb24(struct pdf_doc *pdf,
+                                            const uint8_t *data,
+                                            uint32_t width, uint32_t height)
+{
+    struct pdf_object *obj;
+    size_t len;
+    const char *endstream = ">\r\nendstream\r\n";
+    struct dstr str = INIT_DSTR;
+    size_t data_len = (size_t)width * (size_t)height * 3;
+
+    dstr_printf(&str,
+                "<<\r\n"
+                "  /Type /XObject\r\n"
+                "  /Subtype /Image\r\n"
+                "  /ColorSpace /DeviceRGB\r\n"
+                "  /Height %d\r\n"
+                "  /Width %d\r\n"
+                "  /BitsPerComponent 8\r\n"
+                "  /Length %zu\r\n"
+                ">>stream\r\n",
+                height, width, data_len + 1);
+
+    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
+    if (dstr_ensure(&str, len) < 0) {
+        dstr_free(&str);
+        pdf_set_err(pdf, -ENOMEM,
+                    "Unable to allocate %zu bytes memory for image", len);
+        return NULL;
+    }
+    dstr_append_data(&str, data, data_len);
+    dstr_append(&str, endstream);
+
+    obj = pdf_add_object(pdf, OBJ_image);
+    if (!obj) {
+        dstr_free(&str);
+        return NULL;
+    }
+    obj->stream.stream = str;
+    obj->stream.format = IMAGE_UNKNOWN;
+
+    return obj;
+}
+
+static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
+                         size_t *length)
+{
+    FILE *fp;
+    uint8_t *file_data;
+    struct stat buf;
+    off_t len;
+
+    if ((fp = fopen(file_name, "rb")) == NULL) {
+        pdf_set_err(pdf, -errno, "Unable to open %s: %s", file_name,
+                    strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fileno(fp), &buf) < 0) {
+        pdf_set_err(pdf, -errno, "Unable to access %s: %s", file_name,
+                    strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+
+    len = buf.st_size;
+
+    file_data = (uint8_t *)malloc(len);
+    if (!file_data) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate: %d", (int)len);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fread(file_data, len, 1, fp) != 1) {
+        pdf_set_err(pdf, -errno, "Unable to read full data: %s", file_name);
+        free(file_data);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    *length = len;
+
+    return file_data;
+}
+
+static struct pdf_object *
+pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
+                      const uint8_t *jpeg_data, size_t len)
+{
+    struct pdf_object *obj = pdf_add_object(pdf, OBJ_image);
+    if (!obj)
+        return NULL;
+    obj->stream.format = IMAGE_JPG;
+
+    dstr_printf(&obj->stream.stream,
+                "<<\r\n"
+                "  /Type /XObject\r\n"
+                "  /Subtype /Image\r\n"
+                "  /ColorSpace %s\r\n"
+                "  /Width %d\r\n"
+                "  /Height %d\r\n"
+                "  /BitsPerComponent 8\r\n"
+                "  /Filter /DCTDecode\r\n"
+                "  /Length %zu\r\n"
+                ">>stream\r\n",
+                (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB",
+                info->width, info->height, len);
+    dstr_append_data(&obj->stream.stream, jpeg_data, len);
+
+    dstr_printf(&obj->stream.stream, "\r\nendstream\r\n");
 
-        int set = (set_ean13_encoding[lead] & 1 << i) ? 1 : 0;
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
-                                  colour, *string, set, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
-        string++;
-    }
+    return obj;
+}
 
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_CENTRE,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+/**
+ * Get the display dimensions of an image, respecting the images aspect ratio
+ * if only one desired display dimension is defined.
+ * The pdf parameter is only used for setting the error value.
+ */
+static int get_img_display_dimensions(struct pdf_doc *pdf, uint32_t img_width,
+                                      uint32_t img_height,
+                                      float *display_width,
+                                      float *display_height)
+{
+    if (!display_height || !display_width) {
+        return pdf_set_err(
+            pdf, -EINVAL,
+            "display_width and display_height may not be null pointers");
     }
 
-    for (int i = 0; i != 6; i++) {
-        text[0] = *string;
-        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                              7 * x_width, PDF_ALIGN_CENTER, NULL);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
+    const float display_width_in = *display_width;
+    const float display_height_in = *display_height;
 
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
-                                  colour, *string, 2, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
-        string++;
+    if (display_width_in < 0 && display_height_in < 0) {
+        return pdf_set_err(pdf, -EINVAL,
+                           "Unable to determine image display dimensions, "
+                           "display_width and display_height are both < 0");
     }
-
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    if (img_width == 0 || img_height == 0) {
+        return pdf_set_err(pdf, -EINVAL,
+                           "Invalid image dimensions received, the loaded "
+                           "image appears to be empty.");
     }
 
-    text[0] = '>';
-    x += eanupc_dimensions[0].quiet_right * x_width -
-         604.0f * font / (14.0f * 72.0f);
-    e = pdf_add_text(pdf, page, text, font, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    if (display_width_in < 0) {
+        // Set width, keeping aspect ratio
+        *display_width = display_height_in * ((float)img_width / img_height);
+    } else if (display_height_in < 0) {
+        // Set height, keeping aspect ratio
+        *display_height = display_width_in * ((float)img_height / img_width);
     }
-    pdf_set_font(pdf, save_font);
     return 0;
 }
 
-static int pdf_add_barcode_upca(struct pdf_doc *pdf, struct pdf_object *page,
-                                float x, float y, float width, float height,
-                                const char *string, uint32_t colour)
+static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
+                         struct pdf_object *image, float x, float y,
+                         float width, float height)
 {
-    if (!string)
-        return 0;
-
-    size_t len = strlen(string);
-    if (len != 12)
-        return pdf_set_err(pdf, -EINVAL, "Invalid UPCA string length %lu",
-                           len);
+    int ret;
+    uint64_t data_heap;
+    struct dstr str = INIT_DSTR;
 
-    /* Scale and calculate dimensions */
-    float x_off, y_off, new_width, new_height;
-    float x_width, bar_height, bar_ext, font;
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
 
-    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_UPCA, width, height, &x_off,
-                                 &y_off, &new_width, &new_height, &x_width,
-                                 &bar_height, &bar_ext, &font);
+    if (!page || page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
 
-    x += x_off;
-    y += y_off;
-    float bar_y = y + new_height - bar_height;
+    if (image->type != OBJ_image)
+        return pdf_set_err(pdf, -EINVAL,
+                           "adding an image, but wrong object type %d",
+                           image->type);
 
-    int e;
-    const char *save_font = pdf->current_font->font.name;
-    e = pdf_set_font(pdf, "Courier");
-    if (e < 0)
-        return e;
+    if (image->stream.page != NULL)
+        return pdf_set_err(pdf, -EEXIST, "image already on a page");
 
-    char text[2];
-    text[1] = 0;
-    text[0] = *string;
-    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    /* The object itself was charged for when it was created, & its data
+     * is charged for now that it's placed */
+    image->stream.page = page;
+    data_heap = pdf_object_heap(image) - pdf_object_size(OBJ_image);
+    if (pdf_reserve_heap(pdf, data_heap) < 0) {
+        image->stream.page = NULL;
+        pdf_del_object(pdf, image);
+        return pdf_get_errval(pdf);
     }
+    pdf_count_object(pdf, image, 1);
 
-    x += eanupc_dimensions[1].quiet_left * x_width;
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
-    }
+    pdf_measure(pdf, &page, x, y, x + width, y + height, 0);
+    /* Names come from a counter, so they stay fixed even if the object is
+     * renumbered or moved to another document later on */
+    if (!image->stream.name)
+        image->stream.name = ++pdf->last_name;
 
-    for (int i = 0; i != 6; i++) {
-        text[0] = *string;
-        if (i) {
-            e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                                  7 * x_width, PDF_ALIGN_CENTER, NULL);
-            if (e < 0) {
-                pdf_set_font(pdf, save_font);
-                return e;
+    dstr_append(&str, "q ");
+    dstr_printf(&str, "%f 0 0 %f %f %f cm ", width, height, x, y);
+    dstr_printf(&str, "/Image%d Do ", image->stream.name);
+    dstr_append(&str, "Q");
+
+    ret = pdf_add_stream(pdf, page, dstr_data(&str));
+    dstr_free(&str);
+    return ret;
+}
+
+// Works like fgets, except it's for a fixed in-memory buffer of data
+static size_t dgets(const uint8_t *data, size_t *pos, size_t len, char *line,
+                    size_t line_len)
+{
+    size_t line_pos = 0;
+
+    if (*pos >= len)
+        return 0;
+
+    while ((*pos) < len) {
+        if (line_pos < line_len) {
+            // Reject non-ascii data
+            if (data[*pos] & 0x80) {
+                return 0;
             }
+            line[line_pos] = data[*pos];
+            line_pos++;
         }
-
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y - (i ? 0 : bar_ext),
-                                  x_width, bar_height + (i ? 0 : bar_ext),
-                                  colour, *string, 0, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
+        if (data[*pos] == '\n') {
+            (*pos)++;
+            break;
         }
-        string++;
+        (*pos)++;
     }
 
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_CENTRE,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    if (line_pos < line_len) {
+        line[line_pos] = '\0';
     }
 
-    for (int i = 0; i != 6; i++) {
-        text[0] = *string;
-        if (i != 5) {
-            e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                                  7 * x_width, PDF_ALIGN_CENTER, NULL);
-            if (e < 0) {
-                pdf_set_font(pdf, save_font);
-                return e;
-            }
-        }
+    return *pos;
+}
 
-        e = pdf_barcode_eanupc_ch(
-            pdf, page, x, bar_y - (i != 5 ? 0 : bar_ext), x_width,
-            bar_height + (i != 5 ? 0 : bar_ext), colour, *string, 2, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
+static int parse_ppm_header(struct pdf_img_info *info, const uint8_t *data,
+                            size_t length, char *err_msg,
+                            size_t err_msg_length)
+{
+    char line[1024];
+    memset(line, '\0', sizeof(line));
+    size_t pos = 0;
+
+    // Load the PPM file
+    if (!dgets(data, &pos, length, line, sizeof(line) - 1)) {
+        snprintf(err_msg, err_msg_length, "Invalid PPM file");
+        return -EINVAL;
+    }
+
+    // Determine number of color channels (Also, we only support binary ppms)
+    int ncolors;
+    if (strncmp(line, "P6", 2) == 0) {
+        info->ppm.color_space = PPM_BINARY_COLOR_RGB;
+        ncolors = 3;
+    } else if (strncmp(line, "P5", 2) == 0) {
+        info->ppm.color_space = PPM_BINARY_COLOR_GRAY;
+        ncolors = 1;
+    } else {
+        snprintf(err_msg, err_msg_length,
+                 "Only binary PPM files (grayscale, RGB) supported");
+        return -EINVAL;
+    }
+
+    // Skip comments before header
+    do {
+        if (!dgets(data, &pos, length, line, sizeof(line) - 1)) {
+            snprintf(err_msg, err_msg_length, "Unable to find PPM header");
+            return -EINVAL;
         }
-        string++;
+    } while (line[0] == '#');
+
+    // Read image dimensions
+    if (sscanf(line, "%u %u\n", &(info->width), &(info->height)) != 2) {
+        snprintf(err_msg, err_msg_length, "Unable to find PPM size");
+        return -EINVAL;
     }
-
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
+        snprintf(err_msg, err_msg_length, "Invalid width/height: %ux%u",
+                 info->width, info->height);
+        return -EINVAL;
     }
+    info->ppm.size = (size_t)(info->width * info->height * ncolors);
+    info->ppm.data_begin_pos = pos;
 
-    text[0] = *--string;
+    return 0;
+}
 
-    x += eanupc_dimensions[1].quiet_right * x_width -
-         604.0f * font * 4.0f / 7.0f / (14.0f * 72.0f);
-    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
-    }
-    pdf_set_font(pdf, save_font);
+/**
+ * In measure-only mode, account for where an image would go instead of
+ * creating it. Returns 1 if the image was measured, 0 if it should be added.
+ */
+/* Images can only go on pages, which is checked before anything is decoded
+ * so a bad page doesn't leave an unused image object behind */
+static int pdf_check_image_page(struct pdf_doc *pdf, struct pdf_object *page)
+{
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
+    if (!page || page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
     return 0;
 }
 
-static int pdf_add_barcode_ean8(struct pdf_doc *pdf, struct pdf_object *page,
-                                float x, float y, float width, float height,
-                                const char *string, uint32_t colour)
+static int pdf_measure_image(struct pdf_doc *pdf, struct pdf_object *page,
+                             float x, float y, float display_width,
+                             float display_height, uint32_t width,
+                             uint32_t height)
 {
-    if (!string)
+    if (!pdf->measure_only)
         return 0;
+    if (get_img_display_dimensions(pdf, width, height, &display_width,
+                                   &display_height))
+        return pdf_get_errval(pdf);
+    return pdf_measure(pdf, &page, x, y, x + display_width,
+                       y + display_height, 0);
+}
 
-    size_t len = strlen(string);
-    if (len != 8)
-        return pdf_set_err(pdf, -EINVAL, "Invalid EAN8 string length %lu",
-                           len);
+/* Add raw RGB (3 bytes per pixel) or grayscale (1) pixels, which were
+ * decoded from an image in the given format (for pdf_get_stats) */
+static int pdf_add_pixels(struct pdf_doc *pdf, struct pdf_object *page,
+                          float x, float y, float display_width,
+                          float display_height, const uint8_t *data,
+                          uint32_t width, uint32_t height,
+                          int bytes_per_pixel, int format)
+{
+    struct pdf_object *obj;
+    int ret;
 
-    /* Scale and calculate dimensions */
-    float x_off, y_off, new_width, new_height, x_width, bar_height, bar_ext,
-        font;
+    if (pdf_check_image_page(pdf, page) < 0)
+        return pdf_get_errval(pdf);
+    ret = pdf_measure_image(pdf, page, x, y, display_width, display_height,
+                            width, height);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+    if (pdf_check_image_size(pdf, width, height, bytes_per_pixel) < 0)
+        return pdf_get_errval(pdf);
+    if (bytes_per_pixel == 3)
+        obj = pdf_add_raw_rgb24(pdf, data, width, height);
+    else
+        obj = pdf_add_raw_grayscale8(pdf, data, width, height);
+    if (!obj)
+        return pdf_get_errval(pdf);
+    obj->stream.format = format;
 
-    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_EAN8, width, height, &x_off,
-                                 &y_off, &new_width, &new_height, &x_width,
-                                 &bar_height, &bar_ext, &font);
+    if (get_img_display_dimensions(pdf, width, height, &display_width,
+                                   &display_height)) {
+        return pdf_get_errval(pdf);
+    }
+    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+}
 
-    x += x_off;
-    y += y_off;
-    float bar_y = y + new_height - bar_height;
+int pdf_add_rgb24(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                  float y, float display_width, float display_height,
+                  const uint8_t *data, uint32_t width, uint32_t height)
+{
+    return pdf_add_pixels(pdf, page, x, y, display_width, display_height,
+                          data, width, height, 3, IMAGE_UNKNOWN);
+}
 
-    int e;
-    const char *save_font = pdf->current_font->font.name;
-    e = pdf_set_font(pdf, "Courier"); /* Built-in monospace font */
-    if (e < 0)
-        return e;
+int pdf_add_grayscale8(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                       float y, float display_width, float display_height,
+                       const uint8_t *data, uint32_t width, uint32_t height)
+{
+    return pdf_add_pixels(pdf, page, x, y, display_width, display_height,
+                          data, width, height, 1, IMAGE_UNKNOWN);
+}
 
-    char text[2];
-    text[1] = 0;
-    text[0] = '<';
-    e = pdf_add_text(pdf, page, text, font, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
+                            float x, float y, float display_width,
+                            float display_height,
+                            const struct pdf_img_info *info,
+                            const uint8_t *ppm_data, size_t len)
+{
+    char line[1024];
+    // We start reading at the position delivered by parse_ppm_header,
+    // since we already parsed the header of the file there.
+    size_t pos = info->ppm.data_begin_pos;
+
+    /* Skip over the byte-size line */
+    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1))
+        return pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
+
+    /* Try and limit the memory usage to sane images */
+    if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
+        return pdf_set_err(pdf, -EINVAL,
+                           "Invalid width/height in PPM file: %ux%u",
+                           info->width, info->height);
     }
 
-    x += eanupc_dimensions[2].quiet_left * x_width;
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    if (info->ppm.size > len - pos) {
+        return pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
     }
 
-    for (int i = 0; i != 4; i++) {
-        text[0] = *string;
-        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                              7 * x_width, PDF_ALIGN_CENTER, NULL);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
+    switch (info->ppm.color_space) {
+    case PPM_BINARY_COLOR_GRAY:
+        return pdf_add_pixels(pdf, page, x, y, display_width, display_height,
+                              &ppm_data[pos], info->width, info->height, 1,
+                              IMAGE_PPM);
+        break;
 
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
-                                  colour, *string, 0, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
+    case PPM_BINARY_COLOR_RGB:
+        return pdf_add_pixels(pdf, page, x, y, display_width, display_height,
+                              &ppm_data[pos], info->width, info->height, 3,
+                              IMAGE_PPM);
+        break;
+
+    default:
+        return pdf_set_err(pdf, -EINVAL,
+                           "Invalid color space in ppm file: %i",
+                           info->ppm.color_space);
+        break;
+    }
+}
+
+static int parse_jpeg_header(struct pdf_img_info *info, const uint8_t *data,
+                             size_t length, char *err_msg,
+                             size_t err_msg_length)
+{
+    // See http://www.videotechnology.com/jpeg/j1.html for details
+    if (length >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
+        for (size_t i = 2; i < length; i++) {
+            if (data[i] != 0xff) {
+                break;
+            }
+            while (++i < length && data[i] == 0xff)
+                ;
+            if (i + 2 >= length) {
+                break;
+            }
+            int len = data[i + 1] * 256 + data[i + 2];
+            /* Search for SOFn marker and decode jpeg details */
+            if ((data[i] & 0xf4) == 0xc0) {
+                if (len >= 9 && i + len + 1 < length) {
+                    info->height = data[i + 4] * 256 + data[i + 5];
+                    info->width = data[i + 6] * 256 + data[i + 7];
+                    info->jpeg.ncolours = data[i + 8];
+                    return 0;
+                }
+                break;
+            }
+            i += len;
         }
-        string++;
     }
+    snprintf(err_msg, err_msg_length, "Error parsing JPEG header");
+    return -EINVAL;
+}
 
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_CENTRE,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+static int pdf_add_jpeg_data(struct pdf_doc *pdf, struct pdf_object *page,
+                             float x, float y, float display_width,
+                             float display_height, struct pdf_img_info *info,
+                             const uint8_t *jpeg_data, size_t len)
+{
+    struct pdf_object *obj;
+
+    obj = pdf_add_raw_jpeg_data(pdf, info, jpeg_data, len);
+    if (!obj)
+        return pdf_get_errval(pdf);
+
+    if (get_img_display_dimensions(pdf, info->width, info->height,
+                                   &display_width, &display_height)) {
+        return pdf_get_errval(pdf);
     }
+    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+}
 
-    for (int i = 0; i != 4; i++) {
-        text[0] = *string;
-        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                              7 * x_width, PDF_ALIGN_CENTER, NULL);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
+static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
+                            size_t length, char *err_msg,
+                            size_t err_msg_length)
+{
+    if (length <= sizeof(png_signature)) {
+        snprintf(err_msg, err_msg_length, "PNG file too short");
+        return -EINVAL;
+    }
 
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
-                                  colour, *string, 2, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
-        }
-        string++;
+    if (memcmp(data, png_signature, sizeof(png_signature))) {
+        snprintf(err_msg, err_msg_length, "File is not correct PNG file");
+        return -EINVAL;
     }
 
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y - bar_ext, x_width,
-                               bar_height + bar_ext, colour, GUARD_NORMAL,
-                               &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+    // process first PNG chunk
+    uint32_t pos = sizeof(png_signature);
+    const struct png_chunk *chunk = (const struct png_chunk *)&data[pos];
+    pos += sizeof(struct png_chunk);
+    if (pos > length) {
+        snprintf(err_msg, err_msg_length, "PNG file too short");
+        return -EINVAL;
     }
+    if (strncmp(chunk->type, png_chunk_header, 4) == 0) {
+        // header found, process width and height, check errors
+        struct png_header *header = &info->png;
 
-    text[0] = '>';
-    x += eanupc_dimensions[0].quiet_right * x_width -
-         604.0f * font / (14.0f * 72.0f);
-    e = pdf_add_text(pdf, page, text, font, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+        if (pos + sizeof(struct png_header) > length) {
+            snprintf(err_msg, err_msg_length, "PNG file too short");
+            return -EINVAL;
+        }
+
+        memcpy(header, &data[pos], sizeof(struct png_header));
+        if (header->deflate != 0) {
+            snprintf(err_msg, err_msg_length, "Deflate wrong in PNG header");
+            return -EINVAL;
+        }
+        if (header->bitDepth == 0) {
+            snprintf(err_msg, err_msg_length, "PNG file has zero bit depth");
+            return -EINVAL;
+        }
+        // ensure the width and height values have the proper byte order
+        // and copy them into the info struct.
+        header->width = ntoh32(header->width);
+        header->height = ntoh32(header->height);
+        info->width = header->width;
+        info->height = header->height;
+        return 0;
     }
-    pdf_set_font(pdf, save_font);
-    return 0;
+    snprintf(err_msg, err_msg_length, "Failed to read PNG file header");
+    return -EINVAL;
 }
 
-static int pdf_add_barcode_upce(struct pdf_doc *pdf, struct pdf_object *page,
-                                float x, float y, float width, float height,
-                                const char *string, uint32_t colour)
+static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
+                            float x, float y, float display_width,
+                            float display_height,
+                            const struct pdf_img_info *img_info,
+                            const uint8_t *png_data, size_t png_data_length)
 {
-    if (!string)
-        return 0;
+    // indicates if we return an error or add the img at the
+    // end of the function
+    bool success = false;
 
-    size_t len = strlen(string);
-    if (len != 12)
-        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE string length %lu",
-                           len);
+    // string stream used for writing color space (and palette) info
+    // into the pdf
+    struct dstr colour_space = INIT_DSTR;
 
-    if (*string != '0')
-        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE char %c at start",
-                           *string);
+    struct pdf_object *obj = NULL;
+    uint8_t *final_data = NULL;
+    int written = 0;
+    uint32_t pos;
+    uint8_t *png_data_temp = NULL;
+    size_t png_data_total_length = 0;
+    uint8_t ncolours;
+    /* Decoding buffers are charged against the memory limit while they
+     * exist */
+    uint64_t reserved = 0;
 
-    for (size_t i = 0; i < len; i++) {
-        if (!isdigit(string[i]))
-            return pdf_set_err(pdf, -EINVAL, "Invalid UPCE char 0x%x at %zd",
-                               string[i], i);
+    // Stores palette information for indexed PNGs
+    struct rgb_value *palette_buffer = NULL;
+    size_t palette_buffer_length = 0;
+
+    const struct png_header *header = &img_info->png;
+
+    // Father info from png header
+    switch (header->colorType) {
+    case PNG_COLOR_GREYSCALE:
+        ncolours = 1;
+        break;
+    case PNG_COLOR_RGB:
+        ncolours = 3;
+        break;
+    case PNG_COLOR_INDEXED:
+        ncolours = 1;
+        break;
+    // PNG_COLOR_RGBA and PNG_COLOR_GREYSCALE_A are unsupported
+    default:
+        pdf_set_err(pdf, -EINVAL, "PNG has unsupported color type: %d",
+                    header->colorType);
+        goto free_buffers;
+        break;
     }
 
-    /* Scale and calculate dimensions */
-    float x_off, y_off, new_width, new_height;
-    float x_width, bar_height, bar_ext, font;
+    /* process PNG chunks */
+    pos = sizeof(png_signature);
 
-    pdf_barcode_eanupc_calc_dims(PDF_BARCODE_UPCE, width, height, &x_off,
-                                 &y_off, &new_width, &new_height, &x_width,
-                                 &bar_height, &bar_ext, &font);
+    while (1) {
+        const struct png_chunk *chunk;
 
-    x += x_off;
-    y += y_off;
-    float bar_y = y + new_height - bar_height;
+        chunk = (const struct png_chunk *)&png_data[pos];
+        pos += sizeof(struct png_chunk);
 
-    int e;
-    const char *save_font = pdf->current_font->font.name;
-    e = pdf_set_font(pdf, "Courier");
-    if (e < 0)
-        return e;
+        if (pos > png_data_length - 4) {
+            pdf_set_err(pdf, -EINVAL, "PNG file too short");
+            goto free_buffers;
+        }
+        const uint32_t chunk_length = ntoh32(chunk->length);
+        // chunk length + 4-bytes of CRC
+        if (chunk_length > png_data_length - pos - 4) {
+            pdf_set_err(pdf, -EINVAL, "PNG chunk exceeds file: %d vs %ld",
+                        chunk_length, png_data_length - pos - 4);
+            goto free_buffers;
+        }
+        if (strncmp(chunk->type, png_chunk_header, 4) == 0) {
+            // Ignoring the header, since it was parsed
+            // before calling this function.
+        } else if (strncmp(chunk->type, png_chunk_palette, 4) == 0) {
+            // Palette chunk
+            if (header->colorType == PNG_COLOR_INDEXED) {
+                // palette chunk is needed for indexed images
+                if (palette_buffer) {
+                    pdf_set_err(pdf, -EINVAL,
+                                "PNG contains multiple palette chunks");
+                    goto free_buffers;
+                }
+                if (chunk_length % 3 != 0) {
+                    pdf_set_err(pdf, -EINVAL,
+                                "PNG format error: palette chunk length is "
+                                "not divisbly by 3!");
+                    goto free_buffers;
+                }
+                palette_buffer_length = (size_t)(chunk_length / 3);
+                if (palette_buffer_length > 256 ||
+                    palette_buffer_length == 0) {
+                    pdf_set_err(pdf, -EINVAL,
+                                "PNG palette length invalid: %zd",
+                                palette_buffer_length);
+                    goto free_buffers;
+                }
+                if (pdf_reserve_heap(pdf, palette_buffer_length *
+                                              sizeof(struct rgb_value)) < 0)
+                    goto free_buffers;
+                reserved += palette_buffer_length * sizeof(struct rgb_value);
+                palette_buffer = (struct rgb_value *)malloc(
+                    palette_buffer_length * sizeof(struct rgb_value));
+                if (!palette_buffer) {
+                    pdf_set_err(pdf, -ENOMEM,
+                                "Could not allocate memory for indexed color "
+                                "palette (%zu bytes)",
+                                palette_buffer_length *
+                                    sizeof(struct rgb_value));
+                    goto free_buffers;
+                }
+                for (size_t i = 0; i < palette_buffer_length; i++) {
+                    size_t offset = (i * 3) + pos;
+                    palette_buffer[i].red = png_data[offset];
+                    palette_buffer[i].green = png_data[offset + 1];
+                    palette_buffer[i].blue = png_data[offset + 2];
+                }
+            } else if (header->colorType == PNG_COLOR_RGB ||
+                       header->colorType == PNG_COLOR_RGBA) {
+                // palette chunk is optional for RGB(A) images
+                // but we do not process them
+            } else {
+                pdf_set_err(pdf, -EINVAL,
+                            "Unexpected palette chunk for color type %d",
+                            header->colorType);
+                goto free_buffers;
+            }
+        } else if (strncmp(chunk->type, png_chunk_data, 4) == 0) {
+            if (chunk_length > 0 && chunk_length < png_data_length - pos) {
+                uint8_t *data;
 
-    char text[2];
-    text[1] = 0;
-    text[0] = string[0];
-    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
-    }
+                if (pdf_reserve_heap(pdf, chunk_length) < 0)
+                    goto free_buffers;
+                reserved += chunk_length;
+                data = (uint8_t *)realloc(
+                    png_data_temp, png_data_total_length + chunk_length);
+                // (uint8_t *)realloc(info.data, info.length + chunk_length);
+                if (!data) {
+                    pdf_set_err(pdf, -ENOMEM, "No memory for PNG data");
+                    goto free_buffers;
+                }
+                png_data_temp = data;
+                memcpy(&png_data_temp[png_data_total_length], &png_data[pos],
+                       chunk_length);
+                png_data_total_length += chunk_length;
+            }
+        } else if (strncmp(chunk->type, png_chunk_end, 4) == 0) {
+            /* end of file, exit */
+            break;
+        }
 
-    x += eanupc_dimensions[2].quiet_left * x_width;
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y, x_width, bar_height,
-                               colour, GUARD_NORMAL, &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
+        if (chunk_length >= png_data_length) {
+            pdf_set_err(pdf, -EINVAL, "PNG chunk length larger than file");
+            goto free_buffers;
+        }
+
+        pos += chunk_length;     // add chunk length
+        pos += sizeof(uint32_t); // add CRC length
     }
 
-    char X[6];
-    if (string[5] && memcmp(string + 6, "0000", 4) == 0 &&
-        '5' <= string[10] && string[10] <= '9') {
-        memcpy(X, string + 1, 5);
-        X[5] = string[10];
-    } else if (string[4] && memcmp(string + 5, "00000", 5) == 0) {
-        memcpy(X, string + 1, 4);
-        X[4] = string[11];
-        X[5] = 4;
-    } else if ('0' <= string[3] && string[3] <= '2' &&
-               memcmp(string + 4, "0000", 4) == 0) {
-        X[0] = string[1];
-        X[1] = string[2];
-        X[2] = string[8];
-        X[3] = string[9];
-        X[4] = string[10];
-        X[5] = string[3];
-    } else if ('3' <= string[3] && string[3] <= '9' &&
-               memcmp(string + 4, "00000", 5) == 0) {
-        memcpy(X, string + 1, 3);
-        X[3] = string[9];
-        X[4] = string[10];
-        X[5] = 3;
-    } else {
-        pdf_set_font(pdf, save_font);
-        return pdf_set_err(pdf, -EINVAL, "Invalid UPCE string format");
+    /* if no length was found */
+    if (png_data_total_length == 0) {
+        pdf_set_err(pdf, -EINVAL, "PNG file has zero length");
+        goto free_buffers;
     }
 
-    for (int i = 0; i != 6; i++) {
-        text[0] = X[i];
-        e = pdf_add_text_wrap(pdf, page, text, font, x, y, 0, colour,
-                              7 * x_width, PDF_ALIGN_CENTER, NULL);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
+    switch (header->colorType) {
+    case PNG_COLOR_GREYSCALE:
+        dstr_append(&colour_space, "/DeviceGray");
+        break;
+    case PNG_COLOR_RGB:
+        dstr_append(&colour_space, "/DeviceRGB");
+        break;
+    case PNG_COLOR_INDEXED:
+        if (palette_buffer_length == 0) {
+            pdf_set_err(pdf, -EINVAL, "Indexed PNG contains no palette");
+            goto free_buffers;
         }
-
-        int set = (set_upce_encoding[string[11] - '0'] & 1 << i) ? 1 : 0;
-        e = pdf_barcode_eanupc_ch(pdf, page, x, bar_y, x_width, bar_height,
-                                  colour, X[i], set, &x);
-        if (e < 0) {
-            pdf_set_font(pdf, save_font);
-            return e;
+        // Write the color palette to the color_palette buffer
+        dstr_printf(&colour_space,
+                    "[ /Indexed\r\n"
+                    "  /DeviceRGB\r\n"
+                    "  %zu\r\n"
+                    "  <",
+                    palette_buffer_length - 1);
+        // write individual paletter values
+        // the index value for every RGB value is determined by its position
+        // (0, 1, 2, ...)
+        for (size_t i = 0; i < palette_buffer_length; i++) {
+            dstr_printf(&colour_space, "%02X%02X%02X ", palette_buffer[i].red,
+                        palette_buffer[i].green, palette_buffer[i].blue);
         }
-    }
-
-    e = pdf_barcode_eanupc_aux(pdf, page, x, bar_y, x_width, bar_height,
-                               colour, GUARD_SPECIAL, &x);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
-    }
-
-    text[0] = string[11];
-    x += eanupc_dimensions[0].quiet_right * x_width -
-         604.0f * font * 4.0f / 7.0f / (14.0f * 72.0f);
-    e = pdf_add_text(pdf, page, text, font * 4.0f / 7.0f, x, y, colour);
-    if (e < 0) {
-        pdf_set_font(pdf, save_font);
-        return e;
-    }
-
-    pdf_set_font(pdf, save_font);
-    return 0;
-}
+        dstr_append(&colour_space, ">\r\n]");
+        break;
 
-int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
-                    float x, float y, float width, float height,
-                    const char *string, uint32_t colour)
-{
-    if (!string || !*string)
-        return 0;
-    switch (code) {
-    case PDF_BARCODE_128A:
-        return pdf_add_barcode_128a(pdf, page, x, y, width, height, string,
-                                    colour);
-    case PDF_BARCODE_39:
-        return pdf_add_barcode_39(pdf, page, x, y, width, height, string,
-                                  colour);
-    case PDF_BARCODE_EAN13:
-        return pdf_add_barcode_ean13(pdf, page, x, y, width, height, string,
-                                     colour);
-    case PDF_BARCODE_UPCA:
-        return pdf_add_barcode_upca(pdf, page, x, y, width, height, string,
-                                    colour);
-    case PDF_BARCODE_EAN8:
-        return pdf_add_barcode_ean8(pdf, page, x, y, width, height, string,
-                                    colour);
-    case PDF_BARCODE_UPCE:
-        return pdf_add_barcode_upce(pdf, page, x, y, width, height, string,
-                                    colour);
     default:
-        return pdf_set_err(pdf, -EINVAL, "Invalid barcode code %d", code);
+        pdf_set_err(pdf, -EINVAL,
+                    "Cannot map PNG color type %d to PDF color space",
+                    header->colorType);
+        goto free_buffers;
+        break;
     }
-}
 
-static pdf_object *pdf_add_raw_grayscale8(struct pdf_doc *pdf,
-                                          const uint8_t *data, uint32_t width,
-                                          uint32_t height)
-{
-    struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height;
+    if (pdf_reserve_heap(pdf, png_data_total_length + 1024 +
+                                  dstr_len(&colour_space)) < 0)
+        goto free_buffers;
+    reserved += png_data_total_length + 1024 + dstr_len(&colour_space);
+    final_data = (uint8_t *)malloc(png_data_total_length + 1024 +
+                                   dstr_len(&colour_space));
+    if (!final_data) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate PNG data %zu",
+                    png_data_total_length + 1024 + dstr_len(&colour_space));
+        goto free_buffers;
+    }
 
-    dstr_printf(&str,
+    // Write image information to PDF
+    written =
+        sprintf((char *)final_data,
                 "<<\r\n"
                 "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
                 "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceGray\r\n"
-                "  /Height %d\r\n"
-                "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
+                "  /ColorSpace %s\r\n"
+                "  /Width %u\r\n"
+                "  /Height %u\r\n"
+                "  /Interpolate true\r\n"
+                "  /BitsPerComponent %u\r\n"
+                "  /Filter /FlateDecode\r\n"
+                "  /DecodeParms << /Predictor 15 /Colors %d "
+                "/BitsPerComponent %u /Columns %u >>\r\n"
                 "  /Length %zu\r\n"
                 ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
+                dstr_data(&colour_space),
+                header->width, header->height, header->bitDepth, ncolours,
+                header->bitDepth, header->width, png_data_total_length);
 
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
-        pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
-        return NULL;
-    }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
+    memcpy(&final_data[written], png_data_temp, png_data_total_length);
+    written += png_data_total_length;
+    written += sprintf((char *)&final_data[written], "\r\nendstream\r\n");
 
     obj = pdf_add_object(pdf, OBJ_image);
     if (!obj) {
-        dstr_free(&str);
-        return NULL;
+        goto free_buffers;
     }
-    obj->stream.stream = str;
+    obj->stream.format = IMAGE_PNG;
 
-    return obj;
+    dstr_append_data(&obj->stream.stream, final_data, written);
+
+    if (get_img_display_dimensions(pdf, header->width, header->height,
+                                   &display_width, &display_height)) {
+        goto free_buffers;
+    }
+    success = true;
+
+free_buffers:
+    if (final_data)
+        free(final_data);
+    if (palette_buffer)
+        free(palette_buffer);
+    if (png_data_temp)
+        free(png_data_temp);
+    dstr_free(&colour_space);
+    pdf_charge(pdf, -(int64_t)reserved);
+
+    if (success)
+        return pdf_add_image(pdf, page, obj, x, y, display_width,
+                             display_height);
+    else
+        return pdf_get_errval(pdf);
 }
 
-static struct pdf_object *pdf_add_raw_rgb24(struct pdf_doc *pdf,
-                                            const uint8_t *data,
-                                            uint32_t width, uint32_t height)
+static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
+                            size_t data_length, char *err_msg,
+                            size_t err_msg_length)
 {
-    struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height * 3;
+    if (data_length < sizeof(bmp_signature) + sizeof(struct bmp_header)) {
+        snprintf(err_msg, err_msg_length, "File is too short");
+        return -EINVAL;
+    }
 
-    dstr_printf(&str,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceRGB\r\n"
-                "  /Height %d\r\n"
-                "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
+    if (memcmp(data, bmp_signature, sizeof(bmp_signature))) {
+        snprintf(err_msg, err_msg_length, "File is not correct BMP file");
+        return -EINVAL;
+    }
+    memcpy(&info->bmp, &data[sizeof(bmp_signature)],
+           sizeof(struct bmp_header));
+    if (info->bmp.biWidth < 0) {
+        snprintf(err_msg, err_msg_length, "BMP has negative width");
+        return -EINVAL;
+    }
+    if (info->bmp.biHeight == INT_MIN) {
+        snprintf(err_msg, err_msg_length, "BMP height overflow");
+        return -EINVAL;
+    }
+    info->width = info->bmp.biWidth;
+    // biHeight might be negative (positive indicates vertically mirrored
+    // lines)
+    info->height = abs(info->bmp.biHeight);
+    return 0;
+}
 
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
-        pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
-        return NULL;
+static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
+                            float x, float y, float display_width,
+                            float display_height,
+                            const struct pdf_img_info *info,
+                            const uint8_t *data, const size_t len)
+{
+    const struct bmp_header *header = &info->bmp;
+    uint8_t *bmp_data = NULL;
+    uint8_t row_padding;
+    uint32_t bpp;
+    size_t data_len, reserved;
+    int retval;
+    const uint32_t width = info->width;
+    const uint32_t height = info->height;
+
+    if (header->bfSize != len)
+        return pdf_set_err(pdf, -EINVAL,
+                           "BMP file seems to have wrong length");
+    if (header->biSize != 40)
+        return pdf_set_err(pdf, -EINVAL, "Wrong BMP header: biSize");
+    if (header->biCompression != 0)
+        return pdf_set_err(pdf, -EINVAL, "Wrong BMP compression value: %d",
+                           header->biCompression);
+    if (header->biWidth > MAX_IMAGE_WIDTH || header->biWidth <= 0 ||
+        width > MAX_IMAGE_WIDTH || width == 0)
+        return pdf_set_err(pdf, -EINVAL, "BMP has invalid width: %d",
+                           header->biWidth);
+    if (header->biHeight > MAX_IMAGE_HEIGHT ||
+        header->biHeight < -MAX_IMAGE_HEIGHT || header->biHeight == 0 ||
+        height > MAX_IMAGE_HEIGHT || height == 0)
+        return pdf_set_err(pdf, -EINVAL, "BMP has invalid height: %d",
+                           header->biHeight);
+    if (header->biBitCount != 24 && header->biBitCount != 32)
+        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
+                           header->biBitCount);
+    bpp = header->biBitCount / 8;
+    /* BMP rows are 4-bytes padded! */
+    row_padding = (width * bpp) & 3;
+    data_len = (size_t)width * (size_t)height * 3;
+
+    if (header->bfOffBits >= len)
+        return pdf_set_err(pdf, -EINVAL, "Invalid BMP image offset");
+
+    if (len - header->bfOffBits <
+        (size_t)height * (width + row_padding) * bpp)
+        return pdf_set_err(pdf, -EINVAL, "Wrong BMP image size");
+
+    /* The converted pixels (& a row for mirroring them) are charged
+     * against the memory limit while they exist */
+    reserved = data_len + (header->biHeight >= 0 ? width * 3 : 0);
+    if (pdf_reserve_heap(pdf, reserved) < 0)
+        return pdf_get_errval(pdf);
+    bmp_data = (uint8_t *)malloc(data_len);
+    if (!bmp_data) {
+        pdf_charge(pdf, -(int64_t)reserved);
+        return pdf_set_err(pdf, -ENOMEM, "Insufficient memory for bitmap");
+    }
+    if (bpp == 3) {
+        /* 24 bits: change R and B colors */
+        for (uint32_t pos = 0; pos < width * height; pos++) {
+            uint32_t src_pos =
+                header->bfOffBits + 3 * (pos + (pos / width) * row_padding);
+
+            bmp_data[pos * 3] = data[src_pos + 2];
+            bmp_data[pos * 3 + 1] = data[src_pos + 1];
+            bmp_data[pos * 3 + 2] = data[src_pos];
+        }
+    } else if (bpp == 4) {
+        /* 32 bits: change R and B colors, remove key color */
+        int offs = 0;
+
+        for (uint32_t pos = 0; pos < width * height * 4; pos += 4) {
+            bmp_data[offs] = data[header->bfOffBits + pos + 2];
+            bmp_data[offs + 1] = data[header->bfOffBits + pos + 1];
+            bmp_data[offs + 2] = data[header->bfOffBits + pos];
+            offs += 3;
+        }
+    }
+    if (header->biHeight >= 0) {
+        // BMP has vertically mirrored representation of lines, so swap them
+        uint8_t *line = (uint8_t *)malloc(width * 3);
+        if (!line) {
+            free(bmp_data);
+            pdf_charge(pdf, -(int64_t)reserved);
+            return pdf_set_err(pdf, -ENOMEM,
+                               "Unable to allocate memory for bitmap mirror");
+        }
+        for (uint32_t pos = 0; pos < (height / 2); pos++) {
+            memcpy(line, &bmp_data[pos * width * 3], width * 3);
+            memcpy(&bmp_data[pos * width * 3],
+                   &bmp_data[(height - pos - 1) * width * 3], width * 3);
+            memcpy(&bmp_data[(height - pos - 1) * width * 3], line,
+                   width * 3);
+        }
+        free(line);
     }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
 
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        dstr_free(&str);
-        return NULL;
-    }
-    obj->stream.stream = str;
+    retval = pdf_add_pixels(pdf, page, x, y, display_width, display_height,
+                            bmp_data, width, height, 3, IMAGE_BMP);
+    free(bmp_data);
+    pdf_charge(pdf, -(int64_t)reserved);
 
-    return obj;
+    return retval;
 }
 
-static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
-                         size_t *length)
+static int determine_image_format(const uint8_t *data, size_t length)
 {
-    FILE *fp;
-    uint8_t *file_data;
-    struct stat buf;
-    off_t len;
+    if (length >= sizeof(png_signature) &&
+        memcmp(data, png_signature, sizeof(png_signature)) == 0)
+        return IMAGE_PNG;
+    if (length >= sizeof(bmp_signature) &&
+        memcmp(data, bmp_signature, sizeof(bmp_signature)) == 0)
+        return IMAGE_BMP;
+    if (length >= sizeof(jpeg_signature) &&
+        memcmp(data, jpeg_signature, sizeof(jpeg_signature)) == 0)
+        return IMAGE_JPG;
+    if (length >= sizeof(ppm_signature) &&
+        memcmp(data, ppm_signature, sizeof(ppm_signature)) == 0)
+        return IMAGE_PPM;
+    if (length >= sizeof(pgm_signature) &&
+        memcmp(data, pgm_signature, sizeof(pgm_signature)) == 0)
+        return IMAGE_PPM;
 
-    if ((fp = fopen(file_name, "rb")) == NULL) {
-        pdf_set_err(pdf, -errno, "Unable to open %s: %s", file_name,
-                    strerror(errno));
-        return NULL;
-    }
+    return IMAGE_UNKNOWN;
+}
 
-    if (fstat(fileno(fp), &buf) < 0) {
-        pdf_set_err(pdf, -errno, "Unable to access %s: %s", file_name,
-                    strerror(errno));
-        fclose(fp);
-        return NULL;
-    }
+int pdf_parse_image_header(struct pdf_img_info *info, const uint8_t *data,
+                           size_t length, char *err_msg,
+                           size_t err_msg_length)
 
-    len = buf.st_size;
+{
+    const int image_format = determine_image_format(data, length);
+    info->image_format = image_format;
+    switch (image_format) {
+    case IMAGE_PNG:
+        return parse_png_header(info, data, length, err_msg, err_msg_length);
+    case IMAGE_BMP:
+        return parse_bmp_header(info, data, length, err_msg, err_msg_length);
+    case IMAGE_JPG:
+        return parse_jpeg_header(info, data, length, err_msg, err_msg_length);
+    case IMAGE_PPM:
+        return parse_ppm_header(info, data, length, err_msg, err_msg_length);
 
-    file_data = (uint8_t *)malloc(len);
-    if (!file_data) {
-        pdf_set_err(pdf, -ENOMEM, "Unable to allocate: %d", (int)len);
-        fclose(fp);
-        return NULL;
+    case IMAGE_UNKNOWN:
+    default:
+        snprintf(err_msg, err_msg_length, "Unknown file format");
+        return -EINVAL;
     }
+}
 
-    if (fread(file_data, len, 1, fp) != 1) {
-        pdf_set_err(pdf, -errno, "Unable to read full data: %s", file_name);
-        free(file_data);
-        fclose(fp);
-        return NULL;
-    }
+int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                       float y, float display_width, float display_height,
+                       const uint8_t *data, size_t len)
+{
+    struct pdf_img_info info = {
+        .image_format = IMAGE_UNKNOWN,
+        .width = 0,
+        .height = 0,
+        .jpeg = {0},
+    };
+    char errstr[sizeof(pdf->errstr)] = "Invalid image header";
 
-    fclose(fp);
+    PDF_TRACE_START(pdf, start);
+    if (pdf_check_image_page(pdf, page) < 0)
+        return pdf_get_errval(pdf);
+    int ret =
+        pdf_parse_image_header(&info, data, len, errstr, sizeof(errstr));
+    if (ret)
+        return pdf_set_err(pdf, ret, "%s", errstr);
+    /* Nothing needs decoding just to find out where the image goes */
+    ret = pdf_measure_image(pdf, page, x, y, display_width, display_height,
+                            info.width, info.height);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+    /* Everything is converted to at most 24 bit RGB, apart from JPEGs
+     * which are kept as they are */
+    if (info.image_format != IMAGE_JPG &&
+        pdf_check_image_size(pdf, info.width, info.height, 3) < 0)
+        return pdf_get_errval(pdf);
 
-    *length = len;
+    // Try and determine which image format it is based on the content
+    switch (info.image_format) {
+    case IMAGE_PNG:
+        ret = pdf_add_png_data(pdf, page, x, y, display_width, display_height,
+                               &info, data, len);
+        break;
+    case IMAGE_BMP:
+        ret = pdf_add_bmp_data(pdf, page, x, y, display_width, display_height,
+                               &info, data, len);
+        break;
+    case IMAGE_JPG:
+        ret = pdf_add_jpeg_data(pdf, page, x, y, display_width,
+                                display_height, &info, data, len);
+        break;
+    case IMAGE_PPM:
+        ret = pdf_add_ppm_data(pdf, page, x, y, display_width, display_height,
+                               &info, data, len);
+        break;
 
-    return file_data;
+    // This case should be caught in parse_image_header, but is checked
+    // here again for safety
+    case IMAGE_UNKNOWN:
+    default:
+        return pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+    }
+
+    PDF_TRACE_END(pdf, start, "image",
+                  info.image_format == IMAGE_PNG   ? "png"
+                  : info.image_format == IMAGE_JPG ? "jpeg"
+                  : info.image_format == IMAGE_PPM ? "ppm"
+                                                   : "bmp",
+                  len);
+    return ret;
 }
 
-static struct pdf_object *
-pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
-                      const uint8_t *jpeg_data, size_t len)
+int pdf_add_image_file(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                       float y, float display_width, float display_height,
+                       const char *image_filename)
 {
-    struct pdf_object *obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj)
-        return NULL;
-
-    dstr_printf(&obj->stream.stream,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace %s\r\n"
-                "  /Width %d\r\n"
-                "  /Height %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Filter /DCTDecode\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects),
-                (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB",
-                info->width, info->height, len);
-    dstr_append_data(&obj->stream.stream, jpeg_data, len);
+    size_t len;
+    uint8_t *data;
+    int ret = 0;
 
-    dstr_printf(&obj->stream.stream, "\r\nendstream\r\n");
+    data = get_file(pdf, image_filename, &len);
+    if (data == NULL)
+        return pdf_get_errval(pdf);
 
-    return obj;
+    ret = pdf_add_image_data(pdf, page, x, y, display_width, display_height,
+                             data, len);
+    free(data);
+    return ret;
 }
 
 /**
- * Get the display dimensions of an image, respecting the images aspect ratio
- * if only one desired display dimension is defined.
- * The pdf parameter is only used for setting the error value.
+ * PDF import
+ *
+ * Just enough of a PDF reader to lift a single page out of an existing
+ * document and turn it into a Form XObject. Everything the page needs
+ * (fonts, images, etc.) is copied across, and references are tracked as
+ * objects rather than numbers so the result can be renumbered freely.
+ * Only classic cross-reference tables are understood; files that use
+ * cross-reference streams (and hence compressed object streams) are not.
  */
-static int get_img_display_dimensions(struct pdf_doc *pdf, uint32_t img_width,
-                                      uint32_t img_height,
-                                      float *display_width,
-                                      float *display_height)
-{
-    if (!display_height || !display_width) {
-        return pdf_set_err(
-            pdf, -EINVAL,
-            "display_width and display_height may not be null pointers");
-    }
-
-    const float display_width_in = *display_width;
-    const float display_height_in = *display_height;
-
-    if (display_width_in < 0 && display_height_in < 0) {
-        return pdf_set_err(pdf, -EINVAL,
-                           "Unable to determine image display dimensions, "
-                           "display_width and display_height are both < 0");
-    }
-    if (img_width == 0 || img_height == 0) {
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid image dimensions received, the loaded "
-                           "image appears to be empty.");
-    }
-
-    if (display_width_in < 0) {
-        // Set width, keeping aspect ratio
-        *display_width = display_height_in * ((float)img_width / img_height);
-    } else if (display_height_in < 0) {
-        // Set height, keeping aspect ratio
-        *display_height = display_width_in * ((float)img_height / img_width);
-    }
-    return 0;
-}
 
-static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
-                         struct pdf_object *image, float x, float y,
-                         float width, float height)
-{
-    int ret;
-    struct dstr str = INIT_DSTR;
+/* Limit on nesting of arrays, dictionaries & object references */
+#define PDF_READER_MAX_DEPTH 64
+/* Marks an object as free in pdf_reader.offsets */
+#define PDF_READER_FREE ((size_t)-1)
 
-    if (!page)
-        page = pdf_find_last_object(pdf, OBJ_page);
+enum {
+    PDF_TOK_ERROR = -1,
+    PDF_TOK_EOF,
+    PDF_TOK_NUMBER,
+    PDF_TOK_NAME,
+    PDF_TOK_STRING,
+    PDF_TOK_HEX_STRING,
+    PDF_TOK_ARRAY_START,
+    PDF_TOK_ARRAY_END,
+    PDF_TOK_DICT_START,
+    PDF_TOK_DICT_END,
+    PDF_TOK_KEYWORD,
+    PDF_TOK_REF, /* "<num> <gen> R", only produced by pdf_reader_value */
+};
 
-    if (!page)
-        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
+struct pdf_reader {
+    struct pdf_doc *pdf;        /* Document being imported in to */
+    const char *data;           /* Contents of the source PDF */
+    size_t length;              /* Number of bytes in data */
+    size_t *offsets;            /* Location of each object, 0 if unknown */
+    int object_count;           /* Number of entries in offsets */
+    int root;                   /* Object number of the catalog */
+    int visits;                 /* Page tree nodes looked at so far */
+    struct pdf_object **copies; /* Objects already copied in to pdf */
+};
 
-    if (image->type != OBJ_image)
-        return pdf_set_err(pdf, -EINVAL,
-                           "adding an image, but wrong object type %d",
-                           image->type);
+/* A value in the source PDF. Arrays & dictionaries span their contents */
+struct pdf_value {
+    int type; /* PDF_TOK_xxx */
+    size_t start;
+    size_t end;
+    int ref; /* Object number for PDF_TOK_REF */
+};
 
-    if (image->stream.page != NULL)
-        return pdf_set_err(pdf, -EEXIST, "image already on a page");
+/* Inheritable page attributes, found while walking the page tree */
+struct pdf_reader_page {
+    struct pdf_value page;
+    struct pdf_value resources;
+    struct pdf_value media_box;
+    struct pdf_value crop_box;
+};
 
-    image->stream.page = page;
+static bool pdf_is_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' ||
+           ch == '\f' || ch == '\0';
+}
 
-    dstr_append(&str, "q ");
-    dstr_printf(&str, "%f 0 0 %f %f %f cm ", width, height, x, y);
-    dstr_printf(&str, "/Image%d Do ", image->index);
-    dstr_append(&str, "Q");
+static bool pdf_is_delimiter(char ch)
+{
+    return ch && strchr("()<>[]{}/%", ch) != NULL;
+}
 
-    ret = pdf_add_stream(pdf, page, dstr_data(&str));
-    dstr_free(&str);
-    return ret;
+static bool pdf_reader_is(const struct pdf_reader *r, size_t start,
+                          size_t end, const char *str)
+{
+    size_t len = strlen(str);
+    return end - start == len && memcmp(&r->data[start], str, len) == 0;
 }
 
-// Works like fgets, except it's for a fixed in-memory buffer of data
-static size_t dgets(const uint8_t *data, size_t *pos, size_t len, char *line,
-                    size_t line_len)
+static void pdf_reader_skip_space(const struct pdf_reader *r, size_t *pos)
 {
-    size_t line_pos = 0;
+    while (*pos < r->length) {
+        char ch = r->data[*pos];
+        if (ch == '%') {
+            while (*pos < r->length && r->data[*pos] != '\r' &&
+                   r->data[*pos] != '\n')
+                (*pos)++;
+        } else if (pdf_is_space(ch)) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+}
 
-    if (*pos >= len)
-        return 0;
+/**
+ * Read the next token, which will span from *start to the new *pos.
+ * Returns the PDF_TOK_xxx type of the token
+ */
+static int pdf_reader_token(const struct pdf_reader *r, size_t *pos,
+                            size_t *start)
+{
+    const char *data = r->data;
+    size_t i;
+    char ch;
 
-    while ((*pos) < len) {
-        if (line_pos < line_len) {
-            // Reject non-ascii data
-            if (data[*pos] & 0x80) {
-                return 0;
-            }
-            line[line_pos] = data[*pos];
-            line_pos++;
+    pdf_reader_skip_space(r, pos);
+    i = *start = *pos;
+    if (i >= r->length)
+        return PDF_TOK_EOF;
+
+    switch (data[i]) {
+    case '[':
+        *pos = i + 1;
+        return PDF_TOK_ARRAY_START;
+    case ']':
+        *pos = i + 1;
+        return PDF_TOK_ARRAY_END;
+    case '<':
+        if (i + 1 < r->length && data[i + 1] == '<') {
+            *pos = i + 2;
+            return PDF_TOK_DICT_START;
         }
-        if (data[*pos] == '\n') {
-            (*pos)++;
-            break;
+        for (i++; i < r->length && data[i] != '>'; i++)
+            if (!isxdigit((unsigned char)data[i]) && !pdf_is_space(data[i]))
+                return PDF_TOK_ERROR;
+        if (i >= r->length)
+            return PDF_TOK_ERROR;
+        *pos = i + 1;
+        return PDF_TOK_HEX_STRING;
+    case '>':
+        if (i + 1 < r->length && data[i + 1] == '>') {
+            *pos = i + 2;
+            return PDF_TOK_DICT_END;
+        }
+        return PDF_TOK_ERROR;
+    case '(': {
+        int depth = 0;
+        for (; i < r->length; i++) {
+            if (data[i] == '\\')
+                i++;
+            else if (data[i] == '(')
+                depth++;
+            else if (data[i] == ')' && --depth == 0) {
+                *pos = i + 1;
+                return PDF_TOK_STRING;
+            }
         }
-        (*pos)++;
-    }
-
-    if (line_pos < line_len) {
-        line[line_pos] = '\0';
+        return PDF_TOK_ERROR;
     }
-
-    return *pos;
+    case '/':
+        for (i++; i < r->length && !pdf_is_space(data[i]) &&
+                  !pdf_is_delimiter(data[i]);
+             i++)
+            ;
+        *pos = i;
+        return PDF_TOK_NAME;
+    case ')':
+    case '{':
+    case '}':
+        return PDF_TOK_ERROR;
+    }
+
+    for (; i < r->length && !pdf_is_space(data[i]) &&
+           !pdf_is_delimiter(data[i]);
+         i++)
+        ;
+    *pos = i;
+
+    ch = data[*start];
+    if (isdigit((unsigned char)ch) || ch == '+' || ch == '-' || ch == '.') {
+        for (i = *start; i < *pos; i++)
+            if (!isdigit((unsigned char)data[i]) && !strchr("+-.", data[i]))
+                return PDF_TOK_ERROR;
+        return PDF_TOK_NUMBER;
+    }
+    return PDF_TOK_KEYWORD;
 }
 
-static int parse_ppm_header(struct pdf_img_info *info, const uint8_t *data,
-                            size_t length, char *err_msg,
-                            size_t err_msg_length)
+/* Convert an integer token spanning start to end */
+static int pdf_reader_int(const struct pdf_reader *r, size_t start,
+                          size_t end, long *value)
 {
-    char line[1024];
-    memset(line, '\0', sizeof(line));
-    size_t pos = 0;
+    bool negative = false;
+    long result = 0;
 
-    // Load the PPM file
-    if (!dgets(data, &pos, length, line, sizeof(line) - 1)) {
-        snprintf(err_msg, err_msg_length, "Invalid PPM file");
+    if (start < end && (r->data[start] == '-' || r->data[start] == '+'))
+        negative = r->data[start++] == '-';
+    if (start >= end)
         return -EINVAL;
+    for (; start < end; start++) {
+        char ch = r->data[start];
+        if (!isdigit((unsigned char)ch) || result > (LONG_MAX - 9) / 10)
+            return -EINVAL;
+        result = result * 10 + ch - '0';
     }
+    *value = negative ? -result : result;
+    return 0;
+}
 
-    // Determine number of color channels (Also, we only support binary ppms)
-    int ncolors;
-    if (strncmp(line, "P6", 2) == 0) {
-        info->ppm.color_space = PPM_BINARY_COLOR_RGB;
-        ncolors = 3;
-    } else if (strncmp(line, "P5", 2) == 0) {
-        info->ppm.color_space = PPM_BINARY_COLOR_GRAY;
-        ncolors = 1;
-    } else {
-        snprintf(err_msg, err_msg_length,
-                 "Only binary PPM files (grayscale, RGB) supported");
-        return -EINVAL;
-    }
+/* Convert a (possibly real) number. PDF doesn't allow exponents */
+static int pdf_reader_real(const struct pdf_reader *r,
+                           const struct pdf_value *v, float *value)
+{
+    double result = 0, scale = 1;
+    bool negative = false, point = false, digits = false;
 
-    // Skip comments before header
-    do {
-        if (!dgets(data, &pos, length, line, sizeof(line) - 1)) {
-            snprintf(err_msg, err_msg_length, "Unable to find PPM header");
+    if (v->type != PDF_TOK_NUMBER)
+        return -EINVAL;
+    for (size_t i = v->start; i < v->end; i++) {
+        char ch = r->data[i];
+        if (i == v->start && (ch == '-' || ch == '+')) {
+            negative = ch == '-';
+        } else if (isdigit((unsigned char)ch)) {
+            digits = true;
+            if (point) {
+                scale /= 10;
+                result += (ch - '0') * scale;
+            } else {
+                result = result * 10 + ch - '0';
+            }
+        } else if (ch == '.' && !point) {
+            point = true;
+        } else {
             return -EINVAL;
         }
-    } while (line[0] == '#');
-
-    // Read image dimensions
-    if (sscanf(line, "%u %u\n", &(info->width), &(info->height)) != 2) {
-        snprintf(err_msg, err_msg_length, "Unable to find PPM size");
-        return -EINVAL;
     }
-    if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
-        snprintf(err_msg, err_msg_length, "Invalid width/height: %ux%u",
-                 info->width, info->height);
+    if (!digits)
         return -EINVAL;
-    }
-    info->ppm.size = (size_t)(info->width * info->height * ncolors);
-    info->ppm.data_begin_pos = pos;
-
+    *value = (float)(negative ? -result : result);
     return 0;
 }
 
-static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *ppm_data, size_t len)
+/**
+ * Parse one complete value, including any array/dictionary contents,
+ * leaving *pos just after it
+ */
+static int pdf_reader_value(struct pdf_reader *r, size_t *pos,
+                            struct pdf_value *v, int depth)
 {
-    char line[1024];
-    // We start reading at the position delivered by parse_ppm_header,
-    // since we already parsed the header of the file there.
-    size_t pos = info->ppm.data_begin_pos;
-
-    /* Skip over the byte-size line */
-    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1))
-        return pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
-
-    /* Try and limit the memory usage to sane images */
-    if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid width/height in PPM file: %ux%u",
-                           info->width, info->height);
+    struct pdf_value item;
+    size_t start, p;
+    int type;
+
+    if (depth > PDF_READER_MAX_DEPTH)
+        return pdf_set_err(r->pdf, -ELOOP, "PDF nested too deeply at %zu",
+                           *pos);
+
+    type = pdf_reader_token(r, pos, &start);
+    v->type = type;
+    v->start = start;
+    v->ref = 0;
+
+    switch (type) {
+    case PDF_TOK_NUMBER: {
+        /* Look ahead for a "<num> <gen> R" reference */
+        size_t gen, keyword;
+        long ref;
+
+        p = *pos;
+        if (pdf_reader_token(r, &p, &gen) == PDF_TOK_NUMBER &&
+            pdf_reader_token(r, &p, &keyword) == PDF_TOK_KEYWORD &&
+            pdf_reader_is(r, keyword, p, "R")) {
+            if (pdf_reader_int(r, start, *pos, &ref) < 0 || ref < 0 ||
+                ref > INT_MAX)
+                return pdf_set_err(r->pdf, -EINVAL,
+                                   "Invalid reference at %zu", start);
+            v->type = PDF_TOK_REF;
+            v->ref = (int)ref;
+            *pos = p;
+        }
+        break;
     }
 
-    if (info->ppm.size > len - pos) {
-        return pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
-    }
+    case PDF_TOK_ARRAY_START:
+        for (;;) {
+            p = *pos;
+            if (pdf_reader_token(r, &p, &start) == PDF_TOK_ARRAY_END)
+                break;
+            if ((type = pdf_reader_value(r, pos, &item, depth + 1)) < 0)
+                return type;
+        }
+        *pos = p;
+        break;
 
-    switch (info->ppm.color_space) {
-    case PPM_BINARY_COLOR_GRAY:
-        return pdf_add_grayscale8(pdf, page, x, y, display_width,
-                                  display_height, &ppm_data[pos], info->width,
-                                  info->height);
+    case PDF_TOK_DICT_START:
+        for (;;) {
+            type = pdf_reader_token(r, pos, &start);
+            if (type == PDF_TOK_DICT_END)
+                break;
+            if (type != PDF_TOK_NAME)
+                return pdf_set_err(r->pdf, -EINVAL,
+                                   "Invalid dictionary key at %zu", start);
+            if ((type = pdf_reader_value(r, pos, &item, depth + 1)) < 0)
+                return type;
+        }
         break;
 
-    case PPM_BINARY_COLOR_RGB:
-        return pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                             &ppm_data[pos], info->width, info->height);
+    case PDF_TOK_NAME:
+    case PDF_TOK_STRING:
+    case PDF_TOK_HEX_STRING:
+    case PDF_TOK_KEYWORD:
         break;
 
     default:
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid color space in ppm file: %i",
-                           info->ppm.color_space);
-        break;
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF syntax at %zu",
+                           start);
     }
+    v->end = *pos;
+    return 0;
 }
 
-static int parse_jpeg_header(struct pdf_img_info *info, const uint8_t *data,
-                             size_t length, char *err_msg,
-                             size_t err_msg_length)
+/**
+ * Step through a dictionary, *pos starting just inside the "<<".
+ * Returns 1 for each entry, and 0 once the end is reached
+ */
+static int pdf_reader_dict_next(struct pdf_reader *r, size_t *pos,
+                                struct pdf_value *key,
+                                struct pdf_value *value)
 {
-    // See http://www.videotechnology.com/jpeg/j1.html for details
-    if (length >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
-        for (size_t i = 2; i < length; i++) {
-            if (data[i] != 0xff) {
-                break;
-            }
-            while (++i < length && data[i] == 0xff)
-                ;
-            if (i + 2 >= length) {
-                break;
-            }
-            int len = data[i + 1] * 256 + data[i + 2];
-            /* Search for SOFn marker and decode jpeg details */
-            if ((data[i] & 0xf4) == 0xc0) {
-                if (len >= 9 && i + len + 1 < length) {
-                    info->height = data[i + 4] * 256 + data[i + 5];
-                    info->width = data[i + 6] * 256 + data[i + 7];
-                    info->jpeg.ncolours = data[i + 8];
-                    return 0;
-                }
-                break;
-            }
-            i += len;
-        }
+    int type = pdf_reader_token(r, pos, &key->start);
+
+    if (type == PDF_TOK_DICT_END)
+        return 0;
+    if (type != PDF_TOK_NAME)
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid dictionary key at %zu",
+                           key->start);
+    key->type = type;
+    key->end = *pos;
+    type = pdf_reader_value(r, pos, value, 0);
+    return type < 0 ? type : 1;
+}
+
+/* As for pdf_reader_dict_next, but for arrays */
+static int pdf_reader_array_next(struct pdf_reader *r, size_t *pos,
+                                 struct pdf_value *item)
+{
+    size_t p = *pos, start;
+    int ret;
+
+    if (pdf_reader_token(r, &p, &start) == PDF_TOK_ARRAY_END) {
+        *pos = p;
+        return 0;
     }
-    snprintf(err_msg, err_msg_length, "Error parsing JPEG header");
-    return -EINVAL;
+    ret = pdf_reader_value(r, pos, item, 0);
+    return ret < 0 ? ret : 1;
 }
 
-static int pdf_add_jpeg_data(struct pdf_doc *pdf, struct pdf_object *page,
-                             float x, float y, float display_width,
-                             float display_height, struct pdf_img_info *info,
-                             const uint8_t *jpeg_data, size_t len)
+/* Look up a key (without the leading '/') in a dictionary */
+static int pdf_reader_dict_get(struct pdf_reader *r,
+                               const struct pdf_value *dict, const char *key,
+                               struct pdf_value *value)
 {
-    struct pdf_object *obj;
+    struct pdf_value k;
+    size_t pos = dict->start + 2;
+    int ret;
 
-    obj = pdf_add_raw_jpeg_data(pdf, info, jpeg_data, len);
-    if (!obj)
-        return pdf->errval;
+    if (dict->type != PDF_TOK_DICT_START)
+        return -EINVAL;
+    while ((ret = pdf_reader_dict_next(r, &pos, &k, value)) > 0)
+        if (pdf_reader_is(r, k.start + 1, k.end, key))
+            return 0;
+    return ret < 0 ? ret : -ENOENT;
+}
 
-    if (get_img_display_dimensions(pdf, info->width, info->height,
-                                   &display_width, &display_height)) {
-        return pdf->errval;
+/**
+ * Find the value of object 'num'. If after is supplied, it is set to the
+ * position just past the value (where any stream data follows)
+ */
+static int pdf_reader_object(struct pdf_reader *r, int num,
+                             struct pdf_value *v, size_t *after)
+{
+    size_t pos, start;
+    long value;
+
+    if (num <= 0 || num >= r->object_count || !r->offsets[num] ||
+        r->offsets[num] == PDF_READER_FREE)
+        return pdf_set_err(r->pdf, -ENOENT, "Missing PDF object %d", num);
+
+    pos = r->offsets[num];
+    if (pdf_reader_token(r, &pos, &start) != PDF_TOK_NUMBER ||
+        pdf_reader_int(r, start, pos, &value) < 0 || value != num ||
+        pdf_reader_token(r, &pos, &start) != PDF_TOK_NUMBER ||
+        pdf_reader_token(r, &pos, &start) != PDF_TOK_KEYWORD ||
+        !pdf_reader_is(r, start, pos, "obj"))
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF object %d", num);
+
+    if (pdf_reader_value(r, &pos, v, 0) < 0)
+        return pdf_get_errval(r->pdf);
+    if (after)
+        *after = pos;
+    return 0;
+}
+
+/* Follow a value if it is a reference to another object */
+static int pdf_reader_resolve(struct pdf_reader *r, const struct pdf_value *v,
+                              struct pdf_value *result)
+{
+    if (v->type != PDF_TOK_REF) {
+        *result = *v;
+        return 0;
     }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+    return pdf_reader_object(r, v->ref, result, NULL);
 }
 
-int pdf_add_rgb24(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                  float y, float display_width, float display_height,
-                  const uint8_t *data, uint32_t width, uint32_t height)
+/* As for pdf_reader_dict_get, but following references */
+static int pdf_reader_dict_lookup(struct pdf_reader *r,
+                                  const struct pdf_value *dict,
+                                  const char *key, struct pdf_value *value)
 {
-    struct pdf_object *obj;
+    int ret = pdf_reader_dict_get(r, dict, key, value);
+    if (ret < 0)
+        return ret;
+    return pdf_reader_resolve(r, value, value);
+}
 
-    obj = pdf_add_raw_rgb24(pdf, data, width, height);
-    if (!obj)
-        return pdf->errval;
+/**
+ * Locate the data of a stream whose dictionary ends at pos.
+ * Returns 1 if there is a stream, or 0 if the object is just the dictionary
+ */
+static int pdf_reader_stream(struct pdf_reader *r,
+                             const struct pdf_value *dict, size_t pos,
+                             size_t *start, size_t *length)
+{
+    struct pdf_value value;
+    size_t keyword;
+    long len;
 
-    if (get_img_display_dimensions(pdf, width, height, &display_width,
-                                   &display_height)) {
-        return pdf->errval;
+    if (pdf_reader_token(r, &pos, &keyword) != PDF_TOK_KEYWORD ||
+        !pdf_reader_is(r, keyword, pos, "stream"))
+        return 0;
+    if (pos < r->length && r->data[pos] == '\r')
+        pos++;
+    if (pos < r->length && r->data[pos] == '\n')
+        pos++;
+    *start = pos;
+
+    if (pdf_reader_dict_lookup(r, dict, "Length", &value) == 0 &&
+        value.type == PDF_TOK_NUMBER &&
+        pdf_reader_int(r, value.start, value.end, &len) == 0 && len >= 0 &&
+        (size_t)len <= r->length - pos) {
+        size_t end = pos + len;
+        if (pdf_reader_token(r, &end, &keyword) == PDF_TOK_KEYWORD &&
+            pdf_reader_is(r, keyword, end, "endstream")) {
+            *length = len;
+            return 1;
+        }
     }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+
+    /* The length is missing or wrong, so search for the end instead */
+    for (size_t i = pos; i + 9 <= r->length; i++)
+        if (memcmp(&r->data[i], "endstream", 9) == 0) {
+            if (i > pos && r->data[i - 1] == '\n')
+                i--;
+            if (i > pos && r->data[i - 1] == '\r')
+                i--;
+            *length = i - pos;
+            return 1;
+        }
+    return pdf_set_err(r->pdf, -EINVAL, "Unterminated stream at %zu", pos);
 }
 
-int pdf_add_grayscale8(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                       float y, float display_width, float display_height,
-                       const uint8_t *data, uint32_t width, uint32_t height)
+/* Read the cross-reference table(s) to find where each object lives */
+static int pdf_reader_load_xref(struct pdf_reader *r)
 {
-    struct pdf_object *obj;
+    size_t pos, start;
+    long offset = -1;
+    int sections = 0;
+
+    /* 'startxref' is within the last few lines of the file */
+    for (size_t i = r->length >= 9 ? r->length - 9 + 1 : 0;
+         i-- > 0 && r->length - i < 1024;)
+        if (memcmp(&r->data[i], "startxref", 9) == 0) {
+            pos = i + 9;
+            if (pdf_reader_token(r, &pos, &start) != PDF_TOK_NUMBER ||
+                pdf_reader_int(r, start, pos, &offset) < 0)
+                offset = -1;
+            break;
+        }
+    if (offset <= 0)
+        return pdf_set_err(r->pdf, -EINVAL,
+                           "Unable to find PDF cross-reference table");
+
+    /* Newer sections come first, and take precedence over older ones
+     * linked via /Prev */
+    while (offset > 0) {
+        struct pdf_value trailer, value;
+        int type;
+
+        if (++sections > 64 || (size_t)offset >= r->length)
+            return pdf_set_err(r->pdf, -EINVAL,
+                               "Invalid PDF cross-reference offset %ld",
+                               offset);
+        pos = offset;
+        type = pdf_reader_token(r, &pos, &start);
+        if (type == PDF_TOK_NUMBER)
+            return pdf_set_err(r->pdf, -ENOTSUP,
+                               "PDF cross-reference streams are not "
+                               "supported");
+        if (type != PDF_TOK_KEYWORD || !pdf_reader_is(r, start, pos, "xref"))
+            return pdf_set_err(r->pdf, -EINVAL,
+                               "Invalid PDF cross-reference table at %ld",
+                               offset);
+
+        for (;;) {
+            long first, count;
+
+            type = pdf_reader_token(r, &pos, &start);
+            if (type == PDF_TOK_KEYWORD &&
+                pdf_reader_is(r, start, pos, "trailer"))
+                break;
+            /* Each entry takes 20 bytes, which bounds the count */
+            if (type != PDF_TOK_NUMBER ||
+                pdf_reader_int(r, start, pos, &first) < 0 ||
+                pdf_reader_token(r, &pos, &start) != PDF_TOK_NUMBER ||
+                pdf_reader_int(r, start, pos, &count) < 0 || first < 0 ||
+                count < 0 || (size_t)count > (r->length - pos) / 18 ||
+                (size_t)first > r->length || first + count > INT_MAX)
+                return pdf_set_err(r->pdf, -EINVAL,
+                                   "Invalid PDF cross-reference section at "
+                                   "%zu",
+                                   start);
+
+            if (first + count > r->object_count) {
+                size_t *offsets = (size_t *)realloc(
+                    r->offsets, (first + count) * sizeof(*offsets));
+                if (!offsets)
+                    return pdf_set_err(r->pdf, -ENOMEM,
+                                       "Unable to allocate %ld PDF objects",
+                                       first + count);
+                memset(&offsets[r->object_count], 0,
+                       (first + count - r->object_count) * sizeof(*offsets));
+                r->offsets = offsets;
+                r->object_count = (int)(first + count);
+            }
 
-    obj = pdf_add_raw_grayscale8(pdf, data, width, height);
-    if (!obj)
-        return pdf->errval;
+            for (long i = first; i < first + count; i++) {
+                size_t keyword;
+                long entry;
+
+                if (pdf_reader_token(r, &pos, &start) != PDF_TOK_NUMBER ||
+                    pdf_reader_int(r, start, pos, &entry) < 0 ||
+                    pdf_reader_token(r, &pos, &keyword) != PDF_TOK_NUMBER ||
+                    pdf_reader_token(r, &pos, &keyword) != PDF_TOK_KEYWORD)
+                    return pdf_set_err(r->pdf, -EINVAL,
+                                       "Invalid PDF cross-reference entry "
+                                       "for object %ld",
+                                       i);
+                if (r->offsets[i])
+                    continue;
+                if (pdf_reader_is(r, keyword, pos, "n") && entry > 0 &&
+                    (size_t)entry < r->length)
+                    r->offsets[i] = entry;
+                else
+                    r->offsets[i] = PDF_READER_FREE;
+            }
+        }
 
-    if (get_img_display_dimensions(pdf, width, height, &display_width,
-                                   &display_height)) {
-        return pdf->errval;
-    }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+        if (pdf_reader_value(r, &pos, &trailer, 0) < 0)
+            return pdf_get_errval(r->pdf);
+        if (trailer.type != PDF_TOK_DICT_START)
+            return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF trailer");
+        if (!r->root &&
+            pdf_reader_dict_get(r, &trailer, "Root", &value) == 0 &&
+            value.type == PDF_TOK_REF)
+            r->root = value.ref;
+        offset = 0;
+        if (pdf_reader_dict_get(r, &trailer, "Prev", &value) == 0 &&
+            pdf_reader_int(r, value.start, value.end, &offset) < 0)
+            return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF trailer");
+    }
+
+    if (!r->root)
+        return pdf_set_err(r->pdf, -EINVAL, "Missing PDF document catalog");
+    return 0;
 }
 
-static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
-                            size_t length, char *err_msg,
-                            size_t err_msg_length)
+/**
+ * Walk the page tree to find the page_number'th page, collecting any
+ * attributes it inherits along the way.
+ * Returns 1 once found, 0 if the page isn't under this node
+ */
+static int pdf_reader_find_page(struct pdf_reader *r,
+                                const struct pdf_value *node,
+                                int *page_number,
+                                struct pdf_reader_page *info, int depth)
 {
-    if (length <= sizeof(png_signature)) {
-        snprintf(err_msg, err_msg_length, "PNG file too short");
-        return -EINVAL;
-    }
+    struct pdf_value kids, kid, value;
+    size_t pos;
+    int ret;
 
-    if (memcmp(data, png_signature, sizeof(png_signature))) {
-        snprintf(err_msg, err_msg_length, "File is not correct PNG file");
-        return -EINVAL;
+    /* Guard against loops in the tree */
+    if (depth > PDF_READER_MAX_DEPTH || ++r->visits > r->object_count + 16)
+        return pdf_set_err(r->pdf, -ELOOP, "Invalid PDF page tree");
+    if (node->type != PDF_TOK_DICT_START)
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF page tree node");
+
+    if (pdf_reader_dict_get(r, node, "Resources", &value) == 0)
+        info->resources = value;
+    if (pdf_reader_dict_get(r, node, "MediaBox", &value) == 0)
+        info->media_box = value;
+    if (pdf_reader_dict_get(r, node, "CropBox", &value) == 0)
+        info->crop_box = value;
+
+    if (pdf_reader_dict_lookup(r, node, "Kids", &kids) < 0) {
+        if (--*page_number > 0)
+            return 0;
+        info->page = *node;
+        return 1;
+    }
+    if (kids.type != PDF_TOK_ARRAY_START)
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF page tree kids");
+
+    pos = kids.start + 1;
+    while ((ret = pdf_reader_array_next(r, &pos, &kid)) > 0) {
+        struct pdf_reader_page child = *info;
+        long count;
+
+        if (pdf_reader_resolve(r, &kid, &kid) < 0)
+            return pdf_get_errval(r->pdf);
+        /* Skip over whole subtrees which come before the page */
+        if (pdf_reader_dict_get(r, &kid, "Kids", &value) == 0 &&
+            pdf_reader_dict_lookup(r, &kid, "Count", &value) == 0 &&
+            pdf_reader_int(r, value.start, value.end, &count) == 0 &&
+            count >= 0 && count < *page_number) {
+            *page_number -= (int)count;
+            continue;
+        }
+        ret = pdf_reader_find_page(r, &kid, page_number, &child, depth + 1);
+        if (ret > 0)
+            *info = child;
+        if (ret != 0)
+            return ret;
     }
+    return ret;
+}
 
-    // process first PNG chunk
-    uint32_t pos = sizeof(png_signature);
-    const struct png_chunk *chunk = (const struct png_chunk *)&data[pos];
-    pos += sizeof(struct png_chunk);
-    if (pos > length) {
-        snprintf(err_msg, err_msg_length, "PNG file too short");
-        return -EINVAL;
+static int pdf_reader_copy(struct pdf_reader *r, int num, int depth,
+                           struct pdf_object **copy);
+
+static void pdf_reader_emit_hex(struct dstr *str, unsigned char ch)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char buf[2] = {hex[ch >> 4], hex[ch & 0xf]};
+    dstr_append_data(str, buf, 2);
+}
+
+/* Strings are written out in hex, which avoids any escaping issues */
+static void pdf_reader_emit_string(struct pdf_reader *r, struct dstr *str,
+                                   const struct pdf_value *v)
+{
+    const char *data = r->data;
+    size_t end = v->end - 1;
+
+    dstr_append(str, "<");
+    if (v->type == PDF_TOK_HEX_STRING) {
+        for (size_t i = v->start + 1; i < end; i++)
+            if (isxdigit((unsigned char)data[i]))
+                dstr_append_data(str, &data[i], 1);
+        dstr_append(str, ">");
+        return;
     }
-    if (strncmp(chunk->type, png_chunk_header, 4) == 0) {
-        // header found, process width and height, check errors
-        struct png_header *header = &info->png;
 
-        if (pos + sizeof(struct png_header) > length) {
-            snprintf(err_msg, err_msg_length, "PNG file too short");
-            return -EINVAL;
-        }
+    for (size_t i = v->start + 1; i < end; i++) {
+        unsigned char ch = data[i];
 
-        memcpy(header, &data[pos], sizeof(struct png_header));
-        if (header->deflate != 0) {
-            snprintf(err_msg, err_msg_length, "Deflate wrong in PNG header");
-            return -EINVAL;
-        }
-        if (header->bitDepth == 0) {
-            snprintf(err_msg, err_msg_length, "PNG file has zero bit depth");
-            return -EINVAL;
+        if (ch == '\\' && i + 1 < end) {
+            ch = data[++i];
+            switch (ch) {
+            case 'n':
+                ch = '\n';
+                break;
+            case 'r':
+                ch = '\r';
+                break;
+            case 't':
+                ch = '\t';
+                break;
+            case 'b':
+                ch = '\b';
+                break;
+            case 'f':
+                ch = '\f';
+                break;
+            case '\r':
+                /* Line continuation */
+                if (i + 1 < end && data[i + 1] == '\n')
+                    i++;
+                continue;
+            case '\n':
+                continue;
+            default:
+                if (ch >= '0' && ch <= '7') {
+                    int octal = ch - '0';
+                    for (int digit = 1; digit < 3 && i + 1 < end &&
+                                        data[i + 1] >= '0' &&
+                                        data[i + 1] <= '7';
+                         digit++)
+                        octal = octal * 8 + data[++i] - '0';
+                    ch = (unsigned char)octal;
+                }
+                /* Anything else (eg: parentheses) stands for itself */
+                break;
+            }
+        } else if (ch == '\r') {
+            /* End of line markers all become '\n' */
+            if (i + 1 < end && data[i + 1] == '\n')
+                i++;
+            ch = '\n';
         }
-        // ensure the width and height values have the proper byte order
-        // and copy them into the info struct.
-        header->width = ntoh32(header->width);
-        header->height = ntoh32(header->height);
-        info->width = header->width;
-        info->height = header->height;
-        return 0;
+        pdf_reader_emit_hex(str, ch);
     }
-    snprintf(err_msg, err_msg_length, "Failed to read PNG file header");
-    return -EINVAL;
+    dstr_append(str, ">");
 }
 
-static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *img_info,
-                            const uint8_t *png_data, size_t png_data_length)
+/* Names are written with any unusual characters escaped */
+static void pdf_reader_emit_name(struct pdf_reader *r, struct dstr *str,
+                                 const struct pdf_value *v)
+{
+    dstr_append(str, "/");
+    for (size_t i = v->start + 1; i < v->end; i++) {
+        unsigned char ch = r->data[i];
+        if (ch < 0x21 || ch > 0x7e) {
+            dstr_append(str, "#");
+            pdf_reader_emit_hex(str, ch);
+        } else {
+            dstr_append_data(str, &r->data[i], 1);
+        }
+    }
+}
+
+/**
+ * Append a value to a raw object, copying across any objects it refers to.
+ * If 'extra' is given, the value is a stream dictionary: its /Length is
+ * dropped, and 'extra' written at the end instead
+ */
+static int pdf_reader_emit(struct pdf_reader *r, struct pdf_object *obj,
+                           const struct pdf_value *v, int depth,
+                           const char *extra)
 {
-    // indicates if we return an error or add the img at the
-    // end of the function
-    bool success = false;
+    struct dstr *str = &obj->raw.data;
+    struct pdf_value key, item;
+    size_t pos;
+    int ret;
 
-    // string stream used for writing color space (and palette) info
-    // into the pdf
-    struct dstr colour_space = INIT_DSTR;
+    if (depth > PDF_READER_MAX_DEPTH)
+        return pdf_set_err(r->pdf, -ELOOP, "PDF nested too deeply at %zu",
+                           v->start);
 
-    struct pdf_object *obj = NULL;
-    uint8_t *final_data = NULL;
-    int written = 0;
-    uint32_t pos;
-    uint8_t *png_data_temp = NULL;
-    size_t png_data_total_length = 0;
-    uint8_t ncolours;
+    switch (v->type) {
+    case PDF_TOK_NUMBER:
+        dstr_append_data(str, &r->data[v->start], v->end - v->start);
+        break;
 
-    // Stores palette information for indexed PNGs
-    struct rgb_value *palette_buffer = NULL;
-    size_t palette_buffer_length = 0;
+    case PDF_TOK_KEYWORD:
+        if (!pdf_reader_is(r, v->start, v->end, "true") &&
+            !pdf_reader_is(r, v->start, v->end, "false") &&
+            !pdf_reader_is(r, v->start, v->end, "null"))
+            return pdf_set_err(r->pdf, -EINVAL,
+                               "Unexpected PDF keyword at %zu", v->start);
+        dstr_append_data(str, &r->data[v->start], v->end - v->start);
+        break;
 
-    const struct png_header *header = &img_info->png;
+    case PDF_TOK_NAME:
+        pdf_reader_emit_name(r, str, v);
+        break;
 
-    // Father info from png header
-    switch (header->colorType) {
-    case PNG_COLOR_GREYSCALE:
-        ncolours = 1;
+    case PDF_TOK_STRING:
+    case PDF_TOK_HEX_STRING:
+        pdf_reader_emit_string(r, str, v);
         break;
-    case PNG_COLOR_RGB:
-        ncolours = 3;
+
+    case PDF_TOK_ARRAY_START:
+        dstr_append(str, "[");
+        pos = v->start + 1;
+        for (bool first = true;
+             (ret = pdf_reader_array_next(r, &pos, &item)) > 0;
+             first = false) {
+            if (!first)
+                dstr_append(str, " ");
+            if ((ret = pdf_reader_emit(r, obj, &item, depth + 1, NULL)) < 0)
+                return ret;
+        }
+        if (ret < 0)
+            return ret;
+        dstr_append(str, "]");
         break;
-    case PNG_COLOR_INDEXED:
-        ncolours = 1;
+
+    case PDF_TOK_DICT_START:
+        dstr_append(str, "<<");
+        pos = v->start + 2;
+        while ((ret = pdf_reader_dict_next(r, &pos, &key, &item)) > 0) {
+            if (extra && pdf_reader_is(r, key.start, key.end, "/Length"))
+                continue;
+            pdf_reader_emit_name(r, str, &key);
+            dstr_append(str, " ");
+            if ((ret = pdf_reader_emit(r, obj, &item, depth + 1, NULL)) < 0)
+                return ret;
+            dstr_append(str, " ");
+        }
+        if (ret < 0)
+            return ret;
+        if (extra)
+            dstr_append(str, extra);
+        dstr_append(str, ">>");
         break;
-    // PNG_COLOR_RGBA and PNG_COLOR_GREYSCALE_A are unsupported
-    default:
-        pdf_set_err(pdf, -EINVAL, "PNG has unsupported color type: %d",
-                    header->colorType);
-        goto free_buffers;
+
+    case PDF_TOK_REF: {
+        struct pdf_object *target;
+
+        if ((ret = pdf_reader_copy(r, v->ref, depth + 1, &target)) < 0)
+            return ret;
+        if (!target) {
+            dstr_append(str, "null");
+            break;
+        }
+        if (flexarray_append(&obj->raw.refs, target) < 0)
+            return pdf_set_err(r->pdf, -ENOMEM,
+                               "Unable to allocate PDF reference");
+        dstr_append(str, PDF_RAW_REF_STR);
         break;
     }
 
-    /* process PNG chunks */
-    pos = sizeof(png_signature);
+    default:
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF syntax at %zu",
+                           v->start);
+    }
+    return 0;
+}
 
-    while (1) {
-        const struct png_chunk *chunk;
+/**
+ * Copy object 'num' (and everything it refers to) in to the document.
+ * *copy is left NULL for objects which are deliberately not copied
+ */
+static int pdf_reader_copy(struct pdf_reader *r, int num, int depth,
+                           struct pdf_object **copy)
+{
+    struct pdf_value v, type;
+    struct pdf_object *obj;
+    size_t after, start, length;
+    char extra[32];
+    int ret;
 
-        chunk = (const struct png_chunk *)&png_data[pos];
-        pos += sizeof(struct png_chunk);
+    *copy = NULL;
+    /* References to missing objects are treated as null */
+    if (num <= 0 || num >= r->object_count || !r->offsets[num] ||
+        r->offsets[num] == PDF_READER_FREE)
+        return 0;
+    if (r->copies[num]) {
+        *copy = r->copies[num];
+        return 0;
+    }
 
-        if (pos > png_data_length - 4) {
-            pdf_set_err(pdf, -EINVAL, "PNG file too short");
-            goto free_buffers;
-        }
-        const uint32_t chunk_length = ntoh32(chunk->length);
-        // chunk length + 4-bytes of CRC
-        if (chunk_length > png_data_length - pos - 4) {
-            pdf_set_err(pdf, -EINVAL, "PNG chunk exceeds file: %d vs %ld",
-                        chunk_length, png_data_length - pos - 4);
-            goto free_buffers;
-        }
-        if (strncmp(chunk->type, png_chunk_header, 4) == 0) {
-            // Ignoring the header, since it was parsed
-            // before calling this function.
-        } else if (strncmp(chunk->type, png_chunk_palette, 4) == 0) {
-            // Palette chunk
-            if (header->colorType == PNG_COLOR_INDEXED) {
-                // palette chunk is needed for indexed images
-                if (palette_buffer) {
-                    pdf_set_err(pdf, -EINVAL,
-                                "PNG contains multiple palette chunks");
-                    goto free_buffers;
-                }
-                if (chunk_length % 3 != 0) {
-                    pdf_set_err(pdf, -EINVAL,
-                                "PNG format error: palette chunk length is "
-                                "not divisbly by 3!");
-                    goto free_buffers;
-                }
-                palette_buffer_length = (size_t)(chunk_length / 3);
-                if (palette_buffer_length > 256 ||
-                    palette_buffer_length == 0) {
-                    pdf_set_err(pdf, -EINVAL,
-                                "PNG palette length invalid: %zd",
-                                palette_buffer_length);
-                    goto free_buffers;
-                }
-                palette_buffer = (struct rgb_value *)malloc(
-                    palette_buffer_length * sizeof(struct rgb_value));
-                if (!palette_buffer) {
-                    pdf_set_err(pdf, -ENOMEM,
-                                "Could not allocate memory for indexed color "
-                                "palette (%zu bytes)",
-                                palette_buffer_length *
-                                    sizeof(struct rgb_value));
-                    goto free_buffers;
-                }
-                for (size_t i = 0; i < palette_buffer_length; i++) {
-                    size_t offset = (i * 3) + pos;
-                    palette_buffer[i].red = png_data[offset];
-                    palette_buffer[i].green = png_data[offset + 1];
-                    palette_buffer[i].blue = png_data[offset + 2];
-                }
-            } else if (header->colorType == PNG_COLOR_RGB ||
-                       header->colorType == PNG_COLOR_RGBA) {
-                // palette chunk is optional for RGB(A) images
-                // but we do not process them
-            } else {
-                pdf_set_err(pdf, -EINVAL,
-                            "Unexpected palette chunk for color type %d",
-                            header->colorType);
-                goto free_buffers;
-            }
-        } else if (strncmp(chunk->type, png_chunk_data, 4) == 0) {
-            if (chunk_length > 0 && chunk_length < png_data_length - pos) {
-                uint8_t *data = (uint8_t *)realloc(
-                    png_data_temp, png_data_total_length + chunk_length);
-                // (uint8_t *)realloc(info.data, info.length + chunk_length);
-                if (!data) {
-                    pdf_set_err(pdf, -ENOMEM, "No memory for PNG data");
-                    goto free_buffers;
-                }
-                png_data_temp = data;
-                memcpy(&png_data_temp[png_data_total_length], &png_data[pos],
-                       chunk_length);
-                png_data_total_length += chunk_length;
-            }
-        } else if (strncmp(chunk->type, png_chunk_end, 4) == 0) {
-            /* end of file, exit */
-            break;
-        }
+    if ((ret = pdf_reader_object(r, num, &v, &after)) < 0)
+        return ret;
 
-        if (chunk_length >= png_data_length) {
-            pdf_set_err(pdf, -EINVAL, "PNG chunk length larger than file");
-            goto free_buffers;
-        }
+    /* Links to other pages (eg: from annotations) are dropped, rather than
+     * dragging in the rest of the document */
+    if (pdf_reader_dict_get(r, &v, "Type", &type) == 0 &&
+        (pdf_reader_is(r, type.start, type.end, "/Page") ||
+         pdf_reader_is(r, type.start, type.end, "/Pages") ||
+         pdf_reader_is(r, type.start, type.end, "/Catalog")))
+        return 0;
 
-        pos += chunk_length;     // add chunk length
-        pos += sizeof(uint32_t); // add CRC length
+    obj = pdf_add_object(r->pdf, OBJ_raw);
+    if (!obj)
+        return pdf_get_errval(r->pdf);
+    r->copies[num] = obj;
+    *copy = obj;
+
+    ret = v.type == PDF_TOK_DICT_START
+              ? pdf_reader_stream(r, &v, after, &start, &length)
+              : 0;
+    if (ret < 0)
+        return ret;
+    if (ret) {
+        snprintf(extra, sizeof(extra), "/Length %zu", length);
+        if ((ret = pdf_reader_emit(r, obj, &v, depth, extra)) < 0)
+            return ret;
+        dstr_append(&obj->raw.data, "stream\r\n");
+        obj->raw.dict_len = dstr_len(&obj->raw.data);
+        dstr_append_data(&obj->raw.data, &r->data[start], length);
+        dstr_append(&obj->raw.data, "\r\nendstream\r\n");
+    } else {
+        if ((ret = pdf_reader_emit(r, obj, &v, depth, NULL)) < 0)
+            return ret;
+        dstr_append(&obj->raw.data, "\r\n");
+        obj->raw.dict_len = dstr_len(&obj->raw.data);
     }
+    return 0;
+}
 
-    /* if no length was found */
-    if (png_data_total_length == 0) {
-        pdf_set_err(pdf, -EINVAL, "PNG file has zero length");
-        goto free_buffers;
+/**
+ * Gather the page's content streams. A single stream keeps its filters,
+ * several are only concatenated if they're unfiltered
+ */
+static int pdf_reader_contents(struct pdf_reader *r,
+                               const struct pdf_value *page,
+                               struct pdf_object *form, struct dstr *content)
+{
+    struct pdf_value contents, item, stream, value;
+    size_t pos, after, start, length;
+    int streams[64];
+    int stream_count = 0;
+    int ret;
+
+    if (pdf_reader_dict_get(r, page, "Contents", &contents) < 0)
+        return 0;
+    /* Either a stream, or an array of them (possibly itself indirect) */
+    if (contents.type == PDF_TOK_REF) {
+        if ((ret = pdf_reader_object(r, contents.ref, &value, NULL)) < 0)
+            return ret;
+    } else if (contents.type == PDF_TOK_ARRAY_START) {
+        value = contents;
+    } else {
+        return pdf_set_err(r->pdf, -EINVAL, "Invalid PDF page contents");
     }
 
-    switch (header->colorType) {
-    case PNG_COLOR_GREYSCALE:
-        dstr_append(&colour_space, "/DeviceGray");
-        break;
-    case PNG_COLOR_RGB:
-        dstr_append(&colour_space, "/DeviceRGB");
-        break;
-    case PNG_COLOR_INDEXED:
-        if (palette_buffer_length == 0) {
-            pdf_set_err(pdf, -EINVAL, "Indexed PNG contains no palette");
-            goto free_buffers;
+    if (value.type == PDF_TOK_ARRAY_START) {
+        pos = value.start + 1;
+        while ((ret = pdf_reader_array_next(r, &pos, &item)) > 0) {
+            if (item.type != PDF_TOK_REF ||
+                stream_count >= (int)ARRAY_SIZE(streams))
+                return pdf_set_err(r->pdf, -ENOTSUP,
+                                   "Unsupported PDF page contents");
+            streams[stream_count++] = item.ref;
         }
-        // Write the color palette to the color_palette buffer
-        dstr_printf(&colour_space,
-                    "[ /Indexed\r\n"
-                    "  /DeviceRGB\r\n"
-                    "  %zu\r\n"
-                    "  <",
-                    palette_buffer_length - 1);
-        // write individual paletter values
-        // the index value for every RGB value is determined by its position
-        // (0, 1, 2, ...)
-        for (size_t i = 0; i < palette_buffer_length; i++) {
-            dstr_printf(&colour_space, "%02X%02X%02X ", palette_buffer[i].red,
-                        palette_buffer[i].green, palette_buffer[i].blue);
+        if (ret < 0)
+            return ret;
+    } else {
+        streams[stream_count++] = contents.ref;
+    }
+
+    for (int i = 0; i < stream_count; i++) {
+        if ((ret = pdf_reader_object(r, streams[i], &stream, &after)) < 0)
+            return ret;
+        if (stream.type != PDF_TOK_DICT_START ||
+            (ret = pdf_reader_stream(r, &stream, after, &start,
+                                     &length)) <= 0)
+            return ret < 0 ? ret
+                           : pdf_set_err(r->pdf, -EINVAL,
+                                         "Invalid PDF content stream %d",
+                                         streams[i]);
+
+        if (pdf_reader_dict_get(r, &stream, "Filter", &value) == 0) {
+            if (stream_count > 1)
+                return pdf_set_err(r->pdf, -ENOTSUP,
+                                   "Pages with several compressed content "
+                                   "streams are not supported");
+            dstr_append(&form->raw.data, "  /Filter ");
+            if ((ret = pdf_reader_emit(r, form, &value, 0, NULL)) < 0)
+                return ret;
+            dstr_append(&form->raw.data, "\r\n");
+            if (pdf_reader_dict_get(r, &stream, "DecodeParms", &value) ==
+                0) {
+                dstr_append(&form->raw.data, "  /DecodeParms ");
+                if ((ret = pdf_reader_emit(r, form, &value, 0, NULL)) < 0)
+                    return ret;
+                dstr_append(&form->raw.data, "\r\n");
+            }
         }
-        dstr_append(&colour_space, ">\r\n]");
-        break;
+        if (i > 0)
+            dstr_append(content, "\n");
+        dstr_append_data(content, &r->data[start], length);
+    }
+    return 0;
+}
 
-    default:
-        pdf_set_err(pdf, -EINVAL,
-                    "Cannot map PNG color type %d to PDF color space",
-                    header->colorType);
-        goto free_buffers;
-        break;
+static struct pdf_object *pdf_reader_import(struct pdf_reader *r,
+                                            int page_number)
+{
+    struct pdf_reader_page info;
+    struct pdf_value catalog, pages, box, item;
+    struct pdf_object *form;
+    struct dstr content = INIT_DSTR;
+    size_t pos;
+    int requested = page_number;
+    int ret;
+
+    memset(&info, 0, sizeof(info));
+    if (pdf_reader_object(r, r->root, &catalog, NULL) < 0)
+        return NULL;
+    if (pdf_reader_dict_lookup(r, &catalog, "Pages", &pages) < 0) {
+        pdf_set_err(r->pdf, -EINVAL, "Missing PDF page tree");
+        return NULL;
+    }
+    ret = pdf_reader_find_page(r, &pages, &page_number, &info, 0);
+    if (ret < 0)
+        return NULL;
+    if (ret == 0) {
+        pdf_set_err(r->pdf, -ENOENT, "PDF has no page %d", requested);
+        return NULL;
     }
 
-    final_data = (uint8_t *)malloc(png_data_total_length + 1024 +
-                                   dstr_len(&colour_space));
-    if (!final_data) {
-        pdf_set_err(pdf, -ENOMEM, "Unable to allocate PNG data %zu",
-                    png_data_total_length + 1024 + dstr_len(&colour_space));
-        goto free_buffers;
+    form = pdf_add_object(r->pdf, OBJ_form);
+    if (!form)
+        return NULL;
+    /* Names come from a counter, so they stay fixed even if the object is
+     * renumbered or moved to another document later on */
+    form->raw.name = ++r->pdf->last_name;
+
+    box = info.crop_box.type ? info.crop_box : info.media_box;
+    if (!box.type || pdf_reader_resolve(r, &box, &box) < 0 ||
+        box.type != PDF_TOK_ARRAY_START) {
+        pdf_set_err(r->pdf, -EINVAL, "Invalid PDF page size");
+        return NULL;
     }
+    pos = box.start + 1;
+    for (int i = 0; i < 4; i++)
+        if (pdf_reader_array_next(r, &pos, &item) <= 0 ||
+            pdf_reader_resolve(r, &item, &item) < 0 ||
+            pdf_reader_real(r, &item, &form->raw.bbox[i]) < 0) {
+            pdf_set_err(r->pdf, -EINVAL, "Invalid PDF page size");
+            return NULL;
+        }
+    /* Boxes may be given with any pair of opposite corners */
+    for (int i = 0; i < 2; i++)
+        if (form->raw.bbox[i] > form->raw.bbox[i + 2]) {
+            float tmp = form->raw.bbox[i];
+            form->raw.bbox[i] = form->raw.bbox[i + 2];
+            form->raw.bbox[i + 2] = tmp;
+        }
 
-    // Write image information to PDF
-    written =
-        sprintf((char *)final_data,
+    dstr_printf(&form->raw.data,
                 "<<\r\n"
                 "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace %s\r\n"
-                "  /Width %u\r\n"
-                "  /Height %u\r\n"
-                "  /Interpolate true\r\n"
-                "  /BitsPerComponent %u\r\n"
-                "  /Filter /FlateDecode\r\n"
-                "  /DecodeParms << /Predictor 15 /Colors %d "
-                "/BitsPerComponent %u /Columns %u >>\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), dstr_data(&colour_space),
-                header->width, header->height, header->bitDepth, ncolours,
-                header->bitDepth, header->width, png_data_total_length);
-
-    memcpy(&final_data[written], png_data_temp, png_data_total_length);
-    written += png_data_total_length;
-    written += sprintf((char *)&final_data[written], "\r\nendstream\r\n");
-
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        goto free_buffers;
-    }
-
-    dstr_append_data(&obj->stream.stream, final_data, written);
-
-    if (get_img_display_dimensions(pdf, header->width, header->height,
-                                   &display_width, &display_height)) {
-        goto free_buffers;
+                "  /Subtype /Form\r\n"
+                "  /BBox [%f %f %f %f]\r\n",
+                form->raw.bbox[0], form->raw.bbox[1], form->raw.bbox[2],
+                form->raw.bbox[3]);
+    if (info.resources.type) {
+        dstr_append(&form->raw.data, "  /Resources ");
+        if (pdf_reader_emit(r, form, &info.resources, 0, NULL) < 0)
+            return NULL;
+        dstr_append(&form->raw.data, "\r\n");
+    }
+    if (pdf_reader_contents(r, &info.page, form, &content) < 0) {
+        dstr_free(&content);
+        return NULL;
     }
-    success = true;
-
-free_buffers:
-    if (final_data)
-        free(final_data);
-    if (palette_buffer)
-        free(palette_buffer);
-    if (png_data_temp)
-        free(png_data_temp);
-    dstr_free(&colour_space);
+    dstr_printf(&form->raw.data, "  /Length %zu\r\n>>stream\r\n",
+                dstr_len(&content));
+    form->raw.dict_len = dstr_len(&form->raw.data);
+    dstr_append_data(&form->raw.data, dstr_data(&content),
+                     dstr_len(&content));
+    dstr_append(&form->raw.data, "\r\nendstream\r\n");
+    dstr_free(&content);
 
-    if (success)
-        return pdf_add_image(pdf, page, obj, x, y, display_width,
-                             display_height);
-    else
-        return pdf->errval;
+    return form;
 }
 
-static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
-                            size_t data_length, char *err_msg,
-                            size_t err_msg_length)
+struct pdf_object *pdf_import_page_data(struct pdf_doc *pdf,
+                                        const uint8_t *data, size_t length,
+                                        int page_number)
 {
-    if (data_length < sizeof(bmp_signature) + sizeof(struct bmp_header)) {
-        snprintf(err_msg, err_msg_length, "File is too short");
-        return -EINVAL;
-    }
+    struct pdf_reader r;
+    struct pdf_object *form = NULL;
+    int object_count;
+    uint64_t data_heap = 0;
 
-    if (memcmp(data, bmp_signature, sizeof(bmp_signature))) {
-        snprintf(err_msg, err_msg_length, "File is not correct BMP file");
-        return -EINVAL;
+    if (!pdf)
+        return NULL;
+    if (!data || page_number < 1) {
+        pdf_set_err(pdf, -EINVAL, "Invalid page number %d", page_number);
+        return NULL;
     }
-    memcpy(&info->bmp, &data[sizeof(bmp_signature)],
-           sizeof(struct bmp_header));
-    if (info->bmp.biWidth < 0) {
-        snprintf(err_msg, err_msg_length, "BMP has negative width");
-        return -EINVAL;
+
+    memset(&r, 0, sizeof(r));
+    r.pdf = pdf;
+    /* Offsets are relative to the header, which may have junk before it */
+    for (size_t i = 0; i + 5 <= length && i < 1024; i++)
+        if (memcmp(&data[i], "%PDF-", 5) == 0) {
+            r.data = (const char *)&data[i];
+            r.length = length - i;
+            break;
+        }
+    if (!r.data) {
+        pdf_set_err(pdf, -EINVAL, "Not a PDF file");
+        return NULL;
     }
-    if (info->bmp.biHeight == INT_MIN) {
-        snprintf(err_msg, err_msg_length, "BMP height overflow");
-        return -EINVAL;
+
+    object_count = flexarray_size(&pdf->objects);
+    if (pdf_reader_load_xref(&r) == 0) {
+        r.copies = (struct pdf_object **)calloc(r.object_count,
+                                                sizeof(*r.copies));
+        if (!r.copies)
+            pdf_set_err(pdf, -ENOMEM, "Unable to allocate %d PDF objects",
+                        r.object_count);
+        else
+            form = pdf_reader_import(&r, page_number);
+    }
+    free(r.offsets);
+    free(r.copies);
+
+    /* The objects themselves were charged for when they were created, &
+     * their data is reserved now that its size is known */
+    for (int i = object_count; i < flexarray_size(&pdf->objects); i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (obj) {
+            data_heap += pdf_object_heap(obj) - pdf_object_size(obj->type);
+            pdf_count_object(pdf, obj, 1);
+        }
     }
-    info->width = info->bmp.biWidth;
-    // biHeight might be negative (positive indicates vertically mirrored
-    // lines)
-    info->height = abs(info->bmp.biHeight);
-    return 0;
+    if (form && pdf_reserve_heap(pdf, data_heap) == 0)
+        return form;
+
+    /* Don't leave partial copies behind. Truncating releases their data
+     * along with the objects, so it's charged for first */
+    pdf_charge(pdf, data_heap);
+    pdf_truncate_objects(pdf, object_count);
+    return NULL;
 }
 
-static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *data, const size_t len)
+struct pdf_object *pdf_import_page(struct pdf_doc *pdf, const char *filename,
+                                   int page_number)
 {
-    const struct bmp_header *header = &info->bmp;
-    uint8_t *bmp_data = NULL;
-    uint8_t row_padding;
-    uint32_t bpp;
-    size_t data_len;
-    int retval;
-    const uint32_t width = info->width;
-    const uint32_t height = info->height;
-
-    if (header->bfSize != len)
-        return pdf_set_err(pdf, -EINVAL,
-                           "BMP file seems to have wrong length");
-    if (header->biSize != 40)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP header: biSize");
-    if (header->biCompression != 0)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP compression value: %d",
-                           header->biCompression);
-    if (header->biWidth > MAX_IMAGE_WIDTH || header->biWidth <= 0 ||
-        width > MAX_IMAGE_WIDTH || width == 0)
-        return pdf_set_err(pdf, -EINVAL, "BMP has invalid width: %d",
-                           header->biWidth);
-    if (header->biHeight > MAX_IMAGE_HEIGHT ||
-        header->biHeight < -MAX_IMAGE_HEIGHT || header->biHeight == 0 ||
-        height > MAX_IMAGE_HEIGHT || height == 0)
-        return pdf_set_err(pdf, -EINVAL, "BMP has invalid height: %d",
-                           header->biHeight);
-    if (header->biBitCount != 24 && header->biBitCount != 32)
-        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
-                           header->biBitCount);
-    bpp = header->biBitCount / 8;
-    /* BMP rows are 4-bytes padded! */
-    row_padding = (width * bpp) & 3;
-    data_len = (size_t)width * (size_t)height * 3;
+    struct pdf_object *form;
+    uint8_t *data;
+    size_t len;
 
-    if (header->bfOffBits >= len)
-        return pdf_set_err(pdf, -EINVAL, "Invalid BMP image offset");
+    if (!pdf)
+        return NULL;
+    data = get_file(pdf, filename, &len);
+    if (!data)
+        return NULL;
+    form = pdf_import_page_data(pdf, data, len, page_number);
+    free(data);
+    return form;
+}
 
-    if (len - header->bfOffBits <
-        (size_t)height * (width + row_padding) * bpp)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP image size");
+int pdf_add_form(struct pdf_doc *pdf, struct pdf_object *page,
+                 struct pdf_object *form, float x, float y, float width,
+                 float height)
+{
+    float form_width, form_height;
+    float scale_x, scale_y;
+    bool found = false;
+    struct dstr str = INIT_DSTR;
+    int ret;
 
-    if (bpp == 3) {
-        /* 24 bits: change R and B colors */
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
-        for (uint32_t pos = 0; pos < width * height; pos++) {
-            uint32_t src_pos =
-                header->bfOffBits + 3 * (pos + (pos / width) * row_padding);
+    if (!page)
+        page = pdf_find_last_object(pdf, OBJ_page);
 
-            bmp_data[pos * 3] = data[src_pos + 2];
-            bmp_data[pos * 3 + 1] = data[src_pos + 1];
-            bmp_data[pos * 3 + 2] = data[src_pos];
-        }
-    } else if (bpp == 4) {
-        /* 32 bits: change R and B colors, remove key color */
-        int offs = 0;
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
+    if (!page)
+        return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
 
-        for (uint32_t pos = 0; pos < width * height * 4; pos += 4) {
-            bmp_data[offs] = data[header->bfOffBits + pos + 2];
-            bmp_data[offs + 1] = data[header->bfOffBits + pos + 1];
-            bmp_data[offs + 2] = data[header->bfOffBits + pos];
-            offs += 3;
-        }
-    } else {
-        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
-                           header->biBitCount);
-    }
-    if (header->biHeight >= 0) {
-        // BMP has vertically mirrored representation of lines, so swap them
-        uint8_t *line = (uint8_t *)malloc(width * 3);
-        if (!line) {
-            free(bmp_data);
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Unable to allocate memory for bitmap mirror");
-        }
-        for (uint32_t pos = 0; pos < (height / 2); pos++) {
-            memcpy(line, &bmp_data[pos * width * 3], width * 3);
-            memcpy(&bmp_data[pos * width * 3],
-                   &bmp_data[(height - pos - 1) * width * 3], width * 3);
-            memcpy(&bmp_data[(height - pos - 1) * width * 3], line,
-                   width * 3);
-        }
-        free(line);
-    }
+    if (!form || form->type != OBJ_form)
+        return pdf_set_err(pdf, -EINVAL, "Invalid form object");
+
+    form_width = form->raw.bbox[2] - form->raw.bbox[0];
+    form_height = form->raw.bbox[3] - form->raw.bbox[1];
+    if (form_width <= 0 || form_height <= 0)
+        return pdf_set_err(pdf, -EINVAL, "Form has an empty bounding box");
+
+    /* Negative dimensions are worked out from the form's aspect ratio */
+    if (width < 0 && height < 0) {
+        width = form_width;
+        height = form_height;
+    } else if (width < 0) {
+        width = height * form_width / form_height;
+    } else if (height < 0) {
+        height = width * form_height / form_width;
+    }
+
+    ret = pdf_measure(pdf, &page, x, y, x + width, y + height, 0);
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+    if (page->type != OBJ_page)
+        return pdf_set_err(pdf, -EINVAL, "Forms can only be used on pages");
+
+    for (int i = 0; i < flexarray_size(&page->page.forms); i++) {
+        struct pdf_object *other =
+            (struct pdf_object *)flexarray_get(&page->page.forms, i);
+        if (other == form)
+            found = true;
+        else if (other->raw.name == form->raw.name)
+            return pdf_set_err(pdf, -EEXIST,
+                               "Form name %d already used on this page",
+                               form->raw.name);
+    }
+    if (!found && pdf_flexarray_append(pdf, &page->page.forms, form) < 0)
+        return pdf_get_errval(pdf);
 
-    retval = pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                           bmp_data, width, height);
-    free(bmp_data);
+    scale_x = width / form_width;
+    scale_y = height / form_height;
+    dstr_printf(&str, "q %f 0 0 %f %f %f cm /Form%d Do Q", scale_x, scale_y,
+                x - form->raw.bbox[0] * scale_x,
+                y - form->raw.bbox[1] * scale_y, form->raw.name);
 
-    return retval;
+    ret = pdf_add_stream(pdf, page, dstr_data(&str));
+    dstr_free(&str);
+    return ret;
 }
 
-static int determine_image_format(const uint8_t *data, size_t length)
+struct pdf_object *pdf_add_pattern(struct pdf_doc *pdf, float width,
+                                   float height)
 {
-    if (length >= sizeof(png_signature) &&
-        memcmp(data, png_signature, sizeof(png_signature)) == 0)
-        return IMAGE_PNG;
-    if (length >= sizeof(bmp_signature) &&
-        memcmp(data, bmp_signature, sizeof(bmp_signature)) == 0)
-        return IMAGE_BMP;
-    if (length >= sizeof(jpeg_signature) &&
-        memcmp(data, jpeg_signature, sizeof(jpeg_signature)) == 0)
-        return IMAGE_JPG;
-    if (length >= sizeof(ppm_signature) &&
-        memcmp(data, ppm_signature, sizeof(ppm_signature)) == 0)
-        return IMAGE_PPM;
-    if (length >= sizeof(pgm_signature) &&
-        memcmp(data, pgm_signature, sizeof(pgm_signature)) == 0)
-        return IMAGE_PPM;
+    struct pdf_object *obj;
 
-    return IMAGE_UNKNOWN;
+    if (width <= 0 || height <= 0) {
+        pdf_set_err(pdf, -EINVAL, "Invalid pattern size %fx%f", width,
+                    height);
+        return NULL;
+    }
+
+    obj = pdf_add_object(pdf, OBJ_pattern);
+    if (!obj)
+        return NULL;
+    obj->pattern.width = width;
+    obj->pattern.height = height;
+    obj->pattern.name = ++pdf->last_name;
+
+    return obj;
 }
 
-int pdf_parse_image_header(struct pdf_img_info *info, const uint8_t *data,
-                           size_t length, char *err_msg,
-                           size_t err_msg_length)
+/* Paths with up to this many operations are converted on the stack */
+#define PDF_COMMAND_PATH_STACK 32
 
+static int pdf_execute_path(struct pdf_doc *pdf, struct pdf_object *page,
+                            const struct pdf_command *path,
+                            const struct pdf_command *ops, int op_count)
 {
-    const int image_format = determine_image_format(data, length);
-    info->image_format = image_format;
-    switch (image_format) {
-    case IMAGE_PNG:
-        return parse_png_header(info, data, length, err_msg, err_msg_length);
-    case IMAGE_BMP:
-        return parse_bmp_header(info, data, length, err_msg, err_msg_length);
-    case IMAGE_JPG:
-        return parse_jpeg_header(info, data, length, err_msg, err_msg_length);
-    case IMAGE_PPM:
-        return parse_ppm_header(info, data, length, err_msg, err_msg_length);
+    struct pdf_path_operation stack[PDF_COMMAND_PATH_STACK];
+    struct pdf_path_operation *operations = stack;
+    int ret;
 
-    case IMAGE_UNKNOWN:
-    default:
-        snprintf(err_msg, err_msg_length, "Unknown file format");
-        return -EINVAL;
-    }
+    if (op_count > PDF_COMMAND_PATH_STACK) {
+        operations = (struct pdf_path_operation *)malloc(
+            op_count * sizeof(*operations));
+        if (!operations)
+            return pdf_set_err(pdf, -ENOMEM,
+                               "Unable to allocate %d path operations",
+                               op_count);
+    }
+    for (int i = 0; i < op_count; i++) {
+        if (ops[i].op != PDF_CMD_PATH_OP) {
+            ret = pdf_set_err(pdf, -EINVAL,
+                              "Path has %d operations, but only %d follow",
+                              op_count, i);
+            goto out;
+        }
+        operations[i].op = (char)ops[i].arg;
+        operations[i].x1 = ops[i].v[0];
+        operations[i].y1 = ops[i].v[1];
+        operations[i].x2 = ops[i].v[2];
+        operations[i].y2 = ops[i].v[3];
+        operations[i].x3 = ops[i].v[4];
+        operations[i].y3 = ops[i].v[5];
+    }
+    ret = pdf_add_custom_path(pdf, page, operations, op_count, path->v[0],
+                              path->colour, path->fill);
+out:
+    if (operations != stack)
+        free(operations);
+    return ret;
 }
 
-int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                       float y, float display_width, float display_height,
-                       const uint8_t *data, size_t len)
+static int pdf_execute_one(struct pdf_doc *pdf, struct pdf_object *page,
+                           const struct pdf_command *cmd, const char *text,
+                           struct pdf_object *const *handles,
+                           int handle_count)
 {
-    struct pdf_img_info info = {
-        .image_format = IMAGE_UNKNOWN,
-        .width = 0,
-        .height = 0,
-        .jpeg = {0},
-    };
+    const float *v = cmd->v;
 
-    int ret = pdf_parse_image_header(&info, data, len, pdf->errstr,
-                                     sizeof(pdf->errstr));
-    if (ret)
-        return ret;
+    switch (cmd->op) {
+    case PDF_CMD_NOP:
+        return 0;
 
-    // Try and determine which image format it is based on the content
-    switch (info.image_format) {
-    case IMAGE_PNG:
-        return pdf_add_png_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
-    case IMAGE_BMP:
-        return pdf_add_bmp_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
-    case IMAGE_JPG:
-        return pdf_add_jpeg_data(pdf, page, x, y, display_width,
-                                 display_height, &info, data, len);
-    case IMAGE_PPM:
-        return pdf_add_ppm_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+    case PDF_CMD_FONT: {
+        char font[64];
+
+        if (cmd->data_len >= sizeof(font))
+            return pdf_set_err(pdf, -EINVAL, "Font name too long: %.*s",
+                               (int)cmd->data_len, text);
+        memcpy(font, text, cmd->data_len);
+        font[cmd->data_len] = '\0';
+        return pdf_set_font(pdf, font);
+    }
+
+    case PDF_CMD_TEXT:
+        return pdf_add_text_rotate_n(pdf, page, text, cmd->data_len, v[0],
+                                     v[1], v[2], v[3], cmd->colour);
+
+    case PDF_CMD_TEXT_WRAP:
+        return pdf_add_text_wrap_n(pdf, page, text, cmd->data_len, v[0], v[1],
+                                   v[2], v[3], cmd->colour, v[4], cmd->arg,
+                                   NULL);
+
+    case PDF_CMD_LINE:
+        return pdf_add_line(pdf, page, v[0], v[1], v[2], v[3], v[4],
+                            cmd->colour);
+
+    case PDF_CMD_RECTANGLE:
+        if (PDF_IS_TRANSPARENT(cmd->fill))
+            return pdf_add_rectangle(pdf, page, v[0], v[1], v[2], v[3], v[4],
+                                     cmd->colour);
+        return pdf_add_filled_rectangle(pdf, page, v[0], v[1], v[2], v[3],
+                                        v[4], cmd->fill, cmd->colour);
+
+    case PDF_CMD_ELLIPSE:
+        return pdf_add_ellipse(pdf, page, v[0], v[1], v[2], v[3], v[4],
+                               cmd->colour, cmd->fill);
+
+    case PDF_CMD_PATH_OP:
+        return pdf_set_err(pdf, -EINVAL, "Path operation outside a path");
+
+    case PDF_CMD_IMAGE:
+        return pdf_add_image_data(pdf, page, v[0], v[1], v[2], v[3],
+                                  (const uint8_t *)text, cmd->data_len);
+
+    case PDF_CMD_FORM:
+        if (cmd->arg < 0 || cmd->arg >= handle_count)
+            return pdf_set_err(pdf, -EINVAL, "Invalid form handle %d",
+                               cmd->arg);
+        return pdf_add_form(pdf, page, handles[cmd->arg], v[0], v[1], v[2],
+                            v[3]);
+
+    case PDF_CMD_BARCODE:
+        return pdf_add_barcode_n(pdf, page, cmd->arg, v[0], v[1], v[2], v[3],
+                                 text, cmd->data_len, cmd->colour);
 
-    // This case should be caught in parse_image_header, but is checked
-    // here again for safety
-    case IMAGE_UNKNOWN:
     default:
-        return pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+        return pdf_set_err(pdf, -EINVAL, "Invalid command %u", cmd->op);
     }
 }
 
-int pdf_add_image_file(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                       float y, float display_width, float display_height,
-                       const char *image_filename)
+int pdf_execute(struct pdf_doc *pdf, struct pdf_object *page,
+                const struct pdf_command *commands, int count,
+                const void *data, size_t data_len,
+                struct pdf_object *const *handles, int handle_count,
+                int *results)
 {
-    size_t len;
-    uint8_t *data;
-    int ret = 0;
+    const char *bytes = (const char *)data;
+    int failed = 0;
 
-    data = get_file(pdf, image_filename, &len);
-    if (data == NULL)
-        return pdf_get_errval(pdf);
+    if (!pdf)
+        return -EINVAL;
+    if (count < 0 || (count && !commands) || (data_len && !data) ||
+        handle_count < 0 || (handle_count && !handles))
+        return pdf_set_err(pdf, -EINVAL, "Invalid command buffer");
+
+    PDF_TRACE_START(pdf, start);
+    for (int i = 0; i < count; i++) {
+        const struct pdf_command *cmd = &commands[i];
+        int ops = 0;
+        int ret;
+
+        if (cmd->data_offset > data_len ||
+            cmd->data_len > data_len - cmd->data_offset) {
+            ret = pdf_set_err(pdf, -EINVAL,
+                              "Command %d data (%u bytes at %u) is outside "
+                              "the %zu byte buffer",
+                              i, cmd->data_len, cmd->data_offset, data_len);
+        } else if (cmd->op == PDF_CMD_PATH) {
+            /* The operations are part of the path, so they all share its
+             * result */
+            ops = cmd->arg;
+            if (ops < 0 || ops > count - i - 1) {
+                ret = pdf_set_err(pdf, -EINVAL,
+                                  "Path has %d operations, but only %d "
+                                  "commands follow",
+                                  cmd->arg, count - i - 1);
+                ops = 0;
+            } else {
+                ret = pdf_execute_path(pdf, page, cmd, &cmd[1], ops);
+            }
+        } else {
+            ret = pdf_execute_one(pdf, page, cmd,
+                                  bytes ? &bytes[cmd->data_offset] : "",
+                                  handles, handle_count);
+        }
 
-    ret = pdf_add_image_data(pdf, page, x, y, display_width, display_height,
-                             data, len);
-    free(data);
-    return ret;
+        if (ret < 0)
+            failed++;
+        if (results)
+            for (int j = i; j <= i + ops; j++)
+                results[j] = ret < 0 ? ret : 0;
+        i += ops;
+    }
+    PDF_TRACE_END(pdf, start, "command", "execute", count);
+    return failed;
 }
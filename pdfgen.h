@@ -29,6 +29,27 @@ extern "C" {
  * characters beyond 7-bit ascii are supported (see @ref pdf_add_text for
  * details).
  *
+ * @par Threading
+ * Each page owns its content buffer, and the drawing functions (text,
+ * lines, shapes and barcodes) only modify the buffer of the page they are
+ * given. Several threads may therefore build the content of distinct pages
+ * of one document concurrently, provided that:
+ *  - explicit page handles are passed (NULL means "most recently added
+ *    page", which is not meaningful across threads),
+ *  - pages are appended, and fonts selected, before the threads start;
+ *    page order is the order of @ref pdf_append_page calls,
+ *  - calls that create objects (images, bookmarks, links, new fonts) are
+ *    serialised by the caller,
+ *  - no text cache is enabled (see @ref pdf_set_text_cache).
+ *
+ * The error state (@ref pdf_get_err) is shared by all threads and is
+ * updated under a lock, so the most recent error from any thread wins;
+ * use the return values to tell which call failed. The string returned
+ * by @ref pdf_get_err may be replaced while other threads are still
+ * drawing. Numbers are formatted in the "C" locale, switched per thread
+ * with uselocale (or _configthreadlocale on Windows), so the process
+ * locale is never changed.
+ *
  * @par PDF library example:
  * @code
 #include "pdfgen.h"
@@ -53,6 +74,7 @@ pdf_destroy(pdf);
 
 struct pdf_doc;
 struct pdf_object;
+struct pdf_flow;
 
 /**
  * pdf_info describes the metadata to be inserted into the
@@ -302,6 +324,26 @@ struct pdf_doc *pdf_create(float width, float height,
  */
 void pdf_destroy(struct pdf_doc *pdf);
 
+/**
+ * Append all the pages of one document to the end of another.
+ * Objects are moved rather than copied: pages, their content, images,
+ * links and bookmarks are transferred from src to dst & renumbered, and
+ * fonts already present in dst are shared. Top level bookmarks of src
+ * become top level bookmarks of dst, after the existing ones.
+ *
+ * On success src is destroyed and must not be used again; page objects
+ * from src remain valid and now belong to dst, but bookmark IDs from src
+ * do not. On failure neither document is modified.
+ *
+ * Note: Fonts are matched by both name and resource name. This always
+ * works for the standard fonts, but can fail if the two documents use
+ * different non-standard fonts.
+ * @param dst PDF document to append pages to
+ * @param src PDF document to take pages from
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_append_document(struct pdf_doc *dst, struct pdf_doc *src);
+
 /**
  * Retrieve the error message if any operation fails
  * @param pdf pdf document to retrieve error message from
@@ -348,6 +390,15 @@ int pdf_set_font(struct pdf_doc *pdf, const char *font);
 int pdf_get_font_text_width(struct pdf_doc *pdf, const char *font_name,
                             const char *text, float size, float *text_width);
 
+/**
+ * As @ref pdf_get_font_text_width, but for the first len bytes of text,
+ * which does not need to be NUL terminated.
+ * @return -EINVAL if text is NULL but len is not 0
+ */
+int pdf_get_font_text_width_n(struct pdf_doc *pdf, const char *font_name,
+                              const char *text, size_t len, float size,
+                              float *text_width);
+
 /**
  * Retrieves a PDF document height
  * @param pdf PDF document to get height of
@@ -365,19 +416,21 @@ float pdf_width(const struct pdf_doc *pdf);
 /**
  * Retrieves page height
  * @param page Page object to get height of
- * @return height of page (in points)
+ * @return height of page (in points), or 0 if page isn't a page
  */
 float pdf_page_height(const struct pdf_object *page);
 
 /**
  * Retrieves page width
  * @param page Page object to get width of
- * @return width of page (in points)
+ * @return width of page (in points), or 0 if page isn't a page
  */
 float pdf_page_width(const struct pdf_object *page);
 
 /**
- * Add a new page to the given pdf
+ * Add a new page to the given pdf.
+ * The page is created along with its (initially empty) content stream, so
+ * that later drawing operations on it never allocate new objects.
  * @param pdf PDF document to append page to
  * @return new page object
  */
@@ -394,6 +447,22 @@ struct pdf_object *pdf_append_page(struct pdf_doc *pdf);
  */
 struct pdf_object *pdf_get_page(struct pdf_doc *pdf, int page_number);
 
+/**
+ * Retrieve the bounding box of everything drawn onto a page so far, in
+ * measure-only mode (see @ref pdf_set_measure_only) or once tracking has
+ * been turned on with @ref pdf_set_bbox_tracking.
+ * Line widths are included. Curves are bounded by their control points,
+ * and text by its advance width, from a quarter of the font size below
+ * the baseline to the font size above it.
+ * @param pdf PDF document that the page belongs to
+ * @param page Page to query (NULL for the last page)
+ * @param bbox Filled in with the lower left x & y, then upper right x & y
+ * @return -ENOENT if nothing has been drawn, -EINVAL if bounding boxes
+ *         aren't being tracked, < 0 on failure, 0 on success
+ */
+int pdf_page_get_bbox(struct pdf_doc *pdf, struct pdf_object *page,
+                      float bbox[4]);
+
 /**
  * Adjust the width/height of a specific page
  * @param pdf PDF document that the page belongs to
@@ -405,6 +474,207 @@ struct pdf_object *pdf_get_page(struct pdf_doc *pdf, int page_number);
 int pdf_page_set_size(struct pdf_doc *pdf, struct pdf_object *page,
                       float width, float height);
 
+/**
+ * Preallocate space for a document whose eventual size is known, so that
+ * building it doesn't need to repeatedly grow internal structures.
+ * This is purely an optimisation; documents may still grow past these
+ * sizes.
+ * @param pdf PDF document to update
+ * @param pages Number of pages that are still to be added
+ * @param objects Number of objects (pages, content streams, images, links,
+ *                bookmarks etc.) still to be added. At least two per page
+ *                are always reserved
+ * @param content_bytes_per_page Size of the drawing operations expected on
+ *                               each page added from now on, or 0 for none
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_reserve(struct pdf_doc *pdf, int pages, int objects,
+                size_t content_bytes_per_page);
+
+/**
+ * Statistics about a document, see @ref pdf_get_stats
+ */
+struct pdf_stats {
+    int objects;          //!< Total number of objects in the document
+    int pages;            //!< Number of pages
+    int fonts;            //!< Number of fonts
+    int images;           //!< Number of images
+    int bookmarks;        //!< Number of bookmarks
+    int links;            //!< Number of links
+    int forms;            //!< Number of imported pages (Form XObjects)
+    int imported_objects; //!< Other objects copied from imported PDFs
+    uint64_t content_bytes; //!< Drawing operations in page content streams
+    uint64_t image_bytes;   //!< Image objects, including their headers
+    //! Image bytes by source format (IMAGE_PNG etc.). IMAGE_UNKNOWN
+    //! covers raw pixel data (@ref pdf_add_rgb24, @ref pdf_add_grayscale8)
+    uint64_t image_format_bytes[IMAGE_UNKNOWN + 1];
+    uint64_t imported_bytes; //!< Objects & forms from imported PDFs
+    uint64_t heap_bytes;     //!< Approximate memory used by the document
+    uint64_t output_bytes;   //!< Estimated size of the saved PDF
+    uint64_t text_cache_hits;   //!< Strings found in the text cache
+    uint64_t text_cache_misses; //!< Strings not found in the text cache
+};
+
+/**
+ * Get statistics about a document, such as what it contains & how large
+ * it is. The totals are kept up to date as the document is built, so this
+ * is cheap enough to call after every page (eg: to stop runaway documents
+ * early), and may be called while other threads are drawing.
+ * @param pdf PDF document to examine
+ * @param stats Structure to fill in
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_get_stats(const struct pdf_doc *pdf, struct pdf_stats *stats);
+
+/**
+ * Callback for @ref pdf_set_trace, called once an operation has finished
+ * @param arg Argument given to @ref pdf_set_trace
+ * @param category Area of the library, ie: "object", "image", "text" or
+ *                 "save"
+ * @param name Operation within the category, eg: the object type, image
+ *             format, or save phase
+ * @param start_ns When the operation started, in nanoseconds
+ * @param duration_ns How long the operation took, in nanoseconds
+ * @param bytes Amount of data produced (or for images, consumed)
+ */
+typedef void (*pdf_trace_fn)(void *arg, const char *category,
+                             const char *name, uint64_t start_ns,
+                             uint64_t duration_ns, uint64_t bytes);
+
+/**
+ * Report timings of the expensive operations on a document (creating
+ * objects, parsing images, encoding & wrapping text, and each phase of
+ * saving) to a callback.
+ * The callback is called on the thread doing the work, so it must be
+ * thread safe if pages are drawn on concurrently.
+ * Note: This is only available if PDFGEN_TRACE is defined when building,
+ * otherwise it fails with -ENOTSUP and tracing costs nothing.
+ * @param pdf PDF document to trace
+ * @param callback Function to report timings to (eg: @ref
+ *                 pdf_trace_chrome), or NULL to stop tracing
+ * @param arg Argument to pass to callback
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_trace(struct pdf_doc *pdf, pdf_trace_fn callback, void *arg);
+
+/**
+ * Start a Chrome trace-event JSON file, for viewing in chrome://tracing
+ * or Perfetto. Call this once before passing the file to
+ * @ref pdf_set_trace with @ref pdf_trace_chrome, and
+ * @ref pdf_trace_chrome_finish once tracing is done.
+ * @param fp File to write the trace to
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_trace_chrome_start(FILE *fp);
+
+/**
+ * Trace callback for @ref pdf_set_trace which writes an event to a file
+ * started with @ref pdf_trace_chrome_start. The file is locked while each
+ * event is written, so pages may be traced from several threads.
+ * @param arg FILE pointer to write to
+ * See @ref pdf_trace_fn for the other parameters
+ */
+void pdf_trace_chrome(void *arg, const char *category, const char *name,
+                      uint64_t start_ns, uint64_t duration_ns,
+                      uint64_t bytes);
+
+/**
+ * Finish a Chrome trace-event file, so that it is valid JSON. Tracing
+ * must be stopped (or the document destroyed) first.
+ * @param fp File started with @ref pdf_trace_chrome_start
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_trace_chrome_finish(FILE *fp);
+
+/**
+ * Limits on the resources a document may use, see @ref pdf_set_limits.
+ * Zero means no limit.
+ */
+struct pdf_limits {
+    uint64_t heap_bytes;   //!< Memory used by the document (approximate)
+    int objects;           //!< Number of objects in the document
+    uint64_t image_bytes;  //!< Decoded size of any one image, taken to be
+                           //!< width x height x 3 (or x 1 for greyscale
+                           //!< data). JPEGs are not decoded, so only count
+                           //!< towards heap_bytes
+    uint64_t output_bytes; //!< Size of the saved PDF
+};
+
+/**
+ * Limit the resources a document may use, eg: when building documents
+ * from untrusted input. Operations which would go past a limit fail with
+ * -ENOSPC (leaving the document as it was) instead of exhausting memory,
+ * and saving stops with -ENOSPC once the output limit is reached.
+ * Limits apply from now on; a document that is already past a limit
+ * can't grow any further.
+ * @param pdf PDF document to limit
+ * @param limits New limits, or NULL to remove all limits
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_limits(struct pdf_doc *pdf, const struct pdf_limits *limits);
+
+/**
+ * Largest text cache allowed by @ref pdf_set_text_cache
+ */
+#define PDF_TEXT_CACHE_MAX_ENTRIES (1 << 20)
+
+/**
+ * Keep a cache of recently drawn strings, so that text which is repeated
+ * many times (column headings, labels, page footers) is only converted
+ * from UTF-8, escaped and measured once per font.
+ * Strings of up to 256 bytes are cached the second time in a row that
+ * they hash to an entry, replacing whatever string was there, so the
+ * cache never grows beyond its initial number of entries, and strings
+ * that are only drawn once are never copied into it.
+ * The cache is shared by all pages of the document, so while it is
+ * enabled text must not be drawn on several pages concurrently.
+ * @param pdf PDF document to update
+ * @param entries Number of strings to cache (rounded up to a power of
+ *                two), or 0 to disable and free the cache
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_text_cache(struct pdf_doc *pdf, int entries);
+
+/**
+ * Switch a document into (or out of) measure-only mode.
+ * In this mode every drawing call checks its arguments and grows the
+ * bounding box of its page (see @ref pdf_page_get_bbox), but nothing is
+ * encoded, formatted or added to the page, and images & forms are neither
+ * decoded nor created. This makes a layout pass that only needs to know
+ * how much space things take nearly free.
+ * Pages are still created by @ref pdf_append_page, so measuring is best
+ * done in a separate scratch document.
+ * @param pdf PDF document to update
+ * @param measure_only Non-zero to only measure, zero to draw normally
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_measure_only(struct pdf_doc *pdf, int measure_only);
+
+/**
+ * Keep track of the bounding box of each page while drawing normally, so
+ * that it can be retrieved with @ref pdf_page_get_bbox. This is off by
+ * default, as measuring text means adding up the width of every
+ * character. Measure-only mode always tracks bounding boxes.
+ * Only what is drawn while tracking is included.
+ * @param pdf PDF document to update
+ * @param track Non-zero to track bounding boxes, zero to stop
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_bbox_tracking(struct pdf_doc *pdf, int track);
+
+/**
+ * Make saving the document reproducible: identical documents are saved
+ * as identical bytes. The document ID is a hash of the saved content
+ * rather than being based on the current time, and the creation date is
+ * the one given here rather than when the document was created.
+ * (@ref pdf_stitch_fragments can do the same for stitched documents)
+ * @param pdf PDF document to update
+ * @param date Creation date, in PDF format (eg: "20240101120000Z"), or NULL
+ *             to leave the creation date out
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_deterministic(struct pdf_doc *pdf, const char *date);
+
 /**
  * Save the given pdf document to the supplied filename.
  * @param pdf PDF document to save
@@ -415,12 +685,50 @@ int pdf_save(struct pdf_doc *pdf, const char *filename);
 
 /**
  * Save the given pdf document to the given FILE output
+ * The output does not need to be seekable (eg: it may be a pipe), and
+ * offsets are relative to where the document starts. Documents up to
+ * the 10GB limit of the PDF xref table are supported; beyond that this
+ * fails with -EFBIG.
  * @param pdf PDF document to save
  * @param fp FILE pointer to store the data into (must be writable)
  * @return < 0 on failure, >= 0 on success
  */
 int pdf_save_file(struct pdf_doc *pdf, FILE *fp);
 
+/**
+ * Save the pages of a document as a fragment, to be combined with other
+ * fragments into a single PDF by @ref pdf_stitch_fragments.
+ * This allows separate processes (or machines) to each render a range of
+ * pages of one large document. The fragment holds the pages, their content,
+ * images, fonts, links and bookmarks; the document info is supplied when
+ * stitching.
+ * @param pdf PDF document to save
+ * @param fp FILE pointer to store the fragment into (must be writable)
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_save_fragment(struct pdf_doc *pdf, FILE *fp);
+
+/**
+ * Combine fragments created by @ref pdf_save_fragment into a single PDF.
+ * Pages & top level bookmarks are placed in the order of the fragments.
+ * Object references are renumbered, identical fonts are merged, and stream
+ * data is copied through without being parsed.
+ * @param fp FILE pointer to store the PDF into (must be writable)
+ * @param fragment_files Array of fragment file names
+ * @param fragment_count Number of entries in fragment_files
+ * @param info Optional information to be put into the PDF header
+ * @param deterministic Non-zero to make the output reproducible, as for
+ *             @ref pdf_set_deterministic: the creation date is only the one
+ *             in info (if any), and the ID is a hash of the content
+ * @param err_msg area to put any failure details
+ * @param err_msg_length maximum number of bytes to store in err_msg
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_stitch_fragments(FILE *fp, const char *const *fragment_files,
+                         int fragment_count, const struct pdf_info *info,
+                         int deterministic, char *err_msg,
+                         size_t err_msg_length);
+
 /**
  * Add a text string to the document
  * @param pdf PDF document to add to
@@ -436,6 +744,15 @@ int pdf_add_text(struct pdf_doc *pdf, struct pdf_object *page,
                  const char *text, float size, float xoff, float yoff,
                  uint32_t colour);
 
+/**
+ * As @ref pdf_add_text, but for the first len bytes of text, which does
+ * not need to be NUL terminated (eg: a slice of a larger buffer).
+ * @return -EINVAL if text is NULL but len is not 0
+ */
+int pdf_add_text_n(struct pdf_doc *pdf, struct pdf_object *page,
+                   const char *text, size_t len, float size, float xoff,
+                   float yoff, uint32_t colour);
+
 /**
  * Add a text string to the document at a rotated angle
  * @param pdf PDF document to add to
@@ -451,6 +768,17 @@ int pdf_add_text(struct pdf_doc *pdf, struct pdf_object *page,
 int pdf_add_text_rotate(struct pdf_doc *pdf, struct pdf_object *page,
                         const char *text, float size, float xoff, float yoff,
                         float angle, uint32_t colour);
+
+/**
+ * As @ref pdf_add_text_rotate, but for the first len bytes of text, which
+ * does not need to be NUL terminated.
+ * @return -EINVAL if text is NULL but len is not 0
+ */
+int pdf_add_text_rotate_n(struct pdf_doc *pdf, struct pdf_object *page,
+                          const char *text, size_t len, float size,
+                          float xoff, float yoff, float angle,
+                          uint32_t colour);
+
 /**
  * Add a text string to the document, making it wrap if it is too
  * long
@@ -472,6 +800,144 @@ int pdf_add_text_wrap(struct pdf_doc *pdf, struct pdf_object *page,
                       float angle, uint32_t colour, float wrap_width,
                       int align, float *height);
 
+/**
+ * As @ref pdf_add_text_wrap, but for the first len bytes of text, which
+ * does not need to be NUL terminated.
+ * @return -EINVAL if text is NULL but len is not 0
+ */
+int pdf_add_text_wrap_n(struct pdf_doc *pdf, struct pdf_object *page,
+                        const char *text, size_t len, float size, float xoff,
+                        float yoff, float angle, uint32_t colour,
+                        float wrap_width, int align, float *height);
+
+/**
+ * Style of a paragraph of flowing text, see @ref pdf_flow_write
+ */
+struct pdf_flow_style {
+    const char *font;  //!< Font name, NULL for the current font
+    float size;        //!< Point size of the font
+    float leading;     //!< Distance between lines, 0 for 1.2 x size
+    float space_after; //!< Extra space after the paragraph
+    float indent;      //!< Indent of the first line of the paragraph
+    int align;         //!< PDF_ALIGN_LEFT, _RIGHT, _CENTER or _JUSTIFY
+    uint32_t colour;   //!< Colour of the text
+};
+
+/**
+ * Area that text flows into, the same on every page
+ */
+struct pdf_flow_frame {
+    float x;       //!< Left edge of the frame
+    float y;       //!< Bottom edge of the frame
+    float width;   //!< Width of the frame
+    float height;  //!< Height of the frame
+    int max_pages; //!< Stop after filling this many pages (0 for no limit)
+};
+
+/**
+ * Called whenever flowing text starts on a page (including the first),
+ * before any text is put on it, eg: to draw headers & footers.
+ * page_number counts the pages of this flow, starting from 1.
+ * Returning < 0 stops the flow with that error.
+ */
+typedef int (*pdf_flow_page_fn)(void *arg, struct pdf_doc *pdf,
+                                struct pdf_object *page, int page_number);
+
+/**
+ * Start flowing text into a frame, appending pages as each one fills up.
+ * Text is laid out in a single pass as it is written, using the widths of
+ * the standard fonts, so any amount of it can be streamed through.
+ * @param pdf PDF document to add to
+ * @param page Page to start on, or NULL to start on a new page
+ * @param frame Area of each page to fill with text
+ * @param on_page Callback for each new page (optional)
+ * @param arg Argument passed to on_page
+ * @return New flow, to be finished with @ref pdf_flow_end, or NULL on
+ *         failure
+ */
+struct pdf_flow *pdf_flow_create(struct pdf_doc *pdf, struct pdf_object *page,
+                                 const struct pdf_flow_frame *frame,
+                                 pdf_flow_page_fn on_page, void *arg);
+
+/**
+ * Add text to a flow. Text may be split anywhere between calls, even in
+ * the middle of a word or UTF-8 character. '\n' ends a paragraph, and
+ * runs of spaces & tabs are treated as a single space.
+ * Each paragraph has a single style, so changing the style also ends the
+ * current paragraph.
+ * @param flow Flow to add to
+ * @param style Style of the text
+ * @param text Text to add (need not be NUL terminated)
+ * @param len Length of text in bytes
+ * @return < 0 on failure, 0 on success, or 1 if the frame is full (see
+ *         pdf_flow_frame.max_pages) and no more text will be laid out
+ */
+int pdf_flow_write(struct pdf_flow *flow, const struct pdf_flow_style *style,
+                   const char *text, size_t len);
+
+/**
+ * Lay out the last line of a flow, and free it
+ * @param flow Flow to finish
+ * @param overflow Store the position (counting every byte written to the
+ *        flow) of the first text that didn't fit here, or the total length
+ *        if it all fitted (optional)
+ * @return < 0 on failure, 0 if all the text fitted, 1 if it didn't
+ */
+int pdf_flow_end(struct pdf_flow *flow, size_t *overflow);
+
+/**
+ * Column of a table, see @ref pdf_add_table
+ */
+struct pdf_table_column {
+    float width; //!< Width of the column, or 0 to share out the width left
+                 //!< over in proportion to the widest cell in each column
+    int align;   //!< PDF_ALIGN_LEFT, _RIGHT or _CENTER
+};
+
+/**
+ * Appearance of a table, see @ref pdf_add_table
+ */
+struct pdf_table_style {
+    const char *font;        //!< Font of the cells, NULL for the current font
+    const char *header_font; //!< Font of the header rows, NULL for the
+                             //!< same font as the other cells
+    float size;              //!< Point size of the text
+    float padding;           //!< Space between the text and the grid
+    uint32_t colour;         //!< Colour of the text
+    float border_width;      //!< Width of the grid lines, 0 for no grid
+    uint32_t border_colour;  //!< Colour of the grid lines
+    int header_rows; //!< Number of rows at the top of the table that are
+                     //!< repeated at the top of each new page (unless
+                     //!< the next row only fits on a page without them)
+};
+
+/**
+ * Add a table, appending pages as each one fills up.
+ * All the cells are measured before anything is drawn, so that column
+ * widths and row heights suit their contents. Text wraps within its
+ * cell, and rows are never split across pages. Each page of the table is
+ * added as a single block of text and a single grid, with the borders
+ * between cells drawn once.
+ * @param pdf PDF document to add to
+ * @param page Page to start on (NULL => most recently added page)
+ * @param frame Area of each page for the table; the table is as wide as
+ *        the frame unless all of the columns have fixed widths
+ * @param top Where the table starts on the first page
+ * @param columns Layout of each column
+ * @param column_count Number of columns
+ * @param cells Text of each cell (NULL for empty cells), a row at a time
+ * @param row_count Number of rows
+ * @param style Appearance of the table
+ * @param bottom Store where the table finishes on the last page (optional)
+ * @return < 0 on failure, otherwise the number of rows added, which is
+ *         less than row_count if pdf_flow_frame.max_pages was reached
+ */
+int pdf_add_table(struct pdf_doc *pdf, struct pdf_object *page,
+                  const struct pdf_flow_frame *frame, float top,
+                  const struct pdf_table_column *columns, int column_count,
+                  const char *const *cells, int row_count,
+                  const struct pdf_table_style *style, float *bottom);
+
 /**
  * Add a line to the document
  * @param pdf PDF document to add to
@@ -653,6 +1119,14 @@ int pdf_add_filled_polygon(struct pdf_doc *pdf, struct pdf_object *page,
 int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
                      const char *name);
 
+/**
+ * As @ref pdf_add_bookmark, but for the first name_len bytes of name,
+ * which does not need to be NUL terminated.
+ * @return -EINVAL if name is NULL but name_len is not 0
+ */
+int pdf_add_bookmark_n(struct pdf_doc *pdf, struct pdf_object *page,
+                       int parent, const char *name, size_t name_len);
+
 /**
  * Add a link annotation to the document
  * @param pdf PDF document to add link to
@@ -701,6 +1175,15 @@ int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
                     float x, float y, float width, float height,
                     const char *string, uint32_t colour);
 
+/**
+ * As @ref pdf_add_barcode, but for the first len bytes of string, which
+ * does not need to be NUL terminated.
+ * @return -EINVAL if string is NULL but len is not 0
+ */
+int pdf_add_barcode_n(struct pdf_doc *pdf, struct pdf_object *page, int code,
+                      float x, float y, float width, float height,
+                      const char *string, size_t len, uint32_t colour);
+
 /**
  * Add image data as an image to the document.
  * Image data must be one of: JPEG, PNG, PPM, PGM or BMP formats
@@ -793,6 +1276,198 @@ int pdf_parse_image_header(struct pdf_img_info *info, const uint8_t *data,
                            size_t length, char *err_msg,
                            size_t err_msg_length);
 
+/**
+ * Import a page from an existing PDF file, so that it can be drawn on
+ * pages of this document (eg: as a letterhead or background).
+ * The page, along with everything it uses (fonts, images etc.), is copied
+ * in to the document as a Form XObject. Annotations & links on the page
+ * are not copied. Each import makes its own copy of these, so import a
+ * page once and draw it as often as needed.
+ * Only PDF files with classic cross-reference tables are supported; files
+ * using cross-reference streams (common from PDF 1.5 on) fail with
+ * -ENOTSUP.
+ * @param pdf PDF document to import the page in to
+ * @param filename Name of the PDF file to import from
+ * @param page_number Page to import, starting from 1
+ * @return Form object to pass to pdf_add_form, or NULL on failure
+ */
+struct pdf_object *pdf_import_page(struct pdf_doc *pdf, const char *filename,
+                                   int page_number);
+
+/**
+ * Import a page from an in-memory PDF file. See pdf_import_page
+ * @param pdf PDF document to import the page in to
+ * @param data Contents of the PDF file to import from
+ * @param length Number of bytes in data
+ * @param page_number Page to import, starting from 1
+ * @return Form object to pass to pdf_add_form, or NULL on failure
+ */
+struct pdf_object *pdf_import_page_data(struct pdf_doc *pdf,
+                                        const uint8_t *data, size_t length,
+                                        int page_number);
+
+/**
+ * Draw an imported page on a page of the document.
+ * The same form can be drawn any number of times, on any number of pages,
+ * without its contents being duplicated in the output.
+ * Passing a negative number for either the width or height will have the
+ * form scaled while keeping the original aspect ratio. Passing a negative
+ * number for both draws it at its original size.
+ * @param pdf PDF document to draw on
+ * @param page Page to draw on (NULL => most recently added page)
+ * @param form Form returned from pdf_import_page
+ * @param x X offset to put the form at
+ * @param y Y offset to put the form at
+ * @param width Displayed width of the form
+ * @param height Displayed height of the form
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_add_form(struct pdf_doc *pdf, struct pdf_object *page,
+                 struct pdf_object *form, float x, float y, float width,
+                 float height);
+
+/**
+ * Create a tiling pattern, which repeats a small tile to fill an area.
+ * The tile is drawn once, by passing the pattern in place of a page to
+ * the line, path, shape & text functions (images & forms are not
+ * supported), with coordinates from (0, 0) to (width, height).
+ * Shapes are filled with it by @ref pdf_add_filled_rectangle_pattern,
+ * @ref pdf_add_ellipse_pattern & @ref pdf_add_custom_path_pattern.
+ * Filling a full page with a pattern only adds a few bytes to the page,
+ * rather than repeating every drawing operation for each tile.
+ * @param pdf PDF document to add the pattern to
+ * @param width Width of a tile, which is also the horizontal repeat step
+ * @param height Height of a tile, which is also the vertical repeat step
+ * @return Pattern object, or NULL on failure
+ */
+struct pdf_object *pdf_add_pattern(struct pdf_doc *pdf, float width,
+                                   float height);
+
+/**
+ * Add a rectangle filled with a pattern, as for
+ * @ref pdf_add_filled_rectangle
+ * @param pdf PDF document to add to
+ * @param page Page to add object to (NULL => most recently added page)
+ * @param x X offset to start rectangle at
+ * @param y Y offset to start rectangle at
+ * @param width Width of rectangle
+ * @param height Height of rectangle
+ * @param border_width Width of rectangle border
+ * @param pattern Pattern returned from pdf_add_pattern to fill it with
+ * @param colour_border Colour to draw the rectangle
+ * @return 0 on success, < 0 on failure
+ */
+int pdf_add_filled_rectangle_pattern(struct pdf_doc *pdf,
+                                     struct pdf_object *page, float x,
+                                     float y, float width, float height,
+                                     float border_width,
+                                     struct pdf_object *pattern,
+                                     uint32_t colour_border);
+
+/**
+ * Add an ellipse filled with a pattern, as for @ref pdf_add_ellipse
+ * @param pdf PDF document to add to
+ * @param page Page to add object to (NULL => most recently added page)
+ * @param x X offset of the center of the ellipse
+ * @param y Y offset of the center of the ellipse
+ * @param xradius Radius of the ellipse in the X axis
+ * @param yradius Radius of the ellipse in the Y axis
+ * @param width Width of the ellipse outline stroke
+ * @param colour Colour to draw the ellipse outline stroke
+ * @param fill_pattern Pattern returned from pdf_add_pattern to fill it with
+ * @return 0 on success, < 0 on failure
+ */
+int pdf_add_ellipse_pattern(struct pdf_doc *pdf, struct pdf_object *page,
+                            float x, float y, float xradius, float yradius,
+                            float width, uint32_t colour,
+                            struct pdf_object *fill_pattern);
+
+/**
+ * Add a custom path filled with a pattern, as for
+ * @ref pdf_add_custom_path
+ * @param pdf PDF document to add to
+ * @param page Page to add object to (NULL => most recently added page)
+ * @param operations Array of drawing operations
+ * @param operation_count The number of operations
+ * @param stroke_width Width of the stroke
+ * @param stroke_colour Colour to stroke the curve
+ * @param fill_pattern Pattern returned from pdf_add_pattern to fill it with
+ * @return 0 on success, < 0 on failure
+ */
+int pdf_add_custom_path_pattern(struct pdf_doc *pdf, struct pdf_object *page,
+                                const struct pdf_path_operation *operations,
+                                int operation_count, float stroke_width,
+                                uint32_t stroke_colour,
+                                struct pdf_object *fill_pattern);
+
+/**
+ * Drawing operations for @ref pdf_execute.
+ * The operands of each one are listed as v[] values, colour, fill, arg and
+ * data (the bytes at data_offset/data_len in the data buffer).
+ */
+enum {
+    PDF_CMD_NOP,       //!< Nothing
+    PDF_CMD_FONT,      //!< data: font name
+    PDF_CMD_TEXT,      //!< v: size, x, y, angle; colour; data: text
+    PDF_CMD_TEXT_WRAP, //!< v: size, x, y, angle, wrap width; colour;
+                       //!< arg: PDF_ALIGN_*; data: text
+    PDF_CMD_LINE,      //!< v: x1, y1, x2, y2, width; colour
+    PDF_CMD_RECTANGLE, //!< v: x, y, width, height, border width; colour:
+                       //!< border; fill (or PDF_TRANSPARENT)
+    PDF_CMD_ELLIPSE,   //!< v: x, y, x radius, y radius, width; colour; fill
+    PDF_CMD_PATH,      //!< v: width; colour; fill; arg: number of
+                       //!< PDF_CMD_PATH_OP commands which follow
+    PDF_CMD_PATH_OP,   //!< v: x1, y1, x2, y2, x3, y3; arg: operation (see
+                       //!< @ref pdf_path_operation)
+    PDF_CMD_IMAGE,     //!< v: x, y, width, height; data: image file
+    PDF_CMD_FORM,      //!< v: x, y, width, height; arg: index of the form
+                       //!< in the handles array
+    PDF_CMD_BARCODE,   //!< v: x, y, width, height; colour; arg:
+                       //!< PDF_BARCODE_*; data: text to encode
+};
+
+/**
+ * A single drawing operation for @ref pdf_execute.
+ * This has a fixed layout of 48 bytes, with no pointers, so that arrays of
+ * them are easy to build from other languages.
+ */
+struct pdf_command {
+    uint32_t op;          //!< PDF_CMD_*
+    int32_t arg;          //!< Integer operand
+    uint32_t colour;      //!< Stroke/text colour
+    uint32_t fill;        //!< Fill colour
+    float v[6];           //!< Numeric operands
+    uint32_t data_offset; //!< Start of text/image operand in the data buffer
+    uint32_t data_len;    //!< Length of text/image operand
+};
+
+/**
+ * Draw a whole array of commands onto a page in a single call, which is
+ * much cheaper than one call per operation when calling from another
+ * language. Each command gives the same result as the function it
+ * corresponds to (eg: PDF_CMD_LINE and @ref pdf_add_line).
+ * A failed command doesn't stop the rest from being drawn; the error
+ * message of the last one to fail is available from @ref pdf_get_err.
+ * @param pdf PDF document to add to
+ * @param page Page to add to (NULL => most recently added page)
+ * @param commands Commands to run, in order
+ * @param count Number of commands
+ * @param data Text, font names & image files used by the commands
+ * @param data_len Size of the data buffer
+ * @param handles Forms which PDF_CMD_FORM commands can draw (eg: from
+ *        @ref pdf_import_page), may be NULL
+ * @param handle_count Number of handles
+ * @param results Store the result of each command, < 0 if it failed, or
+ *        NULL. Each PDF_CMD_PATH_OP gets the result of its path.
+ * @return < 0 if the arguments are invalid, otherwise the number of
+ *         commands which failed (0 on complete success)
+ */
+int pdf_execute(struct pdf_doc *pdf, struct pdf_object *page,
+                const struct pdf_command *commands, int count,
+                const void *data, size_t data_len,
+                struct pdf_object *const *handles, int handle_count,
+                int *results);
+
 #ifdef __cplusplus
 }
 #endif
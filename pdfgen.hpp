@@ -0,0 +1,503 @@
+/**
+ * C++ wrapper for PDFGen
+ *
+ * Header-only, and adds no allocations or copies on top of the C API:
+ *  - @ref pdfgen::Document owns a pdf_doc, and is move-only, so the
+ *    document is destroyed exactly once when it goes out of scope.
+ *  - @ref pdfgen::Page is a cheap handle to a page of a document. Pages
+ *    belong to their document, so handles must not outlive it.
+ *  - Strings are taken as std::string_view and passed straight to the
+ *    length-delimited (_n) C functions, so no std::string temporaries or
+ *    NUL terminated copies are made.
+ *  - Bulk calls take contiguous arrays (@ref pdfgen::Span, which accepts
+ *    std::vector, std::array, std::span, C arrays or pointer & count).
+ *
+ * Functions return the same values as the C functions they wrap: < 0 on
+ * failure, with the details available from @ref pdfgen::Document::error.
+ * No exceptions are thrown.
+ *
+ * @par Example:
+ * @code
+#include "pdfgen.hpp"
+ ...
+pdfgen::Document doc(PDF_A4_WIDTH, PDF_A4_HEIGHT);
+doc.set_font("Helvetica");
+pdfgen::Page page = doc.append_page();
+std::string_view title = row.substr(0, 20);
+page.text(title, 12, 50, 800);
+const pdfgen::Line rules[] = {{{50, 790}, {550, 790}}, {{50, 50}, {550, 50}}};
+page.draw(pdfgen::Span<const pdfgen::Line>(rules), 1, PDF_BLACK);
+doc.save("output.pdf");
+ * @endcode
+ */
+#ifndef PDFGEN_HPP
+#define PDFGEN_HPP
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "pdfgen.h"
+
+namespace pdfgen
+{
+
+/**
+ * Read-only view of a contiguous array, like C++20's std::span (which
+ * converts to it), for the bulk drawing calls.
+ */
+template <typename T> class Span
+{
+  public:
+    constexpr Span() noexcept = default;
+    constexpr Span(T *data, std::size_t size) noexcept
+        : data_(data), size_(size)
+    {
+    }
+    template <std::size_t N>
+    constexpr Span(T (&array)[N]) noexcept : data_(array), size_(N)
+    {
+    }
+    /* Any container with contiguous data() & size(), eg: std::vector,
+     * std::array, std::span */
+    template <typename C,
+              typename = decltype(std::declval<C &>().data() +
+                                  std::declval<C &>().size()),
+              typename = std::enable_if_t<std::is_convertible_v<
+                  decltype(std::declval<C &>().data()), T *>>>
+    constexpr Span(C &container) noexcept
+        : data_(container.data()), size_(container.size())
+    {
+    }
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+
+  private:
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/** A point on a page */
+struct Point {
+    float x, y;
+};
+
+/** A straight line, see @ref Page::draw */
+struct Line {
+    Point from, to;
+};
+
+/** An axis aligned rectangle, see @ref Page::draw */
+struct Rect {
+    float x, y, width, height;
+};
+
+/** A circle, see @ref Page::draw */
+struct Circle {
+    Point centre;
+    float radius;
+};
+
+/**
+ * How to draw each kind of shape, picked at compile time by
+ * @ref Page::draw. Specialise this to draw other types of shapes in bulk.
+ */
+template <typename Shape> struct Emitter;
+
+template <> struct Emitter<Line> {
+    static int emit(pdf_doc *pdf, pdf_object *page, const Line &line,
+                    float width, uint32_t colour)
+    {
+        return pdf_add_line(pdf, page, line.from.x, line.from.y, line.to.x,
+                            line.to.y, width, colour);
+    }
+};
+
+template <> struct Emitter<Rect> {
+    static int emit(pdf_doc *pdf, pdf_object *page, const Rect &rect,
+                    float width, uint32_t colour)
+    {
+        return pdf_add_rectangle(pdf, page, rect.x, rect.y, rect.width,
+                                 rect.height, width, colour);
+    }
+};
+
+template <> struct Emitter<Circle> {
+    static int emit(pdf_doc *pdf, pdf_object *page, const Circle &circle,
+                    float width, uint32_t colour)
+    {
+        return pdf_add_circle(pdf, page, circle.centre.x, circle.centre.y,
+                              circle.radius, width, colour, PDF_TRANSPARENT);
+    }
+};
+
+/**
+ * Handle to one page of a @ref Document. Copying it copies the handle,
+ * not the page.
+ */
+class Page
+{
+  public:
+    constexpr Page() noexcept = default;
+    constexpr Page(pdf_doc *pdf, pdf_object *page) noexcept
+        : pdf_(pdf), page_(page)
+    {
+    }
+
+    /** Whether this refers to a page */
+    explicit operator bool() const noexcept { return page_ != nullptr; }
+    pdf_object *get() const noexcept { return page_; }
+    pdf_doc *document() const noexcept { return pdf_; }
+
+    float width() const { return pdf_page_width(page_); }
+    float height() const { return pdf_page_height(page_); }
+    int set_size(float width, float height)
+    {
+        return pdf_page_set_size(pdf_, page_, width, height);
+    }
+
+    /** See @ref pdf_add_text */
+    int text(std::string_view text, float size, float x, float y,
+             uint32_t colour = PDF_BLACK)
+    {
+        return pdf_add_text_n(pdf_, page_, text.data(), text.size(), size, x,
+                              y, colour);
+    }
+
+    /** See @ref pdf_add_text_rotate */
+    int text_rotate(std::string_view text, float size, float x, float y,
+                    float angle, uint32_t colour = PDF_BLACK)
+    {
+        return pdf_add_text_rotate_n(pdf_, page_, text.data(), text.size(),
+                                     size, x, y, angle, colour);
+    }
+
+    /** See @ref pdf_add_text_wrap */
+    int text_wrap(std::string_view text, float size, float x, float y,
+                  float wrap_width, int align = PDF_ALIGN_LEFT,
+                  float *height = nullptr, uint32_t colour = PDF_BLACK,
+                  float angle = 0)
+    {
+        return pdf_add_text_wrap_n(pdf_, page_, text.data(), text.size(),
+                                   size, x, y, angle, colour, wrap_width,
+                                   align, height);
+    }
+
+    /** See @ref pdf_add_barcode */
+    int barcode(int code, float x, float y, float width, float height,
+                std::string_view text, uint32_t colour = PDF_BLACK)
+    {
+        return pdf_add_barcode_n(pdf_, page_, code, x, y, width, height,
+                                 text.data(), text.size(), colour);
+    }
+
+    int line(float x1, float y1, float x2, float y2, float width,
+             uint32_t colour = PDF_BLACK)
+    {
+        return pdf_add_line(pdf_, page_, x1, y1, x2, y2, width, colour);
+    }
+
+    int rectangle(float x, float y, float width, float height,
+                  float border_width, uint32_t colour = PDF_BLACK)
+    {
+        return pdf_add_rectangle(pdf_, page_, x, y, width, height,
+                                 border_width, colour);
+    }
+
+    int filled_rectangle(float x, float y, float width, float height,
+                         uint32_t fill, float border_width = 0,
+                         uint32_t border = PDF_BLACK)
+    {
+        return pdf_add_filled_rectangle(pdf_, page_, x, y, width, height,
+                                        border_width, fill, border);
+    }
+
+    int circle(float x, float y, float radius, float width,
+               uint32_t colour = PDF_BLACK, uint32_t fill = PDF_TRANSPARENT)
+    {
+        return pdf_add_circle(pdf_, page_, x, y, radius, width, colour, fill);
+    }
+
+    int ellipse(float x, float y, float xradius, float yradius, float width,
+                uint32_t colour = PDF_BLACK, uint32_t fill = PDF_TRANSPARENT)
+    {
+        return pdf_add_ellipse(pdf_, page_, x, y, xradius, yradius, width,
+                               colour, fill);
+    }
+
+    /** See @ref pdf_add_custom_path */
+    int path(Span<const pdf_path_operation> operations, float width,
+             uint32_t colour = PDF_BLACK, uint32_t fill = PDF_TRANSPARENT)
+    {
+        return pdf_add_custom_path(pdf_, page_, operations.data(),
+                                   static_cast<int>(operations.size()), width,
+                                   colour, fill);
+    }
+
+    /**
+     * Outline (or fill) a polygon given separate arrays of x & y
+     * coordinates, which must be the same size
+     */
+    int polygon(Span<const float> x, Span<const float> y, float width,
+                uint32_t colour = PDF_BLACK, bool filled = false)
+    {
+        if (x.size() != y.size() || x.size() == 0)
+            return -EINVAL;
+        /* The C functions don't modify the coordinates */
+        float *px = const_cast<float *>(x.data());
+        float *py = const_cast<float *>(y.data());
+        int count = static_cast<int>(x.size());
+        return filled ? pdf_add_filled_polygon(pdf_, page_, px, py, count,
+                                               width, colour)
+                      : pdf_add_polygon(pdf_, page_, px, py, count, width,
+                                        colour);
+    }
+
+    /**
+     * Outline (or fill) a polygon with a fixed number of points. The
+     * points are split into coordinates on the stack.
+     */
+    template <std::size_t N>
+    int polygon(const std::array<Point, N> &points, float width,
+                uint32_t colour = PDF_BLACK, bool filled = false)
+    {
+        static_assert(N >= 2, "A polygon needs at least two points");
+        float x[N], y[N];
+        for (std::size_t i = 0; i < N; i++) {
+            x[i] = points[i].x;
+            y[i] = points[i].y;
+        }
+        return filled ? pdf_add_filled_polygon(pdf_, page_, x, y,
+                                               static_cast<int>(N), width,
+                                               colour)
+                      : pdf_add_polygon(pdf_, page_, x, y,
+                                        static_cast<int>(N), width, colour);
+    }
+
+    /** Join up a series of points with straight lines */
+    int polyline(Span<const Point> points, float width,
+                 uint32_t colour = PDF_BLACK)
+    {
+        for (std::size_t i = 1; i < points.size(); i++) {
+            int e = pdf_add_line(pdf_, page_, points.data()[i - 1].x,
+                                 points.data()[i - 1].y, points.data()[i].x,
+                                 points.data()[i].y, width, colour);
+            if (e < 0)
+                return e;
+        }
+        return 0;
+    }
+
+    /**
+     * Draw a single shape, or an array of shapes of the same type, using
+     * the @ref Emitter for that type of shape.
+     * Stops at the first one which fails.
+     */
+    template <typename Shape>
+    int draw(const Shape &shape, float width, uint32_t colour = PDF_BLACK)
+    {
+        return Emitter<Shape>::emit(pdf_, page_, shape, width, colour);
+    }
+
+    template <typename Shape>
+    int draw(Span<const Shape> shapes, float width,
+             uint32_t colour = PDF_BLACK)
+    {
+        for (const Shape &shape : shapes) {
+            int e = Emitter<Shape>::emit(pdf_, page_, shape, width, colour);
+            if (e < 0)
+                return e;
+        }
+        return 0;
+    }
+
+    /** See @ref pdf_add_image_data */
+    int image(float x, float y, float width, float height,
+              Span<const uint8_t> data)
+    {
+        return pdf_add_image_data(pdf_, page_, x, y, width, height,
+                                  data.data(), data.size());
+    }
+
+    /** See @ref pdf_add_image_file */
+    int image_file(float x, float y, float width, float height,
+                   const char *filename)
+    {
+        return pdf_add_image_file(pdf_, page_, x, y, width, height,
+                                  filename);
+    }
+
+    /** See @ref pdf_add_form */
+    int form(pdf_object *form, float x, float y, float width = -1,
+             float height = -1)
+    {
+        return pdf_add_form(pdf_, page_, form, x, y, width, height);
+    }
+
+    /** See @ref pdf_add_link */
+    int link(float x, float y, float width, float height, Page target,
+             float target_x = 0, float target_y = 0)
+    {
+        return pdf_add_link(pdf_, page_, x, y, width, height, target.page_,
+                            target_x, target_y);
+    }
+
+    /** See @ref pdf_add_bookmark. Returns the new bookmark's id */
+    int bookmark(std::string_view name, int parent = -1)
+    {
+        return pdf_add_bookmark_n(pdf_, page_, parent, name.data(),
+                                  name.size());
+    }
+
+    /** Run a buffer of commands, see @ref pdf_execute */
+    int execute(Span<const pdf_command> commands, std::string_view data,
+                Span<pdf_object *const> handles = {},
+                int *results = nullptr)
+    {
+        return pdf_execute(pdf_, page_, commands.data(),
+                           static_cast<int>(commands.size()), data.data(),
+                           data.size(), handles.data(),
+                           static_cast<int>(handles.size()), results);
+    }
+
+    /** See @ref pdf_page_get_bbox */
+    int bbox(float bbox[4]) const
+    {
+        return pdf_page_get_bbox(pdf_, page_, bbox);
+    }
+
+  private:
+    pdf_doc *pdf_ = nullptr;
+    pdf_object *page_ = nullptr;
+};
+
+/**
+ * A PDF document, which is destroyed along with this object.
+ * Documents can be moved but not copied.
+ */
+class Document
+{
+  public:
+    /** See @ref pdf_create. Check for failure with operator bool */
+    Document(float width, float height, const pdf_info *info = nullptr)
+        : pdf_(pdf_create(width, height, info))
+    {
+    }
+    /** Take ownership of a document created with the C API */
+    explicit Document(pdf_doc *pdf) noexcept : pdf_(pdf) {}
+    ~Document() { reset(); }
+
+    Document(const Document &) = delete;
+    Document &operator=(const Document &) = delete;
+    Document(Document &&other) noexcept : pdf_(other.release()) {}
+    Document &operator=(Document &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            pdf_ = other.release();
+        }
+        return *this;
+    }
+
+    /** Whether the document was created successfully */
+    explicit operator bool() const noexcept { return pdf_ != nullptr; }
+    pdf_doc *get() const noexcept { return pdf_; }
+
+    /** Give up ownership of the document, which the caller must destroy */
+    pdf_doc *release() noexcept
+    {
+        pdf_doc *pdf = pdf_;
+        pdf_ = nullptr;
+        return pdf;
+    }
+
+    /** Destroy the document (all Page handles become invalid) */
+    void reset() noexcept
+    {
+        if (pdf_)
+            pdf_destroy(pdf_);
+        pdf_ = nullptr;
+    }
+
+    /** Most recent error message, or NULL, see @ref pdf_get_err */
+    const char *error(int *errval = nullptr) const
+    {
+        return pdf_get_err(pdf_, errval);
+    }
+    void clear_error() { pdf_clear_err(pdf_); }
+
+    float width() const { return pdf_width(pdf_); }
+    float height() const { return pdf_height(pdf_); }
+
+    /** Add a page, which is invalid (false) on failure */
+    Page append_page() { return Page(pdf_, pdf_append_page(pdf_)); }
+
+    /** Page by number, starting from 1 */
+    Page page(int page_number)
+    {
+        return Page(pdf_, pdf_get_page(pdf_, page_number));
+    }
+
+    /** See @ref pdf_set_font */
+    int set_font(const char *font) { return pdf_set_font(pdf_, font); }
+
+    /** Width of text in points, see @ref pdf_get_font_text_width */
+    int text_width(std::string_view text, float size, float *width,
+                   const char *font = nullptr)
+    {
+        return pdf_get_font_text_width_n(pdf_, font, text.data(),
+                                         text.size(), size, width);
+    }
+
+    int reserve(int pages, int objects, std::size_t content_bytes)
+    {
+        return pdf_reserve(pdf_, pages, objects, content_bytes);
+    }
+    int set_text_cache(int entries)
+    {
+        return pdf_set_text_cache(pdf_, entries);
+    }
+    int set_measure_only(bool measure_only)
+    {
+        return pdf_set_measure_only(pdf_, measure_only ? 1 : 0);
+    }
+    int set_bbox_tracking(bool track)
+    {
+        return pdf_set_bbox_tracking(pdf_, track ? 1 : 0);
+    }
+    int set_deterministic(const char *date)
+    {
+        return pdf_set_deterministic(pdf_, date);
+    }
+    int set_limits(const pdf_limits *limits)
+    {
+        return pdf_set_limits(pdf_, limits);
+    }
+    int stats(pdf_stats *stats) const { return pdf_get_stats(pdf_, stats); }
+
+    /** Move all the pages of other on to the end of this document */
+    int append(Document &other)
+    {
+        return pdf_append_document(pdf_, other.pdf_);
+    }
+
+    /** See @ref pdf_save */
+    int save(const char *filename) { return pdf_save(pdf_, filename); }
+    /** See @ref pdf_save_file */
+    int save(FILE *fp) { return pdf_save_file(pdf_, fp); }
+
+  private:
+    pdf_doc *pdf_ = nullptr;
+};
+
+} // namespace pdfgen
+
+#endif // PDFGEN_HPP
@@ -0,0 +1,78 @@
+/**
+ * Counts heap allocations, for tests/workloads.c & tests/fuzz-complexity.c
+ *
+ * malloc & friends are redirected to the __wrap_ functions below with the
+ * linker's --wrap option (see the Makefile), so this needs GNU ld (or lld)
+ * & glibc's malloc_usable_size. Only include it from one file of each
+ * program, as it defines the wrappers.
+ */
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Counts of the calls to malloc etc. A writer thread allocates too, so
+ * these are updated atomically */
+static uint64_t allocations, heap_bytes, peak_heap_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static void count_alloc(void *ptr)
+{
+    uint64_t bytes, peak;
+
+    if (!ptr)
+        return;
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    bytes = __atomic_add_fetch(&heap_bytes, malloc_usable_size(ptr),
+                               __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&peak_heap_bytes, __ATOMIC_RELAXED);
+    while (bytes > peak &&
+           !__atomic_compare_exchange_n(&peak_heap_bytes, &peak, bytes, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    void *ptr = __real_calloc(count, size);
+
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *new_ptr = __real_realloc(ptr, size);
+
+    if (new_ptr) {
+        __atomic_sub_fetch(&heap_bytes, old_size, __ATOMIC_RELAXED);
+        count_alloc(new_ptr);
+    }
+    return new_ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr)
+        __atomic_sub_fetch(&heap_bytes, malloc_usable_size(ptr),
+                           __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+#endif
@@ -0,0 +1,599 @@
+/**
+ * Microbenchmarks for the hot paths of PDFGen
+ * Each benchmark prints a single line of JSON:
+ *   {"name": ..., "ops": ..., "ns_per_op": ..., "bytes_per_op": ...,
+ *    "allocs_per_op": ..., "output_bytes": ...}
+ * where bytes_per_op & allocs_per_op count heap allocations made while
+ * timing, and output_bytes is the size of the resulting PDF (if any).
+ *
+ * Usage: bench [-s scale] [name-filter]
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PDFGEN_WRITER_THREAD
+#include <pthread.h>
+#endif
+
+/* Count the allocations made by pdfgen.c, which is built in to this file
+ * so that the internals (dstr, flexarray) can be measured too */
+static atomic_size_t alloc_count;
+static atomic_size_t alloc_bytes;
+
+static void *bench_malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return malloc(size);
+}
+
+static void *bench_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return calloc(nmemb, size);
+}
+
+static void *bench_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return realloc(ptr, size);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#include "pdfgen.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+static long scale = 1;
+static const char *filter;
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct bench {
+    const char *name;
+    double start;
+    size_t allocs;
+    size_t bytes;
+};
+
+static bool bench_wanted(const char *name)
+{
+    return !filter || strstr(name, filter);
+}
+
+static void bench_start(struct bench *b, const char *name)
+{
+    b->name = name;
+    b->allocs = alloc_count;
+    b->bytes = alloc_bytes;
+    b->start = now();
+}
+
+/* Size of 'pdf' once saved, or 0 if there is no document */
+static long output_size(struct pdf_doc *pdf)
+{
+    FILE *fp;
+    long size;
+
+    if (!pdf)
+        return 0;
+    fp = tmpfile();
+    if (!fp || pdf_save_file(pdf, fp) < 0) {
+        fprintf(stderr, "Unable to save: %s\n", pdf_get_err(pdf, NULL));
+        exit(1);
+    }
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static void bench_end(struct bench *b, long ops, struct pdf_doc *pdf)
+{
+    double elapsed = now() - b->start;
+    size_t allocs = alloc_count - b->allocs;
+    size_t bytes = alloc_bytes - b->bytes;
+
+    printf("{\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, "
+           "\"bytes_per_op\": %.1f, \"allocs_per_op\": %.3f, "
+           "\"output_bytes\": %ld}\n",
+           b->name, ops, elapsed * 1e9 / ops, (double)bytes / ops,
+           (double)allocs / ops, output_size(pdf));
+    fflush(stdout);
+}
+
+static struct pdf_doc *new_doc(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+
+    if (!pdf) {
+        fprintf(stderr, "Unable to create PDF\n");
+        exit(1);
+    }
+    pdf_set_deterministic(pdf, NULL);
+    pdf_append_page(pdf);
+    return pdf;
+}
+
+static void bench_dstr(void)
+{
+    struct bench b;
+    long ops = 1000000 * scale;
+
+    if (bench_wanted("dstr_append")) {
+        struct dstr str = INIT_DSTR;
+        bench_start(&b, "dstr_append");
+        for (long i = 0; i < ops; i++)
+            dstr_append(&str, "0123456789abcdef");
+        bench_end(&b, ops, NULL);
+        dstr_free(&str);
+    }
+
+    if (bench_wanted("dstr_printf")) {
+        struct dstr str = INIT_DSTR;
+        bench_start(&b, "dstr_printf");
+        for (long i = 0; i < ops; i++)
+            dstr_printf(&str, "%f %f m ", i * 0.5f, i * 0.25f);
+        bench_end(&b, ops, NULL);
+        dstr_free(&str);
+    }
+}
+
+static void bench_flexarray(void)
+{
+    struct bench b;
+    struct flexarray flex = {0};
+    long ops = 1000000 * scale;
+    uintptr_t sum = 0;
+
+    if (!bench_wanted("flexarray"))
+        return;
+    bench_start(&b, "flexarray_append");
+    for (long i = 0; i < ops; i++)
+        flexarray_append(&flex, (void *)(uintptr_t)i);
+    bench_end(&b, ops, NULL);
+
+    bench_start(&b, "flexarray_get");
+    for (long i = 0; i < ops; i++)
+        sum += (uintptr_t)flexarray_get(&flex, (int)((i * 7919) % ops));
+    bench_end(&b, ops, NULL);
+    flexarray_clear(&flex);
+    if (sum == 0)
+        fprintf(stderr, "flexarray_get: unexpected sum\n");
+}
+
+static void bench_text(void)
+{
+    struct bench b;
+    struct pdf_doc *pdf;
+    long ops = 100000 * scale;
+    float width;
+
+    if (bench_wanted("font_text_width")) {
+        pdf = new_doc();
+        bench_start(&b, "font_text_width");
+        for (long i = 0; i < ops; i++)
+            pdf_get_font_text_width(pdf, "Helvetica",
+                                    "The quick brown fox jumps over the "
+                                    "lazy dog",
+                                    12, &width);
+        bench_end(&b, ops, NULL);
+        pdf_destroy(pdf);
+    }
+
+    if (bench_wanted("add_text")) {
+        pdf = new_doc();
+        bench_start(&b, "add_text");
+        for (long i = 0; i < ops; i++) {
+            if (i % 1000 == 999)
+                pdf_append_page(pdf);
+            pdf_add_text(pdf, NULL, "The quick brown fox", 12, 50,
+                         (float)(i % 60) * 12, PDF_BLACK);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+
+    if (bench_wanted("add_text_wrap")) {
+        ops = 10000 * scale;
+        pdf = new_doc();
+        bench_start(&b, "add_text_wrap");
+        for (long i = 0; i < ops; i++) {
+            if (i % 100 == 99)
+                pdf_append_page(pdf);
+            pdf_add_text_wrap(pdf, NULL,
+                              "This is a great big long string that should "
+                              "wrap across several lines, with a few "
+                              "longishwords to check the justification.",
+                              10, 50, 700, 0, PDF_BLACK, 200,
+                              PDF_ALIGN_JUSTIFY, NULL);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+}
+
+/* Labels which repeat (hits), and invoice numbers which never do (misses,
+ * which should cost no more than having no cache) */
+static void bench_text_cache(void)
+{
+    static const char *labels[] = {"Item", "Quantity", "Price", "Total"};
+    struct bench b;
+    struct pdf_doc *pdf;
+    long ops = 100000 * scale;
+    char text[32];
+
+    if (bench_wanted("add_text_cache_hit")) {
+        pdf = new_doc();
+        pdf_set_text_cache(pdf, 256);
+        bench_start(&b, "add_text_cache_hit");
+        for (long i = 0; i < ops; i++) {
+            if (i % 1000 == 999)
+                pdf_append_page(pdf);
+            pdf_add_text(pdf, NULL, labels[i % ARRAY_SIZE(labels)], 12, 50,
+                         (float)(i % 60) * 12, PDF_BLACK);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+
+    if (bench_wanted("add_text_cache_miss")) {
+        pdf = new_doc();
+        pdf_set_text_cache(pdf, 256);
+        bench_start(&b, "add_text_cache_miss");
+        for (long i = 0; i < ops; i++) {
+            if (i % 1000 == 999)
+                pdf_append_page(pdf);
+            snprintf(text, sizeof(text), "Invoice %ld", i);
+            pdf_add_text(pdf, NULL, text, 12, 50, (float)(i % 60) * 12,
+                         PDF_BLACK);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+}
+
+static void bench_layout(void)
+{
+    struct bench b;
+    struct pdf_doc *pdf;
+    long ops = 10000 * scale;
+
+    if (bench_wanted("flow_write")) {
+        const char *text = "This is a great big long paragraph that should "
+                           "wrap across several lines, with a few "
+                           "longishwords to check the justification.\n";
+        struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                       PDF_A4_HEIGHT - 100, 0};
+        struct pdf_flow_style style = {"Times-Roman", 11, 0, 6, 20,
+                                       PDF_ALIGN_JUSTIFY, PDF_BLACK};
+        struct pdf_flow *flow;
+
+        pdf = new_doc();
+        bench_start(&b, "flow_write");
+        flow = pdf_flow_create(pdf, NULL, &frame, NULL, NULL);
+        for (long i = 0; flow && i < ops; i++)
+            pdf_flow_write(flow, &style, text, strlen(text));
+        if (!flow || pdf_flow_end(flow, NULL) < 0) {
+            fprintf(stderr, "flow_write: %s\n", pdf_get_err(pdf, NULL));
+            exit(1);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+
+    if (bench_wanted("add_table")) {
+        struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                       PDF_A4_HEIGHT - 100, 0};
+        struct pdf_table_column columns[] = {{40, PDF_ALIGN_RIGHT},
+                                             {0, PDF_ALIGN_LEFT},
+                                             {0, PDF_ALIGN_LEFT},
+                                             {0, PDF_ALIGN_RIGHT}};
+        struct pdf_table_style style = {.size = 9,
+                                        .padding = 3,
+                                        .colour = PDF_BLACK,
+                                        .border_width = 0.5f,
+                                        .border_colour = PDF_BLACK,
+                                        .header_rows = 1};
+        const char **cells = (const char **)malloc(ops * 4 * sizeof(*cells));
+
+        if (!cells) {
+            fprintf(stderr, "add_table: out of memory\n");
+            exit(1);
+        }
+        for (long i = 0; i < ops * 4; i++)
+            cells[i] = i % 4 == 2 ? "A description which is long enough "
+                                    "to wrap within its cell"
+                                  : "1234.56";
+        pdf = new_doc();
+        bench_start(&b, "add_table");
+        if (pdf_add_table(pdf, NULL, &frame, 790, columns, 4, cells, (int)ops,
+                          &style, NULL) != ops) {
+            fprintf(stderr, "add_table: %s\n", pdf_get_err(pdf, NULL));
+            exit(1);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+        free(cells);
+    }
+}
+
+/* A small checked tile */
+static struct pdf_object *bench_pattern(struct pdf_doc *pdf)
+{
+    struct pdf_object *pattern = pdf_add_pattern(pdf, 10, 10);
+
+    if (!pattern) {
+        fprintf(stderr, "Unable to add pattern: %s\n",
+                pdf_get_err(pdf, NULL));
+        exit(1);
+    }
+    pdf_add_filled_rectangle(pdf, pattern, 0, 0, 5, 5, 0, PDF_RED, 0);
+    pdf_add_filled_rectangle(pdf, pattern, 5, 5, 5, 5, 0, PDF_BLUE, 0);
+    return pattern;
+}
+
+static void bench_primitives(void)
+{
+    struct bench b;
+    struct pdf_doc *pdf;
+    struct pdf_object *pattern;
+    long ops = 100000 * scale;
+    const struct pdf_path_operation path[] = {
+        {'m', 10, 10, 0, 0, 0, 0},
+        {'c', 20, 50, 40, 50, 50, 10},
+        {'l', 30, 0, 0, 0, 0, 0},
+        {'h', 0, 0, 0, 0, 0, 0},
+    };
+
+#define BENCH_PRIMITIVE(name, call)                                          \
+    if (bench_wanted(name)) {                                                \
+        pdf = new_doc();                                                     \
+        bench_start(&b, name);                                               \
+        for (long i = 0; i < ops; i++) {                                     \
+            float f = (float)(i % 500);                                      \
+            (void)f;                                                         \
+            if (i % 1000 == 999)                                             \
+                pdf_append_page(pdf);                                        \
+            call;                                                            \
+        }                                                                    \
+        bench_end(&b, ops, pdf);                                             \
+        pdf_destroy(pdf);                                                    \
+    }
+
+    BENCH_PRIMITIVE("add_line",
+                    pdf_add_line(pdf, NULL, 10, f, 500, f, 1, PDF_BLACK));
+    BENCH_PRIMITIVE("add_rectangle", pdf_add_rectangle(pdf, NULL, f, f, 50,
+                                                       20, 1, PDF_BLACK));
+    BENCH_PRIMITIVE("add_filled_rectangle",
+                    pdf_add_filled_rectangle(pdf, NULL, f, f, 50, 20, 1,
+                                             PDF_RED, PDF_BLACK));
+    BENCH_PRIMITIVE("add_circle",
+                    pdf_add_circle(pdf, NULL, f, f, 20, 1, PDF_BLACK,
+                                   PDF_TRANSPARENT));
+    BENCH_PRIMITIVE("add_custom_path",
+                    pdf_add_custom_path(pdf, NULL, path, ARRAY_SIZE(path), 1,
+                                        PDF_BLACK, PDF_TRANSPARENT));
+#undef BENCH_PRIMITIVE
+
+    /* As add_filled_rectangle, with a tiling pattern for the fill */
+    if (bench_wanted("add_filled_rectangle_pattern")) {
+        pdf = new_doc();
+        pattern = bench_pattern(pdf);
+        bench_start(&b, "add_filled_rectangle_pattern");
+        for (long i = 0; i < ops; i++) {
+            float f = (float)(i % 500);
+            if (i % 1000 == 999)
+                pdf_append_page(pdf);
+            pdf_add_filled_rectangle_pattern(pdf, NULL, f, f, 50, 20, 1,
+                                             pattern, PDF_BLACK);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+
+    /* The same lines as add_line, a page of commands per call */
+    if (bench_wanted("execute_line")) {
+        struct pdf_command commands[1000];
+
+        for (int i = 0; i < 1000; i++)
+            commands[i] = (struct pdf_command){
+                .op = PDF_CMD_LINE,
+                .v = {10, (float)(i % 500), 500, (float)(i % 500), 1},
+            };
+        pdf = new_doc();
+        bench_start(&b, "execute_line");
+        for (long i = 0; i < ops; i += 1000) {
+            if (i)
+                pdf_append_page(pdf);
+            pdf_execute(pdf, NULL, commands, 1000, NULL, 0, NULL, 0, NULL);
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+}
+
+static void bench_barcodes(void)
+{
+    const struct {
+        const char *name;
+        int code;
+        const char *string;
+    } barcodes[] = {
+        {"barcode_128a", PDF_BARCODE_128A, "Code128"},
+        {"barcode_39", PDF_BARCODE_39, "CODE39"},
+        {"barcode_ean13", PDF_BARCODE_EAN13, "4003994155486"},
+        {"barcode_upca", PDF_BARCODE_UPCA, "003994155480"},
+        {"barcode_ean8", PDF_BARCODE_EAN8, "95012346"},
+        {"barcode_upce", PDF_BARCODE_UPCE, "012345000058"},
+    };
+    long ops = 10000 * scale;
+
+    for (size_t i = 0; i < ARRAY_SIZE(barcodes); i++) {
+        struct bench b;
+        struct pdf_doc *pdf;
+
+        if (!bench_wanted(barcodes[i].name))
+            continue;
+        pdf = new_doc();
+        bench_start(&b, barcodes[i].name);
+        for (long j = 0; j < ops; j++) {
+            if (j % 100 == 99)
+                pdf_append_page(pdf);
+            if (pdf_add_barcode(pdf, NULL, barcodes[i].code, 50, 50, 200, 80,
+                                barcodes[i].string, PDF_BLACK) < 0) {
+                fprintf(stderr, "%s: %s\n", barcodes[i].name,
+                        pdf_get_err(pdf, NULL));
+                exit(1);
+            }
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+    }
+}
+
+static uint8_t *load_file(const char *filename, size_t *len)
+{
+    FILE *fp = fopen(filename, "rb");
+    uint8_t *data;
+    long size;
+
+    if (!fp || fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        exit(1);
+    }
+    rewind(fp);
+    data = (uint8_t *)malloc(size);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        exit(1);
+    }
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+static void bench_images(void)
+{
+    const struct {
+        const char *name;
+        const char *filename;
+    } images[] = {
+        {"image_jpeg", "data/penguin.jpg"},
+        {"image_png", "data/coal.png"},
+        {"image_png_indexed", "data/indexed.png"},
+        {"image_bmp", "data/bee.bmp"},
+        {"image_ppm", "data/teapot.ppm"},
+        {"image_pgm", "data/bee.pgm"},
+    };
+    long ops = 100 * scale;
+
+    for (size_t i = 0; i < ARRAY_SIZE(images); i++) {
+        struct bench b;
+        struct pdf_doc *pdf;
+        uint8_t *data;
+        size_t len;
+
+        if (!bench_wanted(images[i].name))
+            continue;
+        data = load_file(images[i].filename, &len);
+        pdf = new_doc();
+        bench_start(&b, images[i].name);
+        for (long j = 0; j < ops; j++) {
+            if (pdf_add_image_data(pdf, NULL, 50, 50, 200, -1, data, len) <
+                0) {
+                fprintf(stderr, "%s: %s\n", images[i].name,
+                        pdf_get_err(pdf, NULL));
+                exit(1);
+            }
+        }
+        bench_end(&b, ops, pdf);
+        pdf_destroy(pdf);
+        free(data);
+    }
+}
+
+static void bench_save(void)
+{
+    const struct {
+        const char *name;
+        long pages;
+    } saves[] = {
+        {"save_1_page", 1},
+        {"save_1k_pages", 1000},
+        {"save_100k_pages", 100000},
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(saves); i++) {
+        struct bench b;
+        struct pdf_doc *pdf;
+        FILE *fp;
+        long ops = saves[i].pages < 1000 ? 100 : 1;
+
+        if (!bench_wanted(saves[i].name))
+            continue;
+        pdf = new_doc();
+        for (long p = 0; p < saves[i].pages; p++) {
+            if (p > 0)
+                pdf_append_page(pdf);
+            pdf_add_text(pdf, NULL, "Page heading", 18, 50, 780, PDF_BLACK);
+            pdf_add_line(pdf, NULL, 50, 770, 545, 770, 1, PDF_BLACK);
+            pdf_add_text(pdf, NULL, "Some body text", 12, 50, 700,
+                         PDF_BLACK);
+        }
+        fp = tmpfile();
+        if (!fp) {
+            perror("tmpfile");
+            exit(1);
+        }
+        bench_start(&b, saves[i].name);
+        for (long j = 0; j < ops; j++) {
+            rewind(fp);
+            if (pdf_save_file(pdf, fp) < 0) {
+                fprintf(stderr, "%s: %s\n", saves[i].name,
+                        pdf_get_err(pdf, NULL));
+                exit(1);
+            }
+        }
+        bench_end(&b, ops, pdf);
+        fclose(fp);
+        pdf_destroy(pdf);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            scale = atol(argv[++i]);
+            if (scale < 1)
+                scale = 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    bench_dstr();
+    bench_flexarray();
+    bench_text();
+    bench_text_cache();
+    bench_layout();
+    bench_primitives();
+    bench_barcodes();
+    bench_images();
+    bench_save();
+
+    return 0;
+}
@@ -0,0 +1,318 @@
+/**
+ * Algorithmic complexity fuzzer
+ * Rather than looking for crashes, this looks for inputs which take far
+ * more time or memory than their size warrants.
+ * The first byte of each input picks a scenario, and the rest is its
+ * payload. Each scenario is run twice: once with the payload as given,
+ * and once with it repeated SCALE times. The input fails (by aborting, so
+ * libFuzzer keeps it) if either run goes over a fixed budget per unit of
+ * work, or if the larger run is much more than SCALE times slower, ie:
+ * the scenario is superlinear in the size of its input.
+ * Memory is the peak heap while the scenario runs, counted by
+ * tests/alloc-count.h so that it includes temporary buffers (eg: decoded
+ * images) which the document never charges for.
+ *
+ * Inputs found to be slow are kept in tests/complexity-corpus, which is
+ * replayed by 'make check-complexity' (which doesn't need libFuzzer).
+ * Wall time varies too much between machines for a test suite, so the
+ * replay only checks the heap & allocation counts, which are
+ * deterministic; 'make check-complexity-timing' checks the time too.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc-count.h"
+#include "pdfgen.h"
+
+/* How much bigger the second run of each input is */
+#define SCALE 4
+/* Time allowed regardless of input size, in ns */
+#define BUDGET_BASE_NS (50 * 1000 * 1000ull)
+/* Time allowed per unit of work (byte, object, ...), in ns */
+#define BUDGET_UNIT_NS (50 * 1000ull)
+/* Memory allowed regardless of input size, and per unit of work. A unit
+ * may start a new list (eg: a bookmark's children), whose first bin is
+ * 1024 pointers */
+#define BUDGET_BASE_BYTES (4 * 1024 * 1024ull)
+#define BUDGET_UNIT_BYTES (12 * 1024ull)
+/* A linear scenario is SCALE times slower when scaled up; a quadratic one
+ * is SCALE * SCALE times slower. Runs shorter than this are too noisy to
+ * compare */
+#define SUPERLINEAR_RATIO (SCALE * 2)
+#define SUPERLINEAR_MIN_NS (5 * 1000 * 1000ull)
+/* Likewise for the number of allocations, below which the fixed cost of
+ * creating a document dominates */
+#define SUPERLINEAR_MIN_ALLOCATIONS 10000
+
+/* Whether to check wall time, as well as the heap & allocation counts */
+static int check_time = 1;
+
+struct scenario {
+    const char *name;
+    /* Bytes at the start of the payload which are not repeated (eg: file
+     * headers) */
+    size_t fixed;
+    /* Run the scenario, returning the amount of work it was given */
+    size_t (*run)(struct pdf_doc *pdf, const uint8_t *data, size_t len);
+};
+
+static void save(struct pdf_doc *pdf)
+{
+    FILE *fp = fopen("/dev/null", "wb");
+
+    if (fp) {
+        pdf_save_file(pdf, fp);
+        fclose(fp);
+    }
+}
+
+static char *to_text(const uint8_t *data, size_t len, int strip_spaces)
+{
+    char *text = (char *)malloc(len + 1);
+    size_t pos = 0;
+
+    if (!text)
+        return NULL;
+    for (size_t i = 0; i < len; i++) {
+        if (!data[i] || (strip_spaces && (data[i] == ' ' || data[i] == '\n')))
+            continue;
+        text[pos++] = (char)data[i];
+    }
+    text[pos] = '\0';
+    return text;
+}
+
+static size_t run_wrap(struct pdf_doc *pdf, const uint8_t *data, size_t len,
+                       int strip_spaces)
+{
+    char *text = to_text(data, len, strip_spaces);
+    float height;
+
+    if (!text)
+        return len;
+    pdf_add_text(pdf, NULL, text, 10, 20, 30, PDF_BLACK);
+    pdf_add_text_wrap(pdf, NULL, text, 10, 20, 800, 0, PDF_BLACK, 200,
+                      PDF_ALIGN_JUSTIFY, &height);
+    free(text);
+    save(pdf);
+    return len;
+}
+
+/* Arbitrary text, wrapped */
+static size_t run_text(struct pdf_doc *pdf, const uint8_t *data, size_t len)
+{
+    return run_wrap(pdf, data, len, 0);
+}
+
+/* Long unbroken words, which have to be split to be wrapped */
+static size_t run_word(struct pdf_doc *pdf, const uint8_t *data, size_t len)
+{
+    return run_wrap(pdf, data, len, 1);
+}
+
+/* Image files, PNG chunks & BMP conversion in particular */
+static size_t run_image(struct pdf_doc *pdf, const uint8_t *data, size_t len)
+{
+    pdf_add_image_data(pdf, NULL, 10, 10, 100, -1, data, len);
+    save(pdf);
+    return len;
+}
+
+/* Saving many objects of various types */
+static size_t run_objects(struct pdf_doc *pdf, const uint8_t *data,
+                          size_t len)
+{
+    struct pdf_object *first = pdf_get_page(pdf, 1);
+
+    for (size_t i = 0; i < len; i++) {
+        switch (data[i] % 4) {
+        case 0:
+            pdf_append_page(pdf);
+            break;
+        case 1:
+            pdf_add_text(pdf, NULL, "Text", 10, 20, 30, PDF_BLACK);
+            break;
+        case 2:
+            pdf_add_link(pdf, NULL, 0, 0, 10, 10, first, 0, 0);
+            break;
+        case 3:
+            pdf_add_bookmark(pdf, NULL, -1, "Bookmark");
+            break;
+        }
+    }
+    save(pdf);
+    return len;
+}
+
+/* Bookmark trees, where each byte says how far back up the tree the next
+ * bookmark goes (so all zeros is a single very deep branch) */
+static size_t run_bookmarks(struct pdf_doc *pdf, const uint8_t *data,
+                            size_t len)
+{
+    int *ids = (int *)malloc((len + 1) * sizeof(int));
+    int depth = 0;
+
+    if (!ids)
+        return len;
+    ids[0] = -1;
+    for (size_t i = 0; i < len; i++) {
+        int up = data[i] % 8;
+        int id;
+
+        depth = depth > up ? depth - up : 0;
+        id = pdf_add_bookmark(pdf, NULL, ids[depth], "Bookmark");
+        if (id >= 0)
+            ids[++depth] = id;
+    }
+    free(ids);
+    save(pdf);
+    return len;
+}
+
+static const struct scenario scenarios[] = {
+    {"text", 0, run_text},           {"word", 0, run_word},
+    {"png", 33, run_image},          {"bmp", 54, run_image},
+    {"objects", 0, run_objects},     {"bookmarks", 0, run_bookmarks},
+};
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* How much a scenario took */
+struct cost {
+    size_t units;         /* Amount of work it was given */
+    uint64_t duration;    /* Wall time, in ns */
+    uint64_t heap;        /* Peak heap above that before it ran, in bytes */
+    uint64_t allocations; /* Calls to malloc etc. */
+};
+
+/* Run a scenario with the payload repeated 'scale' times */
+static void run_scaled(const struct scenario *s, const uint8_t *data,
+                       size_t len, int scale, struct cost *cost)
+{
+    size_t fixed = len < s->fixed ? len : s->fixed;
+    size_t scaled_len = fixed + (len - fixed) * scale;
+    uint8_t *scaled = (uint8_t *)malloc(scaled_len ? scaled_len : 1);
+    struct pdf_doc *pdf;
+    uint64_t start, start_heap, start_allocations;
+
+    memset(cost, 0, sizeof(*cost));
+    if (!scaled)
+        return;
+    memcpy(scaled, data, fixed);
+    for (int i = 0; i < scale; i++)
+        memcpy(&scaled[fixed + (len - fixed) * i], &data[fixed], len - fixed);
+
+    /* The document itself counts towards the heap */
+    start_heap = peak_heap_bytes = heap_bytes;
+    start_allocations = allocations;
+    start = now_ns();
+    pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    pdf_set_font(pdf, "Times-Roman");
+    pdf_append_page(pdf);
+    cost->units = s->run(pdf, scaled, scaled_len);
+    pdf_destroy(pdf);
+    cost->duration = now_ns() - start;
+    cost->heap = peak_heap_bytes - start_heap;
+    cost->allocations = allocations - start_allocations;
+    free(scaled);
+}
+
+static void check_budget(const struct scenario *s, int scale,
+                         const struct cost *cost)
+{
+    uint64_t time_budget = BUDGET_BASE_NS + cost->units * BUDGET_UNIT_NS;
+    uint64_t heap_budget =
+        BUDGET_BASE_BYTES + cost->units * BUDGET_UNIT_BYTES;
+
+    if (check_time && cost->duration > time_budget) {
+        fprintf(stderr, "%s x%d: %llu ns for %zu units (budget %llu ns)\n",
+                s->name, scale, (unsigned long long)cost->duration,
+                cost->units, (unsigned long long)time_budget);
+        abort();
+    }
+    if (cost->heap > heap_budget) {
+        fprintf(stderr,
+                "%s x%d: %llu bytes for %zu units (budget %llu bytes)\n",
+                s->name, scale, (unsigned long long)cost->heap, cost->units,
+                (unsigned long long)heap_budget);
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const struct scenario *s;
+    struct cost small, large;
+
+    if (size == 0)
+        return 0;
+    s = &scenarios[data[0] % SCENARIO_COUNT];
+
+    run_scaled(s, &data[1], size - 1, 1, &small);
+    check_budget(s, 1, &small);
+    run_scaled(s, &data[1], size - 1, SCALE, &large);
+    check_budget(s, SCALE, &large);
+
+    if (check_time && large.duration > SUPERLINEAR_MIN_NS &&
+        large.duration > small.duration * SUPERLINEAR_RATIO) {
+        fprintf(stderr, "%s: %llu ns, but %llu ns when %d times larger\n",
+                s->name, (unsigned long long)small.duration,
+                (unsigned long long)large.duration, SCALE);
+        abort();
+    }
+    if (large.allocations > SUPERLINEAR_MIN_ALLOCATIONS &&
+        large.allocations > small.allocations * SUPERLINEAR_RATIO) {
+        fprintf(stderr,
+                "%s: %llu allocations, but %llu when %d times larger\n",
+                s->name, (unsigned long long)small.allocations,
+                (unsigned long long)large.allocations, SCALE);
+        abort();
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/* Replay inputs without libFuzzer, eg: the corpus of slow inputs. Only
+ * checks wall time if given '-t' */
+int main(int argc, char *argv[])
+{
+    int first = 1;
+
+    check_time = 0;
+    if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+        check_time = 1;
+        first++;
+    }
+    for (int i = first; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        uint8_t *data;
+        long len;
+
+        if (!fp || fseek(fp, 0, SEEK_END) < 0 || (len = ftell(fp)) < 0) {
+            fprintf(stderr, "Unable to read '%s'\n", argv[i]);
+            return 1;
+        }
+        rewind(fp);
+        data = (uint8_t *)malloc(len ? len : 1);
+        if (!data || fread(data, 1, len, fp) != (size_t)len) {
+            fprintf(stderr, "Unable to read '%s'\n", argv[i]);
+            return 1;
+        }
+        fclose(fp);
+        printf("%s\n", argv[i]);
+        LLVMFuzzerTestOneInput(data, len);
+        free(data);
+    }
+    return 0;
+}
+#endif
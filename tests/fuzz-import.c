@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pdfgen.h"
+
+int LLVMFuzzerTestOneInput(char *data, int size)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_object *form;
+
+    pdf_append_page(pdf);
+    form = pdf_import_page_data(pdf, (uint8_t *)data, size, 1);
+    pdf_add_form(pdf, NULL, form, 100, 500, 200, -1);
+    pdf_save(pdf, "fuzz-import.pdf");
+    pdf_destroy(pdf);
+    return 0;
+}
@@ -1,7 +1,15 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <locale.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -14,6 +22,1561 @@ extern unsigned int data_penguin_jpg_len;
 
 extern unsigned char data_rgb[];
 
+/* Read all of a file in to memory */
+static char *read_file(FILE *fp, long *len)
+{
+    char *data;
+
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (char *)malloc(*len + 1);
+    if (data && fread(data, 1, *len, fp) != (size_t)*len) {
+        free(data);
+        return NULL;
+    }
+    /* Terminated, so the text before any binary data can be searched */
+    if (data)
+        data[*len] = '\0';
+    return data;
+}
+
+/* Count the occurrences of a string in binary data (which may contain
+ * NULs) */
+static int data_count(const char *data, long len, const char *needle)
+{
+    const char *end = data + len;
+    size_t needle_len = strlen(needle);
+    int count = 0;
+
+    for (const char *p = data; (size_t)(end - p) >= needle_len; p++) {
+        p = (const char *)memchr(p, needle[0], end - p);
+        if (!p || (size_t)(end - p) < needle_len)
+            break;
+        if (memcmp(p, needle, needle_len) == 0)
+            count++;
+    }
+    return count;
+}
+
+#define JSON_SPACE " \t\r\n"
+
+/* Skip over a JSON value, returning NULL if it isn't valid */
+static const char *json_skip(const char *p)
+{
+    p += strspn(p, JSON_SPACE);
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        int object = *p == '{';
+
+        p++;
+        p += strspn(p, JSON_SPACE);
+        if (*p == close)
+            return p + 1;
+        for (;;) {
+            if (object) {
+                /* Keys must be strings */
+                if (*p != '"' || !(p = json_skip(p)))
+                    return NULL;
+                p += strspn(p, JSON_SPACE);
+                if (*p++ != ':')
+                    return NULL;
+            }
+            if (!(p = json_skip(p)))
+                return NULL;
+            p += strspn(p, JSON_SPACE);
+            if (*p == close)
+                return p + 1;
+            if (*p++ != ',')
+                return NULL;
+            p += strspn(p, JSON_SPACE);
+        }
+    }
+    if (*p == '"') {
+        for (p++; *p != '"'; p++) {
+            if ((unsigned char)*p < ' ')
+                return NULL;
+            if (*p == '\\' && !*++p)
+                return NULL;
+        }
+        return p + 1;
+    }
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0)
+        return p + 4;
+    if (strncmp(p, "false", 5) == 0)
+        return p + 5;
+    /* Numbers, without caring about the exact syntax */
+    if (strspn(p, "-+0123456789.eE") == 0)
+        return NULL;
+    return p + strspn(p, "-+0123456789.eE");
+}
+
+/* Is 'data' a single, valid, JSON value? */
+static int json_valid(const char *data)
+{
+    const char *end = json_skip(data);
+
+    return end && end[strspn(end, JSON_SPACE)] == '\0';
+}
+
+/* Render one page range of the stitched document as a fragment */
+static int write_fragment(int i, const char *filename)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    FILE *fp;
+    int bm;
+
+    if (!pdf)
+        return -1;
+    for (int p = 0; p < 2; p++) {
+        char text[64];
+        struct pdf_object *page = pdf_append_page(pdf);
+
+        sprintf(text, "Fragment %d page %d", i + 1, p + 1);
+        pdf_add_text(pdf, page, text, 12, 50, 700, PDF_BLACK);
+        bm = pdf_add_bookmark(pdf, page, -1, text);
+        pdf_add_bookmark(pdf, page, bm, "Child");
+    }
+    pdf_set_font(pdf, i ? "Courier" : "Helvetica");
+    pdf_add_text(pdf, NULL, "(Different font)", 12, 50, 680, PDF_BLACK);
+    pdf_add_image_file(pdf, NULL, 50, 500, 100, -1, "data/teapot.ppm");
+    pdf_add_link(pdf, NULL, 50, 680, 100, 12, pdf_get_page(pdf, 1), 0, 0);
+    if (i)
+        pdf_add_form(pdf, NULL,
+                     pdf_import_page(pdf, "data/letterhead.pdf", 1), 300,
+                     500, 150, -1);
+    fp = fopen(filename, "wb");
+    if (!fp || pdf_save_fragment(pdf, fp) < 0) {
+        fprintf(stderr, "Unable to save fragment %d\n", i);
+        if (fp)
+            fclose(fp);
+        pdf_destroy(pdf);
+        return -1;
+    }
+    fclose(fp);
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* Render two page ranges as fragments, each in its own process where
+ * possible, & stitch them into a single PDF */
+static int test_fragments(void)
+{
+    const char *files[] = {"output-fragment-1.pdfgen",
+                           "output-fragment-2.pdfgen"};
+    char err_msg[128];
+    struct pdf_info info = {.title = "Stitched document"};
+    char *data[2];
+    long len[2];
+
+#ifndef _WIN32
+    pid_t pids[2];
+
+    fflush(NULL);
+    for (int i = 0; i < 2; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            return -1;
+        if (pids[i] == 0)
+            _exit(write_fragment(i, files[i]) < 0 ? 1 : 0);
+    }
+    for (int i = 0; i < 2; i++) {
+        int status;
+
+        if (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Fragment writer %d failed\n", i);
+            return -1;
+        }
+    }
+#else
+    for (int i = 0; i < 2; i++)
+        if (write_fragment(i, files[i]) < 0)
+            return -1;
+#endif
+
+    /* Stitching deterministically twice must give the same bytes, even
+     * without a date */
+    for (int i = 0; i < 2; i++) {
+        FILE *fp = i ? tmpfile() : fopen("output-stitched.pdf", "w+b");
+
+        if (!fp)
+            return -1;
+        if (pdf_stitch_fragments(fp, files, 2, &info, 1, err_msg,
+                                 sizeof(err_msg)) < 0) {
+            fprintf(stderr, "Unable to stitch fragments: %s\n", err_msg);
+            fclose(fp);
+            return -1;
+        }
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        if (!data[i])
+            return -1;
+    }
+    if (len[0] != len[1] || memcmp(data[0], data[1], len[0]) != 0 ||
+        strstr(data[0], "/CreationDate")) {
+        fprintf(stderr, "Deterministic stitched PDFs differ\n");
+        return -1;
+    }
+    if (!data_count(data[0], len[0], "(Fragment 1 page 1)") ||
+        !data_count(data[0], len[0], "(Fragment 2 page 2)") ||
+        !data_count(data[0], len[0], "/Count 4")) {
+        fprintf(stderr, "Stitched document is missing pages\n");
+        return -1;
+    }
+    free(data[0]);
+    free(data[1]);
+    return 0;
+}
+
+/* A pattern's dictionary lists every font, so with enough of them it's
+ * longer than the stitcher reads at first */
+static int test_fragment_pattern(void)
+{
+    const char *file = "output-fragment-pattern.pdfgen";
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_object *pattern;
+    char err_msg[128], font[32];
+    FILE *fp;
+    int ret;
+
+    if (!pdf || !pdf_append_page(pdf))
+        return -1;
+    for (int i = 0; i < 300; i++) {
+        sprintf(font, "Font%d", i);
+        if (pdf_set_font(pdf, font) < 0)
+            return -1;
+    }
+    pattern = pdf_add_pattern(pdf, 10, 10);
+    if (!pattern ||
+        pdf_add_line(pdf, pattern, 0, 0, 10, 10, 1, PDF_RED) < 0 ||
+        pdf_add_filled_rectangle_pattern(pdf, NULL, 50, 100, 100, 100, 0,
+                                         pattern, PDF_BLACK) < 0)
+        return -1;
+    fp = fopen(file, "wb");
+    if (!fp || pdf_save_fragment(pdf, fp) < 0)
+        return -1;
+    fclose(fp);
+    pdf_destroy(pdf);
+
+    fp = tmpfile();
+    if (!fp)
+        return -1;
+    ret = pdf_stitch_fragments(fp, &file, 1, NULL, 1, err_msg,
+                               sizeof(err_msg));
+    fclose(fp);
+    if (ret < 0) {
+        fprintf(stderr, "Unable to stitch pattern: %s\n", err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+/* Build sections as separate documents & merge them into one */
+static int test_append(void)
+{
+    struct pdf_doc *sections[3];
+    struct pdf_object *page, *pattern;
+
+    for (int i = 0; i < 3; i++) {
+        char text[64];
+
+        sections[i] = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        if (!sections[i])
+            return -1;
+        if (i == 1)
+            pdf_set_font(sections[i], "Helvetica-Bold");
+        page = pdf_append_page(sections[i]);
+        sprintf(text, "Section %d", i + 1);
+        pdf_add_text(sections[i], page, text, 24, 50, 700, PDF_BLACK);
+        pdf_add_bookmark(sections[i], page, -1, text);
+        pdf_add_image_file(sections[i], page, 50, 400, 100, -1,
+                           "data/bee.bmp");
+        pattern = pdf_add_pattern(sections[i], 10, 10);
+        pdf_add_line(sections[i], pattern, 0, 0, 10, 10, 1, PDF_RED);
+        pdf_add_filled_rectangle_pattern(sections[i], page, 50, 100, 100,
+                                         100, 0, pattern, PDF_BLACK);
+        pdf_add_link(sections[i], page, 50, 700, 100, 24, page, 0, 0);
+    }
+    /* Text which looks like a resource name mustn't be renamed */
+    pdf_add_text(sections[2], page, "/Image1", 12, 50, 300, PDF_BLACK);
+    page = pdf_append_page(sections[2]);
+    pdf_add_text(sections[2], page, "Appendix, page 2", 12, 50, 700,
+                 PDF_BLACK);
+
+    if (pdf_append_document(NULL, sections[1]) != -EINVAL)
+        return -1;
+    for (int i = 1; i < 3; i++)
+        if (pdf_append_document(sections[0], sections[i]) < 0) {
+            fprintf(stderr, "Unable to append document: %s\n",
+                    pdf_get_err(sections[0], NULL));
+            return -1;
+        }
+
+    /* Pages that came from the other documents can still be drawn on */
+    pdf_add_text(sections[0], page, "Added after appending", 12, 50, 680,
+                 PDF_BLACK);
+    /* Images moved across are renamed, so this one can't clash with them */
+    pdf_add_image_file(sections[0], pdf_get_page(sections[0], 3), 200, 400,
+                       100, -1, "data/teapot.ppm");
+    pattern = pdf_add_pattern(sections[0], 10, 10);
+    pdf_add_ellipse_pattern(sections[0], pdf_get_page(sections[0], 3), 300,
+                            300, 50, 20, 1, PDF_BLACK, pattern);
+    if (pdf_save(sections[0], "output-appended.pdf") < 0)
+        return -1;
+    pdf_destroy(sections[0]);
+
+    FILE *fp = fopen("output-appended.pdf", "rb");
+    char *data;
+    long len;
+
+    if (!fp)
+        return -1;
+    data = read_file(fp, &len);
+    fclose(fp);
+    if (!data)
+        return -1;
+    /* Images & patterns share a counter */
+    for (int i = 1; i <= 8; i++) {
+        char name[32];
+
+        sprintf(name, i % 2 ? "/Image%d Do" : "/P%d scn", i);
+        if (data_count(data, len, name) != 1) {
+            fprintf(stderr, "Appended resource %s used %d times\n", name,
+                    data_count(data, len, name));
+            free(data);
+            return -1;
+        }
+    }
+    if (data_count(data, len, "(/Image1)") != 1) {
+        fprintf(stderr, "Text renamed along with the images\n");
+        free(data);
+        return -1;
+    }
+    free(data);
+    return 0;
+}
+
+/* Use pages from existing PDFs as letterheads & thumbnails */
+static int test_import(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_object *letterhead, *second, *thumbnail, *page;
+
+    if (!pdf)
+        return -1;
+    letterhead = pdf_import_page(pdf, "data/letterhead.pdf", 1);
+    second = pdf_import_page(pdf, "data/letterhead.pdf", 2);
+    thumbnail = pdf_import_page(pdf, "output.pdf", 1);
+    if (!letterhead || !second || !thumbnail) {
+        fprintf(stderr, "Unable to import page: %s\n",
+                pdf_get_err(pdf, NULL));
+        pdf_destroy(pdf);
+        return -1;
+    }
+
+    /* Failures mustn't leave anything half imported behind */
+    if (pdf_import_page(pdf, "data/letterhead.pdf", 3) ||
+        pdf_import_page(pdf, "data/bee.bmp", 1) ||
+        pdf_import_page(pdf, "data/no-such-file.pdf", 1)) {
+        fprintf(stderr, "Imported a page that doesn't exist\n");
+        pdf_destroy(pdf);
+        return -1;
+    }
+    pdf_clear_err(pdf);
+
+    for (int i = 0; i < 2; i++) {
+        char text[64];
+
+        page = pdf_append_page(pdf);
+        pdf_add_form(pdf, page, letterhead, 0, 0, -1, -1);
+        sprintf(text, "Letter page %d", i + 1);
+        pdf_add_text(pdf, page, text, 12, 50, 700, PDF_BLACK);
+    }
+    pdf_add_form(pdf, page, thumbnail, 50, 150, 200, -1);
+    pdf_add_form(pdf, page, second, 300, 150, -1, 300);
+
+    if (pdf_save(pdf, "output-imported.pdf") < 0 ||
+        pdf_get_err(pdf, NULL)) {
+        fprintf(stderr, "Unable to save imported pages: %s\n",
+                pdf_get_err(pdf, NULL));
+        pdf_destroy(pdf);
+        return -1;
+    }
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* The same document, built twice, must be saved as the same bytes */
+static int test_deterministic(void)
+{
+    char *data[2];
+    long len[2];
+
+    if (pdf_set_deterministic(NULL, "20240101120000Z") != -EINVAL)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        struct pdf_info info = {.title = "Reproducible document"};
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, &info);
+        FILE *fp = tmpfile();
+
+        if (!pdf || !fp)
+            return -1;
+        pdf_set_deterministic(pdf, "20240101120000Z");
+        pdf_append_page(pdf);
+        pdf_add_text(pdf, NULL, "Same every time", 12, 50, 700, PDF_BLACK);
+        pdf_add_bookmark(pdf, NULL, -1, "Bookmark");
+        pdf_add_image_file(pdf, NULL, 50, 500, 100, -1, "data/teapot.ppm");
+        pdf_add_form(pdf, NULL,
+                     pdf_import_page(pdf, "data/letterhead.pdf", 1), 300,
+                     500, 150, -1);
+        if (pdf_save_file(pdf, fp) < 0) {
+            fprintf(stderr, "Unable to save deterministic PDF: %s\n",
+                    pdf_get_err(pdf, NULL));
+            return -1;
+        }
+        pdf_destroy(pdf);
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        if (!data[i])
+            return -1;
+    }
+
+    if (len[0] != len[1] || memcmp(data[0], data[1], len[0]) != 0 ||
+        !strstr(data[0], "/CreationDate (D:20240101120000Z)")) {
+        fprintf(stderr, "Deterministic PDFs differ\n");
+        return -1;
+    }
+    free(data[0]);
+    free(data[1]);
+    return 0;
+}
+
+/* Reserving space up front must not change the output */
+static int test_reserve(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    FILE *fp = tmpfile();
+
+    if (!pdf || !fp)
+        return -1;
+    if (pdf_reserve(pdf, -1, 0, 0) >= 0)
+        return -1;
+    if (pdf_reserve(pdf, 3000, 10000, 2048) < 0) {
+        fprintf(stderr, "Unable to reserve: %s\n", pdf_get_err(pdf, NULL));
+        return -1;
+    }
+    for (int i = 0; i < 3000; i++) {
+        pdf_append_page(pdf);
+        pdf_add_text(pdf, NULL, "Reserved page", 12, 50, 700, PDF_BLACK);
+    }
+    if (!pdf_get_page(pdf, 3000) || pdf_save_file(pdf, fp) < 0) {
+        fprintf(stderr, "Unable to save reserved PDF: %s\n",
+                pdf_get_err(pdf, NULL));
+        return -1;
+    }
+    pdf_destroy(pdf);
+    fclose(fp);
+    return 0;
+}
+
+/* Statistics should track what has been added, & roughly predict the size */
+static int test_stats(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_stats stats;
+    FILE *fp = tmpfile();
+    const uint8_t pixels[4 * 4 * 3] = {0};
+    long size;
+
+    if (!pdf || !fp)
+        return -1;
+    for (int i = 0; i < 50; i++) {
+        pdf_append_page(pdf);
+        pdf_add_text(pdf, NULL, "Some statistics", 12, 50, 700, PDF_BLACK);
+        pdf_add_bookmark(pdf, NULL, -1, "Statistics");
+    }
+    pdf_add_link(pdf, NULL, 50, 700, 100, 20, pdf_get_page(pdf, 1), 0, 0);
+    pdf_add_image_file(pdf, NULL, 50, 500, 100, -1, "data/penguin.jpg");
+    pdf_add_image_file(pdf, NULL, 50, 300, 100, -1, "data/teapot.ppm");
+    pdf_add_rgb24(pdf, NULL, 50, 100, 100, 100, pixels, 4, 4);
+    if (pdf_get_stats(pdf, &stats) < 0 || pdf_save_file(pdf, fp) < 0)
+        return -1;
+    size = ftell(fp);
+    fclose(fp);
+    pdf_destroy(pdf);
+
+    if (stats.pages != 50 || stats.bookmarks != 50 || stats.links != 1 ||
+        stats.images != 3 || stats.fonts != 1 || stats.content_bytes == 0 ||
+        stats.image_format_bytes[IMAGE_JPG] == 0 ||
+        stats.image_format_bytes[IMAGE_PPM] == 0 ||
+        stats.image_format_bytes[IMAGE_PNG] != 0 ||
+        stats.image_format_bytes[IMAGE_UNKNOWN] == 0 ||
+        stats.heap_bytes < stats.image_bytes ||
+        stats.output_bytes < size * 0.8 || stats.output_bytes > size * 1.2) {
+        fprintf(stderr, "Unexpected statistics (estimated %lu of %ld)\n",
+                (unsigned long)stats.output_bytes, size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Tracing should report each phase of building & saving a document */
+static int test_trace(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    FILE *trace = fopen("output-trace.json", "w+");
+    char *data;
+    long len;
+
+    if (!pdf || !trace || pdf_trace_chrome_start(trace) < 0)
+        return -1;
+    if (pdf_set_trace(pdf, pdf_trace_chrome, trace) < 0) {
+        /* Not built with PDFGEN_TRACE */
+        fclose(trace);
+        pdf_destroy(pdf);
+        return 0;
+    }
+    pdf_append_page(pdf);
+    pdf_add_text_wrap(pdf, NULL, "Some text to be traced", 12, 50, 700, 0,
+                      PDF_BLACK, 100, PDF_ALIGN_LEFT, NULL);
+    pdf_add_image_file(pdf, NULL, 50, 500, 100, -1, "data/coal.png");
+    if (pdf_save(pdf, "output-trace.pdf") < 0)
+        return -1;
+    pdf_destroy(pdf);
+    if (pdf_trace_chrome_finish(trace) < 0)
+        return -1;
+    data = read_file(trace, &len);
+    fclose(trace);
+    if (!data || !json_valid(data)) {
+        fprintf(stderr, "Trace isn't valid JSON\n");
+        return -1;
+    }
+    if (data[0] != '[' || !strstr(data, "\"name\": \"wrap\"") ||
+        !strstr(data, "\"name\": \"png\"") ||
+        !strstr(data, "\"name\": \"xref\"") ||
+        !strstr(data, "\"name\": \"page\", \"cat\": \"save\"")) {
+        fprintf(stderr, "Trace is missing events\n");
+        return -1;
+    }
+    free(data);
+    return 0;
+}
+
+/* Going past a limit should fail cleanly, leaving a usable document */
+static int test_limits(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_limits limits = {.objects = 20, .image_bytes = 10000};
+    FILE *fp = tmpfile();
+    int pages = 0, err = 0;
+
+    if (!pdf || !fp || pdf_set_limits(pdf, &limits) < 0)
+        return -1;
+    while (pdf_append_page(pdf))
+        pages++;
+    if (pages == 0 || pages > 10 || !pdf_get_err(pdf, &err) ||
+        err != -ENOSPC)
+        return -1;
+    pdf_clear_err(pdf);
+    if (pdf_add_image_file(pdf, NULL, 50, 500, 100, -1, "data/teapot.ppm") !=
+        -ENOSPC)
+        return -1;
+
+    /* Memory */
+    limits.objects = 0;
+    limits.heap_bytes = 64 * 1024;
+    pdf_set_limits(pdf, &limits);
+    err = 0;
+    for (int i = 0; i < 10000 && err == 0; i++)
+        err = pdf_add_text(pdf, NULL, "Filling up memory", 12, 50, 500,
+                           PDF_BLACK);
+    if (err != -ENOSPC)
+        return -1;
+    pdf_clear_err(pdf);
+
+    /* Output */
+    limits.heap_bytes = 0;
+    limits.output_bytes = 1024;
+    pdf_set_limits(pdf, &limits);
+    if (pdf_save_file(pdf, fp) != -ENOSPC)
+        return -1;
+    pdf_set_limits(pdf, NULL);
+    rewind(fp);
+    if (pdf_save_file(pdf, fp) < 0)
+        return -1;
+    fclose(fp);
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* Draw the same content in both modes, which must agree on its extent */
+static int draw_measured(struct pdf_doc *pdf, float bbox[4])
+{
+    float xs[3] = {300, 350, 320}, ys[3] = {100, 100, 150};
+
+    if (!pdf_append_page(pdf) ||
+        pdf_page_get_bbox(pdf, NULL, bbox) != -ENOENT)
+        return -1;
+    pdf_clear_err(pdf);
+    pdf_add_text_wrap(pdf, NULL, "Text that is long enough to wrap", 12, 50,
+                      700, 0, PDF_BLACK, 100, PDF_ALIGN_LEFT, NULL);
+    pdf_add_text_rotate(pdf, NULL, "Rotated", 12, 200, 600, 0.5f, PDF_BLACK);
+    pdf_add_line(pdf, NULL, 10, 20, 500, 20, 4, PDF_BLACK);
+    pdf_add_circle(pdf, NULL, 400, 400, 50, 2, PDF_RED, PDF_TRANSPARENT);
+    pdf_add_filled_polygon(pdf, NULL, xs, ys, 3, 1, PDF_BLUE);
+    pdf_add_barcode(pdf, NULL, PDF_BARCODE_128A, 50, 750, 200, 50, "MEASURE",
+                    PDF_BLACK);
+    if (pdf_add_image_file(pdf, NULL, 50, 300, 100, -1, "data/penguin.jpg") <
+        0)
+        return -1;
+    return pdf_page_get_bbox(pdf, NULL, bbox);
+}
+
+static int test_measure(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_doc *measure = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_stats stats;
+    float bbox[4], measured[4];
+
+    if (!pdf || !measure || pdf_set_measure_only(measure, 1) < 0)
+        return -1;
+    /* Bounding boxes are only kept when asked for outside measure-only
+     * mode */
+    if (!pdf_append_page(pdf) ||
+        pdf_add_text(pdf, NULL, "Untracked", 12, 50, 50, PDF_BLACK) < 0 ||
+        pdf_page_get_bbox(pdf, NULL, bbox) != -EINVAL ||
+        pdf_set_bbox_tracking(pdf, 1) < 0)
+        return -1;
+    pdf_clear_err(pdf);
+    if (draw_measured(pdf, bbox) < 0 || draw_measured(measure, measured) < 0)
+        return -1;
+    if (memcmp(bbox, measured, sizeof(bbox)) != 0 || bbox[0] != 8 ||
+        bbox[1] != 18 || bbox[2] < 500 || bbox[3] < 800) {
+        fprintf(stderr, "Bounding boxes differ: %f %f %f %f/%f %f %f %f\n",
+                bbox[0], bbox[1], bbox[2], bbox[3], measured[0],
+                measured[1], measured[2], measured[3]);
+        return -1;
+    }
+    /* Nothing was actually drawn */
+    if (pdf_get_stats(measure, &stats) < 0 || stats.content_bytes != 0 ||
+        stats.images != 0)
+        return -1;
+    pdf_destroy(measure);
+    pdf_destroy(pdf);
+    return 0;
+}
+
+static int flow_footer(void *arg, struct pdf_doc *pdf,
+                       struct pdf_object *page, int page_number)
+{
+    char footer[32];
+
+    snprintf(footer, sizeof(footer), "Page %d", page_number);
+    *(int *)arg = page_number;
+    return pdf_add_text(pdf, page, footer, 10, 290, 20, PDF_BLACK);
+}
+
+/* Flow a long document, chunk bytes at a time, returning the page count */
+static int flow_text(const char *text, size_t len, size_t chunk,
+                     int max_pages, size_t *overflow)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                   PDF_A4_HEIGHT - 100, max_pages};
+    struct pdf_flow_style body = {"Times-Roman", 11, 0, 6, 20,
+                                  PDF_ALIGN_JUSTIFY, PDF_BLACK};
+    struct pdf_flow_style heading = {"Helvetica-Bold", 16, 0, 10, 0,
+                                     PDF_ALIGN_LEFT, PDF_BLUE};
+    struct pdf_flow *flow;
+    struct pdf_stats stats;
+    FILE *fp = tmpfile();
+    int pages = 0, ret = 0;
+
+    flow = pdf_flow_create(pdf, NULL, &frame, flow_footer, &pages);
+    if (!flow || !fp)
+        return -1;
+    for (size_t pos = 0; pos < len && ret == 0;) {
+        /* Paragraphs starting with '#' are headings */
+        const struct pdf_flow_style *style =
+            text[pos] == '#' ? &heading : &body;
+        size_t end = pos;
+
+        while (end < len && text[end++] != '\n')
+            ;
+        for (; pos < end && ret == 0; pos += chunk) {
+            size_t n = end - pos < chunk ? end - pos : chunk;
+            ret = pdf_flow_write(flow, style, &text[pos], n);
+        }
+        pos = end;
+    }
+    if (pdf_flow_end(flow, overflow) != ret || ret < 0)
+        return -1;
+    if (pdf_get_stats(pdf, &stats) < 0 || stats.pages != pages ||
+        pdf_save_file(pdf, fp) < 0)
+        return -1;
+    fclose(fp);
+    pdf_destroy(pdf);
+    return pages;
+}
+
+/* Bounding box of a single flowed line, or of the same text drawn
+ * directly (flowing measures it during layout, not while drawing) */
+static int flow_bbox(int measure_only, int flowed, float bbox[4])
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_flow_frame frame = {50, 50, 400, 700, 0};
+    struct pdf_flow_style style = {"Helvetica", 12, 0, 0, 0, PDF_ALIGN_LEFT,
+                                   PDF_BLACK};
+    const char *text = "Measured once, in caf\xc3\xa9s";
+    struct pdf_flow *flow;
+    int ret;
+
+    if (!pdf || pdf_set_bbox_tracking(pdf, 1) < 0 ||
+        pdf_set_measure_only(pdf, measure_only) < 0)
+        return -1;
+    if (flowed) {
+        flow = pdf_flow_create(pdf, NULL, &frame, NULL, NULL);
+        if (!flow || pdf_flow_write(flow, &style, text, strlen(text)) < 0 ||
+            pdf_flow_end(flow, NULL) < 0)
+            return -1;
+    } else {
+        if (!pdf_append_page(pdf) || pdf_set_font(pdf, "Helvetica") < 0 ||
+            pdf_add_text(pdf, NULL, text, 12, 50, 738, PDF_BLACK) < 0)
+            return -1;
+    }
+    ret = pdf_page_get_bbox(pdf, NULL, bbox);
+    pdf_destroy(pdf);
+    return ret;
+}
+
+static int test_flow(void)
+{
+    const char *sentence = "The quick brown fox jumps over the lazy dog, "
+                           "in a caf\xc3\xa9. ";
+    size_t len = 0, overflow = 0;
+    char *text = (char *)malloc(200 * 40 * 60);
+    int pages, chunked, limited;
+    float drawn[4], flowed[4], measured[4];
+
+    if (!text)
+        return -1;
+    if (flow_bbox(0, 0, drawn) < 0 || flow_bbox(0, 1, flowed) < 0 ||
+        flow_bbox(1, 1, measured) < 0 ||
+        memcmp(drawn, flowed, sizeof(drawn)) != 0 ||
+        memcmp(drawn, measured, sizeof(drawn)) != 0) {
+        fprintf(stderr, "Flowed text has a different bounding box\n");
+        return -1;
+    }
+    for (int p = 0; p < 200; p++) {
+        if (p % 20 == 0)
+            len += sprintf(&text[len], "#Heading\n");
+        for (int s = 0; s < 40; s++)
+            len += sprintf(&text[len], "%s", sentence);
+        text[len++] = '\n';
+    }
+    pages = flow_text(text, len, len, 0, &overflow);
+    if (pages < 20 || overflow != len)
+        return -1;
+    /* Chunks that split words & characters shouldn't change the layout */
+    chunked = flow_text(text, len, 997, 0, &overflow);
+    if (chunked != pages || overflow != len)
+        return -1;
+    /* Running out of pages stops at the start of a line */
+    limited = flow_text(text, len, len, 3, &overflow);
+    if (limited != 3 || overflow == 0 || overflow >= len ||
+        (text[overflow - 1] != ' ' && text[overflow - 1] != '\n')) {
+        fprintf(stderr, "Unexpected flow: %d/%d pages, overflow at %zu\n",
+                chunked, limited, overflow);
+        return -1;
+    }
+    free(text);
+    return 0;
+}
+
+/* Lay out an invoice-like table, returning the number of rows added */
+static int table_rows(struct pdf_doc *pdf, int row_count, int max_pages,
+                      float bbox[4])
+{
+    struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                   PDF_A4_HEIGHT - 100, max_pages};
+    struct pdf_table_column columns[] = {
+        {40, PDF_ALIGN_RIGHT},
+        {0, PDF_ALIGN_LEFT},
+        {0, PDF_ALIGN_LEFT},
+        {0, PDF_ALIGN_RIGHT},
+    };
+    struct pdf_table_style style = {.font = "Helvetica",
+                                    .header_font = "Helvetica-Bold",
+                                    .size = 9,
+                                    .padding = 3,
+                                    .colour = PDF_BLACK,
+                                    .border_width = 0.5f,
+                                    .border_colour = PDF_RGB(0, 0, 128),
+                                    .header_rows = 1};
+    const char **cells =
+        (const char **)calloc(row_count * 4, sizeof(*cells));
+    char *numbers = (char *)malloc(row_count * 32);
+    float bottom;
+    int rows;
+
+    if (!cells || !numbers || !pdf_append_page(pdf))
+        return -1;
+    cells[0] = "#";
+    cells[1] = "Item";
+    cells[2] = "Description";
+    cells[3] = "Amount";
+    for (int row = 1; row < row_count; row++) {
+        char *number = &numbers[row * 32];
+        snprintf(number, 16, "%d", row);
+        snprintf(number + 16, 16, "%d.%02d", row * 7, row % 100);
+        cells[row * 4] = number;
+        cells[row * 4 + 1] = row % 3 ? "Widget" : "Widget (deluxe)";
+        cells[row * 4 + 2] =
+            row % 5 ? "Standard"
+                    : "A long description, which is long enough that it "
+                      "has to wrap onto several lines within its cell, "
+                      "while the other cells stay on one line";
+        cells[row * 4 + 3] = number + 16;
+    }
+    rows = pdf_add_table(pdf, NULL, &frame, 700, columns, 4, cells,
+                         row_count, &style, &bottom);
+    if (rows > 0 && bbox && pdf_page_get_bbox(pdf, NULL, bbox) < 0)
+        rows = -1;
+    free(cells);
+    free(numbers);
+    return rows;
+}
+
+static int test_table(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_doc *measure = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_doc *limited = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_stats stats;
+    float bbox[4], measured[4];
+    FILE *fp = tmpfile();
+    char *data;
+    long len;
+    int text_objects = 0;
+
+    if (!pdf || !measure || !limited || !fp)
+        return -1;
+    pdf_set_measure_only(measure, 1);
+    pdf_set_bbox_tracking(pdf, 1);
+    if (table_rows(pdf, 500, 0, bbox) != 500 ||
+        table_rows(measure, 500, 0, measured) != 500 ||
+        memcmp(bbox, measured, sizeof(bbox)) != 0)
+        return -1;
+    if (pdf_get_stats(pdf, &stats) < 0 || stats.pages < 5 ||
+        pdf_save_file(pdf, fp) < 0)
+        return -1;
+    /* One block of text per page */
+    data = read_file(fp, &len);
+    if (!data)
+        return -1;
+    for (long i = 0; i + 3 < len; i++)
+        if (memcmp(&data[i], "BT ", 3) == 0)
+            text_objects++;
+    free(data);
+    fclose(fp);
+    if (text_objects != stats.pages) {
+        fprintf(stderr, "%d text objects on %d pages\n", text_objects,
+                stats.pages);
+        return -1;
+    }
+    /* Stopping after two pages */
+    if (table_rows(limited, 500, 2, NULL) >= 500 ||
+        pdf_get_stats(limited, &stats) < 0 || stats.pages != 2)
+        return -1;
+    pdf_destroy(limited);
+    pdf_destroy(measure);
+    pdf_destroy(pdf);
+    return 0;
+}
+
+static int count_string(const char *data, long len, const char *str)
+{
+    long str_len = (long)strlen(str);
+    int count = 0;
+
+    for (long i = 0; i + str_len <= len; i++)
+        if (memcmp(&data[i], str, str_len) == 0)
+            count++;
+    return count;
+}
+
+static int test_table_borders(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_flow_frame frame = {50, 50, 300, 95, 0};
+    struct pdf_table_column columns[] = {{0, PDF_ALIGN_LEFT},
+                                         {0, PDF_ALIGN_RIGHT}};
+    struct pdf_table_style style = {.size = 10,
+                                    .padding = 2,
+                                    .colour = PDF_BLACK,
+                                    .border_width = 1,
+                                    .border_colour = PDF_BLACK,
+                                    .header_rows = 1};
+    const char *cells[] = {"Name", "Value", "First", "1", "Second", "2"};
+    const char *tall[] = {"Name", "Value", "Short", "1",
+                          "1\n2\n3\n4\n5\n6\n7", "2"};
+    FILE *fp = tmpfile();
+    char *data;
+    long len;
+    float bottom;
+    int lines;
+
+    if (!pdf || !fp || !pdf_append_page(pdf) ||
+        pdf_add_table(NULL, NULL, &frame, 145, columns, 2, cells, 3, &style,
+                      NULL) != -EINVAL)
+        return -1;
+    /* Borders shared by neighbouring cells are drawn once: a line per row
+     * & column, plus one to close the table off */
+    if (pdf_add_table(pdf, NULL, &frame, 145, columns, 2, cells, 3, &style,
+                      NULL) != 3 ||
+        pdf_save_file(pdf, fp) < 0)
+        return -1;
+    data = read_file(fp, &len);
+    if (!data)
+        return -1;
+    lines = count_string(data, len, " l ");
+    free(data);
+    fclose(fp);
+    if (lines != (3 + 1) + (2 + 1)) {
+        fprintf(stderr, "%d border lines for 3 rows & 2 columns\n", lines);
+        return -1;
+    }
+
+    /* A row which would only fit on a new page without the headers above
+     * it doesn't get them */
+    if (!pdf_append_page(pdf) ||
+        pdf_add_table(pdf, NULL, &frame, 145, columns, 2, tall, 3, &style,
+                      &bottom) != 3 ||
+        bottom < frame.y) {
+        fprintf(stderr, "Table overflows its frame: %f\n", bottom);
+        return -1;
+    }
+    pdf_destroy(pdf);
+    return 0;
+}
+
+static int test_pattern(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_object *pattern, *page;
+    const struct pdf_path_operation triangle[] = {
+        {'m', 300, 300, 0, 0, 0, 0},
+        {'l', 400, 300, 0, 0, 0, 0},
+        {'l', 350, 400, 0, 0, 0, 0},
+        {'h', 0, 0, 0, 0, 0, 0},
+    };
+    static const uint8_t pixels[12] = {0xff};
+    static const uint8_t ppm[] = "P6\n2 2\n255\n000000000000";
+    struct pdf_stats stats;
+    FILE *fp = tmpfile();
+    char *data;
+    long len;
+    int fills = 0, objects;
+
+    if (!pdf || !fp)
+        return -1;
+    pattern = pdf_add_pattern(pdf, 20, 20);
+    if (!pattern || pdf_add_pattern(pdf, 0, 20) != NULL)
+        return -1;
+    if (pdf_set_font(pdf, "Helvetica") < 0 ||
+        pdf_add_line(pdf, pattern, 0, 0, 20, 20, 1, PDF_BLUE) < 0 ||
+        pdf_add_filled_rectangle(pdf, pattern, 5, 5, 5, 5, 0, PDF_RED,
+                                 PDF_BLACK) < 0 ||
+        pdf_add_text(pdf, pattern, "x", 6, 12, 2, PDF_BLACK) < 0)
+        return -1;
+    /* Patterns can't contain themselves, or be drawn without a page */
+    if (pdf_add_filled_rectangle_pattern(pdf, pattern, 0, 0, 20, 20, 0,
+                                         pattern, 0) >= 0)
+        return -1;
+    for (int i = 0; i < 3; i++) {
+        page = pdf_append_page(pdf);
+        if (!page ||
+            pdf_add_filled_rectangle_pattern(pdf, page, 0, 0, PDF_A4_WIDTH,
+                                             PDF_A4_HEIGHT, 0, pattern,
+                                             0) < 0 ||
+            pdf_add_ellipse_pattern(pdf, page, 100, 100, 50, 50, 1,
+                                    PDF_BLACK, pattern) < 0)
+            return -1;
+    }
+    if (pdf_add_custom_path_pattern(pdf, page, triangle, 4, 1, PDF_BLACK,
+                                    pattern) < 0)
+        return -1;
+    if (pdf_add_filled_rectangle_pattern(pdf, NULL, 0, 0, 10, 10, 0, page,
+                                         0) >= 0 ||
+        pdf_add_ellipse_pattern(pdf, NULL, 0, 0, 10, 10, 0, 0, NULL) >= 0)
+        return -1;
+    /* Colours with any alpha are still colours, not patterns */
+    if (pdf_add_filled_rectangle(pdf, NULL, 0, 0, 10, 10, 0,
+                                 PDF_ARGB(0xfe, 0xff, 0, 0), PDF_BLACK) < 0 ||
+        pdf_add_circle(pdf, NULL, 50, 50, 10, 1, PDF_BLACK,
+                       PDF_ARGB(0xfe, 0, 0xff, 0)) < 0)
+        return -1;
+    /* Images can't go in patterns, & mustn't leave an object behind */
+    if (pdf_get_stats(pdf, &stats) < 0)
+        return -1;
+    objects = stats.objects;
+    if (pdf_add_rgb24(pdf, pattern, 0, 0, 2, 2, pixels, 2, 2) >= 0 ||
+        pdf_add_image_data(pdf, pattern, 0, 0, 2, 2, ppm,
+                           sizeof(ppm) - 1) >= 0 ||
+        pdf_get_stats(pdf, &stats) < 0 || stats.objects != objects ||
+        stats.images != 0)
+        return -1;
+    if (pdf_get_stats(pdf, &stats) < 0 || stats.pages != 3 ||
+        pdf_save_file(pdf, fp) < 0)
+        return -1;
+    data = read_file(fp, &len);
+    if (!data)
+        return -1;
+    fills = count_string(data, len, "/P1 scn");
+    if (fills != 7 || count_string(data, len, "/PatternType 1") != 1 ||
+        count_string(data, len, "/Pattern << /P1 ") != 3) {
+        fprintf(stderr, "Pattern missing from output (%d fills)\n", fills);
+        return -1;
+    }
+    free(data);
+    fclose(fp);
+    pdf_destroy(pdf);
+    return 0;
+}
+
+static int cached_text(struct pdf_doc *pdf, int cache_entries, FILE *fp)
+{
+    static const char *strings[] = {"Total", "Price (\xe2\x82\xac)",
+                                     "Page", "a\\b", "Total"};
+    char long_string[300];
+    float bbox[4];
+
+    memset(long_string, 'x', sizeof(long_string) - 1);
+    long_string[sizeof(long_string) - 1] = '\0';
+    if (pdf_set_deterministic(pdf, "20240101120000Z") < 0 ||
+        pdf_set_bbox_tracking(pdf, 1) < 0 ||
+        pdf_set_text_cache(pdf, cache_entries) < 0 ||
+        !pdf_append_page(pdf))
+        return -1;
+    for (int i = 0; i < 200; i++) {
+        pdf_set_font(pdf, i % 3 ? "Helvetica" : "Times-Bold");
+        if (pdf_add_text(pdf, NULL, strings[i % 5], 10, 50,
+                         (float)(i * 4), PDF_BLACK) < 0)
+            return -1;
+    }
+    if (pdf_add_text(pdf, NULL, long_string, 10, 50, 20, PDF_BLACK) < 0 ||
+        pdf_add_text(pdf, NULL, "\xff", 10, 50, 20, PDF_BLACK) >= 0 ||
+        pdf_page_get_bbox(pdf, NULL, bbox) < 0)
+        return -1;
+    return pdf_save_file(pdf, fp);
+}
+
+static int test_text_cache(void)
+{
+    int entries[] = {0, 1, 64};
+    char *data[3];
+    long len[3];
+    struct pdf_stats stats;
+
+    for (int i = 0; i < 3; i++) {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        FILE *fp = tmpfile();
+
+        if (!pdf || !fp || cached_text(pdf, entries[i], fp) < 0 ||
+            pdf_get_stats(pdf, &stats) < 0)
+            return -1;
+        /* A one entry cache thrashes, but still gets the odd hit. Each
+         * string misses twice before it is cached */
+        if ((entries[i] == 0 && stats.text_cache_hits != 0) ||
+            (entries[i] == 64 && stats.text_cache_hits < 180)) {
+            fprintf(stderr, "%d entries: %" PRIu64 " hits\n", entries[i],
+                    stats.text_cache_hits);
+            return -1;
+        }
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        pdf_destroy(pdf);
+        if (!data[i])
+            return -1;
+    }
+    for (int i = 1; i < 3; i++)
+        if (len[i] != len[0] || memcmp(data[i], data[0], len[0]) != 0) {
+            fprintf(stderr, "Cached text differs with %d entries\n",
+                    entries[i]);
+            return -1;
+        }
+    for (int i = 0; i < 3; i++)
+        free(data[i]);
+
+    /* Strings are only copied into the cache once they've been seen
+     * twice, so ones which are drawn once cost nothing */
+    {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        uint64_t heap;
+        char text[32];
+
+        if (!pdf || pdf_set_measure_only(pdf, 1) < 0 ||
+            pdf_set_text_cache(pdf, 64) < 0 || !pdf_append_page(pdf) ||
+            pdf_get_stats(pdf, &stats) < 0)
+            return -1;
+        heap = stats.heap_bytes;
+        for (int i = 0; i < 1000; i++) {
+            sprintf(text, "Invoice %d", i);
+            pdf_add_text(pdf, NULL, text, 10, 50, 50, PDF_BLACK);
+        }
+        if (pdf_get_stats(pdf, &stats) < 0 || stats.heap_bytes != heap)
+            return -1;
+        pdf_add_text(pdf, NULL, text, 10, 50, 50, PDF_BLACK);
+        pdf_add_text(pdf, NULL, text, 10, 50, 50, PDF_BLACK);
+        if (pdf_get_stats(pdf, &stats) < 0 || stats.heap_bytes == heap ||
+            stats.text_cache_hits != 1) {
+            fprintf(stderr, "Repeated string wasn't cached\n");
+            return -1;
+        }
+        pdf_destroy(pdf);
+    }
+    return 0;
+}
+
+/* Draw the same things from NUL terminated strings, or from slices of a
+ * buffer with no terminators at all */
+static int draw_slices(struct pdf_doc *pdf, int use_slices)
+{
+    static const char *strings[] = {"Name", "Wrapped (text) \xe2\x82\xac",
+                                    "CODE39", "4003994155486", "Section"};
+    char *buffer;
+    const char *slice[5];
+    size_t len[5], total = 0;
+    float width;
+
+    for (int i = 0; i < 5; i++)
+        total += strlen(strings[i]);
+    buffer = (char *)malloc(total);
+    if (!buffer)
+        return -1;
+    total = 0;
+    for (int i = 0; i < 5; i++) {
+        len[i] = strlen(strings[i]);
+        memcpy(&buffer[total], strings[i], len[i]);
+        slice[i] = use_slices ? &buffer[total] : strings[i];
+        total += len[i];
+    }
+
+    if (pdf_set_deterministic(pdf, "20240101120000Z") < 0 ||
+        pdf_set_font(pdf, "Helvetica") < 0 || !pdf_append_page(pdf))
+        return -1;
+    if (use_slices) {
+        if (pdf_add_text_n(pdf, NULL, slice[0], len[0], 12, 50, 700,
+                           PDF_BLACK) < 0 ||
+            pdf_add_text_rotate_n(pdf, NULL, slice[0], len[0], 12, 50, 650,
+                                  0.5f, PDF_BLACK) < 0 ||
+            pdf_add_text_wrap_n(pdf, NULL, slice[1], len[1], 12, 50, 600, 0,
+                                PDF_BLACK, 40, PDF_ALIGN_JUSTIFY, NULL) < 0 ||
+            pdf_add_barcode_n(pdf, NULL, PDF_BARCODE_39, 50, 300, 200, 50,
+                              slice[2], len[2], PDF_BLACK) < 0 ||
+            pdf_add_barcode_n(pdf, NULL, PDF_BARCODE_EAN13, 50, 200, 200, 50,
+                              slice[3], len[3], PDF_BLACK) < 0 ||
+            pdf_add_bookmark_n(pdf, NULL, -1, slice[4], len[4]) < 0 ||
+            pdf_get_font_text_width_n(pdf, NULL, slice[1], len[1], 12,
+                                      &width) < 0)
+            return -1;
+    } else {
+        if (pdf_add_text(pdf, NULL, slice[0], 12, 50, 700, PDF_BLACK) < 0 ||
+            pdf_add_text_rotate(pdf, NULL, slice[0], 12, 50, 650, 0.5f,
+                                PDF_BLACK) < 0 ||
+            pdf_add_text_wrap(pdf, NULL, slice[1], 12, 50, 600, 0, PDF_BLACK,
+                              40, PDF_ALIGN_JUSTIFY, NULL) < 0 ||
+            pdf_add_barcode(pdf, NULL, PDF_BARCODE_39, 50, 300, 200, 50,
+                            slice[2], PDF_BLACK) < 0 ||
+            pdf_add_barcode(pdf, NULL, PDF_BARCODE_EAN13, 50, 200, 200, 50,
+                            slice[3], PDF_BLACK) < 0 ||
+            pdf_add_bookmark(pdf, NULL, -1, slice[4]) < 0 ||
+            pdf_get_font_text_width(pdf, NULL, slice[1], 12, &width) < 0)
+            return -1;
+    }
+    free(buffer);
+    return width > 0 ? 0 : -1;
+}
+
+static int test_slices(void)
+{
+    char *data[2];
+    long len[2];
+
+    for (int i = 0; i < 2; i++) {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        FILE *fp = tmpfile();
+
+        if (!pdf || !fp || draw_slices(pdf, i) < 0 ||
+            pdf_save_file(pdf, fp) < 0)
+            return -1;
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        pdf_destroy(pdf);
+        if (!data[i])
+            return -1;
+    }
+    if (len[0] != len[1] || memcmp(data[0], data[1], len[0]) != 0) {
+        fprintf(stderr, "Slices drawn differently to strings\n");
+        return -1;
+    }
+    free(data[0]);
+    free(data[1]);
+    return 0;
+}
+
+/* A NULL slice with a length is a caller bug, not an empty string */
+static int test_null_slices(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    float width;
+    int errval = 0;
+
+    if (!pdf || !pdf_append_page(pdf))
+        return -1;
+    if (pdf_add_text_n(pdf, NULL, NULL, 4, 12, 50, 700, PDF_BLACK) !=
+            -EINVAL ||
+        pdf_add_text_rotate_n(pdf, NULL, NULL, 4, 12, 50, 650, 0.5f,
+                              PDF_BLACK) != -EINVAL ||
+        pdf_add_text_wrap_n(pdf, NULL, NULL, 4, 12, 50, 600, 0, PDF_BLACK,
+                            40, PDF_ALIGN_LEFT, NULL) != -EINVAL ||
+        pdf_get_font_text_width_n(pdf, NULL, NULL, 4, 12, &width) !=
+            -EINVAL ||
+        pdf_add_bookmark_n(pdf, NULL, -1, NULL, 4) != -EINVAL ||
+        pdf_add_barcode_n(pdf, NULL, PDF_BARCODE_39, 50, 300, 200, 50, NULL,
+                          4, PDF_BLACK) != -EINVAL)
+        return -1;
+    if (!pdf_get_err(pdf, &errval) || errval != -EINVAL)
+        return -1;
+
+    /* But a NULL slice with no length is still nothing to draw */
+    pdf_clear_err(pdf);
+    if (pdf_add_text_n(pdf, NULL, NULL, 0, 12, 50, 700, PDF_BLACK) != 0 ||
+        pdf_add_barcode_n(pdf, NULL, PDF_BARCODE_39, 50, 300, 200, 50, NULL,
+                          0, PDF_BLACK) != 0 ||
+        pdf_get_err(pdf, NULL))
+        return -1;
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* Draw a page either directly, or as a single buffer of commands */
+static int draw_commands(struct pdf_doc *pdf, int use_commands)
+{
+    static const char strings[] = "Courier"
+                                  "Command text"
+                                  "Wrapped command text"
+                                  "CODE39";
+    const struct pdf_path_operation ops[] = {
+        {'m', 300, 300, 0, 0, 0, 0},
+        {'c', 350, 400, 400, 400, 450, 300},
+        {'h', 0, 0, 0, 0, 0, 0},
+    };
+    struct pdf_command commands[] = {
+        {.op = PDF_CMD_FONT, .data_offset = 0, .data_len = 7},
+        {.op = PDF_CMD_TEXT,
+         .v = {12, 50, 700, 0},
+         .colour = PDF_RED,
+         .data_offset = 7,
+         .data_len = 12},
+        {.op = PDF_CMD_TEXT_WRAP,
+         .v = {12, 50, 650, 0, 60},
+         .arg = PDF_ALIGN_CENTER,
+         .data_offset = 19,
+         .data_len = 20},
+        {.op = PDF_CMD_LINE, .v = {50, 600, 500, 600, 2}},
+        {.op = PDF_CMD_RECTANGLE,
+         .v = {50, 500, 100, 50, 1},
+         .fill = PDF_TRANSPARENT},
+        {.op = PDF_CMD_RECTANGLE,
+         .v = {200, 500, 100, 50, 1},
+         .colour = PDF_BLUE,
+         .fill = PDF_GREEN},
+        {.op = PDF_CMD_ELLIPSE,
+         .v = {100, 400, 40, 20, 1},
+         .fill = PDF_TRANSPARENT},
+        {.op = PDF_CMD_PATH, .v = {2}, .fill = PDF_RED, .arg = 3},
+        {.op = PDF_CMD_PATH_OP, .arg = 'm', .v = {300, 300}},
+        {.op = PDF_CMD_PATH_OP,
+         .arg = 'c',
+         .v = {350, 400, 400, 400, 450, 300}},
+        {.op = PDF_CMD_PATH_OP, .arg = 'h'},
+        {.op = PDF_CMD_BARCODE,
+         .v = {50, 200, 200, 50},
+         .arg = PDF_BARCODE_39,
+         .data_offset = 39,
+         .data_len = 6},
+        {.op = PDF_CMD_IMAGE, .v = {300, 50, 100, -1}},
+        {.op = PDF_CMD_FORM, .v = {400, 650, 150, -1}, .arg = 0},
+        {.op = PDF_CMD_NOP},
+    };
+    size_t count = sizeof(commands) / sizeof(commands[0]);
+    size_t data_len = sizeof(strings) - 1 + data_penguin_jpg_len;
+    struct pdf_object *form;
+    char *data;
+    int results[sizeof(commands) / sizeof(commands[0])];
+    int ret = 0;
+
+    if (pdf_set_deterministic(pdf, "20240101120000Z") < 0 ||
+        !pdf_append_page(pdf))
+        return -1;
+    form = pdf_import_page(pdf, "data/letterhead.pdf", 1);
+    if (!form)
+        return -1;
+    if (use_commands) {
+        data = (char *)malloc(data_len);
+        if (!data)
+            return -1;
+        memcpy(data, strings, sizeof(strings) - 1);
+        memcpy(&data[sizeof(strings) - 1], data_penguin_jpg,
+               data_penguin_jpg_len);
+        commands[count - 3].data_offset = sizeof(strings) - 1;
+        commands[count - 3].data_len = data_penguin_jpg_len;
+        ret = pdf_execute(pdf, NULL, commands, count, data, data_len, &form,
+                          1, results);
+        free(data);
+        for (size_t i = 0; i < count; i++)
+            if (results[i] < 0)
+                ret = -1;
+        return ret == 0 ? 0 : -1;
+    }
+
+    if (pdf_set_font(pdf, "Courier") < 0 ||
+        pdf_add_text(pdf, NULL, "Command text", 12, 50, 700, PDF_RED) < 0 ||
+        pdf_add_text_wrap(pdf, NULL, "Wrapped command text", 12, 50, 650, 0,
+                          PDF_BLACK, 60, PDF_ALIGN_CENTER, NULL) < 0 ||
+        pdf_add_line(pdf, NULL, 50, 600, 500, 600, 2, PDF_BLACK) < 0 ||
+        pdf_add_rectangle(pdf, NULL, 50, 500, 100, 50, 1, PDF_BLACK) < 0 ||
+        pdf_add_filled_rectangle(pdf, NULL, 200, 500, 100, 50, 1, PDF_GREEN,
+                                 PDF_BLUE) < 0 ||
+        pdf_add_ellipse(pdf, NULL, 100, 400, 40, 20, 1, PDF_BLACK,
+                        PDF_TRANSPARENT) < 0 ||
+        pdf_add_custom_path(pdf, NULL, ops, 3, 2, PDF_BLACK, PDF_RED) < 0 ||
+        pdf_add_barcode(pdf, NULL, PDF_BARCODE_39, 50, 200, 200, 50,
+                        "CODE39", PDF_BLACK) < 0 ||
+        pdf_add_image_data(pdf, NULL, 300, 50, 100, -1, data_penguin_jpg,
+                           data_penguin_jpg_len) < 0 ||
+        pdf_add_form(pdf, NULL, form, 400, 650, 150, -1) < 0)
+        return -1;
+    return 0;
+}
+
+static int test_commands(void)
+{
+    const struct pdf_command bad[] = {
+        {.op = PDF_CMD_LINE, .v = {0, 0, 10, 10, 1}},
+        {.op = 999},
+        {.op = PDF_CMD_TEXT,
+         .v = {12, 0, 0},
+         .data_offset = 2,
+         .data_len = 2},
+        {.op = PDF_CMD_FORM, .arg = 1},
+        {.op = PDF_CMD_PATH_OP, .arg = 'l'},
+        {.op = PDF_CMD_PATH, .arg = 2},
+        {.op = PDF_CMD_PATH_OP, .arg = 'm'},
+    };
+    const int expected[] = {0, -EINVAL, -EINVAL, -EINVAL,
+                            -EINVAL, -EINVAL, -EINVAL};
+    int results[7];
+    char *data[2];
+    long len[2];
+
+    for (int i = 0; i < 2; i++) {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        FILE *fp = tmpfile();
+
+        if (!pdf || !fp || draw_commands(pdf, i) < 0 ||
+            pdf_save_file(pdf, fp) < 0)
+            return -1;
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        pdf_destroy(pdf);
+        if (!data[i])
+            return -1;
+    }
+    if (len[0] != len[1] || memcmp(data[0], data[1], len[0]) != 0) {
+        fprintf(stderr, "Commands drawn differently to direct calls\n");
+        return -1;
+    }
+    free(data[0]);
+    free(data[1]);
+
+    /* Failed commands are reported individually, and don't stop the rest */
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    if (!pdf || !pdf_append_page(pdf))
+        return -1;
+    if (pdf_execute(pdf, NULL, bad, 7, "abc", 3, NULL, 0, results) != 6 ||
+        pdf_execute(pdf, NULL, bad, -1, NULL, 0, NULL, 0, NULL) != -EINVAL) {
+        fprintf(stderr, "Invalid commands not detected\n");
+        return -1;
+    }
+    for (int i = 0; i < 7; i++) {
+        if (results[i] != expected[i]) {
+            fprintf(stderr, "Command %d: %d, not %d\n", i, results[i],
+                    expected[i]);
+            return -1;
+        }
+    }
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* Objects which aren't pages must be rejected by everything taking a page */
+static int test_wrong_type(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_flow_frame frame = {.x = 50, .y = 50, .width = 200,
+                                   .height = 200};
+    struct pdf_object *page, *pattern;
+    float bbox[4];
+    int link;
+
+    if (!pdf)
+        return -1;
+    page = pdf_append_page(pdf);
+    pattern = pdf_add_pattern(pdf, 10, 10);
+    link = pdf_add_link(pdf, page, 0, 0, 10, 10, page, 0, 0);
+    if (!page || !pattern || link < 0)
+        return -1;
+    if (pdf_add_link(pdf, pattern, 0, 0, 10, 10, page, 0, 0) != -EINVAL ||
+        pdf_add_link(pdf, page, 0, 0, 10, 10, pattern, 0, 0) != -EINVAL ||
+        pdf_add_bookmark(pdf, pattern, -1, "Pattern") != -EINVAL ||
+        pdf_add_bookmark(pdf, page, link, "Child of a link") != -EINVAL ||
+        pdf_add_bookmark(pdf, page, 1000000, "No parent") != -EINVAL ||
+        pdf_page_set_size(pdf, pattern, 10, 10) != -EINVAL ||
+        pdf_page_get_bbox(pdf, pattern, bbox) != -EINVAL ||
+        pdf_page_width(pattern) != 0 || pdf_page_height(pattern) != 0 ||
+        pdf_add_image_file(pdf, pattern, 0, 0, 10, 10, "data/teapot.ppm") !=
+            -EINVAL ||
+        pdf_flow_create(pdf, pattern, &frame, NULL, NULL) != NULL) {
+        fprintf(stderr, "Object used as a page\n");
+        return -1;
+    }
+    pdf_destroy(pdf);
+    return 0;
+}
+
+#ifndef _WIN32
+#define THREAD_PAGES 8
+
+struct thread_pages {
+    struct pdf_doc *pdf;
+    int first; /* Draws every other page, starting at this one */
+};
+
+static void *draw_thread_pages(void *arg)
+{
+    const struct thread_pages *tp = (const struct thread_pages *)arg;
+
+    for (int p = tp->first; p < THREAD_PAGES; p += 2) {
+        struct pdf_object *page = pdf_get_page(tp->pdf, p + 1);
+        char text[64];
+
+        for (int i = 0; i < 200; i++) {
+            sprintf(text, "Page %d line %d: %.2f", p + 1, i, i * 0.25);
+            pdf_add_text(tp->pdf, page, text, 10, 50, 800 - i * 3.5f,
+                         PDF_BLACK);
+            pdf_add_line(tp->pdf, page, 40, 800 - i * 3.5f, 45,
+                         800 - i * 3.5f, 0.5f, PDF_RGB(i, p * 30, 0));
+        }
+        pdf_add_filled_rectangle(tp->pdf, page, 300, 300, 100, 50, 1,
+                                 PDF_BLUE, PDF_TRANSPARENT);
+        /* Errors from several threads at once */
+        pdf_add_barcode(tp->pdf, page, 999, 0, 0, 10, 10, "X", PDF_BLACK);
+    }
+    return NULL;
+}
+
+/* The number of different thread ids in a trace */
+static int trace_thread_count(const char *trace)
+{
+    int tids[8], count = 0;
+
+    for (const char *p = strstr(trace, "\"tid\": "); p;
+         p = strstr(p + 1, "\"tid\": ")) {
+        int tid = atoi(p + 7), seen = 0;
+
+        for (int i = 0; i < count; i++)
+            seen |= tids[i] == tid;
+        if (!seen && count < 8)
+            tids[count++] = tid;
+    }
+    return count;
+}
+
+/* Pages drawn on concurrently must come out the same as when drawn in turn */
+static int test_threads(void)
+{
+    char *data[2];
+    long len[2];
+
+    for (int i = 0; i < 2; i++) {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+        struct thread_pages tp[2] = {{pdf, 0}, {pdf, 1}};
+        pthread_t threads[2];
+        FILE *fp = tmpfile(), *trace = tmpfile();
+        int err = 0, traced;
+
+        if (!pdf || !fp || !trace || pdf_trace_chrome_start(trace) < 0)
+            return -1;
+        pdf_set_deterministic(pdf, "20240101120000Z");
+        /* Both threads write to the same trace (if built with tracing) */
+        traced = pdf_set_trace(pdf, pdf_trace_chrome, trace) == 0;
+        pdf_clear_err(pdf);
+        for (int p = 0; p < THREAD_PAGES; p++)
+            pdf_append_page(pdf);
+        if (i) {
+            for (int t = 0; t < 2; t++)
+                if (pthread_create(&threads[t], NULL, draw_thread_pages,
+                                   &tp[t]) != 0)
+                    return -1;
+            for (int t = 0; t < 2; t++)
+                pthread_join(threads[t], NULL);
+        } else {
+            draw_thread_pages(&tp[0]);
+            draw_thread_pages(&tp[1]);
+        }
+        if (!pdf_get_err(pdf, &err) || err != -EINVAL)
+            return -1;
+        pdf_clear_err(pdf);
+        if (pdf_save_file(pdf, fp) < 0)
+            return -1;
+        data[i] = read_file(fp, &len[i]);
+        fclose(fp);
+        pdf_destroy(pdf);
+        if (!data[i] || pdf_trace_chrome_finish(trace) < 0)
+            return -1;
+        {
+            long trace_len;
+            char *trace_data = read_file(trace, &trace_len);
+
+            fclose(trace);
+            if (!trace_data || !json_valid(trace_data)) {
+                fprintf(stderr, "Trace from threads isn't valid JSON\n");
+                return -1;
+            }
+            /* Each drawing thread has its own track, as well as the one
+             * which saved the document */
+            if (traced && i && trace_thread_count(trace_data) != 3) {
+                fprintf(stderr, "Trace has %d threads, not 3\n",
+                        trace_thread_count(trace_data));
+                return -1;
+            }
+            free(trace_data);
+        }
+    }
+    if (len[0] != len[1] || memcmp(data[0], data[1], len[0]) != 0) {
+        fprintf(stderr, "Pages drawn on threads differ\n");
+        return -1;
+    }
+    free(data[0]);
+    free(data[1]);
+    return 0;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     struct pdf_info info = {.creator = "My software",
@@ -285,6 +1848,10 @@ int main(int argc, char *argv[])
     }
     pdf_add_rgb24(pdf, NULL, 72, 72, 288, 144, data_rgb, 16, 8);
 
+    /* Pages own their content, so earlier pages can still be drawn on */
+    pdf_add_text(pdf, first_page, "Drawn after the last page", 10, 250, 60,
+                 PDF_RGB(0, 0, 0));
+
     pdf_save(pdf, "output.pdf");
 
     const char *err_str = pdf_get_err(pdf, &err);
@@ -295,5 +1862,66 @@ int main(int argc, char *argv[])
     }
     pdf_destroy(pdf);
 
+    if (test_fragments() < 0)
+        return -1;
+
+    if (test_fragment_pattern() < 0)
+        return -1;
+
+    if (test_append() < 0)
+        return -1;
+
+    if (test_import() < 0)
+        return -1;
+
+    if (test_deterministic() < 0)
+        return -1;
+
+    if (test_reserve() < 0)
+        return -1;
+
+    if (test_stats() < 0)
+        return -1;
+
+    if (test_trace() < 0)
+        return -1;
+
+    if (test_limits() < 0)
+        return -1;
+
+    if (test_measure() < 0)
+        return -1;
+
+    if (test_flow() < 0)
+        return -1;
+
+    if (test_table() < 0)
+        return -1;
+    if (test_table_borders() < 0)
+        return -1;
+
+    if (test_pattern() < 0)
+        return -1;
+
+    if (test_text_cache() < 0)
+        return -1;
+
+    if (test_slices() < 0)
+        return -1;
+
+    if (test_null_slices() < 0)
+        return -1;
+
+    if (test_commands() < 0)
+        return -1;
+
+    if (test_wrong_type() < 0)
+        return -1;
+
+#ifndef _WIN32
+    if (test_threads() < 0)
+        return -1;
+#endif
+
     return 0;
 }
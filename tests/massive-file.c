@@ -1,15 +1,240 @@
+#define _FILE_OFFSET_BITS 64
 #include "pdfgen.h"
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
 
-int main(int argc, char **argv)
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+/* Each page of a stitched file carries this much (uncompressed) image */
+#define IMAGE_SIZE 2048
+#define PAGES_PER_FRAGMENT 32
+
+/**
+ * Check that the xref table points at every object it claims to, by
+ * reading it back & visiting each object
+ */
+static int check_xref(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    char buf[256];
+    uint64_t xref_offset = 0, size;
+    int count, first;
+
+    if (!fp) {
+        perror(filename);
+        return -1;
+    }
+    if (fseeko(fp, -64, SEEK_END) < 0)
+        goto fail;
+    size = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[size] = '\0';
+    if (!strstr(buf, "startxref") ||
+        sscanf(strstr(buf, "startxref"), "startxref %" SCNu64,
+               &xref_offset) != 1)
+        goto fail;
+    if (fseeko(fp, (off_t)xref_offset, SEEK_SET) < 0 ||
+        !fgets(buf, sizeof(buf), fp) || strncmp(buf, "xref", 4) != 0 ||
+        !fgets(buf, sizeof(buf), fp) ||
+        sscanf(buf, "%d %d", &first, &count) != 2)
+        goto fail;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t offset;
+        char entry[21] = {0};
+        off_t next;
+        int index;
+
+        if (fread(entry, 20, 1, fp) != 1 ||
+            sscanf(entry, "%" SCNu64, &offset) != 1)
+            goto fail;
+        if (entry[17] == 'f')
+            continue;
+        next = ftello(fp);
+        if (fseeko(fp, (off_t)offset, SEEK_SET) < 0 ||
+            fscanf(fp, "%d 0 obj", &index) != 1 || index != first + i) {
+            fprintf(stderr, "%s: object %d is not at %" PRIu64 "\n",
+                    filename, first + i, offset);
+            fclose(fp);
+            return -1;
+        }
+        fseeko(fp, next, SEEK_SET);
+    }
+    fclose(fp);
+    printf("%s: %d xref entries ok, xref at %" PRIu64 "\n", filename, count,
+           xref_offset);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: unable to read xref table\n", filename);
+    fclose(fp);
+    return -1;
+}
+
+/**
+ * Build a file of at least 'megabytes' by stitching fragments together,
+ * so that only one fragment needs to be held in memory at a time
+ */
+static int stitch_file(uint64_t megabytes, const char *filename)
+{
+    uint8_t *image = (uint8_t *)malloc(IMAGE_SIZE * IMAGE_SIZE * 3);
+    uint64_t bytes_per_fragment =
+        (uint64_t)PAGES_PER_FRAGMENT * IMAGE_SIZE * IMAGE_SIZE * 3;
+    int fragments = (int)((megabytes * 1024 * 1024 + bytes_per_fragment - 1) /
+                          bytes_per_fragment);
+    char **files = (char **)calloc(fragments, sizeof(*files));
+    char err_msg[128];
+    FILE *fp;
+    int ret = 0;
+
+    if (!image || !files)
+        return -1;
+    for (int i = 0; i < IMAGE_SIZE * IMAGE_SIZE * 3; i++)
+        image[i] = (uint8_t)(i * 7);
+
+    for (int f = 0; f < fragments && ret == 0; f++) {
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+
+        files[f] = (char *)malloc(64);
+        sprintf(files[f], "massive-fragment-%d.pdfgen", f);
+        for (int p = 0; p < PAGES_PER_FRAGMENT; p++) {
+            char str[64];
+            pdf_append_page(pdf);
+            sprintf(str, "fragment %d page %d", f, p);
+            pdf_add_text(pdf, NULL, str, 12, 50, 20, PDF_BLACK);
+            pdf_add_rgb24(pdf, NULL, 50, 100, 400, 400, image, IMAGE_SIZE,
+                          IMAGE_SIZE);
+        }
+        fp = fopen(files[f], "wb");
+        if (!fp || pdf_save_fragment(pdf, fp) < 0) {
+            fprintf(stderr, "Unable to save %s: %s\n", files[f],
+                    pdf_get_err(pdf, NULL));
+            ret = -1;
+        }
+        if (fp)
+            fclose(fp);
+        pdf_destroy(pdf);
+    }
+    free(image);
+
+    if (ret == 0) {
+        fp = fopen(filename, "wb");
+        if (!fp ||
+            pdf_stitch_fragments(fp, (const char *const *)files, fragments,
+                                 NULL, 0, err_msg, sizeof(err_msg)) < 0) {
+            fprintf(stderr, "Unable to stitch %s: %s\n", filename, err_msg);
+            ret = -1;
+        }
+        if (fp)
+            fclose(fp);
+    }
+
+    for (int f = 0; f < fragments; f++) {
+        if (files[f])
+            remove(files[f]);
+        free(files[f]);
+    }
+    free(files);
+    return ret;
+}
+
+static double now(void)
 {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time how long pdf_save takes for an in-memory document of about
+ * 'megabytes', to measure output throughput
+ */
+static int save_throughput(uint64_t megabytes, const char *filename)
+{
+    const int size = 512;
+    uint8_t *image = (uint8_t *)malloc(size * size * 3);
+    uint64_t pages = megabytes * 1024 * 1024 / (size * size * 3);
     struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    double start, elapsed;
+    FILE *fp;
+
+    if (!image || !pdf)
+        return -1;
+    for (int i = 0; i < size * size * 3; i++)
+        image[i] = (uint8_t)(i * 13);
+    if (pages < 1)
+        pages = 1;
+    pdf_reserve(pdf, (int)pages, (int)pages * 3, 4096);
+    for (uint64_t p = 0; p < pages; p++) {
+        char str[64];
+        pdf_append_page(pdf);
+        sprintf(str, "page %" PRIu64, p);
+        pdf_add_text(pdf, NULL, str, 12, 50, 20, PDF_BLACK);
+        pdf_add_rgb24(pdf, NULL, 50, 100, 400, 400, image, size, size);
+        /* Plenty of small objects as well as the large ones */
+        for (int l = 0; l < 50; l++)
+            pdf_add_line(pdf, NULL, 10, 10 + l, 500, 10 + l, 1, PDF_BLACK);
+    }
+    free(image);
+
+    start = now();
+    fp = fopen(filename, "wb");
+    if (!fp || pdf_save_file(pdf, fp) < 0 || fclose(fp) != 0) {
+        fprintf(stderr, "Unable to save %s: %s\n", filename,
+                pdf_get_err(pdf, NULL));
+        pdf_destroy(pdf);
+        return -1;
+    }
+    elapsed = now() - start;
+    pdf_destroy(pdf);
+
+    fp = fopen(filename, "rb");
+    fseeko(fp, 0, SEEK_END);
+    printf("%s: %.1f MB in %.3f s, %.1f MB/s\n", filename,
+           ftello(fp) / 1048576.0, elapsed, ftello(fp) / 1048576.0 / elapsed);
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct pdf_doc *pdf;
     int pagecount = 10;
     char filename[128];
 
+    /* massive-file -s <megabytes>: build a huge file from fragments */
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        uint64_t megabytes = strtoull(argv[2], NULL, 10);
+        sprintf(filename, "massive-%" PRIu64 "M.pdf", megabytes);
+        if (stitch_file(megabytes, filename) < 0 || check_xref(filename) < 0)
+            return 1;
+        return 0;
+    }
+
+    /* massive-file -b <megabytes>...: measure save throughput at each
+     * size, to show how it scales */
+    if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+        for (int i = 2; i < argc; i++) {
+            uint64_t megabytes = strtoull(argv[i], NULL, 10);
+            sprintf(filename, "massive-%" PRIu64 "M.pdf", megabytes);
+            if (save_throughput(megabytes, filename) < 0 ||
+                check_xref(filename) < 0)
+                return 1;
+            remove(filename);
+        }
+        return 0;
+    }
+
     if (argc > 1) {
         pagecount = atoi(argv[1]);
     }
+    pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
     pdf_set_font(pdf, "Times-Roman");
     for (int i = 0; i < pagecount; i++) {
         char str[64];
@@ -21,7 +246,12 @@ int main(int argc, char **argv)
     }
 
     sprintf(filename, "massive-%d.pdf", pagecount);
-    pdf_save(pdf, filename);
+    if (pdf_save(pdf, filename) < 0) {
+        fprintf(stderr, "Unable to save %s: %s\n", filename,
+                pdf_get_err(pdf, NULL));
+        pdf_destroy(pdf);
+        return 1;
+    }
     pdf_destroy(pdf);
-    return 0;
-}
\ No newline at end of file
+    return check_xref(filename) < 0 ? 1 : 0;
+}
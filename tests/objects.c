@@ -0,0 +1,268 @@
+/**
+ * Tests of the object table which need pdfgen's internals, as there's no
+ * public way to delete objects
+ */
+#include "pdfgen.c"
+#include <pthread.h>
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            return -1;                                                       \
+        }                                                                    \
+    } while (0)
+
+static char *save_to_memory(struct pdf_doc *pdf, long *len)
+{
+    FILE *fp = tmpfile();
+    char *data = NULL;
+
+    if (fp && pdf_save_file(pdf, fp) >= 0) {
+        *len = ftell(fp);
+        rewind(fp);
+        data = (char *)malloc(*len + 1);
+        if (data && fread(data, 1, *len, fp) != (size_t)*len) {
+            free(data);
+            data = NULL;
+        }
+        if (data)
+            data[*len] = '\0';
+    }
+    if (fp)
+        fclose(fp);
+    return data;
+}
+
+/* Like strstr, but the data may contain NULs (eg: in image streams) */
+static const char *data_find(const char *data, long len, const char *needle)
+{
+    size_t nlen = strlen(needle);
+
+    for (const char *p = data; p + nlen <= data + len; p++)
+        if (memcmp(p, needle, nlen) == 0)
+            return p;
+    return NULL;
+}
+
+/* Check every xref entry points at its object, & return the number of
+ * free entries (including object 0) */
+static int check_xref(const char *data, long len)
+{
+    const char *xref = NULL, *entry;
+    int first, count, free_count = 0;
+
+    for (const char *p = data; p; p = data_find(p + 1, data + len - p - 1,
+                                                "\nxref\r\n"))
+        xref = p;
+    CHECK(xref && xref != data);
+    CHECK(sscanf(xref + 7, "%d %d", &first, &count) == 2 && first == 0);
+    entry = strchr(xref + 7, '\n') + 1;
+    for (int i = 0; i < count; i++, entry += 20) {
+        unsigned long long offset;
+        char type, expected[32];
+        int generation;
+
+        CHECK(entry + 20 <= data + len);
+        CHECK(sscanf(entry, "%llu %d %c", &offset, &generation, &type) == 3);
+        if (type == 'f') {
+            free_count++;
+            continue;
+        }
+        snprintf(expected, sizeof(expected), "%d 0 obj", i);
+        CHECK(offset < (unsigned long long)len &&
+              strncmp(data + offset, expected, strlen(expected)) == 0);
+    }
+    return free_count;
+}
+
+/* Deleting an object mustn't change the numbers of the rest, as callers
+ * keep hold of them (eg: as bookmark parents), but the saved file has no
+ * holes: only object 0 is free */
+static int test_delete(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    uint8_t rgb[4 * 4 * 3] = {0};
+    struct pdf_object *page, *unused;
+    char *data;
+    long len;
+    int bm, child;
+
+    CHECK(pdf);
+    pdf_set_deterministic(pdf, "20240101120000Z");
+    page = pdf_append_page(pdf);
+    CHECK(page);
+    /* An image which is never placed, followed by more objects */
+    unused = pdf_add_raw_rgb24(pdf, rgb, 4, 4);
+    CHECK(unused);
+    bm = pdf_add_bookmark(pdf, page, -1, "Parent");
+    CHECK(bm > unused->index);
+    CHECK(pdf_add_rgb24(pdf, page, 50, 50, 100, 100, rgb, 4, 4) >= 0);
+    pdf_del_object(pdf, unused);
+    CHECK(pdf->deleted_count == 1);
+
+    data = save_to_memory(pdf, &len);
+    CHECK(data);
+    CHECK(check_xref(data, len) == 1);
+    free(data);
+
+    /* The bookmark still has its number, and new objects don't reuse the
+     * number of the deleted one */
+    page = pdf_append_page(pdf);
+    child = pdf_add_bookmark(pdf, page, bm, "Child");
+    CHECK(child > bm);
+    CHECK(pdf_add_rgb24(pdf, page, 50, 50, 100, 100, rgb, 4, 4) >= 0);
+
+    data = save_to_memory(pdf, &len);
+    CHECK(data);
+    CHECK(check_xref(data, len) == 1);
+    {
+        char parent[64];
+
+        /* Saved one lower, as the deleted image came before it */
+        snprintf(parent, sizeof(parent), "/Parent %d 0 R\r\n  /Title (Child)",
+                 bm - 1);
+        CHECK(data_find(data, len, parent));
+    }
+    CHECK(data_find(data, len, "/Image1 Do") &&
+          data_find(data, len, "/Image2 Do"));
+    free(data);
+
+    /* Fragments are numbered the same way, so stitching them has no holes
+     * either */
+    {
+        const char *fragment = "output-objects.pdfgen";
+        FILE *fp = fopen(fragment, "wb");
+        char err[128];
+
+        CHECK(fp);
+        CHECK(pdf_save_fragment(pdf, fp) == 0);
+        fclose(fp);
+        fp = tmpfile();
+        CHECK(fp);
+        CHECK(pdf_stitch_fragments(fp, &fragment, 1, NULL, 1, err,
+                                   sizeof(err)) == 0);
+        len = ftell(fp);
+        rewind(fp);
+        data = (char *)malloc(len);
+        CHECK(data && fread(data, 1, len, fp) == (size_t)len);
+        fclose(fp);
+        CHECK(check_xref(data, len) == 1);
+        CHECK(data_find(data, len, "/Title (Child)"));
+        free(data);
+    }
+    pdf_destroy(pdf);
+    return 0;
+}
+
+/* What the document's memory charge should be, worked out from scratch */
+static uint64_t expected_heap(const struct pdf_doc *pdf)
+{
+    uint64_t heap = flexarray_heap(&pdf->objects);
+
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        const struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (obj)
+            heap += pdf_object_heap(obj);
+    }
+    heap += pdf->text_cache_size * sizeof(*pdf->text_cache);
+    for (int i = 0; i < pdf->text_cache_size; i++)
+        heap += pdf->text_cache[i].text_len + pdf->text_cache[i].encoded_len;
+    return heap;
+}
+
+/* Everything charged against the memory limit must be given back, both
+ * on success & on failure */
+static int test_heap(void)
+{
+    const char *images[] = {"data/coal.png", "data/bee.bmp",
+                            "data/indexed.png", "data/penguin.jpg",
+                            "data/teapot.ppm"};
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_limits limits = {0};
+    int bm;
+
+    CHECK(pdf);
+    CHECK(pdf_set_text_cache(pdf, 64) == 0);
+    CHECK(pdf_append_page(pdf));
+    bm = pdf_add_bookmark(pdf, NULL, -1, "Parent");
+    CHECK(pdf_add_bookmark(pdf, NULL, bm, "Child") > bm);
+    CHECK(pdf_add_link(pdf, NULL, 0, 0, 10, 10, pdf_get_page(pdf, 1), 0,
+                       0) >= 0);
+    for (size_t i = 0; i < ARRAY_SIZE(images); i++)
+        CHECK(pdf_add_image_file(pdf, NULL, 10, 10 + i * 100, 100, -1,
+                                 images[i]) >= 0);
+    for (int i = 0; i < 100; i++)
+        CHECK(pdf_add_text(pdf, NULL, "Some cached text", 12, 50, 700,
+                           PDF_BLACK) == 0);
+    CHECK(pdf_import_page(pdf, "data/letterhead.pdf", 1));
+    CHECK(pdf->heap_bytes == expected_heap(pdf));
+
+    /* Fail everything at the limit */
+    limits.heap_bytes = pdf->heap_bytes + 100;
+    CHECK(pdf_set_limits(pdf, &limits) == 0);
+    for (size_t i = 0; i < ARRAY_SIZE(images); i++)
+        CHECK(pdf_add_image_file(pdf, NULL, 10, 10, 100, -1, images[i]) ==
+              -ENOSPC);
+    CHECK(!pdf_import_page(pdf, "data/letterhead.pdf", 1));
+    while (pdf_add_bookmark(pdf, NULL, bm, "A long enough bookmark") >= 0)
+        ;
+    while (pdf_add_text(pdf, NULL, "Until the page is full", 12, 50, 700,
+                        PDF_BLACK) == 0)
+        ;
+    CHECK(pdf_get_errval(pdf) == -ENOSPC);
+    CHECK(pdf->heap_bytes <= limits.heap_bytes);
+    CHECK(pdf->heap_bytes == expected_heap(pdf));
+    pdf_destroy(pdf);
+    return 0;
+}
+
+struct heap_thread {
+    struct pdf_doc *pdf;
+    struct pdf_object *page;
+};
+
+static void *fill_page(void *arg)
+{
+    struct heap_thread *t = (struct heap_thread *)arg;
+
+    while (pdf_add_text(t->pdf, t->page, "Filling the page from a thread",
+                        12, 50, 700, PDF_BLACK) == 0)
+        ;
+    return NULL;
+}
+
+/* Threads growing different pages mustn't be able to go past the limit
+ * between them */
+static int test_heap_threads(void)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    struct pdf_limits limits = {.heap_bytes = 1024 * 1024};
+    struct heap_thread t[4];
+    pthread_t threads[4];
+
+    CHECK(pdf);
+    CHECK(pdf_set_limits(pdf, &limits) == 0);
+    for (int i = 0; i < 4; i++) {
+        t[i].pdf = pdf;
+        t[i].page = pdf_append_page(pdf);
+        CHECK(t[i].page);
+    }
+    for (int i = 0; i < 4; i++)
+        CHECK(pthread_create(&threads[i], NULL, fill_page, &t[i]) == 0);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    CHECK(pdf_get_errval(pdf) == -ENOSPC);
+    CHECK(pdf->heap_bytes <= limits.heap_bytes);
+    CHECK(pdf->heap_bytes == expected_heap(pdf));
+    pdf_destroy(pdf);
+    return 0;
+}
+
+int main(void)
+{
+    if (test_delete() < 0 || test_heap() < 0 || test_heap_threads() < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,186 @@
+unsigned char data_penguin_jpg[] = {
+  0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46, 0x49, 0x46, 0x00, 0x01,
+  0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00, 0xff, 0xe1, 0x00, 0x16,
+  0x45, 0x78, 0x69, 0x66, 0x00, 0x00, 0x4d, 0x4d, 0x00, 0x2a, 0x00, 0x00,
+  0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xdb, 0x00, 0x43,
+  0x00, 0x05, 0x03, 0x04, 0x04, 0x04, 0x03, 0x05, 0x04, 0x04, 0x04, 0x05,
+  0x05, 0x05, 0x06, 0x07, 0x0c, 0x08, 0x07, 0x07, 0x07, 0x07, 0x0f, 0x0b,
+  0x0b, 0x09, 0x0c, 0x11, 0x0f, 0x12, 0x12, 0x11, 0x0f, 0x11, 0x11, 0x13,
+  0x16, 0x1c, 0x17, 0x13, 0x14, 0x1a, 0x15, 0x11, 0x11, 0x18, 0x21, 0x18,
+  0x1a, 0x1d, 0x1d, 0x1f, 0x1f, 0x1f, 0x13, 0x17, 0x22, 0x24, 0x22, 0x1e,
+  0x24, 0x1c, 0x1e, 0x1f, 0x1e, 0xff, 0xdb, 0x00, 0x43, 0x01, 0x05, 0x05,
+  0x05, 0x07, 0x06, 0x07, 0x0e, 0x08, 0x08, 0x0e, 0x1e, 0x14, 0x11, 0x14,
+  0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+  0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+  0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+  0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+  0x1e, 0x1e, 0xff, 0xc0, 0x00, 0x11, 0x08, 0x00, 0x60, 0x00, 0x60, 0x03,
+  0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xff, 0xc4, 0x00,
+  0x1d, 0x00, 0x00, 0x01, 0x04, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x03, 0x04, 0x05, 0x06, 0x00,
+  0x01, 0x08, 0x02, 0x09, 0xff, 0xc4, 0x00, 0x38, 0x10, 0x00, 0x02, 0x01,
+  0x03, 0x03, 0x01, 0x05, 0x05, 0x05, 0x08, 0x03, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x06, 0x07,
+  0x31, 0x41, 0x51, 0x61, 0x13, 0x22, 0x71, 0x81, 0xa1, 0x08, 0x91, 0xb1,
+  0xc1, 0xf0, 0x14, 0x15, 0x32, 0x42, 0x52, 0x62, 0x82, 0xb2, 0x33, 0x63,
+  0x72, 0xe1, 0xff, 0xc4, 0x00, 0x1b, 0x01, 0x00, 0x02, 0x03, 0x01, 0x01,
+  0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+  0x05, 0x01, 0x04, 0x06, 0x02, 0x00, 0x07, 0xff, 0xc4, 0x00, 0x26, 0x11,
+  0x00, 0x02, 0x02, 0x01, 0x03, 0x03, 0x04, 0x03, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x03, 0x11, 0x04, 0x12, 0x21,
+  0x05, 0x31, 0x71, 0x13, 0x32, 0x41, 0x51, 0x22, 0x23, 0x61, 0x81, 0xff,
+  0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f,
+  0x00, 0x8a, 0xd9, 0x5a, 0xda, 0x33, 0x4b, 0xec, 0xc5, 0x61, 0x5c, 0x77,
+  0xd6, 0xd3, 0x33, 0x27, 0x88, 0xdf, 0x6d, 0x61, 0x4a, 0xf6, 0xd2, 0xc0,
+  0xa0, 0x96, 0x9e, 0x35, 0x03, 0xbf, 0x2c, 0x05, 0x33, 0xb9, 0xd6, 0x34,
+  0x8b, 0x74, 0x2d, 0x2e, 0xa5, 0x68, 0x00, 0x19, 0xc0, 0x94, 0x13, 0xf7,
+  0x0e, 0x6b, 0x92, 0xe0, 0x77, 0x32, 0x76, 0xe6, 0x38, 0xdb, 0x5a, 0xdb,
+  0x55, 0x0d, 0x4b, 0xb4, 0x5d, 0x2a, 0x06, 0x29, 0x67, 0x6d, 0x2d, 0xd1,
+  0x1f, 0xcc, 0xc7, 0x62, 0xfe, 0x67, 0xe9, 0x50, 0xd7, 0x5d, 0xa4, 0x5f,
+  0xa0, 0xde, 0x96, 0x16, 0x81, 0x09, 0xe0, 0x31, 0x63, 0xf5, 0xc8, 0xfc,
+  0x2a, 0xb3, 0xeb, 0xa9, 0x5e, 0x37, 0x42, 0xae, 0x92, 0xc6, 0x19, 0x0b,
+  0x08, 0xe5, 0x7c, 0xab, 0x5b, 0x6a, 0x99, 0xd3, 0xfd, 0xa2, 0xe9, 0xf7,
+  0xb7, 0x0b, 0x6f, 0xa9, 0x5b, 0x9b, 0x17, 0x63, 0x81, 0x26, 0xfd, 0xd1,
+  0xe7, 0xd7, 0xbb, 0x1f, 0x5a, 0xbc, 0x85, 0x52, 0x32, 0x39, 0x07, 0xbb,
+  0x14, 0x6a, 0xee, 0x4b, 0x46, 0x54, 0xe6, 0x09, 0xea, 0x64, 0x38, 0x61,
+  0x88, 0x8e, 0xda, 0xd1, 0x5e, 0x3b, 0xa9, 0x7d, 0xb5, 0xad, 0xbe, 0x94,
+  0x49, 0xc8, 0x11, 0x0d, 0xb5, 0xad, 0xb4, 0xb1, 0x53, 0xe5, 0x58, 0x56,
+  0xbd, 0x3d, 0x89, 0x23, 0xb6, 0xa3, 0x75, 0x6d, 0x28, 0x5f, 0xc8, 0x3d,
+  0xa5, 0xd4, 0xab, 0x18, 0x18, 0xf6, 0x43, 0x1b, 0x73, 0xe7, 0x52, 0xfb,
+  0x45, 0x66, 0xc1, 0x43, 0x65, 0x57, 0x18, 0x30, 0x80, 0x95, 0x39, 0x12,
+  0x8d, 0xa8, 0x74, 0x68, 0x51, 0x24, 0x90, 0x41, 0x69, 0x7b, 0x9e, 0x7d,
+  0x9c, 0xdb, 0xa3, 0x27, 0xd0, 0x30, 0x38, 0xfb, 0xc5, 0x55, 0x64, 0xb9,
+  0xe9, 0xeb, 0x0b, 0xa7, 0xb0, 0xd4, 0x34, 0x9d, 0x4b, 0x4b, 0x9d, 0x78,
+  0x64, 0xca, 0x4b, 0x19, 0xcf, 0x8e, 0x08, 0xc9, 0x1e, 0xa0, 0xd1, 0x8c,
+  0xa5, 0x57, 0xba, 0xe3, 0xa6, 0x2d, 0xfa, 0x8b, 0x4a, 0x68, 0x76, 0xaa,
+  0x5e, 0x46, 0x0b, 0x5b, 0xcc, 0x7f, 0x94, 0xf9, 0x1f, 0xed, 0x3f, 0xfd,
+  0xa5, 0xba, 0x9e, 0x9c, 0x96, 0x0c, 0xa6, 0x41, 0xf3, 0x19, 0x69, 0xba,
+  0x8b, 0xd6, 0x40, 0x60, 0x08, 0xfe, 0x81, 0x03, 0x7d, 0x43, 0x67, 0xa7,
+  0xac, 0x86, 0xe2, 0xc2, 0xf2, 0x39, 0x62, 0xf1, 0x50, 0xa5, 0x18, 0x7f,
+  0x89, 0xfc, 0x89, 0xa8, 0x79, 0x02, 0x3c, 0x0a, 0x8e, 0xf9, 0x4c, 0xe4,
+  0x60, 0x73, 0x59, 0xa8, 0xc3, 0x7b, 0xa7, 0x5f, 0xcb, 0x65, 0x76, 0x8d,
+  0x1c, 0xf0, 0xb6, 0xd7, 0x46, 0xf0, 0x34, 0x9a, 0xc9, 0xbc, 0x61, 0xb0,
+  0x29, 0x26, 0xd2, 0x9c, 0x18, 0xc9, 0xac, 0x0e, 0x72, 0x06, 0x22, 0x53,
+  0x20, 0x45, 0x06, 0x36, 0x24, 0x79, 0x1a, 0x2b, 0x76, 0x53, 0xd4, 0x53,
+  0xb4, 0x31, 0x68, 0x9a, 0xa2, 0xc8, 0x8c, 0x57, 0x36, 0x72, 0x48, 0xa4,
+  0x6f, 0x5f, 0xe8, 0xc9, 0xef, 0xc7, 0x87, 0xa7, 0x1e, 0x55, 0x46, 0xe8,
+  0x6d, 0x31, 0x75, 0x6e, 0xaf, 0xd3, 0xac, 0x25, 0x43, 0x24, 0x6f, 0x26,
+  0x59, 0x71, 0xde, 0x14, 0x16, 0xc7, 0xd2, 0xba, 0x67, 0x59, 0xe8, 0xf8,
+  0xee, 0xfa, 0x79, 0x6d, 0x67, 0x06, 0x39, 0x38, 0x78, 0xe5, 0x03, 0xde,
+  0x85, 0xc7, 0x2a, 0xc3, 0xd4, 0x1a, 0xa8, 0xdd, 0x59, 0xb4, 0x7a, 0xa4,
+  0xad, 0x57, 0x39, 0xef, 0xe2, 0x10, 0xf4, 0xf5, 0xd4, 0x50, 0xce, 0xc7,
+  0x18, 0xed, 0xe6, 0x41, 0x95, 0xf4, 0xad, 0x6d, 0x3e, 0x55, 0xad, 0x32,
+  0x57, 0x9e, 0xd1, 0x5a, 0x60, 0xab, 0x3a, 0x16, 0x8e, 0x60, 0x3b, 0x83,
+  0xa9, 0x2a, 0xd8, 0xf4, 0xc8, 0x38, 0xf4, 0xa7, 0x05, 0x4d, 0x6e, 0x11,
+  0xc3, 0xa8, 0x61, 0xf3, 0x32, 0xec, 0xa5, 0x49, 0x06, 0x20, 0x52, 0xbc,
+  0x94, 0xa7, 0x1b, 0x05, 0x68, 0xad, 0x75, 0x22, 0x3c, 0x55, 0x27, 0xc3,
+  0x8a, 0x50, 0x27, 0x14, 0xa2, 0xa7, 0x75, 0x7a, 0xdb, 0x5c, 0x6e, 0x93,
+  0x88, 0x86, 0xca, 0xc1, 0x19, 0x24, 0x05, 0x19, 0x27, 0x8c, 0x52, 0xdb,
+  0x7d, 0x6a, 0x57, 0xa7, 0xad, 0x15, 0xe7, 0x6b, 0x89, 0x17, 0x2b, 0x10,
+  0xc8, 0x1e, 0xb4, 0x0d, 0x4e, 0xa0, 0x51, 0x51, 0x73, 0x0b, 0x4d, 0x46,
+  0xc7, 0x0a, 0x25, 0x17, 0xad, 0x3b, 0x3b, 0xe9, 0xfd, 0x4e, 0xf9, 0x6f,
+  0x35, 0x13, 0x78, 0xd7, 0xee, 0x80, 0x48, 0xb6, 0xf2, 0x2a, 0xa2, 0x81,
+  0xdd, 0x9c, 0xa9, 0xcb, 0x7a, 0xe7, 0xc0, 0x0f, 0x5a, 0x84, 0x4e, 0xcb,
+  0xfa, 0x61, 0x53, 0xde, 0x3a, 0x9a, 0x8f, 0x49, 0x97, 0x3f, 0x55, 0xa2,
+  0xc5, 0xe2, 0x23, 0x4c, 0x59, 0x97, 0xde, 0x3c, 0x9a, 0x68, 0xf6, 0x8d,
+  0x2b, 0x1f, 0x77, 0x83, 0xdd, 0x5f, 0x3d, 0xd5, 0x6a, 0x75, 0x36, 0x58,
+  0x58, 0x37, 0x79, 0xac, 0xd3, 0x57, 0x4a, 0x20, 0x52, 0xb0, 0x41, 0x63,
+  0xad, 0x74, 0x3f, 0x66, 0x9d, 0x60, 0x9b, 0xb4, 0x3d, 0x5b, 0x50, 0xb8,
+  0x44, 0x04, 0x4d, 0x2c, 0xc9, 0x85, 0x07, 0xfa, 0x46, 0x06, 0x68, 0xf5,
+  0xa4, 0xf5, 0xff, 0x00, 0x47, 0x75, 0x67, 0x4e, 0x8d, 0x47, 0x4e, 0xbb,
+  0x31, 0x11, 0xee, 0x3c, 0x52, 0xae, 0x19, 0x1b, 0x1d, 0xc4, 0x7e, 0x85,
+  0x07, 0x7b, 0x75, 0xe8, 0xd3, 0x73, 0xd2, 0xe7, 0x59, 0x44, 0xdb, 0x3d,
+  0x91, 0xdd, 0xbb, 0xcd, 0x0f, 0x78, 0xfc, 0x0d, 0x0a, 0x7a, 0x06, 0xfe,
+  0x5b, 0x64, 0xb8, 0x8a, 0x32, 0x50, 0x9c, 0x12, 0xc3, 0xc7, 0xe3, 0x47,
+  0xd3, 0xe9, 0x56, 0xf0, 0x1d, 0xbd, 0xd3, 0x8b, 0xad, 0xf4, 0xdb, 0x0b,
+  0xed, 0x86, 0xdb, 0x0b, 0xa8, 0xcf, 0x53, 0xea, 0xb6, 0xbc, 0x05, 0x9e,
+  0x4f, 0xda, 0x62, 0xf5, 0xe0, 0x2b, 0x63, 0xee, 0x53, 0xf3, 0x35, 0x2d,
+  0xb2, 0x84, 0xd1, 0xea, 0xd7, 0x70, 0xdd, 0x43, 0x3c, 0x6e, 0x44, 0xb1,
+  0x36, 0xe4, 0x24, 0x67, 0x1e, 0x60, 0xfa, 0x1f, 0xce, 0x8a, 0x5a, 0x2d,
+  0xfc, 0x1a, 0xae, 0x9b, 0x15, 0xed, 0xbf, 0x0a, 0xe3, 0xde, 0x53, 0xde,
+  0xac, 0x3b, 0xc1, 0xf8, 0x56, 0xcf, 0xa7, 0xdb, 0xfa, 0xc5, 0x67, 0xb8,
+  0x99, 0xdd, 0x65, 0x78, 0xb3, 0x78, 0xf9, 0x8b, 0x14, 0xf0, 0xad, 0x6d,
+  0xc1, 0xa5, 0xf6, 0xd6, 0xb6, 0xd5, 0xfd, 0xd2, 0xa4, 0x78, 0x01, 0xaf,
+  0x41, 0x45, 0x7b, 0x0a, 0x4f, 0x85, 0x7b, 0x00, 0x03, 0xdd, 0x42, 0xcc,
+  0x9c, 0x44, 0xf6, 0x01, 0x56, 0x5e, 0x91, 0x85, 0x5b, 0x44, 0x9e, 0xe9,
+  0xc9, 0xe4, 0x92, 0x83, 0x19, 0x27, 0xf4, 0x2a, 0xb9, 0x70, 0x09, 0x8b,
+  0x68, 0xef, 0x72, 0x10, 0x7c, 0xe8, 0x8d, 0xd3, 0x76, 0x1b, 0xb4, 0xc8,
+  0xed, 0xd0, 0x0d, 0x80, 0x0c, 0x95, 0x5f, 0x4e, 0x69, 0x1f, 0x58, 0xbb,
+  0xf1, 0x15, 0xff, 0x00, 0xb1, 0x9f, 0x4e, 0xaf, 0x92, 0xf2, 0xaa, 0xb6,
+  0x92, 0x4b, 0x39, 0x65, 0x53, 0x8c, 0xf1, 0x91, 0x53, 0xda, 0x3e, 0x82,
+  0xf3, 0x4a, 0x88, 0x11, 0xb3, 0xe0, 0x2a, 0xc5, 0xa4, 0xf4, 0xf4, 0x8f,
+  0x33, 0xa2, 0x45, 0xbf, 0x1c, 0x90, 0x06, 0x78, 0xcf, 0x7d, 0x5f, 0x34,
+  0x4d, 0x12, 0x1b, 0x25, 0x59, 0x48, 0xdd, 0x28, 0x03, 0x1e, 0x94, 0x80,
+  0x57, 0xbc, 0xf1, 0x1b, 0x67, 0x10, 0x7b, 0xd6, 0x1d, 0x9d, 0x9d, 0x4f,
+  0xa4, 0x75, 0x0b, 0x29, 0x76, 0xab, 0x4d, 0x6c, 0xe9, 0xdd, 0x9c, 0x12,
+  0xa7, 0x15, 0xc0, 0xda, 0x1c, 0x72, 0x59, 0x6b, 0xd3, 0xd9, 0xba, 0x95,
+  0x75, 0x2c, 0xac, 0x0f, 0x07, 0x20, 0xe2, 0xbe, 0xa7, 0x5d, 0xc2, 0xb3,
+  0xc1, 0x24, 0x2d, 0x90, 0x19, 0x48, 0xaf, 0x9b, 0x3d, 0xa8, 0x69, 0x6f,
+  0xa1, 0xf6, 0xe7, 0xac, 0xe9, 0xc8, 0xa0, 0x6c, 0xd4, 0x24, 0xc0, 0x1c,
+  0x0c, 0x31, 0xdd, 0xf9, 0xd5, 0xca, 0x57, 0xd3, 0x7c, 0x08, 0x3b, 0x79,
+  0x5c, 0xfd, 0x45, 0x92, 0x0f, 0x6d, 0x83, 0x18, 0x19, 0xcf, 0x35, 0x2b,
+  0xd9, 0xae, 0xb3, 0xfb, 0xbf, 0xa9, 0x5f, 0x47, 0x9d, 0xf1, 0x05, 0xe7,
+  0xfc, 0x79, 0x3c, 0x2c, 0x80, 0x71, 0xf7, 0x8e, 0x3e, 0x42, 0x98, 0x00,
+  0x90, 0x0d, 0xec, 0x10, 0x1c, 0x1d, 0xc0, 0x9f, 0x0f, 0x2a, 0x88, 0xd6,
+  0x77, 0x89, 0xe2, 0xbe, 0xb7, 0x62, 0x93, 0x44, 0xc1, 0x94, 0x81, 0xc8,
+  0x20, 0xe4, 0x1a, 0x65, 0x4b, 0x94, 0x70, 0xd2, 0x9d, 0xd5, 0x87, 0x4c,
+  0x43, 0xd9, 0x4a, 0xd1, 0x41, 0x4d, 0xfa, 0x73, 0x50, 0x4d, 0x5f, 0x43,
+  0xb3, 0xd4, 0x93, 0x8f, 0x6f, 0x10, 0x66, 0x03, 0xc1, 0xbb, 0x98, 0x7c,
+  0x88, 0x22, 0x9f, 0xed, 0xc5, 0x3b, 0x0d, 0x91, 0x91, 0x14, 0x62, 0x38,
+  0xe7, 0x15, 0x82, 0xb7, 0x59, 0x52, 0x04, 0xe2, 0x78, 0xdc, 0x45, 0xd4,
+  0x03, 0x9c, 0x29, 0x2c, 0x7f, 0x2a, 0x2f, 0x74, 0xbc, 0x26, 0x3b, 0x38,
+  0x49, 0xc9, 0x66, 0x42, 0xd8, 0xc1, 0x23, 0x9c, 0x50, 0x8a, 0x35, 0xdf,
+  0x72, 0x38, 0xee, 0x18, 0xa2, 0xdf, 0x46, 0x48, 0xdf, 0xbb, 0x61, 0x33,
+  0x1c, 0xba, 0x9f, 0x0e, 0x70, 0x3c, 0x3e, 0x15, 0x99, 0xea, 0x27, 0x7d,
+  0xa6, 0x3e, 0xd1, 0x2e, 0xda, 0xc0, 0x96, 0x03, 0xa9, 0x2d, 0x84, 0x81,
+  0xe2, 0x7d, 0xd2, 0x9f, 0xe3, 0xe3, 0xd0, 0x7e, 0xbe, 0x55, 0x3f, 0xa5,
+  0xeb, 0x36, 0xb7, 0x50, 0xaf, 0xb4, 0x70, 0x92, 0x73, 0x91, 0x55, 0x8b,
+  0xdd, 0x3a, 0x67, 0x67, 0xba, 0x40, 0x08, 0x27, 0x20, 0x79, 0x0e, 0xff,
+  0x00, 0xce, 0x99, 0xc5, 0x14, 0xd1, 0xbe, 0x46, 0x42, 0xf8, 0x9a, 0x5e,
+  0x0b, 0x21, 0xe2, 0x5b, 0xef, 0x2f, 0xf7, 0xdb, 0x8d, 0xa3, 0x3c, 0x4c,
+  0x0f, 0x19, 0x18, 0xf1, 0xae, 0x0e, 0xed, 0xc3, 0x49, 0x66, 0xed, 0xe3,
+  0x50, 0x92, 0x38, 0x76, 0xca, 0xe1, 0x66, 0x1b, 0x8e, 0x01, 0x25, 0x79,
+  0x3f, 0x7d, 0x76, 0xd6, 0x8d, 0x7f, 0x34, 0x71, 0x15, 0x91, 0x77, 0xa6,
+  0x70, 0x07, 0x95, 0x73, 0xaf, 0xda, 0xdb, 0x42, 0x4b, 0x0e, 0xb9, 0xe9,
+  0xfe, 0xa4, 0xb6, 0x8f, 0x6c, 0x57, 0xb1, 0x3d, 0xbc, 0xa7, 0xfb, 0x87,
+  0x23, 0xe9, 0x56, 0x2b, 0x20, 0xb8, 0x69, 0x07, 0x95, 0x22, 0x00, 0xaf,
+  0x6d, 0xa5, 0x8e, 0x76, 0x59, 0x81, 0xdc, 0x3b, 0xea, 0x36, 0xe7, 0xda,
+  0x3c, 0x04, 0x22, 0x6e, 0x23, 0xc3, 0x8a, 0x79, 0xd4, 0x57, 0x57, 0x0b,
+  0x3c, 0x92, 0x46, 0xc5, 0x82, 0x92, 0x40, 0xa6, 0xa0, 0x7e, 0xd1, 0x60,
+  0x97, 0x11, 0x93, 0xb1, 0xf3, 0xc8, 0xfe, 0x53, 0xe2, 0x31, 0xf4, 0xfd,
+  0x1a, 0x61, 0x9e, 0x25, 0x6c, 0x0c, 0xcb, 0xd7, 0x61, 0x9a, 0xc9, 0x96,
+  0xde, 0xef, 0x43, 0x98, 0xfb, 0xd1, 0x1f, 0x6f, 0x0f, 0xfe, 0x49, 0xc3,
+  0x0f, 0x91, 0xc1, 0xff, 0x00, 0x23, 0x44, 0xe0, 0xa2, 0xb9, 0xc7, 0xa5,
+  0xf5, 0x45, 0xd0, 0x7a, 0xaa, 0xc7, 0x51, 0x0c, 0x56, 0x38, 0xe4, 0x02,
+  0x5f, 0x54, 0x3c, 0x37, 0xd0, 0x93, 0xf2, 0x15, 0xd2, 0x69, 0x86, 0x50,
+  0xca, 0x72, 0x08, 0xc8, 0x22, 0x98, 0xe9, 0xec, 0xca, 0x63, 0xea, 0x2c,
+  0xbe, 0xbd, 0xaf, 0xe6, 0x78, 0xac, 0xac, 0xe7, 0xca, 0xb2, 0xaf, 0x4a,
+  0x71, 0x5b, 0x22, 0xa2, 0xed, 0x18, 0xa8, 0x38, 0x3d, 0xde, 0x74, 0x42,
+  0xe9, 0xbb, 0xd5, 0x8e, 0x31, 0xc1, 0x4c, 0x37, 0xf0, 0xf8, 0x77, 0x73,
+  0x8a, 0x1c, 0xdb, 0x30, 0xfd, 0xa3, 0xe7, 0x57, 0x2d, 0x09, 0xc2, 0x95,
+  0x3b, 0xb6, 0x91, 0xc8, 0x07, 0xe3, 0x59, 0x6b, 0x86, 0xe7, 0x62, 0x7e,
+  0xcc, 0xd0, 0x54, 0x70, 0xa3, 0xc4, 0x2d, 0xf4, 0xed, 0xd4, 0x52, 0x44,
+  0x23, 0xd9, 0x85, 0xc6, 0xc1, 0xe3, 0xe3, 0xf8, 0x73, 0x52, 0xcf, 0xa6,
+  0xda, 0xb4, 0x46, 0x35, 0x88, 0x28, 0x3e, 0x22, 0xa9, 0x5d, 0x35, 0x76,
+  0x55, 0xd4, 0x67, 0x01, 0xb1, 0xdc, 0x7c, 0xaa, 0xf1, 0x6f, 0x3a, 0x94,
+  0x01, 0xbf, 0x8c, 0x71, 0xf1, 0xa1, 0x2e, 0x3b, 0x18, 0x70, 0x67, 0x8b,
+  0x3d, 0x3a, 0x0b, 0x64, 0x00, 0x0c, 0xe3, 0x3d, 0xf4, 0x01, 0xfb, 0x68,
+  0xdd, 0x23, 0x68, 0xfd, 0x37, 0xa7, 0xdb, 0xa0, 0x6b, 0x93, 0xa8, 0x97,
+  0x5f, 0x45, 0x08, 0x77, 0x7e, 0x22, 0xba, 0x16, 0x49, 0x36, 0xa9, 0x23,
+  0x91, 0x5c, 0x83, 0xf6, 0xb5, 0xea, 0x40, 0x3a, 0xdd, 0xe3, 0x46, 0xdc,
+  0xba, 0x4d, 0x8f, 0xb3, 0x51, 0xff, 0x00, 0x7c, 0xc7, 0x3f, 0xea, 0x10,
+  0xd7, 0x5c, 0x02, 0x00, 0x93, 0xf0, 0x4c, 0x03, 0x5d, 0x5f, 0x5b, 0xcb,
+  0x7f, 0x3d, 0xa6, 0xf0, 0x1d, 0x1d, 0x86, 0x0f, 0x88, 0x04, 0x81, 0x51,
+  0x9a, 0x1e, 0xa3, 0x1d, 0xa6, 0xa7, 0x36, 0x9b, 0x71, 0x8f, 0x61, 0x72,
+  0xe0, 0x23, 0x01, 0x9f, 0x66, 0xe7, 0x80, 0x7e, 0x1e, 0x75, 0x5e, 0x9a,
+  0x66, 0x69, 0x5a, 0x5c, 0x90, 0xf9, 0xce, 0x7c, 0x69, 0x19, 0x99, 0x9b,
+  0xde, 0x66, 0x3b, 0x89, 0xc9, 0x35, 0x7b, 0x1c, 0x4a, 0x45, 0xc6, 0xee,
+  0x25, 0x8b, 0x55, 0x41, 0x1d, 0xcb, 0x90, 0x01, 0x19, 0x3d, 0xc6, 0xba,
+  0x17, 0xb2, 0xfd, 0x50, 0x6b, 0x1d, 0x13, 0xa7, 0xce, 0x5b, 0x32, 0xc4,
+  0x9e, 0xc2, 0x5f, 0x30, 0xc9, 0xc7, 0x3f, 0x11, 0x83, 0xf3, 0xae, 0x7a,
+  0xd6, 0x2e, 0x3d, 0xb9, 0x8e, 0x62, 0x9b, 0x4b, 0x44, 0x8c, 0x46, 0x7b,
+  0xb2, 0xa0, 0xd1, 0x53, 0xec, 0xe7, 0x7d, 0xbe, 0xc7, 0x55, 0xd3, 0x9d,
+  0xbd, 0xd8, 0xe4, 0x49, 0x97, 0x3f, 0xdc, 0x08, 0x3f, 0xea, 0x28, 0xb4,
+  0x36, 0x1a, 0x0e, 0xf5, 0x0d, 0x89, 0xff, 0xd9
+};
+unsigned int data_penguin_jpg_len = 2192;
@@ -57,6 +57,33 @@ run "check page count" grep -q "NumberOfPages: 5$" output.pdftk
 run "check bookmarks" grep -q "BookmarkTitle: First page$" output.pdftk
 run "check for subject" grep -q "InfoValue: My subject$" output.pdftk
 
+# Check the fragments were stitched together properly
+run "pdftk stitched" pdftk output-stitched.pdf dump_data output output-stitched.pdftk
+run "check stitched page count" grep -q "NumberOfPages: 4$" output-stitched.pdftk
+run "check stitched bookmarks" grep -q "BookmarkTitle: Fragment 2 page 2$" output-stitched.pdftk
+# Each fragment was written by a separate process
+run "pdftotext stitched" pdftotext -layout output-stitched.pdf output-stitched.txt
+run "check stitched fragment 1" grep -q "Fragment 1 page 1" output-stitched.txt
+run "check stitched fragment 2" grep -q "Fragment 2 page 2" output-stitched.txt
+
+# Check the appended documents were merged properly
+run "pdftk appended" pdftk output-appended.pdf dump_data output output-appended.pdftk
+run "check appended page count" grep -q "NumberOfPages: 4$" output-appended.pdftk
+run "check appended bookmarks" grep -q "BookmarkTitle: Section 3$" output-appended.pdftk
+
+# Check pages were imported from other PDFs
+run "pdftotext imported" pdftotext -layout output-imported.pdf
+run "check imported letterhead" grep -q "PDFGen Letterhead" output-imported.txt
+run "check imported page" grep -q "Second (imported) page" output-imported.txt
+run "check imported thumbnail" grep -q "Page One" output-imported.txt
+
+# Check the document drawn by pdfgen-render from commands
+run "pdftotext render" pdftotext -layout output-render.pdf
+run "check render text" grep -q "Special characters: €ÜŽžŠšÁáüöäÄÜÖß" output-render.txt
+run "pdftk render" pdftk output-render.pdf dump_data output output-render.pdftk
+run "check render page count" grep -q "NumberOfPages: 5$" output-render.pdftk
+run "check render bookmarks" grep -q "BookmarkTitle: Another child page$" output-render.pdftk
+
 # Run it again in a different locale
 export LC_ALL=fr_FR
 run "locale" ./testprog
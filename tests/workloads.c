@@ -0,0 +1,572 @@
+/**
+ * End-to-end workloads: representative documents built with the public
+ * API, to catch performance regressions that microbenchmarks (see
+ * tests/bench.c) miss.
+ *
+ * Each workload runs in its own process, and records the number of heap
+ * allocations, the peak heap size, the number of PDF objects and the
+ * output size. These don't depend on the machine (or how busy it is), so
+ * they are compared against a checked in baseline file with one line per
+ * workload:
+ *   <name> <allocations> <peak heap kB> <objects> <output bytes>
+ * and any that are more than the threshold (percent) worse are reported
+ * as regressions. Wall time & peak RSS are printed too, but as they vary
+ * from machine to machine they aren't compared.
+ *
+ * Allocations are counted by tests/alloc-count.h, which needs GNU ld (or
+ * lld) & glibc's malloc_usable_size.
+ *
+ * Usage: workloads [-b baseline] [-u] [-t threshold] [name]
+ */
+#include "alloc-count.h"
+#include "pdfgen.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct result {
+    char name[32];
+    long allocations;
+    long peak_heap_kb;
+    long objects;
+    long output_bytes;
+    double wall_ms;
+    long peak_rss_kb;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct pdf_doc *new_doc(const char *title)
+{
+    struct pdf_info info = {.creator = "PDFGen workloads"};
+    struct pdf_doc *pdf;
+
+    snprintf(info.title, sizeof(info.title), "%s", title);
+    pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, &info);
+    if (!pdf) {
+        fprintf(stderr, "Unable to create PDF\n");
+        exit(1);
+    }
+    pdf_set_deterministic(pdf, "20240101120000Z");
+    return pdf;
+}
+
+/* A table with a ruled grid, a header row & right aligned amounts */
+static void draw_table(struct pdf_doc *pdf, float x, float y, int rows,
+                       int seed)
+{
+    const float widths[] = {60, 250, 60, 60, 70};
+    const char *headings[] = {"Code", "Description", "Qty", "Price",
+                              "Amount"};
+    const float row_height = 16;
+    float total_width = 0;
+
+    for (int c = 0; c < 5; c++)
+        total_width += widths[c];
+    pdf_add_filled_rectangle(pdf, NULL, x, y - row_height, total_width,
+                             row_height, 0, PDF_RGB(0xdd, 0xdd, 0xdd),
+                             PDF_TRANSPARENT);
+    for (int r = 0; r <= rows; r++) {
+        float cx = x;
+        float ry = y - (r + 1) * row_height;
+
+        pdf_add_line(pdf, NULL, x, ry, x + total_width, ry, 0.5, PDF_BLACK);
+        for (int c = 0; c < 5; c++) {
+            char cell[64];
+            int qty = (seed + r * 7 + c) % 9 + 1;
+            int price = (seed * 31 + r * 17) % 10000;
+
+            if (r == 0)
+                snprintf(cell, sizeof(cell), "%s", headings[c]);
+            else if (c == 0)
+                snprintf(cell, sizeof(cell), "A%04d", (seed + r) % 10000);
+            else if (c == 1)
+                snprintf(cell, sizeof(cell), "Widget, type %d, finish %c",
+                         (seed + r) % 97, 'A' + r % 26);
+            else if (c == 2)
+                snprintf(cell, sizeof(cell), "%d", qty);
+            else if (c == 3)
+                snprintf(cell, sizeof(cell), "%d.%02d", price / 100,
+                         price % 100);
+            else
+                snprintf(cell, sizeof(cell), "%d.%02d", qty * price / 100,
+                         qty * price % 100);
+            pdf_add_text(pdf, NULL, cell, 9, cx + 3, ry + 4, PDF_BLACK);
+            pdf_add_line(pdf, NULL, cx, ry, cx, ry + row_height, 0.5,
+                         PDF_BLACK);
+            cx += widths[c];
+        }
+        pdf_add_line(pdf, NULL, cx, ry, cx, ry + row_height, 0.5, PDF_BLACK);
+    }
+}
+
+/* A 20 page invoice, mostly tables */
+static struct pdf_doc *workload_invoice(void)
+{
+    struct pdf_doc *pdf = new_doc("Invoice");
+
+    for (int p = 0; p < 20; p++) {
+        char str[64];
+
+        pdf_append_page(pdf);
+        pdf_set_font(pdf, "Helvetica-Bold");
+        pdf_add_text(pdf, NULL, "INVOICE", 24, 50, 780, PDF_BLACK);
+        pdf_set_font(pdf, "Helvetica");
+        snprintf(str, sizeof(str), "Invoice 2024-%05d, page %d of 20", 42,
+                 p + 1);
+        pdf_add_text(pdf, NULL, str, 10, 50, 760, PDF_BLACK);
+        pdf_add_text_wrap(pdf, NULL,
+                          "Example Company Ltd\n123 Some Street\nSome "
+                          "Town\nSome Country",
+                          10, 380, 780, 0, PDF_BLACK, 170, PDF_ALIGN_RIGHT,
+                          NULL);
+        draw_table(pdf, 50, 700, 38, p);
+        pdf_add_text(pdf, NULL, "Payment is due within 30 days", 9, 50, 50,
+                     PDF_RGB(0x60, 0x60, 0x60));
+    }
+    return pdf;
+}
+
+/* 10,000 single page statements, each on a shared letterhead */
+static struct pdf_doc *workload_statements(void)
+{
+    struct pdf_doc *pdf = new_doc("Statements");
+    struct pdf_object *letterhead;
+
+    pdf_reserve(pdf, 10000, 0, 8192);
+    letterhead = pdf_import_page(pdf, "data/letterhead.pdf", 1);
+    if (!letterhead) {
+        fprintf(stderr, "Unable to import letterhead: %s\n",
+                pdf_get_err(pdf, NULL));
+        exit(1);
+    }
+    for (int s = 0; s < 10000; s++) {
+        char str[96];
+        int balance = 0;
+
+        pdf_append_page(pdf);
+        pdf_add_form(pdf, NULL, letterhead, 0, 0, PDF_A4_WIDTH,
+                     PDF_A4_HEIGHT);
+        snprintf(str, sizeof(str), "Statement for account %08d", s * 7919);
+        pdf_add_text(pdf, NULL, str, 14, 50, 700, PDF_BLACK);
+        for (int t = 0; t < 40; t++) {
+            int amount = ((s + 1) * (t + 3) * 37) % 20000 - 10000;
+
+            balance += amount;
+            snprintf(str, sizeof(str),
+                     "2024-%02d-%02d  Transaction %4d  %8.2f", t / 28 + 1,
+                     t % 28 + 1, t, amount / 100.0);
+            pdf_add_text(pdf, NULL, str, 9, 50, 660 - t * 14, PDF_BLACK);
+        }
+        snprintf(str, sizeof(str), "Closing balance %.2f", balance / 100.0);
+        pdf_add_text(pdf, NULL, str, 12, 50, 80, PDF_BLACK);
+        pdf_add_bookmark(pdf, NULL, -1, str);
+    }
+    return pdf;
+}
+
+/* A catalogue of photos from data/, six to a page with captions */
+static struct pdf_doc *workload_catalogue(void)
+{
+    const char *images[] = {"data/penguin.jpg", "data/coal.png",
+                            "data/bee.bmp",     "data/teapot.ppm",
+                            "data/grey.jpg",    "data/indexed.png"};
+    struct pdf_doc *pdf = new_doc("Catalogue");
+
+    for (int p = 0; p < 20; p++) {
+        pdf_append_page(pdf);
+        for (int i = 0; i < 6; i++) {
+            float x = 60 + (i % 2) * 250;
+            float y = 580 - (i / 2) * 250;
+            char str[64];
+
+            if (pdf_add_image_file(pdf, NULL, x, y, 200, 180,
+                                   images[(p + i) % 6]) < 0) {
+                fprintf(stderr, "Unable to add %s: %s\n",
+                        images[(p + i) % 6], pdf_get_err(pdf, NULL));
+                exit(1);
+            }
+            snprintf(str, sizeof(str), "Item %d: %s", p * 6 + i,
+                     images[(p + i) % 6] + 5);
+            pdf_add_text(pdf, NULL, str, 10, x, y - 15, PDF_BLACK);
+        }
+    }
+    return pdf;
+}
+
+/* 500 shipping labels, 3 x 8 to a page, each with two barcodes */
+static struct pdf_doc *workload_labels(void)
+{
+    struct pdf_doc *pdf = new_doc("Labels");
+
+    for (int l = 0; l < 500; l++) {
+        float x = 20 + (l % 3) * 190;
+        float y = 740 - ((l / 3) % 8) * 100;
+        char str[32];
+
+        if (l % 24 == 0)
+            pdf_append_page(pdf);
+        pdf_add_rectangle(pdf, NULL, x, y, 180, 95, 0.5, PDF_BLACK);
+        snprintf(str, sizeof(str), "SHIP%06d", l);
+        pdf_add_barcode(pdf, NULL, PDF_BARCODE_128A, x + 5, y + 45, 170, 45,
+                        str, PDF_BLACK);
+        snprintf(str, sizeof(str), "40039941%04d", l);
+        pdf_add_barcode(pdf, NULL, PDF_BARCODE_EAN13, x + 5, y + 5, 100, 38,
+                        str, PDF_BLACK);
+    }
+    return pdf;
+}
+
+/* A report full of bar charts & line graphs */
+static struct pdf_doc *workload_charts(void)
+{
+    struct pdf_doc *pdf = new_doc("Report");
+    const uint32_t colours[] = {PDF_RED, PDF_GREEN, PDF_BLUE,
+                                PDF_RGB(0xff, 0x80, 0)};
+
+    for (int p = 0; p < 50; p++) {
+        pdf_append_page(pdf);
+        pdf_add_text(pdf, NULL, "Quarterly figures", 18, 50, 790, PDF_BLACK);
+        for (int c = 0; c < 4; c++) {
+            float x = 50 + (c % 2) * 260;
+            float y = 420 - (c / 2) * 360;
+            struct pdf_path_operation path[64];
+
+            pdf_add_line(pdf, NULL, x, y, x + 230, y, 1, PDF_BLACK);
+            pdf_add_line(pdf, NULL, x, y, x, y + 300, 1, PDF_BLACK);
+            for (int b = 0; b < 24; b++) {
+                float h = (float)((p * 13 + c * 7 + b * 29) % 250) + 10;
+
+                pdf_add_filled_rectangle(pdf, NULL, x + 5 + b * 9, y, 7, h,
+                                         0, colours[b % 4], PDF_TRANSPARENT);
+            }
+            path[0].op = 'm';
+            path[0].x1 = x;
+            path[0].y1 = y + 150;
+            for (int i = 1; i < 64; i++) {
+                path[i].op = 'l';
+                path[i].x1 = x + i * 230.0f / 63;
+                path[i].y1 = y + 150 + (float)((p + c * 5 + i * 11) % 120);
+            }
+            pdf_add_custom_path(pdf, NULL, path, 64, 1.5, PDF_BLACK,
+                                PDF_TRANSPARENT);
+            pdf_add_circle(pdf, NULL, x + 200, y + 270, 15, 1, PDF_BLACK,
+                           colours[c]);
+        }
+    }
+    return pdf;
+}
+
+/* A patterned band across the top of each page of the report */
+static int report_page(void *arg, struct pdf_doc *pdf,
+                       struct pdf_object *page, int page_number)
+{
+    char str[32];
+
+    pdf_add_filled_rectangle_pattern(pdf, page, 0, PDF_A4_HEIGHT - 40,
+                                     PDF_A4_WIDTH, 40, 0,
+                                     (struct pdf_object *)arg,
+                                     PDF_TRANSPARENT);
+    snprintf(str, sizeof(str), "Page %d", page_number);
+    return pdf_add_text(pdf, page, str, 9, 280, 20, PDF_BLACK);
+}
+
+/* A long report of flowing text, with headings & patterned page headers */
+static struct pdf_doc *workload_report(void)
+{
+    struct pdf_doc *pdf = new_doc("Annual report");
+    struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                   PDF_A4_HEIGHT - 120, 0};
+    struct pdf_flow_style body = {"Times-Roman", 11, 0, 6, 20,
+                                  PDF_ALIGN_JUSTIFY, PDF_BLACK};
+    struct pdf_flow_style heading = {"Helvetica-Bold", 16, 0, 10, 0,
+                                     PDF_ALIGN_LEFT, PDF_BLUE};
+    struct pdf_object *pattern = pdf_add_pattern(pdf, 20, 20);
+    struct pdf_flow *flow;
+
+    pdf_add_filled_rectangle(pdf, pattern, 0, 0, 10, 10, 0,
+                             PDF_RGB(0xcc, 0xdd, 0xff), PDF_TRANSPARENT);
+    pdf_add_line(pdf, pattern, 0, 20, 20, 0, 1, PDF_RGB(0x88, 0x99, 0xcc));
+    flow = pdf_flow_create(pdf, NULL, &frame, report_page, pattern);
+    for (int p = 0; flow && p < 1000; p++) {
+        char str[512];
+        int len;
+
+        if (p % 20 == 0) {
+            len = snprintf(str, sizeof(str), "Section %d\n", p / 20 + 1);
+            pdf_flow_write(flow, &heading, str, len);
+        }
+        len = snprintf(str, sizeof(str),
+                       "Paragraph %d. The quick brown fox jumps over the "
+                       "lazy dog, in a caf\xc3\xa9, %d times. Pack my box "
+                       "with five dozen liquor jugs, and then some more "
+                       "text to make the paragraph run over several "
+                       "lines.\n",
+                       p, p * 7 % 100);
+        pdf_flow_write(flow, &body, str, len);
+    }
+    if (!flow || pdf_flow_end(flow, NULL) < 0) {
+        fprintf(stderr, "Unable to flow report: %s\n",
+                pdf_get_err(pdf, NULL));
+        exit(1);
+    }
+    return pdf;
+}
+
+/* A 5,000 row price list as a single table, with repeated cell text
+ * going through the text cache */
+static struct pdf_doc *workload_price_list(void)
+{
+    struct pdf_doc *pdf = new_doc("Price list");
+    const char *categories[] = {"Fasteners", "Hinges", "Brackets",
+                                "Fixings", "Handles"};
+    struct pdf_flow_frame frame = {50, 50, PDF_A4_WIDTH - 100,
+                                   PDF_A4_HEIGHT - 100, 0};
+    struct pdf_table_column columns[] = {{60, PDF_ALIGN_LEFT},
+                                         {0, PDF_ALIGN_LEFT},
+                                         {80, PDF_ALIGN_LEFT},
+                                         {60, PDF_ALIGN_RIGHT}};
+    struct pdf_table_style style = {
+        .font = "Helvetica",
+        .header_font = "Helvetica-Bold",
+        .size = 9,
+        .padding = 3,
+        .colour = PDF_BLACK,
+        .border_width = 0.5f,
+        .border_colour = PDF_RGB(0x80, 0x80, 0x80),
+        .header_rows = 1,
+    };
+    const int rows = 5000;
+    const char **cells = (const char **)malloc(rows * 4 * sizeof(*cells));
+    char *text = (char *)malloc(rows * 64);
+
+    if (!cells || !text) {
+        fprintf(stderr, "Unable to allocate price list\n");
+        exit(1);
+    }
+    pdf_set_text_cache(pdf, 256);
+    pdf_append_page(pdf);
+    cells[0] = "Code";
+    cells[1] = "Description";
+    cells[2] = "Category";
+    cells[3] = "Price";
+    for (int r = 1; r < rows; r++) {
+        char *code = &text[r * 64], *price = code + 16;
+
+        snprintf(code, 16, "P%05d", r);
+        snprintf(price, 16, "%d.%02d", r * 37 % 1000, r % 100);
+        cells[r * 4] = code;
+        cells[r * 4 + 1] = r % 7 ? "Zinc plated, pack of 100"
+                                 : "Stainless steel, pack of 50, suitable "
+                                   "for outdoor use";
+        cells[r * 4 + 2] = categories[r % 5];
+        cells[r * 4 + 3] = price;
+    }
+    if (pdf_add_table(pdf, NULL, &frame, PDF_A4_HEIGHT - 50, columns, 4,
+                      cells, rows, &style, NULL) != rows) {
+        fprintf(stderr, "Unable to add price list: %s\n",
+                pdf_get_err(pdf, NULL));
+        exit(1);
+    }
+    free(cells);
+    free(text);
+    return pdf;
+}
+
+static const struct {
+    const char *name;
+    struct pdf_doc *(*run)(void);
+} workloads[] = {
+    {"invoice", workload_invoice},     {"statements", workload_statements},
+    {"catalogue", workload_catalogue}, {"labels", workload_labels},
+    {"charts", workload_charts},       {"report", workload_report},
+    {"price_list", workload_price_list},
+};
+
+/* Run a single workload, with the measurements written to 'result' */
+static int run_workload(int index, struct result *result)
+{
+    struct rusage usage;
+    struct pdf_stats stats;
+    struct pdf_doc *pdf;
+    double start = now();
+    FILE *fp = tmpfile();
+
+    if (!fp)
+        return -1;
+    snprintf(result->name, sizeof(result->name), "%s", workloads[index].name);
+    pdf = workloads[index].run();
+    if (pdf_get_stats(pdf, &stats) < 0 || pdf_save_file(pdf, fp) < 0) {
+        fprintf(stderr, "%s: unable to save: %s\n", result->name,
+                pdf_get_err(pdf, NULL));
+        return -1;
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    pdf_destroy(pdf);
+    result->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    result->peak_heap_kb =
+        __atomic_load_n(&peak_heap_bytes, __ATOMIC_RELAXED) / 1024;
+    result->objects = stats.objects;
+    result->output_bytes = ftell(fp);
+    result->wall_ms = (now() - start) * 1000;
+    result->peak_rss_kb = usage.ru_maxrss;
+    fclose(fp);
+    return 0;
+}
+
+/* Run a workload in a child process, so that its peak RSS is its own */
+static int run_isolated(int index, struct result *result)
+{
+    int fds[2], status;
+    pid_t pid;
+    ssize_t len;
+
+    if (pipe(fds) < 0)
+        return -1;
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        close(fds[0]);
+        if (run_workload(index, result) < 0 ||
+            write(fds[1], result, sizeof(*result)) != sizeof(*result))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    len = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || len != sizeof(*result))
+        return -1;
+    return 0;
+}
+
+static int find_baseline(FILE *fp, const char *name, struct result *base)
+{
+    char line[256];
+
+    if (!fp)
+        return -1;
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "%31s %ld %ld %ld %ld", base->name,
+                   &base->allocations, &base->peak_heap_kb, &base->objects,
+                   &base->output_bytes) == 5 &&
+            strcmp(base->name, name) == 0)
+            return 0;
+    return -1;
+}
+
+/* Is 'value' more than 'threshold' percent above 'base'? */
+static bool regressed(double value, double base, double threshold)
+{
+    return base > 0 && value > base * (1 + threshold / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *baseline_file = "tests/workloads-baseline.txt";
+    const char *only = NULL;
+    double threshold = 20;
+    bool update = false;
+    int regressions = 0;
+    FILE *baseline, *out = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            baseline_file = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-u") == 0)
+            update = true;
+        else
+            only = argv[i];
+    }
+
+    baseline = fopen(baseline_file, "r");
+    if (update && !(out = tmpfile())) {
+        perror("tmpfile");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        struct result result, base;
+        bool bad;
+
+        if (only && strcmp(only, workloads[i].name) != 0)
+            continue;
+        if (run_isolated(i, &result) < 0) {
+            fprintf(stderr, "%s: failed\n", workloads[i].name);
+            return 1;
+        }
+        if (out)
+            fprintf(out, "%s %ld %ld %ld %ld\n", result.name,
+                    result.allocations, result.peak_heap_kb, result.objects,
+                    result.output_bytes);
+        if (find_baseline(baseline, result.name, &base) < 0) {
+            printf("%-12s %9ld allocs %8ld kB heap %8ld objects %10ld bytes "
+                   "%9.1f ms %8ld kB RSS (no baseline)\n",
+                   result.name, result.allocations, result.peak_heap_kb,
+                   result.objects, result.output_bytes, result.wall_ms,
+                   result.peak_rss_kb);
+            continue;
+        }
+        bad = regressed(result.allocations, base.allocations, threshold) ||
+              regressed(result.peak_heap_kb, base.peak_heap_kb, threshold) ||
+              regressed(result.objects, base.objects, threshold) ||
+              regressed(result.output_bytes, base.output_bytes, threshold);
+        printf("%-12s %9ld allocs (%+5.1f%%) %8ld kB heap (%+5.1f%%) %8ld "
+               "objects (%+5.1f%%) %10ld bytes (%+5.1f%%) %9.1f ms %8ld kB "
+               "RSS%s\n",
+               result.name, result.allocations,
+               ((double)result.allocations / base.allocations - 1) * 100,
+               result.peak_heap_kb,
+               ((double)result.peak_heap_kb / base.peak_heap_kb - 1) * 100,
+               result.objects,
+               ((double)result.objects / base.objects - 1) * 100,
+               result.output_bytes,
+               ((double)result.output_bytes / base.output_bytes - 1) * 100,
+               result.wall_ms, result.peak_rss_kb, bad ? " REGRESSION" : "");
+        if (bad)
+            regressions++;
+    }
+    if (baseline)
+        fclose(baseline);
+
+    if (out) {
+        char line[256];
+        FILE *fp = fopen(baseline_file, "w");
+
+        if (!fp) {
+            perror(baseline_file);
+            return 1;
+        }
+        rewind(out);
+        while (fgets(line, sizeof(line), out))
+            fputs(line, fp);
+        fclose(fp);
+        fclose(out);
+        printf("Baseline written to %s\n", baseline_file);
+        return 0;
+    }
+
+    if (regressions) {
+        printf("%d workload(s) regressed by more than %.0f%%\n", regressions,
+               threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * Tests for the C++ wrapper (pdfgen.hpp)
+ * Draws the same document through the wrapper & the C API, and checks
+ * that they produce identical files.
+ */
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "pdfgen.hpp"
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            return -1;                                                       \
+        }                                                                    \
+    } while (0)
+
+static const char *const date = "20240101120000Z";
+
+static std::string read_file(FILE *fp)
+{
+    std::string data;
+    char buffer[4096];
+    size_t len;
+
+    rewind(fp);
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        data.append(buffer, len);
+    return data;
+}
+
+static std::string save_to_string(pdf_doc *pdf)
+{
+    std::string data;
+    FILE *fp = tmpfile();
+
+    if (fp && pdf_save_file(pdf, fp) >= 0)
+        data = read_file(fp);
+    if (fp)
+        fclose(fp);
+    return data;
+}
+
+static int draw_cpp(std::string &output)
+{
+    pdfgen::Document doc(PDF_A4_WIDTH, PDF_A4_HEIGHT);
+    /* Text slices which aren't NUL terminated */
+    const std::string row = "Left|Right|Wrapped text spanning lines";
+    std::string_view view(row);
+    std::vector<pdfgen::Line> lines = {{{50, 790}, {550, 790}},
+                                       {{50, 50}, {550, 50}}};
+    const pdfgen::Rect rects[] = {{50, 100, 100, 50}, {200, 100, 100, 50}};
+    std::array<pdfgen::Circle, 2> circles = {
+        {{{100, 300}, 20}, {{200, 300}, 30}}};
+    std::array<pdfgen::Point, 3> triangle = {
+        {{300, 400}, {350, 450}, {400, 400}}};
+    std::vector<float> xs = {50, 100, 150, 100}, ys = {500, 550, 500, 450};
+    const pdfgen::Point zigzag[] = {{50, 600}, {100, 650}, {150, 600}};
+    float width, height, bbox[4];
+
+    CHECK(doc);
+    CHECK(doc.set_deterministic(date) >= 0);
+    CHECK(doc.set_font("Helvetica") >= 0);
+    CHECK(doc.set_bbox_tracking(true) >= 0);
+    pdfgen::Page page = doc.append_page();
+    CHECK(page);
+    CHECK(page.text(view.substr(0, 4), 12, 50, 800) >= 0);
+    CHECK(page.text_rotate(view.substr(5, 5), 12, 300, 800, 0.5f,
+                           PDF_RED) >= 0);
+    CHECK(page.text_wrap(view.substr(11), 12, 50, 750, 80, PDF_ALIGN_LEFT,
+                         &height) >= 0);
+    CHECK(height > 12);
+    CHECK(doc.text_width(view.substr(0, 4), 12, &width) >= 0);
+    CHECK(width > 0);
+    CHECK(page.draw(pdfgen::Span<const pdfgen::Line>(lines), 1) >= 0);
+    CHECK(page.draw(pdfgen::Span<const pdfgen::Rect>(rects), 2, PDF_BLUE) >=
+          0);
+    CHECK(page.draw(pdfgen::Span<const pdfgen::Circle>(circles), 1) >= 0);
+    CHECK(page.draw(pdfgen::Rect{400, 100, 50, 50}, 1) >= 0);
+    CHECK(page.polygon(triangle, 1, PDF_GREEN, true) >= 0);
+    CHECK(page.polygon(xs, ys, 1) >= 0);
+    CHECK(page.polygon(xs, pdfgen::Span<const float>(ys.data(), 2), 1) ==
+          -EINVAL);
+    CHECK(page.polyline(zigzag, 2) >= 0);
+    CHECK(page.barcode(PDF_BARCODE_128A, 300, 600, 200, 50,
+                       view.substr(0, 4)) >= 0);
+    CHECK(page.bbox(bbox) >= 0);
+    const pdf_command commands[] = {
+        {PDF_CMD_LINE, 0, PDF_RED, 0, {50, 700, 100, 750, 1}, 0, 0},
+        {PDF_CMD_TEXT, 0, PDF_BLACK, 0, {12, 50, 720}, 0, 4},
+    };
+    CHECK(page.execute(commands, view) == 0);
+
+    pdfgen::Page second = doc.append_page();
+    CHECK(second);
+    int bm = second.bookmark(view.substr(0, 4));
+    CHECK(bm >= 0);
+    CHECK(second.bookmark(view.substr(5, 5), bm) >= 0);
+    CHECK(second.link(50, 50, 100, 20, doc.page(1)) >= 0);
+    CHECK(!doc.page(3));
+
+    /* Ownership moves with the document */
+    pdfgen::Document moved(std::move(doc));
+    CHECK(!doc && moved);
+    output = save_to_string(moved.get());
+    CHECK(!output.empty());
+    return 0;
+}
+
+static int draw_c(std::string &output)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    float xs[] = {50, 100, 150, 100}, ys[] = {500, 550, 500, 450};
+    float tx[] = {300, 350, 400}, ty[] = {400, 450, 400};
+    float height;
+
+    CHECK(pdf);
+    pdf_set_deterministic(pdf, date);
+    pdf_set_font(pdf, "Helvetica");
+    struct pdf_object *page = pdf_append_page(pdf);
+    pdf_add_text(pdf, page, "Left", 12, 50, 800, PDF_BLACK);
+    pdf_add_text_rotate(pdf, page, "Right", 12, 300, 800, 0.5f, PDF_RED);
+    pdf_add_text_wrap(pdf, page, "Wrapped text spanning lines", 12, 50, 750,
+                      0, PDF_BLACK, 80, PDF_ALIGN_LEFT, &height);
+    pdf_add_line(pdf, page, 50, 790, 550, 790, 1, PDF_BLACK);
+    pdf_add_line(pdf, page, 50, 50, 550, 50, 1, PDF_BLACK);
+    pdf_add_rectangle(pdf, page, 50, 100, 100, 50, 2, PDF_BLUE);
+    pdf_add_rectangle(pdf, page, 200, 100, 100, 50, 2, PDF_BLUE);
+    pdf_add_circle(pdf, page, 100, 300, 20, 1, PDF_BLACK, PDF_TRANSPARENT);
+    pdf_add_circle(pdf, page, 200, 300, 30, 1, PDF_BLACK, PDF_TRANSPARENT);
+    pdf_add_rectangle(pdf, page, 400, 100, 50, 50, 1, PDF_BLACK);
+    pdf_add_filled_polygon(pdf, page, tx, ty, 3, 1, PDF_GREEN);
+    pdf_add_polygon(pdf, page, xs, ys, 4, 1, PDF_BLACK);
+    pdf_add_line(pdf, page, 50, 600, 100, 650, 2, PDF_BLACK);
+    pdf_add_line(pdf, page, 100, 650, 150, 600, 2, PDF_BLACK);
+    pdf_add_barcode(pdf, page, PDF_BARCODE_128A, 300, 600, 200, 50, "Left",
+                    PDF_BLACK);
+    pdf_add_line(pdf, page, 50, 700, 100, 750, 1, PDF_RED);
+    pdf_add_text(pdf, page, "Left", 12, 50, 720, PDF_BLACK);
+
+    struct pdf_object *second = pdf_append_page(pdf);
+    int bm = pdf_add_bookmark(pdf, second, -1, "Left");
+    pdf_add_bookmark(pdf, second, bm, "Right");
+    pdf_add_link(pdf, second, 50, 50, 100, 20, page, 0, 0);
+    output = save_to_string(pdf);
+    pdf_destroy(pdf);
+    CHECK(!output.empty());
+    return 0;
+}
+
+static int test_errors(void)
+{
+    pdfgen::Document doc(PDF_A4_WIDTH, PDF_A4_HEIGHT);
+    int errval = 0;
+
+    CHECK(doc);
+    pdfgen::Page page = doc.append_page();
+    /* Errors are reported through the document, not exceptions */
+    CHECK(page.image_file(0, 0, 10, 10, "no-such-file.png") < 0);
+    CHECK(strlen(doc.error(&errval)) > 0 && errval < 0);
+    doc.clear_error();
+    CHECK(!doc.error());
+
+    /* Adopting & releasing C documents */
+    pdfgen::Document adopted(pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL));
+    CHECK(adopted);
+    doc = std::move(adopted);
+    CHECK(doc && !adopted);
+    pdf_doc *raw = doc.release();
+    CHECK(raw && !doc);
+    pdf_destroy(raw);
+    return 0;
+}
+
+int main(void)
+{
+    std::string cpp, c;
+
+    if (draw_cpp(cpp) < 0 || draw_c(c) < 0 || test_errors() < 0)
+        return 1;
+    if (cpp != c) {
+        fprintf(stderr, "Wrapper output differs from the C API\n");
+        return 1;
+    }
+    return 0;
+}